@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 int arch_fill_cpuinfo_model(int fd)
 {
@@ -29,3 +31,13 @@ int arch_fill_cpuinfo_model(int fd)
 	fclose(fp);
 	return ret;
 }
+
+bool arch_has_invariant_tsc(void)
+{
+	return false;
+}
+
+uint64_t arch_read_tsc(void)
+{
+	return 0;
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+
+#include "mcount-arch.h"
 
 int arch_fill_cpuinfo_model(int fd)
 {
@@ -21,3 +24,29 @@ int arch_fill_cpuinfo_model(int fd)
 	fclose(fp);
 	return ret;
 }
+
+bool arch_has_invariant_tsc(void)
+{
+	char buf[4096];
+	FILE *fp;
+	bool ret = false;
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if (fp == NULL)
+		return false;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (!strncmp(buf, "flags\t\t:", 8)) {
+			ret = strstr(buf, " constant_tsc") &&
+			      strstr(buf, " nonstop_tsc");
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+uint64_t arch_read_tsc(void)
+{
+	return mcount_arch_read_tsc();
+}
@@ -1,6 +1,8 @@
 #ifndef __MCOUNT_ARCH_H__
 #define __MCOUNT_ARCH_H__
 
+#include <stdint.h>
+
 #define mcount_regs  mcount_regs
 
 struct mcount_regs {
@@ -44,4 +46,14 @@ enum x86_reg_index {
 	X86_REG_XMM7,
 };
 
+#define ARCH_SUPPORT_TSC  1
+
+static inline uint64_t mcount_arch_read_tsc(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 #endif /* __MCOUNT_ARCH_H__ */
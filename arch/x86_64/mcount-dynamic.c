@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "dynamic"
+#define PR_DOMAIN  DBG_MCOUNT
+
+#include "libmcount/mcount.h"
+#include "mcount-arch.h"
+#include "utils/utils.h"
+
+#define CALL_INSN_SIZE  5
+#define JMP_INSN_SIZE   6  /* jmp *disp32(%rip) */
+#define INT3_INSN       0xcc
+
+/* from <linux/membarrier.h> which might not be available */
+#ifndef SYS_membarrier
+# define SYS_membarrier  324
+#endif
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE           (1 << 5)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE  (1 << 6)
+
+/*
+ * layout of the trampoline page:
+ *   0: jmp *fentry_slot(%rip)
+ *  16: jmp *mcount_slot(%rip)
+ *  32: ret                      (target when tracing is disabled)
+ *  48: fentry_slot: address of __fentry__
+ *  56: mcount_slot: address of mcount
+ */
+#define TRAMP_FENTRY_OFS  0
+#define TRAMP_MCOUNT_OFS  16
+#define TRAMP_RET_OFS     32
+#define TRAMP_SLOT_OFS    48
+
+/* gcc -mnop-mcount emits this 5-byte nop instead of the call */
+static const unsigned char nop5[CALL_INSN_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+/* functions start with it when compiled with -fcf-protection (CET) */
+static const unsigned char endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+
+static void write_jmp_insn(unsigned char *insn, unsigned long slot)
+{
+	int32_t disp = slot - ((unsigned long)insn + JMP_INSN_SIZE);
+
+	insn[0] = 0xff;
+	insn[1] = 0x25;
+	memcpy(&insn[2], &disp, sizeof(disp));
+}
+
+static void set_trampoline_slots(struct mcount_dynamic_info *mdi,
+				 unsigned long fentry, unsigned long mcount)
+{
+	unsigned long *slot = (void *)(mdi->trampoline + TRAMP_SLOT_OFS);
+
+	/* aligned 8-byte stores: other threads see either old or new one */
+	__atomic_store_n(&slot[0], fentry, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot[1], mcount, __ATOMIC_RELEASE);
+}
+
+static bool is_near_text(struct mcount_dynamic_info *mdi, unsigned long addr)
+{
+	unsigned long start = mdi->text_addr;
+	unsigned long end = mdi->text_addr + mdi->text_size;
+
+	if (addr < start)
+		return end - addr < INT32_MAX;
+	else
+		return addr - start < INT32_MAX;
+}
+
+/* find an unmapped page closest to the text using /proc/self/maps */
+static unsigned long find_trampoline_addr(struct mcount_dynamic_info *mdi,
+					  unsigned long page_size)
+{
+	FILE *fp;
+	char buf[PATH_MAX];
+	unsigned long prev_end = page_size * 16;  /* skip low addresses */
+	unsigned long addr = 0;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		unsigned long start, end;
+
+		if (sscanf(buf, "%lx-%lx", &start, &end) != 2)
+			continue;
+
+		if (start >= prev_end + page_size) {
+			/* use the last page below the text, or first one above */
+			if (start <= mdi->text_addr) {
+				if (is_near_text(mdi, start - page_size))
+					addr = start - page_size;
+			}
+			else {
+				if (addr == 0 && is_near_text(mdi, prev_end))
+					addr = prev_end;
+				break;
+			}
+		}
+
+		if (end > prev_end)
+			prev_end = end;
+	}
+	fclose(fp);
+
+	return addr;
+}
+
+/**
+ * mcount_arch_setup_trampoline - allocate trampoline near the text
+ * @mdi: dynamic patching info of the executable
+ *
+ * The patched call instruction has 32-bit displacement only so it
+ * cannot reach libmcount directly.  Map a page close to the text
+ * and jump to the real entry point indirectly from there.
+ */
+int mcount_arch_setup_trampoline(struct mcount_dynamic_info *mdi)
+{
+	unsigned long page_size = getpagesize();
+	unsigned long addr;
+	unsigned char *tramp;
+
+	addr = find_trampoline_addr(mdi, page_size);
+	if (addr == 0) {
+		pr_dbg("cannot find a space for trampoline\n");
+		return -1;
+	}
+
+	tramp = mmap((void *)addr, page_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (tramp == MAP_FAILED) {
+		pr_dbg("cannot map trampoline: %m\n");
+		return -1;
+	}
+
+	if (!is_near_text(mdi, (unsigned long)tramp)) {
+		pr_dbg("trampoline is too far from the text: %p\n", tramp);
+		munmap(tramp, page_size);
+		return -1;
+	}
+
+	mdi->trampoline = (unsigned long)tramp;
+
+	write_jmp_insn(tramp + TRAMP_FENTRY_OFS,
+		       mdi->trampoline + TRAMP_SLOT_OFS);
+	write_jmp_insn(tramp + TRAMP_MCOUNT_OFS,
+		       mdi->trampoline + TRAMP_SLOT_OFS + sizeof(long));
+	tramp[TRAMP_RET_OFS] = 0xc3;
+
+	set_trampoline_slots(mdi, mdi->fentry_addr, mdi->mcount_addr);
+
+	if (mprotect(tramp, page_size, PROT_READ | PROT_EXEC) < 0) {
+		pr_dbg("cannot change trampoline protection: %m\n");
+		munmap(tramp, page_size);
+		mdi->trampoline = 0;
+		return -1;
+	}
+
+	pr_dbg2("trampoline at %#lx\n", mdi->trampoline);
+	return 0;
+}
+
+/**
+ * mcount_arch_enable_trampoline - switch target of the trampoline
+ * @mdi:    dynamic patching info of the executable
+ * @enable: jump to libmcount if true, return immediately otherwise
+ *
+ * This is safe to call while other threads are running patched code.
+ */
+void mcount_arch_enable_trampoline(struct mcount_dynamic_info *mdi,
+				   bool enable)
+{
+	unsigned long page_size = getpagesize();
+	unsigned long ret_addr = mdi->trampoline + TRAMP_RET_OFS;
+
+	if (mprotect((void *)mdi->trampoline, page_size,
+		     PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		pr_dbg("cannot change trampoline protection: %m\n");
+		return;
+	}
+
+	if (enable)
+		set_trampoline_slots(mdi, mdi->fentry_addr, mdi->mcount_addr);
+	else
+		set_trampoline_slots(mdi, ret_addr, ret_addr);
+
+	mprotect((void *)mdi->trampoline, page_size, PROT_READ | PROT_EXEC);
+}
+
+/**
+ * mcount_arch_fentry_addr - return the address of the fentry call site
+ * @addr: start address of a function
+ *
+ * The call to __fentry__ comes after the endbr64 instruction if the
+ * function was compiled with -fcf-protection.
+ */
+unsigned long mcount_arch_fentry_addr(unsigned long addr)
+{
+	if (!memcmp((void *)addr, endbr64, sizeof(endbr64)))
+		addr += sizeof(endbr64);
+
+	return addr;
+}
+
+/**
+ * mcount_arch_patch_site - convert a nop into a call to the trampoline
+ * @mdi:    dynamic patching info of the executable
+ * @site:   call site recorded in the __mcount_loc section
+ * @fentry: whether the site is at the function entry (-mfentry)
+ *
+ * The text should be writable and no other thread should run it.
+ */
+int mcount_arch_patch_site(struct mcount_dynamic_info *mdi,
+			   struct mcount_dynamic_site *site, bool fentry)
+{
+	unsigned char *insn = (void *)site->addr;
+	unsigned char call[CALL_INSN_SIZE];
+	unsigned long target;
+	int32_t disp;
+
+	if (memcmp(insn, nop5, sizeof(nop5)))
+		return -1;
+
+	target = mdi->trampoline;
+	target += fentry ? TRAMP_FENTRY_OFS : TRAMP_MCOUNT_OFS;
+	disp = target - (site->addr + CALL_INSN_SIZE);
+
+	call[0] = 0xe8;
+	memcpy(&call[1], &disp, sizeof(disp));
+
+	memcpy(site->orig, insn, CALL_INSN_SIZE);
+	memcpy(insn, call, CALL_INSN_SIZE);
+	return 0;
+}
+
+/**
+ * mcount_arch_unpatch_site - convert a call to mcount into a nop
+ * @mdi:  dynamic patching info of the executable
+ * @site: call site recorded in the __mcount_loc section
+ *
+ * This is for binaries built with -mrecord-mcount only so that
+ * unselected functions don't call into libmcount at all.
+ */
+int mcount_arch_unpatch_site(struct mcount_dynamic_info *mdi,
+			     struct mcount_dynamic_site *site)
+{
+	unsigned char *insn = (void *)site->addr;
+
+	if (insn[0] != 0xe8)
+		return -1;
+
+	memcpy(site->orig, insn, CALL_INSN_SIZE);
+	memcpy(insn, nop5, CALL_INSN_SIZE);
+	return 0;
+}
+
+/* sites being restored (sorted by address) for the SIGTRAP handler */
+static struct mcount_dynamic_site *trap_sites;
+static size_t nr_trap_sites;
+static struct sigaction old_trap_action;
+
+static int cmp_site(const void *a, const void *b)
+{
+	const struct mcount_dynamic_site *sa = a;
+	const struct mcount_dynamic_site *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr > sb->addr ? 1 : -1;
+	return 0;
+}
+
+static void trap_handler(int sig, siginfo_t *info, void *arg)
+{
+	ucontext_t *uc = arg;
+	struct mcount_dynamic_site key, *site;
+
+	/* RIP points to the next byte of the int3 */
+	key.addr = uc->uc_mcontext.gregs[REG_RIP] - 1;
+	site = bsearch(&key, trap_sites, nr_trap_sites, sizeof(key), cmp_site);
+	if (site) {
+		/* skip the site, the trampoline is disabled anyway */
+		uc->uc_mcontext.gregs[REG_RIP] = site->addr + CALL_INSN_SIZE;
+		return;
+	}
+
+	/* not ours, pass it to the original handler */
+	if (old_trap_action.sa_flags & SA_SIGINFO) {
+		old_trap_action.sa_sigaction(sig, info, arg);
+	}
+	else if (old_trap_action.sa_handler == SIG_DFL) {
+		sigaction(SIGTRAP, &old_trap_action, NULL);
+		raise(SIGTRAP);
+	}
+	else if (old_trap_action.sa_handler != SIG_IGN) {
+		old_trap_action.sa_handler(sig);
+	}
+}
+
+/* make other cores discard instructions fetched before the change */
+static void sync_cores(void)
+{
+	syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+}
+
+/**
+ * mcount_arch_restore_sites - restore original instructions of sites
+ * @mdi:      dynamic patching info of the executable
+ * @sites:    call sites modified by patch or unpatch
+ * @nr_sites: number of the sites
+ *
+ * Other threads might run the code at the same time.  So it puts an
+ * int3 at the first byte of every site, then writes the other bytes
+ * and finally the first byte, serializing other cores after each step
+ * so that they never execute a partially updated instruction.  Threads
+ * hitting the int3 in the meantime just skip the site, as the disabled
+ * trampoline would do.  The @sites array is sorted and should be kept
+ * since a trapped thread might look it up after this returns.
+ *
+ * It returns the number of restored sites, which is 0 if the kernel
+ * cannot serialize other cores.  The text should be writable.
+ */
+int mcount_arch_restore_sites(struct mcount_dynamic_info *mdi,
+			      struct mcount_dynamic_site *sites,
+			      size_t nr_sites)
+{
+	struct sigaction act = {
+		.sa_sigaction = trap_handler,
+		.sa_flags = SA_SIGINFO | SA_RESTART,
+	};
+	unsigned char *insn;
+	size_t i;
+
+	if (nr_sites == 0)
+		return 0;
+
+	if (syscall(SYS_membarrier,
+		    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) < 0) {
+		pr_dbg("cannot serialize other cores: %m\n");
+		return 0;
+	}
+
+	qsort(sites, nr_sites, sizeof(*sites), cmp_site);
+	trap_sites = sites;
+	nr_trap_sites = nr_sites;
+
+	/* it's not restored since other threads might be trapped already */
+	sigemptyset(&act.sa_mask);
+	if (sigaction(SIGTRAP, &act, &old_trap_action) < 0) {
+		pr_dbg("cannot install SIGTRAP handler: %m\n");
+		return 0;
+	}
+
+	for (i = 0; i < nr_sites; i++) {
+		insn = (void *)sites[i].addr;
+		__atomic_store_n(&insn[0], INT3_INSN, __ATOMIC_RELAXED);
+	}
+	sync_cores();
+
+	for (i = 0; i < nr_sites; i++) {
+		insn = (void *)sites[i].addr;
+		memcpy(&insn[1], &sites[i].orig[1], CALL_INSN_SIZE - 1);
+	}
+	sync_cores();
+
+	for (i = 0; i < nr_sites; i++) {
+		insn = (void *)sites[i].addr;
+		__atomic_store_n(&insn[0], sites[i].orig[0], __ATOMIC_RELAXED);
+	}
+	sync_cores();
+
+	return nr_sites;
+}
+
+#ifdef UNIT_TEST
+
+TEST_CASE(dynamic_x86_patch)
+{
+	unsigned long page_size = getpagesize();
+	unsigned char *text;
+	struct mcount_dynamic_info mdi = {
+		.fentry_addr = 0x1234,
+		.mcount_addr = 0x5678,
+	};
+	struct mcount_dynamic_site site = {};
+	static struct mcount_dynamic_site sites[2];
+	unsigned long *slot;
+	int32_t disp;
+	int nr;
+
+	text = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	TEST_NE(text, MAP_FAILED);
+
+	mdi.text_addr = (unsigned long)text;
+	mdi.text_size = page_size;
+	TEST_EQ(mcount_arch_setup_trampoline(&mdi), 0);
+
+	slot = (void *)(mdi.trampoline + TRAMP_SLOT_OFS);
+	TEST_EQ(slot[0], mdi.fentry_addr);
+	TEST_EQ(slot[1], mdi.mcount_addr);
+
+	/* function entry at aligned address */
+	memcpy(text + 16, nop5, sizeof(nop5));
+	site.addr = (unsigned long)text + 16;
+
+	TEST_EQ(mcount_arch_patch_site(&mdi, &site, true), 0);
+	TEST_EQ(text[16], 0xe8);
+	memcpy(&disp, &text[17], sizeof(disp));
+	TEST_EQ(site.addr + CALL_INSN_SIZE + disp, mdi.trampoline);
+
+	/* cannot patch it twice */
+	TEST_EQ(mcount_arch_patch_site(&mdi, &site, true), -1);
+
+	mcount_arch_enable_trampoline(&mdi, false);
+	TEST_EQ(slot[0], mdi.trampoline + TRAMP_RET_OFS);
+	mcount_arch_enable_trampoline(&mdi, true);
+	TEST_EQ(slot[1], mdi.mcount_addr);
+
+	/* site crossing 8-byte boundary */
+	memcpy(text + 36, nop5, sizeof(nop5));
+	sites[0] = site;
+	sites[1].addr = (unsigned long)text + 36;
+	TEST_EQ(mcount_arch_patch_site(&mdi, &sites[1], false), 0);
+
+	nr = mcount_arch_restore_sites(&mdi, sites, 2);
+	if (nr) {
+		TEST_EQ(nr, 2);
+		TEST_MEMEQ(text + 16, nop5, sizeof(nop5));
+		TEST_MEMEQ(text + 36, nop5, sizeof(nop5));
+	}
+	else {
+		/* old kernel: it should not touch the text at all */
+		TEST_EQ(text[16], 0xe8);
+		TEST_EQ(text[36], 0xe8);
+		memcpy(text + 36, sites[1].orig, CALL_INSN_SIZE);
+	}
+
+	/* convert a call back to nop */
+	TEST_EQ(mcount_arch_patch_site(&mdi, &sites[1], false), 0);
+	TEST_EQ(mcount_arch_unpatch_site(&mdi, &sites[1]), 0);
+	TEST_MEMEQ(text + 36, nop5, sizeof(nop5));
+
+	munmap((void *)mdi.trampoline, page_size);
+	munmap(text, page_size);
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include "uftrace.h"
+#include "libmcount/mcount.h"
+#include "utils/utils.h"
+
+static int add_setting(char *buf, size_t size, int len,
+		       const char *key, const char *val)
+{
+	return len + snprintf(buf + len, size - len, "%s=%s\n", key, val);
+}
+
+/*
+ * command_control - change settings of a running 'uftrace record'
+ *
+ * It sends the given filter, trigger, depth, time filter and enable
+ * state to the recorder through the control FIFO in the data directory.
+ * The recorder should be started with --control option.  Other settings
+ * are not changed.
+ */
+int command_control(int argc, char *argv[], struct opts *opts)
+{
+	char buf[PIPE_BUF];
+	char val[64];
+	char *fifo = NULL;
+	int len = 0;
+	int fd;
+
+	if (opts->filter)
+		len = add_setting(buf, sizeof(buf), len, "filter", opts->filter);
+
+	if (opts->trigger)
+		len = add_setting(buf, sizeof(buf), len, "trigger", opts->trigger);
+
+	if (opts->depth != MCOUNT_DEFAULT_DEPTH) {
+		snprintf(val, sizeof(val), "%d", opts->depth);
+		len = add_setting(buf, sizeof(buf), len, "depth", val);
+	}
+
+	if (opts->threshold) {
+		snprintf(val, sizeof(val), "%"PRIu64, opts->threshold);
+		len = add_setting(buf, sizeof(buf), len, "threshold", val);
+	}
+
+	if (opts->enable || opts->disabled) {
+		len = add_setting(buf, sizeof(buf), len, "enable",
+				  opts->disabled ? "0" : "1");
+	}
+
+	if (len == 0) {
+		pr_use("nothing to change: use -F, -N, -T, -D, -t, --enable or --disable\n");
+		return -1;
+	}
+
+	/* it should be written atomically */
+	if (len >= (int)sizeof(buf))
+		pr_err_ns("too long settings: %d bytes\n", len);
+
+	xasprintf(&fifo, "%s/%s", opts->dirname, MCOUNT_CONTROL_FIFO);
+
+	fd = open(fifo, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		if (errno == ENOENT || errno == ENXIO)
+			pr_err_ns("no 'uftrace record --control' is running for %s\n",
+				  opts->dirname);
+		pr_err("cannot open %s", fifo);
+	}
+
+	if (write(fd, buf, len) != len)
+		pr_err("cannot send settings");
+
+	pr_dbg("settings sent to %s\n", fifo);
+
+	close(fd);
+	free(fifo);
+	return 0;
+}
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "uftrace.h"
@@ -87,7 +90,7 @@ out:
 	return 0;
 }
 
-static int pr_task_txt(struct opts *opts)
+static int pr_task_txt(struct opts *opts, struct ftrace_tsc_clock *tsc)
 {
 	FILE *fp;
 	char buf[PATH_MAX];
@@ -176,6 +179,27 @@ static int pr_task_txt(struct opts *opts)
 			pr_out("%s  session of task %d: %.*s (%s)\n",
 			       timestamp, tid, 16, sid, exename);
 		}
+		else if (!strncmp(buf, "CTRL", 4)) {
+			uint64_t time;
+			unsigned gen;
+			int len = 0;
+
+			if (sscanf(buf + 5, "time=%"SCNu64" tid=%d pid=%d gen=%u%n",
+				   &time, &tid, &pid, &gen, &len) != 4) {
+				pr_red("invalid control timestamp\n");
+				goto out;
+			}
+			end = buf + 5 + len;
+			end[strcspn(end, "\n")] = '\0';
+
+			/* it's saved in the record clock */
+			if (tsc)
+				time = tsc_to_nsec(tsc, time);
+
+			pr_out("%"PRIu64".%09"PRIu64"  control #%u of pid %d:%s\n",
+			       time / NSEC_PER_SEC, time % NSEC_PER_SEC,
+			       gen, pid, end);
+		}
 	}
 
 out:
@@ -327,10 +351,15 @@ static void dump_raw(int argc, char *argv[], struct opts *opts,
 	pr_out("\n");
 
 	if (debug) {
+		struct ftrace_tsc_clock *tsc = NULL;
+
+		if (handle->hdr.info_mask & (1UL << CLOCK_INFO))
+			tsc = &handle->info.tsc;
+
 		pr_out("%d tasks found\n", handle->info.nr_tid);
 
 		/* try to read task.txt first */
-		if (pr_task_txt(opts) < 0 && pr_task(opts) < 0)
+		if (pr_task_txt(opts, tsc) < 0 && pr_task(opts) < 0)
 			pr_red("cannot open task file\n");
 
 		pr_out("\n");
@@ -344,7 +373,7 @@ static void dump_raw(int argc, char *argv[], struct opts *opts,
 
 		setup_task_handle(handle, &task, tid);
 
-		if (task.fp == NULL)
+		if (task.done)
 			continue;
 
 		prev_time = 0;
@@ -352,16 +381,23 @@ static void dump_raw(int argc, char *argv[], struct opts *opts,
 		pr_out("reading %d.dat\n", tid);
 		while (!read_task_ustack(handle, &task) && !ftrace_done) {
 			struct ftrace_ret_stack *frs = &task.ustack;
-			struct ftrace_session *sess = find_task_session(tid, frs->time);
-			struct symtabs *symtabs;
+			struct ftrace_session *sess;
 			struct sym *sym = NULL;
 			char *name;
-
-			if (sess) {
-				symtabs = &sess->symtabs;
-				sym = find_symtabs(symtabs, frs->addr);
+			int range;
+
+			range = check_time_range(&handle->time_range, frs->time);
+			if (range > 0)
+				break;
+			if (range < 0) {
+				task.valid = false;
+				continue;
 			}
 
+			sess = get_task_session(&task, frs->time);
+			if (sess)
+				sym = find_session_sym(sess, frs->addr);
+
 			name = symbol_getname(sym, frs->addr);
 
 			if (prev_time > frs->time) {
@@ -420,6 +456,16 @@ static void dump_raw(int argc, char *argv[], struct opts *opts,
 		pr_out("reading kernel-cpu%d.dat\n", i);
 		while (!read_kernel_cpu_data(kernel, i) && !ftrace_done) {
 			int losts = kernel->missed_events[i];
+			int range;
+
+			range = check_time_range(&handle->time_range,
+						 mrs->end_time ?: mrs->start_time);
+			if (range > 0)
+				break;
+			if (range < 0) {
+				kernel->missed_events[i] = 0;
+				continue;
+			}
 
 			sym = find_symtabs(NULL, mrs->child_ip);
 			name = symbol_getname(sym, mrs->child_ip);
@@ -455,7 +501,227 @@ static void dump_raw(int argc, char *argv[], struct opts *opts,
 	}
 }
 
-static void print_ustack_chrome_trace(struct ftrace_task_handle *task,
+/*
+ * The chrome trace output of each task (and kernel cpu) is formatted by
+ * worker threads into private chunks in parallel.  The main thread
+ * writes the chunks in the original order so the output is the same as
+ * the serial version.  Each event is formatted with the preceding ",\n"
+ * and the first one in a section is stripped when it's written.
+ */
+#define CHROME_CHUNK_SIZE    (1024 * 1024)
+#define CHROME_MAX_CHUNKS    64
+#define CHROME_KERNEL_BATCH  1024
+
+struct chrome_chunk {
+	struct chrome_chunk	*next;
+	size_t			len;
+	size_t			size;
+	char			data[];
+};
+
+struct chrome_unit {
+	struct chrome_chunk	*head;
+	struct chrome_chunk	*tail;
+	struct chrome_chunk	*cur;
+	bool			done;
+};
+
+struct chrome_name {
+	struct symtabs		*symtabs;
+	unsigned long		addr;
+	struct sym		*sym;
+	char			*name;
+};
+
+/* per-thread cache of symbol names resolved once per address */
+struct chrome_names {
+	struct chrome_name	*table;
+	unsigned		nr;
+	unsigned		size;
+};
+
+struct chrome_krecord {
+	struct mcount_ret_stack	rstack;
+	int			losts;
+};
+
+struct chrome_data {
+	struct ftrace_file_handle	*handle;
+	struct chrome_unit		*units;
+	int				nr_user;
+	int				nr_units;
+	int				next;
+	int				writing;
+	int				nr_chunks;
+	unsigned			lost_event_cnt;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	/* kernel data cannot be decoded in parallel */
+	pthread_mutex_t			kernel_lock;
+};
+
+static void chrome_flush(struct chrome_data *data, struct chrome_unit *unit)
+{
+	struct chrome_chunk *chunk = unit->cur;
+
+	unit->cur = NULL;
+	if (chunk == NULL)
+		return;
+
+	if (chunk->len == 0) {
+		free(chunk);
+		return;
+	}
+
+	pthread_mutex_lock(&data->lock);
+
+	if (unit->tail)
+		unit->tail->next = chunk;
+	else
+		unit->head = chunk;
+	unit->tail = chunk;
+	data->nr_chunks++;
+
+	pthread_cond_broadcast(&data->cond);
+
+	/* limit memory usage, but the unit being written should not wait */
+	while (data->nr_chunks > CHROME_MAX_CHUNKS && !ftrace_done &&
+	       unit != &data->units[data->writing])
+		pthread_cond_wait(&data->cond, &data->lock);
+
+	pthread_mutex_unlock(&data->lock);
+}
+
+static void chrome_printf(struct chrome_data *data, struct chrome_unit *unit,
+			  const char *fmt, ...)
+{
+	struct chrome_chunk *chunk = unit->cur;
+	va_list ap;
+	size_t size;
+	int len;
+
+	if (chunk) {
+		va_start(ap, fmt);
+		len = vsnprintf(chunk->data + chunk->len,
+				chunk->size - chunk->len, fmt, ap);
+		va_end(ap);
+
+		if (chunk->len + len < chunk->size) {
+			chunk->len += len;
+			return;
+		}
+
+		chrome_flush(data, unit);
+	}
+	else {
+		va_start(ap, fmt);
+		len = vsnprintf(NULL, 0, fmt, ap);
+		va_end(ap);
+	}
+
+	size = CHROME_CHUNK_SIZE;
+	if ((size_t)len >= size)
+		size = len + 1;
+
+	chunk = xmalloc(sizeof(*chunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+
+	va_start(ap, fmt);
+	chunk->len = vsnprintf(chunk->data, size, fmt, ap);
+	va_end(ap);
+
+	unit->cur = chunk;
+}
+
+static void chrome_finish_unit(struct chrome_data *data,
+			       struct chrome_unit *unit)
+{
+	chrome_flush(data, unit);
+
+	pthread_mutex_lock(&data->lock);
+	unit->done = true;
+	pthread_cond_broadcast(&data->cond);
+	pthread_mutex_unlock(&data->lock);
+}
+
+static unsigned chrome_name_hash(struct symtabs *symtabs, unsigned long addr)
+{
+	uint64_t key = addr ^ (unsigned long)symtabs;
+
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static struct chrome_name *chrome_find_name(struct chrome_names *names,
+					    struct symtabs *symtabs,
+					    unsigned long addr)
+{
+	unsigned mask = names->size - 1;
+	unsigned i = chrome_name_hash(symtabs, addr) & mask;
+
+	while (names->table[i].name) {
+		struct chrome_name *cn = &names->table[i];
+
+		if (cn->addr == addr && cn->symtabs == symtabs)
+			return cn;
+
+		i = (i + 1) & mask;
+	}
+	return &names->table[i];
+}
+
+static void chrome_grow_names(struct chrome_names *names)
+{
+	struct chrome_names old = *names;
+	unsigned i;
+
+	names->size = old.size ? old.size * 2 : 1024;
+	names->table = xcalloc(names->size, sizeof(*names->table));
+
+	for (i = 0; i < old.size; i++) {
+		struct chrome_name *cn = &old.table[i];
+
+		if (cn->name)
+			*chrome_find_name(names, cn->symtabs, cn->addr) = *cn;
+	}
+	free(old.table);
+}
+
+static const char *chrome_symname(struct chrome_names *names,
+				  struct symtabs *symtabs, unsigned long addr)
+{
+	struct chrome_name *cn;
+
+	if (names->nr * 2 >= names->size)
+		chrome_grow_names(names);
+
+	cn = chrome_find_name(names, symtabs, addr);
+	if (cn->name == NULL) {
+		cn->symtabs = symtabs;
+		cn->addr = addr;
+		cn->sym = find_symtabs(symtabs, addr);
+		cn->name = symbol_getname(cn->sym, addr);
+		names->nr++;
+	}
+	return cn->name;
+}
+
+static void chrome_release_names(struct chrome_names *names)
+{
+	unsigned i;
+
+	for (i = 0; i < names->size; i++) {
+		struct chrome_name *cn = &names->table[i];
+
+		if (cn->name)
+			symbol_putname(cn->sym, cn->name);
+	}
+	free(names->table);
+}
+
+static void print_ustack_chrome_trace(struct chrome_data *data,
+				      struct chrome_unit *unit,
+				      struct ftrace_task_handle *task,
 				      struct ftrace_ret_stack *frs,
 				      int tid, const char* name)
 {
@@ -465,151 +731,297 @@ static void print_ustack_chrome_trace(struct ftrace_task_handle *task,
 
 	if (frs->type == FTRACE_ENTRY) {
 		ph = 'B';
-		pr_out("{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,\"name\":\"%s\"",
-			frs->time / 1000, ph, tid, name);
 		if (frs->more) {
 			str_mode |= HAS_MORE;
 			get_argspec_string(task, spec_buf, sizeof(spec_buf), str_mode);
-			pr_out(",\"args\":{\"arguments\":\"%s\"}}",
-				spec_buf);
+			chrome_printf(data, unit, ",\n{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,"
+				      "\"name\":\"%s\",\"args\":{\"arguments\":\"%s\"}}",
+				      frs->time / 1000, ph, tid, name, spec_buf);
 		} else
-			pr_out("}");
+			chrome_printf(data, unit, ",\n{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,"
+				      "\"name\":\"%s\"}",
+				      frs->time / 1000, ph, tid, name);
 	} else if (frs->type == FTRACE_EXIT) {
 		ph = 'E';
-		pr_out("{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,\"name\":\"%s\"",
-			frs->time / 1000, ph, tid, name);
 		if (frs->more) {
 			str_mode |= IS_RETVAL | HAS_MORE;
 			get_argspec_string(task, spec_buf, sizeof(spec_buf), str_mode);
-			pr_out(",\"args\":{\"retval\":\"%s\"}}",
-				spec_buf);
+			chrome_printf(data, unit, ",\n{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,"
+				      "\"name\":\"%s\",\"args\":{\"retval\":\"%s\"}}",
+				      frs->time / 1000, ph, tid, name, spec_buf);
 		} else
-			pr_out("}");
+			chrome_printf(data, unit, ",\n{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,"
+				      "\"name\":\"%s\"}",
+				      frs->time / 1000, ph, tid, name);
 	} else
 		abort();
 }
 
-static void print_kstack_chrome_trace(struct ftrace_task_handle *task,
+static void print_kstack_chrome_trace(struct chrome_data *data,
+				      struct chrome_unit *unit,
 				      struct mcount_ret_stack *mrs,
 				      const char* name)
 {
 	char ph;
 	uint64_t timestamp = mrs->end_time ?: mrs->start_time;
-	enum ftrace_ret_stack_type rstack_type;
-
-	if (mrs->end_time)
-		rstack_type = FTRACE_EXIT;
-	else
-		rstack_type = FTRACE_ENTRY;
 
 	/*
 	 * We may add a category info with "cat" field later to distinguish that
 	 * this record is from kernel function.
 	 */
-	if (rstack_type == FTRACE_ENTRY) {
-		ph = 'B';
-		pr_out("{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,\"name\":\"%s\"",
-			timestamp / 1000, ph, mrs->tid, name);
-		/* kernel trace data doesn't have more field */
-		pr_out("}");
-	} else if (rstack_type == FTRACE_EXIT) {
+	if (mrs->end_time)
 		ph = 'E';
-		pr_out("{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,\"name\":\"%s\"",
-			timestamp / 1000, ph, mrs->tid, name);
-		/* kernel trace data doesn't have more field */
-		pr_out("}");
-	} else
-		abort();
+	else
+		ph = 'B';
+
+	/* kernel trace data doesn't have more field */
+	chrome_printf(data, unit, ",\n{\"ts\":%lu,\"ph\":\"%c\",\"pid\":%d,"
+		      "\"name\":\"%s\"}",
+		      timestamp / 1000, ph, mrs->tid, name);
 }
 
-static void dump_chrome_trace(int argc, char *argv[], struct opts *opts,
-			      struct ftrace_file_handle *handle)
+static void chrome_user_unit(struct chrome_data *data, int idx,
+			     struct chrome_names *names)
 {
-	int i;
-	struct ftrace_task_handle task;
-	char buf[PATH_MAX];
-	struct stat statbuf;
-	unsigned lost_event_cnt = 0;
+	struct ftrace_file_handle *handle = data->handle;
+	struct chrome_unit *unit = &data->units[idx];
+	struct ftrace_file_handle single;
+	struct ftrace_task_handle *task;
+	struct ftrace_ret_stack *frs;
+	int tid = handle->info.tids[idx];
 
-	/* read recorded date and time */
-	snprintf(buf, sizeof(buf), "%s/info", opts->dirname);
-	if (stat(buf, &statbuf) < 0)
-		return;
+	setup_single_task_handle(handle, &single, idx);
 
-	ctime_r(&statbuf.st_mtime, buf);
-	buf[strlen(buf) - 1] = '\0';
+	while ((frs = get_task_ustack(&single, 0)) != NULL && !ftrace_done) {
+		struct ftrace_session *sess;
+		const char *name;
+		char *noname;
+		int range;
 
-	pr_out("{\"traceEvents\":[\n");
-	for (i = 0; i < handle->info.nr_tid; i++) {
-		int tid = handle->info.tids[i];
+		task = &single.tasks[0];
 
-		setup_task_handle(handle, &task, tid);
+		/* force re-read in read_task_ustack() */
+		task->valid = false;
+
+		range = check_time_range(&handle->time_range, frs->time);
+		if (range > 0)
+			break;
+		if (range < 0)
+			continue;
 
-		if (task.fp == NULL)
+		sess = get_task_session(task, frs->time);
+		if (sess) {
+			name = chrome_symname(names, &sess->symtabs, frs->addr);
+			print_ustack_chrome_trace(data, unit, task, frs, tid, name);
 			continue;
+		}
 
-		while (!read_task_ustack(handle, &task) && !ftrace_done) {
-			struct ftrace_ret_stack *frs = &task.ustack;
-			struct ftrace_session *sess = find_task_session(tid, frs->time);
-			struct symtabs *symtabs;
-			struct sym *sym = NULL;
-			char *name;
-			static bool last_comma = false;
+		noname = symbol_getname(NULL, frs->addr);
+		print_ustack_chrome_trace(data, unit, task, frs, tid, noname);
+		symbol_putname(NULL, noname);
+	}
+
+	reset_task_handle(&single);
+	chrome_finish_unit(data, unit);
+}
+
+static void chrome_kernel_unit(struct chrome_data *data, int idx,
+			       struct chrome_names *names,
+			       struct chrome_krecord *batch)
+{
+	struct ftrace_file_handle *handle = data->handle;
+	struct ftrace_kernel *kernel = handle->kern;
+	struct chrome_unit *unit = &data->units[idx];
+	int cpu = idx - data->nr_user;
+	bool done = false;
+	int i, nr;
+
+	while (!done && !ftrace_done) {
+		struct mcount_ret_stack *mrs = &kernel->rstacks[cpu];
+
+		pthread_mutex_lock(&data->kernel_lock);
+		for (nr = 0; nr < CHROME_KERNEL_BATCH; ) {
+			int losts;
+			int range;
+
+			if (read_kernel_cpu_data(kernel, cpu) < 0) {
+				done = true;
+				break;
+			}
+
+			losts = kernel->missed_events[cpu];
+			kernel->missed_events[cpu] = 0;
 
-			if (sess) {
-				symtabs = &sess->symtabs;
-				sym = find_symtabs(symtabs, frs->addr);
+			range = check_time_range(&handle->time_range,
+						 mrs->end_time ?: mrs->start_time);
+			if (range > 0) {
+				done = true;
+				break;
 			}
+			if (range < 0)
+				continue;
 
-			name = symbol_getname(sym, frs->addr);
+			memcpy(&batch[nr].rstack, mrs, sizeof(*mrs));
+			batch[nr++].losts = losts;
+		}
+		pthread_mutex_unlock(&data->kernel_lock);
 
-			if (last_comma)
-				pr_out(",\n");
+		for (i = 0; i < nr; i++) {
+			const char *name;
 
-			print_ustack_chrome_trace(&task, frs, tid, name);
+			mrs = &batch[i].rstack;
+			name = chrome_symname(names, NULL, mrs->child_ip);
 
-			last_comma = true;
+			/* it just counts the number of LOST events occured */
+			if (batch[i].losts)
+				__sync_fetch_and_add(&data->lost_event_cnt, 1);
 
-			/* force re-read in read_task_ustack() */
-			task.valid = false;
-			symbol_putname(sym, name);
+			print_kstack_chrome_trace(data, unit, mrs, name);
 		}
 	}
 
-	if (!opts->kernel || handle->kern == NULL || ftrace_done)
-		goto json_footer;
+	chrome_finish_unit(data, unit);
+}
 
-	pr_out(",\n");
-	for (i = 0; i < handle->kern->nr_cpus; i++) {
-		struct ftrace_kernel *kernel = handle->kern;
-		struct mcount_ret_stack *mrs = &kernel->rstacks[i];
-		struct sym *sym;
-		char *name;
+static void *chrome_worker(void *arg)
+{
+	struct chrome_data *data = arg;
+	struct chrome_names names = {};
+	struct chrome_krecord *batch = NULL;
+	int idx;
+
+	while ((idx = __sync_fetch_and_add(&data->next, 1)) < data->nr_units) {
+		if (idx < data->nr_user) {
+			chrome_user_unit(data, idx, &names);
+			continue;
+		}
 
-		while (!read_kernel_cpu_data(kernel, i) && !ftrace_done) {
-			static bool last_comma = false;
-			int losts = kernel->missed_events[i];
+		if (batch == NULL)
+			batch = xmalloc(CHROME_KERNEL_BATCH * sizeof(*batch));
+		chrome_kernel_unit(data, idx, &names, batch);
+	}
 
-			sym = find_symtabs(NULL, mrs->child_ip);
-			name = symbol_getname(sym, mrs->child_ip);
+	chrome_release_names(&names);
+	free(batch);
+	return NULL;
+}
 
-			if (last_comma)
-				pr_out(",\n");
+/* write out the chunks of units in a section using large writes */
+static void chrome_write_units(struct chrome_data *data, int start, int end)
+{
+	struct chrome_chunk *chunk;
+	struct chrome_unit *unit;
+	bool first = true;
+	int i;
 
-			/* it just counts the number of LOST events occured */
-			if (losts) {
-				kernel->missed_events[i] = 0;
-				lost_event_cnt++;
+	for (i = start; i < end; i++) {
+		unit = &data->units[i];
+
+		pthread_mutex_lock(&data->lock);
+		data->writing = i;
+		pthread_cond_broadcast(&data->cond);
+
+		while (true) {
+			while (unit->head == NULL && !unit->done)
+				pthread_cond_wait(&data->cond, &data->lock);
+
+			chunk = unit->head;
+			if (chunk == NULL)
+				break;
+
+			unit->head = chunk->next;
+			if (unit->head == NULL)
+				unit->tail = NULL;
+			data->nr_chunks--;
+			pthread_cond_broadcast(&data->cond);
+			pthread_mutex_unlock(&data->lock);
+
+			/* strip the leading ",\n" of the first event */
+			if (first) {
+				fwrite(chunk->data + 2, 1, chunk->len - 2, outfp);
+				first = false;
 			}
+			else
+				fwrite(chunk->data, 1, chunk->len, outfp);
+			free(chunk);
 
-			print_kstack_chrome_trace(&task, mrs, name);
-			last_comma = true;
+			pthread_mutex_lock(&data->lock);
+		}
+		pthread_mutex_unlock(&data->lock);
+	}
+}
 
-			symbol_putname(sym, name);
+static void dump_chrome_trace(int argc, char *argv[], struct opts *opts,
+			      struct ftrace_file_handle *handle)
+{
+	char buf[PATH_MAX];
+	struct stat statbuf;
+	struct chrome_data data = {
+		.handle = handle,
+	};
+	pthread_t *threads;
+	int nr_threads;
+	int i;
+
+	/* read recorded date and time */
+	snprintf(buf, sizeof(buf), "%s/info", opts->dirname);
+	if (stat(buf, &statbuf) < 0)
+		return;
+
+	ctime_r(&statbuf.st_mtime, buf);
+	buf[strlen(buf) - 1] = '\0';
+
+	data.nr_user = data.nr_units = handle->info.nr_tid;
+	if (opts->kernel && handle->kern)
+		data.nr_units += handle->kern->nr_cpus;
+
+	data.units = xcalloc(data.nr_units + 1, sizeof(*data.units));
+	pthread_mutex_init(&data.lock, NULL);
+	pthread_mutex_init(&data.kernel_lock, NULL);
+	pthread_cond_init(&data.cond, NULL);
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > data.nr_units)
+		nr_threads = data.nr_units;
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	threads = xcalloc(nr_threads, sizeof(*threads));
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, chrome_worker, &data) != 0)
+			pr_err_ns("cannot create dump thread\n");
+	}
+
+	pr_out("{\"traceEvents\":[\n");
+	chrome_write_units(&data, 0, data.nr_user);
+
+	if (data.nr_units > data.nr_user && !ftrace_done) {
+		pr_out(",\n");
+		chrome_write_units(&data, data.nr_user, data.nr_units);
+	}
+	else {
+		/* let remaining workers finish without waiting */
+		pthread_mutex_lock(&data.lock);
+		data.writing = data.nr_units;
+		pthread_cond_broadcast(&data.cond);
+		pthread_mutex_unlock(&data.lock);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* release chunks not written */
+	for (i = 0; i < data.nr_units; i++) {
+		struct chrome_chunk *chunk = data.units[i].head;
+
+		while (chunk) {
+			struct chrome_chunk *next = chunk->next;
+
+			free(chunk);
+			chunk = next;
 		}
 	}
 
-json_footer:
 	pr_out("\n], \"metadata\": {\n");
 	if (handle->hdr.info_mask & (1UL << CMDLINE))
 		pr_out("\"command_line\":\"%s\",\n", handle->info.cmdline);
@@ -627,12 +1039,18 @@ json_footer:
 	 * match entry and exit of some lost functions, we just inform the fact
 	 * to users as of now.
 	 */
-	if (lost_event_cnt) {
+	if (data.lost_event_cnt) {
 		pr_warn("Some of function trace records are lost. "
-			"(%d times shown)\n", lost_event_cnt);
+			"(%d times shown)\n", data.lost_event_cnt);
 		pr_warn("The output json format may not show the correct view "
 			"in chrome browser.\n");
 	}
+
+	pthread_cond_destroy(&data.cond);
+	pthread_mutex_destroy(&data.kernel_lock);
+	pthread_mutex_destroy(&data.lock);
+	free(threads);
+	free(data.units);
 }
 
 int command_dump(int argc, char *argv[], struct opts *opts)
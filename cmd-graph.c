@@ -70,7 +70,7 @@ static struct uftrace_graph * get_graph(struct ftrace_task_handle *task)
 	struct uftrace_graph *graph;
 	struct ftrace_session *sess;
 
-	sess = find_task_session(task->tid, task->ustack.time);
+	sess = get_task_session(task, task->ustack.time);
 	if (sess == NULL)
 		return NULL;
 
@@ -150,14 +150,11 @@ static int print_backtrace(struct uftrace_graph *graph)
 
 		for (k = 0; k < bt->len; k++) {
 			sym = find_symtabs(&graph->sess->symtabs, bt->addr[k]);
-			if (sym)
-				symname = xstrdup(sym->name);
-			else
-				symname = symbol_getname(NULL, bt->addr[k]);
+			symname = symbol_getname(sym, bt->addr[k]);
 
 			pr_out("   [%d] %s (%#lx)\n", k, symname, bt->addr[k]);
 
-			free(symname);
+			symbol_putname(sym, symname);
 		}
 		pr_out("\n");
 	}
@@ -400,7 +397,7 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle, cha
 
 		setup_task_handle(handle, &task, tid);
 
-		if (task.fp == NULL)
+		if (task.done)
 			continue;
 
 		prev_time = 0;
@@ -409,6 +406,15 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle, cha
 			struct ftrace_ret_stack *frs = &task.ustack;
 			struct sym *sym = NULL;
 			char *name;
+			int range;
+
+			range = check_time_range(&handle->time_range, frs->time);
+			if (range > 0)
+				break;
+			if (range < 0) {
+				task.valid = false;
+				continue;
+			}
 
 			graph = get_graph(&task);
 			if (graph == NULL) {
@@ -416,7 +422,7 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle, cha
 				return -1;
 			}
 
-			sym = find_symtabs(&graph->sess->symtabs, frs->addr);
+			sym = find_session_sym(graph->sess, frs->addr);
 			name = symbol_getname(sym, frs->addr);
 
 			if (frs->type == FTRACE_ENTRY)
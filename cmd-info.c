@@ -29,6 +29,8 @@ struct fill_handler_arg {
 	int exit_status;
 	struct opts *opts;
 	struct rusage *rusage;
+	struct ftrace_tsc_clock *tsc;
+	struct ftrace_lost_info *lost;
 };
 
 static char *copy_info_str(char *src)
@@ -474,7 +476,7 @@ static int fill_taskinfo(void *arg)
 	};
 	int i;
 
-	if (read_task_txt_file(fha->opts->dirname, false, false) < 0 &&
+	if (read_task_txt_file(fha->opts->dirname, false, false, NULL) < 0 &&
 	    read_task_file(fha->opts->dirname, false, false) < 0)
 		return -1;
 
@@ -649,6 +651,7 @@ static int fill_arg_spec(void *arg)
 		dprintf(fha->fd, "%s;", fha->opts->args);
 	if (fha->opts->retval)
 		dprintf(fha->fd, "%s;", fha->opts->retval);
+	dprintf(fha->fd, "\n");
 
 	return 0;
 }
@@ -669,13 +672,212 @@ static int read_arg_spec(void *arg)
 	return 0;
 }
 
+static int fill_clock_info(void *arg)
+{
+	struct fill_handler_arg *fha = arg;
+	struct ftrace_tsc_clock *tsc = fha->tsc;
+
+	if (tsc == NULL)
+		return -1;
+
+	dprintf(fha->fd, "clock:lines=4\n");
+	dprintf(fha->fd, "clock:source=tsc\n");
+	dprintf(fha->fd, "clock:tsc_freq=%"PRIu64"\n", tsc->freq);
+	dprintf(fha->fd, "clock:anchor=%"PRIu64"/%"PRIu64"\n",
+		tsc->mono_base, tsc->tsc_base);
+	dprintf(fha->fd, "clock:anchor=%"PRIu64"/%"PRIu64"\n",
+		tsc->mono_last, tsc->tsc_last);
+	return 0;
+}
+
+static int fill_sample_info(void *arg)
+{
+	struct fill_handler_arg *fha = arg;
+	struct opts *opts = fha->opts;
+
+	if (opts->sample_count <= 1 && opts->sample_period == 0)
+		return -1;
+
+	dprintf(fha->fd, "sample:lines=2\n");
+	dprintf(fha->fd, "sample:count=%u\n", opts->sample_count ?: 1);
+	dprintf(fha->fd, "sample:window=%"PRIu64"/%"PRIu64"\n",
+		opts->sample_on, opts->sample_period);
+	return 0;
+}
+
+static int read_sample_info(void *arg)
+{
+	struct ftrace_file_handle *handle = arg;
+	struct ftrace_info *info = &handle->info;
+	char buf[4096];
+	int i, lines;
+
+	if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+		return -1;
+
+	if (strncmp(buf, "sample:", 7))
+		return -1;
+
+	if (sscanf(&buf[7], "lines=%d\n", &lines) == EOF)
+		return -1;
+
+	for (i = 0; i < lines; i++) {
+		if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+			return -1;
+
+		if (strncmp(buf, "sample:", 7))
+			return -1;
+
+		if (!strncmp(&buf[7], "count=", 6))
+			sscanf(&buf[13], "%u", &info->sample_count);
+		else if (!strncmp(&buf[7], "window=", 7))
+			sscanf(&buf[14], "%"SCNu64"/%"SCNu64,
+			       &info->sample_on, &info->sample_period);
+	}
+	return 0;
+}
+
+static int read_clock_info(void *arg)
+{
+	struct ftrace_file_handle *handle = arg;
+	struct ftrace_info *info = &handle->info;
+	struct ftrace_tsc_clock *tsc = &info->tsc;
+	char buf[4096];
+	int i, lines;
+	int nr_anchor = 0;
+
+	if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+		return -1;
+
+	if (strncmp(buf, "clock:", 6))
+		return -1;
+
+	if (sscanf(&buf[6], "lines=%d\n", &lines) == EOF)
+		return -1;
+
+	for (i = 0; i < lines; i++) {
+		if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+			return -1;
+
+		if (strncmp(buf, "clock:", 6))
+			return -1;
+
+		if (!strncmp(&buf[6], "source=", 7)) {
+			if (strncmp(&buf[13], "tsc", 3))
+				return -1;
+		}
+		else if (!strncmp(&buf[6], "tsc_freq=", 9)) {
+			sscanf(&buf[15], "%"SCNu64, &tsc->freq);
+		}
+		else if (!strncmp(&buf[6], "anchor=", 7)) {
+			/* the first anchor is used for conversion */
+			if (nr_anchor++ == 0)
+				sscanf(&buf[13], "%"SCNu64"/%"SCNu64,
+				       &tsc->mono_base, &tsc->tsc_base);
+			else
+				sscanf(&buf[13], "%"SCNu64"/%"SCNu64,
+				       &tsc->mono_last, &tsc->tsc_last);
+		}
+	}
+
+	if (tsc->freq == 0)
+		return -1;
+
+	return 0;
+}
+
+static int cmp_lost_entry(const void *a, const void *b)
+{
+	const struct ftrace_lost_entry *ea = a;
+	const struct ftrace_lost_entry *eb = b;
+
+	return ea->id - eb->id;
+}
+
+static int fill_lost_info(void *arg)
+{
+	struct fill_handler_arg *fha = arg;
+	struct ftrace_lost_info *lost = fha->lost;
+	int i;
+
+	if (lost == NULL || lost->total == 0)
+		return -1;
+
+	qsort(lost->tasks, lost->nr_task, sizeof(*lost->tasks),
+	      cmp_lost_entry);
+	qsort(lost->windows, lost->nr_window, sizeof(*lost->windows),
+	      cmp_lost_entry);
+
+	dprintf(fha->fd, "lost:lines=%d\n", 3 + lost->nr_task + lost->nr_window);
+	dprintf(fha->fd, "lost:total=%lu\n", lost->total);
+	dprintf(fha->fd, "lost:policy=%s\n", fha->opts->buffer_policy ?: "block");
+	dprintf(fha->fd, "lost:window=%"PRIu64"\n", lost->window);
+
+	for (i = 0; i < lost->nr_task; i++)
+		dprintf(fha->fd, "lost:task=%d/%lu\n",
+			lost->tasks[i].id, lost->tasks[i].count);
+	for (i = 0; i < lost->nr_window; i++)
+		dprintf(fha->fd, "lost:time=%d/%lu\n",
+			lost->windows[i].id, lost->windows[i].count);
+	return 0;
+}
+
+static int read_lost_info(void *arg)
+{
+	struct ftrace_file_handle *handle = arg;
+	struct ftrace_lost_info *lost = &handle->info.lost;
+	struct ftrace_lost_entry *entry;
+	char buf[4096];
+	int i, lines;
+
+	if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+		return -1;
+
+	if (strncmp(buf, "lost:", 5))
+		return -1;
+
+	if (sscanf(&buf[5], "lines=%d\n", &lines) == EOF)
+		return -1;
+
+	lost->tasks = xcalloc(lines, sizeof(*lost->tasks));
+	lost->windows = xcalloc(lines, sizeof(*lost->windows));
+
+	for (i = 0; i < lines; i++) {
+		if (fgets(buf, sizeof(buf), handle->fp) == NULL)
+			return -1;
+
+		if (strncmp(buf, "lost:", 5))
+			return -1;
+
+		if (!strncmp(&buf[5], "total=", 6)) {
+			sscanf(&buf[11], "%lu", &lost->total);
+		}
+		else if (!strncmp(&buf[5], "policy=", 7)) {
+			lost->policy = copy_info_str(&buf[12]);
+		}
+		else if (!strncmp(&buf[5], "window=", 7)) {
+			sscanf(&buf[12], "%"SCNu64, &lost->window);
+		}
+		else if (!strncmp(&buf[5], "task=", 5)) {
+			entry = &lost->tasks[lost->nr_task++];
+			sscanf(&buf[10], "%d/%lu", &entry->id, &entry->count);
+		}
+		else if (!strncmp(&buf[5], "time=", 5)) {
+			entry = &lost->windows[lost->nr_window++];
+			sscanf(&buf[10], "%d/%lu", &entry->id, &entry->count);
+		}
+	}
+	return 0;
+}
+
 struct ftrace_info_handler {
 	enum ftrace_info_bits bit;
 	int (*handler)(void *arg);
 };
 
 void fill_ftrace_info(uint64_t *info_mask, int fd, struct opts *opts, int status,
-		      struct rusage *rusage)
+		      struct rusage *rusage, struct ftrace_tsc_clock *tsc,
+		      struct ftrace_lost_info *lost)
 {
 	size_t i;
 	off_t offset;
@@ -684,6 +886,8 @@ void fill_ftrace_info(uint64_t *info_mask, int fd, struct opts *opts, int status
 		.opts = opts,
 		.exit_status = status,
 		.rusage = rusage,
+		.tsc = tsc,
+		.lost = lost,
 	};
 	struct ftrace_info_handler fill_handlers[] = {
 		{ EXE_NAME,	fill_exe_name },
@@ -697,6 +901,9 @@ void fill_ftrace_info(uint64_t *info_mask, int fd, struct opts *opts, int status
 		{ USAGEINFO,	fill_usageinfo },
 		{ LOADINFO,	fill_loadinfo },
 		{ ARG_SPEC,	fill_arg_spec },
+		{ CLOCK_INFO,	fill_clock_info },
+		{ SAMPLE_INFO,	fill_sample_info },
+		{ LOST_INFO,	fill_lost_info },
 	};
 
 	for (i = 0; i < ARRAY_SIZE(fill_handlers); i++) {
@@ -726,6 +933,9 @@ int read_ftrace_info(uint64_t info_mask, struct ftrace_file_handle *handle)
 		{ USAGEINFO,	read_usageinfo },
 		{ LOADINFO,	read_loadinfo },
 		{ ARG_SPEC,	read_arg_spec },
+		{ CLOCK_INFO,	read_clock_info },
+		{ SAMPLE_INFO,	read_sample_info },
+		{ LOST_INFO,	read_lost_info },
 	};
 
 	memset(&handle->info, 0, sizeof(handle->info));
@@ -754,6 +964,9 @@ void clear_ftrace_info(struct ftrace_info *info)
 	free(info->distro);
 	free(info->tids);
 	free(info->argspec);
+	free(info->lost.policy);
+	free(info->lost.tasks);
+	free(info->lost.windows);
 }
 
 int command_info(int argc, char *argv[], struct opts *opts)
@@ -803,6 +1016,20 @@ int command_info(int argc, char *argv[], struct opts *opts)
 	if (handle.hdr.info_mask & (1UL << MEMINFO))
 		pr_out(fmt, "memory info", handle.info.meminfo);
 
+	if (handle.hdr.info_mask & (1UL << CLOCK_INFO))
+		pr_out("# %-20s: %s (%.3f MHz)\n", "clock source", "tsc",
+		       handle.info.tsc.freq / 1000000.0);
+
+	if (handle.hdr.info_mask & (1UL << SAMPLE_INFO)) {
+		if (handle.info.sample_count > 1)
+			pr_out("# %-20s: 1 / %u calls\n", "sampling rate",
+			       handle.info.sample_count);
+		if (handle.info.sample_period)
+			pr_out("# %-20s: %"PRIu64" / %"PRIu64" nsec\n",
+			       "sampling window", handle.info.sample_on,
+			       handle.info.sample_period);
+	}
+
 	if (handle.hdr.info_mask & (1UL << LOADINFO))
 		pr_out("# %-20s: %.02f / %.02f / %.02f (1 / 5 / 15 min)\n", "system load",
 		       handle.info.load1, handle.info.load5, handle.info.load15);
@@ -873,6 +1100,28 @@ int command_info(int argc, char *argv[], struct opts *opts)
 		pr_out("# %-20s: %ld / %ld (read / write)\n", "disk iops",
 		       handle.info.rblock, handle.info.wblock);
 	}
+
+	if (handle.hdr.info_mask & (1UL << LOST_INFO)) {
+		struct ftrace_lost_info *lost = &handle.info.lost;
+		uint64_t window = lost->window ?: NSEC_PER_SEC;
+		int i;
+
+		pr_out("# %-20s: %lu (policy: %s)\n", "lost records",
+		       lost->total, lost->policy);
+
+		pr_out("# %-20s: ", "lost by task");
+		for (i = 0; i < lost->nr_task; i++)
+			pr_out("%s%d (%lu)", i ? ", " : "",
+			       lost->tasks[i].id, lost->tasks[i].count);
+		pr_out("\n");
+
+		pr_out("# %-20s: ", "lost by time");
+		for (i = 0; i < lost->nr_window; i++)
+			pr_out("%s%.1fs (%lu)", i ? ", " : "",
+			       (double)lost->windows[i].id * window / NSEC_PER_SEC,
+			       lost->windows[i].count);
+		pr_out("\n");
+	}
 	pr_out("\n");
 
 out:
@@ -85,6 +85,12 @@ int command_live(int argc, char *argv[], struct opts *opts)
 
 	if (command_record(argc, argv, opts) == 0 && !opts->nop) {
 		pr_dbg("live-record finished.. \n");
+		if (opts->summary) {
+			/* there's nothing to replay */
+			command_report(argc, argv, opts);
+			goto out;
+		}
+
 		if (opts->report) {
 			pr_out("#\n# ftrace report\n#\n");
 			command_report(argc, argv, opts);
@@ -96,6 +102,7 @@ int command_live(int argc, char *argv[], struct opts *opts)
 		command_replay(argc, argv, opts);
 	}
 
+out:
 	cleanup_tempdir();
 
 	return 0;
@@ -6,50 +6,165 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <assert.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/eventfd.h>
 #include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "uftrace.h"
 #include "libmcount/mcount.h"
 #include "utils/utils.h"
 #include "utils/symbol.h"
 #include "utils/list.h"
+#include "utils/rbtree.h"
 #include "utils/filter.h"
+#include "utils/fdcache.h"
+#include "utils/compress.h"
+#include "utils/fstack.h"
+#include "utils/compiler.h"
 
 #define SHMEM_NAME_SIZE (64 - (int)sizeof(void*))
 
-struct shmem_list {
-	struct list_head list;
-	char id[SHMEM_NAME_SIZE];
+struct shmem_ring_list {
+	struct list_head		list;
+	struct mcount_shmem_ring	*ring;
+	size_t				size;
+	int				tid;
+	/* ring in a shmem pool, size is 0 for them */
+	struct mcount_shmem_pool	*pool;
+	unsigned			idx;
+	/* the task has gone (due to exec) - write partial buffer too */
+	bool				flush;
+	/* link in the incoming stack of a queue */
+	struct shmem_ring_list		*next;
+	/*
+	 * buffers before @sent were written, but ones sent by MSG_ZEROCOPY
+	 * are given back after the completion (see release_sent_buffers)
+	 */
+	unsigned			sent;
+	uint64_t			sent_seq;
+	unsigned			zc_tail;
+	uint64_t			zc_seq;
+	bool				zc_pending;
+	bool				all_sent;
 };
 
-static LIST_HEAD(shmem_list_head);
-static LIST_HEAD(shmem_need_unlink);
+/*
+ * Each writer thread has its own queue of rings.  Rings for a same tid
+ * always go to a same queue to keep the order.  New rings are pushed to
+ * the lock-free incoming stack so that the recorder doesn't wait for the
+ * writer which holds the lock while writing the data.
+ */
+struct shmem_ring_queue {
+	pthread_mutex_t		lock;
+	struct list_head	rings;
+	struct shmem_ring_list	*incoming;	/* new rings (LIFO) */
+	unsigned		load;		/* pending buffers in last round */
+	unsigned long		nr_steal;	/* for statistics */
+	struct fd_cache		fds;		/* open <tid>.dat files */
+	uint64_t		nr_bytes;	/* for statistics */
+	int			pipe[2];	/* for --zero-copy */
+	struct ftrace_compressor comp;		/* for --compress */
+	uint64_t		nr_frame_bytes;	/* size after compression */
+};
 
-struct buf_list {
-	struct list_head list;
-	int tid;
-	void *shmem_buf;
+/* max size (and number of buffers) written by a single writev() */
+#define WRITE_BATCH_SIZE  (16 * 1024 * 1024)
+#define WRITE_BATCH_IOV   64
+
+/* pipe size for vmsplice/splice, unprivileged users can have up to 1MB */
+#define SPLICE_PIPE_SIZE  (1024 * 1024)
+
+/* it's cleared when the kernel doesn't support splicing to the file */
+static bool zero_copy;
+
+/* compression level of the data files, 0 if not compressed */
+static int compress_level;
+
+/* shmem pool of rings created by each session */
+struct shmem_pool_list {
+	struct list_head		list;
+	struct mcount_shmem_pool	*pool;
+	size_t				size;
+	char				sid[16];
 };
 
-static LIST_HEAD(buf_free_list);
-static LIST_HEAD(buf_write_list);
+static LIST_HEAD(shmem_pools);
 
-/* currently active writers */
-static LIST_HEAD(writer_list);
+static struct shmem_ring_queue *ring_queues;
+static int nr_ring_queue;
+static bool buf_done;
 
-static pthread_mutex_t free_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t write_list_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * libmcount kicks the ring_event_fd (inherited eventfd) whenever it
+ * publishes a buffer.  The main thread passes it to idle writers
+ * by bumping write_gen under write_lock.
+ */
+static int ring_event_fd = -1;
+static unsigned write_gen;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
-static bool buf_done;
+
+/* writers check steals and finished rings at least this often */
+#define WRITER_TIMEOUT  (100 * 1000 * 1000)
+
+/*
+ * Tids are hashed into buckets and each bucket is owned by a queue.  The
+ * initial owner is found on a consistent hash ring where every queue has
+ * NR_HASH_POINTS points, so that adding a writer moves only a part of the
+ * buckets.  An idle writer can steal a whole bucket from a busy one.
+ * The owner changes only while the current owner's queue is locked.
+ */
+#define NR_TID_BUCKET  256
+#define NR_HASH_POINTS  16
+
+struct hash_point {
+	uint32_t		hash;
+	int			queue;
+};
+
+/* don't bother to steal from a queue having less pending buffers */
+#define STEAL_MIN_LOAD  SHMEM_RING_SLOTS
+
+static int tid_bucket_owner[NR_TID_BUCKET];
+/* number of rings being pushed to the owner, a steal waits for them */
+static unsigned tid_bucket_users[NR_TID_BUCKET];
+
+/* number of finished rings kept in a queue for snapshots */
+#define FLIGHT_DONE_RINGS  4
+
+static bool flight_recorder;
+static volatile bool snapshot_requested;
+static int nr_snapshot;
+
+/* runtime control by 'uftrace control' */
+static struct mcount_control *control;
+static char control_name[64];
+static char *control_fifo;
+static char *control_dir;
+static int control_fd = -1;
+
+static struct ftrace_tsc_clock tsc_clock;
+static bool use_tsc_clock;
+
+/* lost records are also counted per task and per time window */
+#define LOST_WINDOW  NSEC_PER_SEC
+
+static struct ftrace_lost_info lost_info;
+static uint64_t record_start_time;
+
+/* binary has call sites to be patched at runtime (-mnop-mcount) */
+static bool need_dynamic_patch;
 
 
 static bool can_use_fast_libmcount(struct opts *opts)
@@ -58,6 +173,14 @@ static bool can_use_fast_libmcount(struct opts *opts)
 		return false;
 	if (opts->depth != MCOUNT_DEFAULT_DEPTH)
 		return false;
+	if (opts->sample_count > 1 || opts->sample_period)
+		return false;
+	if (opts->patch || need_dynamic_patch)
+		return false;
+	if (opts->buffer_policy && !strcmp(opts->buffer_policy, "degrade"))
+		return false;
+	if (opts->control)
+		return false;
 	return true;
 }
 
@@ -84,6 +207,10 @@ static void setup_child_environ(struct opts *opts, int pfd)
 	const char *old_libpath = getenv("LD_LIBRARY_PATH");
 	bool must_use_multi_thread = check_libpthread(opts->exename);
 
+	/* libmcount runs a separate thread for the runtime control */
+	if (opts->control)
+		must_use_multi_thread = true;
+
 	if (opts->lib_path)
 		snprintf(buf, sizeof(buf), "%s/libmcount/", opts->lib_path);
 	else
@@ -138,6 +265,9 @@ static void setup_child_environ(struct opts *opts, int pfd)
 	if (opts->trigger)
 		setenv("UFTRACE_TRIGGER", opts->trigger, 1);
 
+	if (opts->patch)
+		setenv("UFTRACE_PATCH", opts->patch, 1);
+
 	if (opts->args)
 		setenv("UFTRACE_ARGUMENT", opts->args, 1);
 
@@ -176,6 +306,11 @@ static void setup_child_environ(struct opts *opts, int pfd)
 		setenv("UFTRACE_BUFFER", buf, 1);
 	}
 
+	if (opts->buffer_count != SHMEM_RING_SLOTS) {
+		snprintf(buf, sizeof(buf), "%d", opts->buffer_count);
+		setenv("UFTRACE_BUFFER_COUNT", buf, 1);
+	}
+
 	if (opts->logfile) {
 		snprintf(buf, sizeof(buf), "%d", fileno(logfp));
 		setenv("UFTRACE_LOGFD", buf, 1);
@@ -185,6 +320,11 @@ static void setup_child_environ(struct opts *opts, int pfd)
 	setenv("UFTRACE_PIPE", buf, 1);
 	setenv("UFTRACE_SHMEM", "1", 1);
 
+	if (ring_event_fd >= 0) {
+		snprintf(buf, sizeof(buf), "%d", ring_event_fd);
+		setenv("UFTRACE_RING_EVENT", buf, 1);
+	}
+
 	if (debug) {
 		snprintf(buf, sizeof(buf), "%d", debug);
 		setenv("UFTRACE_DEBUG", buf, 1);
@@ -201,6 +341,47 @@ static void setup_child_environ(struct opts *opts, int pfd)
 
 	snprintf(buf, sizeof(buf), "%d", demangler);
 	setenv("UFTRACE_DEMANGLE", buf, 1);
+
+	if (use_tsc_clock) {
+		setenv("UFTRACE_CLOCK", "tsc", 1);
+
+		snprintf(buf, sizeof(buf), "%"PRIu64, tsc_clock.freq);
+		setenv("UFTRACE_TSC_FREQ", buf, 1);
+	}
+
+	if (opts->summary)
+		setenv("UFTRACE_SUMMARY", "1", 1);
+
+	if (opts->flight_recorder)
+		setenv("UFTRACE_FLIGHT", "1", 1);
+
+	if (opts->sample_count > 1) {
+		snprintf(buf, sizeof(buf), "%u", opts->sample_count);
+		setenv("UFTRACE_SAMPLE", buf, 1);
+	}
+
+	if (opts->sample_period) {
+		snprintf(buf, sizeof(buf), "%"PRIu64"/%"PRIu64,
+			 opts->sample_on, opts->sample_period);
+		setenv("UFTRACE_SAMPLE_WINDOW", buf, 1);
+	}
+
+	if (opts->throttle_calls) {
+		snprintf(buf, sizeof(buf), "%lu/%"PRIu64,
+			 opts->throttle_calls, opts->throttle_time);
+		setenv("UFTRACE_THROTTLE", buf, 1);
+	}
+
+	if (opts->buffer_policy)
+		setenv("UFTRACE_BUFFER_POLICY", opts->buffer_policy, 1);
+
+	if (opts->buffer_wait) {
+		snprintf(buf, sizeof(buf), "%"PRIu64, opts->buffer_wait);
+		setenv("UFTRACE_BUFFER_WAIT", buf, 1);
+	}
+
+	if (opts->control)
+		setenv("UFTRACE_CONTROL", control_name, 1);
 }
 
 static uint64_t calc_feat_mask(struct opts *opts)
@@ -228,6 +409,12 @@ static uint64_t calc_feat_mask(struct opts *opts)
 	if (opts->retval)
 		features |= RETVAL;
 
+	if (opts->summary)
+		features |= SUMMARY;
+
+	if (opts->compress)
+		features |= COMPRESSED;
+
 	return features;
 }
 
@@ -257,7 +444,9 @@ static int fill_file_header(struct opts *opts, int status, struct rusage *rusage
 		goto close_efd;
 
 	strncpy(hdr.magic, UFTRACE_MAGIC_STR, UFTRACE_MAGIC_LEN);
-	hdr.version = UFTRACE_FILE_VERSION;
+	/* old versions cannot read compressed data, let them refuse it */
+	hdr.version = opts->compress ? UFTRACE_COMPRESS_VERSION :
+				       UFTRACE_COMPACT_VERSION;
 	hdr.header_size = sizeof(hdr);
 	hdr.endian = elf_ident[EI_DATA];
 	hdr.class = elf_ident[EI_CLASS];
@@ -270,7 +459,11 @@ static int fill_file_header(struct opts *opts, int status, struct rusage *rusage
 	if (write(fd, &hdr, sizeof(hdr)) != (int)sizeof(hdr))
 		pr_err("writing header info failed");
 
-	fill_ftrace_info(&hdr.info_mask, fd, opts, status, rusage);
+	if (use_tsc_clock)
+		update_tsc_clock(&tsc_clock);
+
+	fill_ftrace_info(&hdr.info_mask, fd, opts, status, rusage,
+			 use_tsc_clock ? &tsc_clock : NULL, &lost_info);
 
 try_write:
 	ret = pwrite(fd, &hdr, sizeof(hdr), 0);
@@ -324,82 +517,683 @@ static char *make_disk_name(const char *dirname, int tid)
 	return filename;
 }
 
-static void write_buffer_file(const char *dirname, struct buf_list *buf)
+static void write_buffer_file(const char *dirname, int tid,
+			      struct mcount_shmem_buffer *shmbuf)
 {
+	static struct ftrace_compressor comp;
+	static bool comp_ready;
+	void *data = shmbuf->data;
+	size_t size = shmbuf->size;
 	int fd;
 	char *filename;
-	struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
 
-	filename = make_disk_name(dirname, buf->tid);
+	if (compress_level) {
+		if (!comp_ready && setup_compressor(&comp, compress_level) < 0)
+			pr_err_ns("cannot setup compression\n");
+		comp_ready = true;
+
+		data = compress_frame(&comp, data, size, &size);
+	}
+
+	filename = make_disk_name(dirname, tid);
 	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
 	if (fd < 0)
 		pr_err("open disk file");
 
-	if (write_all(fd, shmbuf->data, shmbuf->size) < 0)
+	if (write_all(fd, data, size) < 0)
 		pr_err("write shmem buffer");
 
 	close(fd);
 	free(filename);
 }
 
-static void write_buffer(struct buf_list *buf, struct opts *opts, int sock)
+/* skip @len bytes in the iovec array */
+static void advance_iovec(struct iovec **piov, int *pnr_iov, size_t len)
+{
+	struct iovec *iov = *piov;
+	int nr_iov = *pnr_iov;
+
+	while (nr_iov && len >= iov->iov_len) {
+		len -= iov->iov_len;
+		iov++;
+		nr_iov--;
+	}
+	if (nr_iov) {
+		iov->iov_base += len;
+		iov->iov_len  -= len;
+	}
+
+	*piov = iov;
+	*pnr_iov = nr_iov;
+}
+
+/* write out data left in the pipe when splice() failed */
+static void drain_pipe(int pipefd, int fd, size_t len)
+{
+	char buf[4096];
+	ssize_t n;
+
+	while (len) {
+		n = read(pipefd, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			pr_err("read pipe failed");
+
+		if (write_all(fd, buf, n) < 0)
+			pr_err("write shmem buffer");
+		len -= n;
+	}
+}
+
+/**
+ * splice_buffers - write buffers to the file without copying to user
+ * @queue: queue having the pipe
+ * @fd: file descriptor of the data file
+ * @piov: pointer to the iovec array of shmem buffers
+ * @pnr_iov: pointer to the number of the iovecs
+ *
+ * The shmem pages are mapped to a pipe by vmsplice() and moved to the
+ * file by splice().  As splice() returns after the data is in the page
+ * cache, the buffers can be reused by libmcount after this returns.
+ *
+ * It returns 0 on success.  On error, @piov and @pnr_iov are updated
+ * to have the data not written yet and it returns -1.
+ */
+static int splice_buffers(struct shmem_ring_queue *queue, int fd,
+			  struct iovec **piov, int *pnr_iov)
+{
+	ssize_t in, out;
+
+	if (queue->pipe[0] < 0) {
+		if (pipe(queue->pipe) < 0)
+			return -1;
+		fcntl(queue->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	while (*pnr_iov) {
+		in = vmsplice(queue->pipe[1], *piov, *pnr_iov, 0);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		advance_iovec(piov, pnr_iov, in);
+
+		while (in) {
+			out = splice(queue->pipe[0], NULL, fd, NULL, in,
+				     SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0) {
+				drain_pipe(queue->pipe[0], fd, in);
+				return -1;
+			}
+			in -= out;
+		}
+	}
+	return 0;
+}
+
+/*
+ * write (or send) consecutive buffers of a task at once.  It returns the
+ * sequence number of the last zero-copy send (or 0).
+ */
+static uint64_t write_buffers(struct shmem_ring_queue *queue, int tid,
+			      struct iovec *iov, int nr_iov,
+			      struct opts *opts, int sock)
+{
+	char filename[PATH_MAX];
+	uint64_t seq = 0;
+	void *frame;
+	size_t size;
+	int i, fd = -1;
+
+	if (!opts->host) {
+		snprintf(filename, sizeof(filename), "%s/%d.dat",
+			 opts->dirname, tid);
+
+		/* splice() doesn't work with O_APPEND, the cache seeks to the end */
+		fd = fd_cache_get(&queue->fds, tid, filename,
+				  O_WRONLY | O_CREAT | (zero_copy ? 0 : O_APPEND));
+		if (fd < 0)
+			pr_err("open disk file");
+	}
+
+	/* each buffer is compressed to a frame independently */
+	for (i = 0; compress_level && i < nr_iov; i++) {
+		frame = compress_frame(&queue->comp, iov[i].iov_base,
+				       iov[i].iov_len, &size);
+
+		if (opts->host)
+			send_trace_data(sock, tid, frame, size);
+		else if (write_all(fd, frame, size) < 0)
+			pr_err("write shmem buffer");
+
+		queue->nr_frame_bytes += size;
+	}
+	if (compress_level)
+		return 0;
+
+	if (opts->host) {
+		for (i = 0; i < nr_iov; i++)
+			seq = send_trace_data(sock, tid, iov[i].iov_base,
+					      iov[i].iov_len) ?: seq;
+		return seq;
+	}
+
+	if (zero_copy && splice_buffers(queue, fd, &iov, &nr_iov) < 0) {
+		pr_dbg("cannot splice to the file, disable zero-copy: %m\n");
+		zero_copy = false;
+	}
+
+	if (nr_iov && writev_all(fd, iov, nr_iov) < 0)
+		pr_err("write shmem buffer");
+
+	return 0;
+}
+
+/*
+ * give the buffers back to libmcount and wake it up if it's waiting.
+ * It's paired with libmcount/record.c::wait_shmem_ring().
+ */
+static void wake_shmem_ring(struct mcount_shmem_ring *ring, unsigned tail)
+{
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &ring->tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * give the written buffers back to libmcount.  Buffers sent by
+ * MSG_ZEROCOPY are still used by the kernel until the completion is
+ * notified.  Keep the oldest point waiting for it, later buffers will
+ * be the next point after it's released.  It returns true if no buffer
+ * is in flight.
+ */
+static bool release_sent_buffers(struct shmem_ring_list *rl, uint64_t seq)
+{
+	if (seq)
+		rl->sent_seq = seq;
+
+	if (rl->zc_pending && zerocopy_completed(rl->zc_seq)) {
+		wake_shmem_ring(rl->ring, rl->zc_tail);
+		rl->zc_pending = false;
+	}
+
+	if (rl->zc_pending)
+		return false;
+
+	if (zerocopy_completed(rl->sent_seq)) {
+		wake_shmem_ring(rl->ring, rl->sent);
+		return true;
+	}
+
+	rl->zc_tail = rl->sent;
+	rl->zc_seq = rl->sent_seq;
+	rl->zc_pending = true;
+	return false;
+}
+
+/**
+ * consume_shmem_ring - write all published buffers in a ring
+ * @queue: queue of the ring
+ * @rl: ring to consume
+ * @opts: recording options
+ * @sock: socket for network recording
+ * @partial: also write the unpublished (current) buffer
+ * @written: set to true if any data was written
+ *
+ * Consecutive buffers are written by a single writev() to the file.
+ * This function returns true if the ring is done and can be released
+ * (the kernel doesn't use the buffers for MSG_ZEROCOPY anymore).
+ * It's paired with libmcount/record.c::finish_shmem_buffer().
+ */
+static bool consume_shmem_ring(struct shmem_ring_queue *queue,
+			       struct shmem_ring_list *rl, struct opts *opts,
+			       int sock, bool partial, bool *written)
+{
+	struct mcount_shmem_ring *ring = rl->ring;
+	struct mcount_shmem_buffer *shmbuf;
+	struct iovec iov[WRITE_BATCH_IOV + 1];
+	unsigned head, tail;
+	uint64_t seq;
+	size_t len = 0;
+	int nr_iov = 0;
+	bool done;
+
+	/* everything was sent, wait for the completion */
+	if (rl->all_sent)
+		return release_sent_buffers(rl, 0);
+
+	/* read done first so that no more buffer is published after head */
+	done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = rl->sent;
+
+	while (tail != head) {
+		shmbuf = shmem_ring_slot(ring, tail);
+
+		if (nr_iov == WRITE_BATCH_IOV ||
+		    (nr_iov && len + shmbuf->size > WRITE_BATCH_SIZE)) {
+			seq = write_buffers(queue, rl->tid, iov, nr_iov, opts, sock);
+			queue->nr_bytes += len;
+			*written = true;
+			nr_iov = 0;
+			len = 0;
+
+			rl->sent = tail;
+			release_sent_buffers(rl, seq);
+		}
+
+		if (shmbuf->size) {
+			iov[nr_iov].iov_base = shmbuf->data;
+			iov[nr_iov].iov_len  = shmbuf->size;
+			len += shmbuf->size;
+			nr_iov++;
+		}
+		tail++;
+	}
+
+	if (partial && !done) {
+		shmbuf = shmem_ring_slot(ring, head);
+
+		/* the owner is gone, buffer at head might have some data */
+		if (shmbuf->size) {
+			pr_dbg3("flushing partial buffer of task %d\n", rl->tid);
+			iov[nr_iov].iov_base = shmbuf->data;
+			iov[nr_iov].iov_len  = shmbuf->size;
+			len += shmbuf->size;
+			nr_iov++;
+		}
+		done = true;
+	}
+
+	seq = 0;
+	if (nr_iov) {
+		seq = write_buffers(queue, rl->tid, iov, nr_iov, opts, sock);
+		queue->nr_bytes += len;
+		*written = true;
+	}
+
+	rl->sent = tail;
+	if (!release_sent_buffers(rl, seq) && done) {
+		rl->all_sent = true;
+		return false;
+	}
+
+	return done;
+}
+
+static bool is_ring_done(struct shmem_ring_list *rl)
+{
+	return rl->flush || __atomic_load_n(&rl->ring->done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * snapshot_shmem_ring - save buffers in a ring without consuming them
+ * @rl: ring to save
+ * @dirname: directory to save the data
+ *
+ * In the flight recorder mode, libmcount overwrites the oldest buffer
+ * when the ring is full.  Copy the buffers first and then check the
+ * head again to discard buffers which might be reused during the copy.
+ * It's paired with libmcount/record.c::get_new_shmem_buffer().
+ */
+static void snapshot_shmem_ring(struct shmem_ring_list *rl,
+				const char *dirname)
+{
+	struct mcount_shmem_ring *ring = rl->ring;
+	struct mcount_shmem_buffer *shmbuf, *copy;
+	unsigned nr_slot = ring->nr_slot;
+	size_t slot_size = ring->slot_size;
+	unsigned first, last, head, idx;
+	void *copies;
+	bool done;
+
+	done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	/* the buffer at head is being written unless the task is done */
+	last  = done ? head : head + 1;
+	first = last > nr_slot ? last - nr_slot : 0;
+
+	copies = xmalloc(nr_slot * slot_size);
+
+	for (idx = first; idx < last; idx++) {
+		shmbuf = shmem_ring_slot(ring, idx);
+		copy = copies + (idx - first) * slot_size;
+
+		copy->size = __atomic_load_n(&shmbuf->size, __ATOMIC_ACQUIRE);
+		if (copy->size > slot_size - sizeof(*shmbuf))
+			copy->size = 0;
+
+		memcpy(copy->data, shmbuf->data, copy->size);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (idx = first; idx < last; idx++) {
+		copy = copies + (idx - first) * slot_size;
+
+		/* libmcount might start to overwrite it */
+		if (idx + nr_slot <= head)
+			continue;
+
+		/* skip the empty buffer having the sync marker only */
+		if (copy->size > 1)
+			write_buffer_file(dirname, rl->tid, copy);
+	}
+
+	free(copies);
+}
+
+static void release_shmem_ring(struct shmem_ring_list *rl)
+{
+	list_del(&rl->list);
+
+	/* let libmcount reuse the ring, paired with claim_pool_ring() */
+	if (rl->pool)
+		__atomic_store_n(&rl->pool->owner[rl->idx], 0, __ATOMIC_RELEASE);
+	else
+		munmap(rl->ring, rl->size);
+
+	free(rl);
+}
+
+static uint32_t hash_int(uint32_t val)
 {
-	struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
+	/* finalizer of MurmurHash3 */
+	val ^= val >> 16;
+	val *= 0x85ebca6b;
+	val ^= val >> 13;
+	val *= 0xc2b2ae35;
+	val ^= val >> 16;
+
+	return val;
+}
 
-	if (!opts->host)
-		return write_buffer_file(opts->dirname, buf);
+static unsigned tid_bucket(int tid)
+{
+	return hash_int(tid) % NR_TID_BUCKET;
+}
+
+static void push_incoming_ring(struct shmem_ring_queue *queue,
+			       struct shmem_ring_list *rl)
+{
+	struct shmem_ring_list *head;
 
-	send_trace_data(sock, buf->tid, shmbuf->data, shmbuf->size);
+	head = __atomic_load_n(&queue->incoming, __ATOMIC_RELAXED);
+	do {
+		rl->next = head;
+	}
+	while (!__atomic_compare_exchange_n(&queue->incoming, &head, rl, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* move new rings to the queue, should be called with queue->lock held */
+static void drain_incoming_rings(struct shmem_ring_queue *queue)
+{
+	struct shmem_ring_list *rl, *pos, *next;
+	struct shmem_ring_list *prev = NULL;
+
+	rl = __atomic_exchange_n(&queue->incoming, NULL, __ATOMIC_ACQUIRE);
+
+	/* reverse the stack to keep the order */
+	while (rl) {
+		next = rl->next;
+		rl->next = prev;
+		prev = rl;
+		rl = next;
+	}
+
+	for (rl = prev; rl; rl = next) {
+		next = rl->next;
+
+		/* previous rings of the tid (due to exec) will not be finished */
+		list_for_each_entry(pos, &queue->rings, list) {
+			if (pos->tid == rl->tid)
+				pos->flush = true;
+		}
+		list_add_tail(&rl->list, &queue->rings);
+	}
+}
+
+/* check if an older ring of the same task is still in the queue */
+static bool has_prev_ring(struct shmem_ring_queue *queue,
+			  struct shmem_ring_list *rl)
+{
+	struct shmem_ring_list *pos;
+
+	list_for_each_entry(pos, &queue->rings, list) {
+		if (pos == rl)
+			break;
+		if (pos->tid == rl->tid)
+			return true;
+	}
+	return false;
+}
+
+static bool consume_ring_queue(struct shmem_ring_queue *queue,
+			       struct opts *opts, int sock, bool final)
+{
+	struct shmem_ring_list *rl, *tmp;
+	bool written = false;
+	unsigned load = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	drain_incoming_rings(queue);
+
+	list_for_each_entry_safe(rl, tmp, &queue->rings, list) {
+		/* keep the order of buffers for a task */
+		if (has_prev_ring(queue, rl))
+			continue;
+
+		load += __atomic_load_n(&rl->ring->head, __ATOMIC_RELAXED) -
+			rl->sent;
+
+		if (consume_shmem_ring(queue, rl, opts, sock,
+				       rl->flush || final, &written))
+			release_shmem_ring(rl);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	__atomic_store_n(&queue->load, load, __ATOMIC_RELAXED);
+	return written;
+}
+
+/* find a bucket to steal, should be called with queue->lock held */
+static int find_steal_bucket(struct shmem_ring_queue *queue)
+{
+	struct shmem_ring_list *rl;
+	unsigned pending[NR_TID_BUCKET] = { 0, };
+	int nr_busy = 0;
+	int bucket = -1;
+	int b;
+
+	list_for_each_entry(rl, &queue->rings, list) {
+		unsigned nr = __atomic_load_n(&rl->ring->head, __ATOMIC_RELAXED) -
+			      rl->sent;
+
+		if (nr == 0)
+			continue;
+
+		b = tid_bucket(rl->tid);
+		if (pending[b] == 0)
+			nr_busy++;
+
+		pending[b] += nr;
+		if (bucket < 0 || pending[b] > pending[bucket])
+			bucket = b;
+	}
+
+	/* moving the only bucket doesn't help */
+	if (nr_busy < 2)
+		return -1;
+
+	return bucket;
+}
+
+/**
+ * steal_ring_bucket - move a bucket of tids from the busiest queue
+ * @queue: queue of the idle writer
+ *
+ * All rings in the bucket are moved together so that buffers of a task
+ * are written by a single writer in order.  After the owner is changed,
+ * new rings in the bucket will go to @queue.  Rings pushed to the victim
+ * by readers which saw the old owner are moved after they're done.
+ * It returns true if it stole anything.
+ */
+static bool steal_ring_bucket(struct shmem_ring_queue *queue)
+{
+	struct shmem_ring_queue *victim = NULL;
+	struct shmem_ring_queue *first, *second;
+	struct shmem_ring_list *rl, *tmp;
+	unsigned load, max_load = STEAL_MIN_LOAD - 1;
+	int i, bucket;
+
+	for (i = 0; i < nr_ring_queue; i++) {
+		if (&ring_queues[i] == queue)
+			continue;
+
+		load = __atomic_load_n(&ring_queues[i].load, __ATOMIC_RELAXED);
+		if (load > max_load) {
+			max_load = load;
+			victim = &ring_queues[i];
+		}
+	}
+
+	if (victim == NULL)
+		return false;
+
+	/* lock in the address order to prevent deadlocks between thieves */
+	first  = victim < queue ? victim : queue;
+	second = victim < queue ? queue : victim;
+
+	pthread_mutex_lock(&first->lock);
+	pthread_mutex_lock(&second->lock);
+
+	drain_incoming_rings(victim);
+
+	bucket = find_steal_bucket(victim);
+	if (bucket >= 0) {
+		pr_dbg3("writer %ld steals bucket %d from writer %ld\n",
+			(long)(queue - ring_queues), bucket,
+			(long)(victim - ring_queues));
+
+		/* paired with queue_shmem_ring() */
+		__atomic_store_n(&tid_bucket_owner[bucket], queue - ring_queues,
+				 __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&tid_bucket_users[bucket], __ATOMIC_SEQ_CST))
+			cpu_relax();
+
+		drain_incoming_rings(victim);
+
+		list_for_each_entry_safe(rl, tmp, &victim->rings, list) {
+			if (tid_bucket(rl->tid) != (unsigned)bucket)
+				continue;
+
+			/* the file offset might be stale for the next time */
+			fd_cache_close(&victim->fds, rl->tid);
+			list_move_tail(&rl->list, &queue->rings);
+		}
+
+		__atomic_store_n(&victim->load, 0, __ATOMIC_RELAXED);
+		queue->nr_steal++;
+	}
+
+	pthread_mutex_unlock(&second->lock);
+	pthread_mutex_unlock(&first->lock);
+
+	return bucket >= 0;
+}
+
+/* release old finished rings in the flight recorder mode */
+static void trim_ring_queue(struct shmem_ring_queue *queue)
+{
+	struct shmem_ring_list *rl, *tmp;
+	int nr_done = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	drain_incoming_rings(queue);
+
+	list_for_each_entry(rl, &queue->rings, list) {
+		if (is_ring_done(rl))
+			nr_done++;
+	}
+
+	list_for_each_entry_safe(rl, tmp, &queue->rings, list) {
+		if (nr_done <= FLIGHT_DONE_RINGS)
+			break;
+
+		if (is_ring_done(rl)) {
+			release_shmem_ring(rl);
+			nr_done--;
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
 }
 
 struct writer_arg {
-	struct list_head	list;
-	struct list_head	bufs;
 	struct opts		*opts;
-	struct ftrace_kernel	*kern;
 	int			sock;
 	int			idx;
-	int			tid;
-	int			nr_cpu;
-	int			cpus[];
 };
 
-static void write_buf_list(struct list_head *buf_head, struct opts *opts,
-			   struct writer_arg *warg)
+static uint64_t get_clock_nsec(clockid_t clk_id)
 {
-	struct buf_list *buf;
+	struct timespec ts;
 
-	list_for_each_entry(buf, buf_head, list) {
-		struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
+	clock_gettime(clk_id, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-		write_buffer(buf, opts, warg->sock);
+static void kick_writers(void)
+{
+	pthread_mutex_lock(&write_lock);
+	write_gen++;
+	pthread_cond_broadcast(&write_cond);
+	pthread_mutex_unlock(&write_lock);
+}
 
-		/*
-		 * Now it has consumed all contents in the shmem buffer,
-		 * make it so that mcount can reuse it.
-		 * This is paired with get_new_shmem_buffer().
-		 */
-		__sync_synchronize();
-		shmbuf->flag = SHMEM_FL_WRITTEN;
+/* sleep until new buffers are published after @gen (or timeout) */
+static void wait_for_buffers(unsigned gen)
+{
+	struct timespec timeout;
 
-		munmap(shmbuf, opts->bufsize);
-		buf->shmem_buf = NULL;
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_nsec += WRITER_TIMEOUT;
+	if (timeout.tv_nsec >= NSEC_PER_SEC) {
+		timeout.tv_nsec -= NSEC_PER_SEC;
+		timeout.tv_sec++;
 	}
 
-	pthread_mutex_lock(&free_list_lock);
-	while (!list_empty(buf_head)) {
-		struct list_head *l = buf_head->next;
-		list_move(l, &buf_free_list);
+	pthread_mutex_lock(&write_lock);
+	while (write_gen == gen && !buf_done) {
+		if (pthread_cond_timedwait(&write_cond, &write_lock,
+					   &timeout) == ETIMEDOUT)
+			break;
 	}
-	pthread_mutex_unlock(&free_list_lock);
+	pthread_mutex_unlock(&write_lock);
+}
+
+static void read_ring_event(void)
+{
+	uint64_t count;
+
+	if (read(ring_event_fd, &count, sizeof(count)) == (ssize_t)sizeof(count))
+		kick_writers();
 }
 
 void *writer_thread(void *arg)
 {
-	struct buf_list *buf, *pos;
 	struct writer_arg *warg = arg;
 	struct opts *opts = warg->opts;
-	int i;
+	struct shmem_ring_queue *queue = &ring_queues[warg->idx];
+	uint64_t start_time = get_clock_nsec(CLOCK_MONOTONIC);
+	uint64_t elapsed, cpu_time;
 
 	if (opts->rt_prio) {
 		struct sched_param param = {
@@ -411,311 +1205,690 @@ void *writer_thread(void *arg)
 	}
 
 	pr_dbg2("start writer thread %d\n", warg->idx);
-	while (true) {
-		LIST_HEAD(head);
+	while (!__atomic_load_n(&buf_done, __ATOMIC_ACQUIRE)) {
+		unsigned gen = __atomic_load_n(&write_gen, __ATOMIC_ACQUIRE);
+		bool written = false;
 
-		pthread_mutex_lock(&write_list_lock);
-		while (list_empty(&buf_write_list)) {
-			struct timespec timeout;
+		/* buffers are saved only by snapshots */
+		if (opts->flight_recorder)
+			trim_ring_queue(queue);
+		else
+			written = consume_ring_queue(queue, opts, warg->sock, false);
 
-			if (buf_done) {
-				pthread_mutex_unlock(&write_list_lock);
-				/* escape from nested loop */
-				goto out;
-			}
+		/* help other writers when it has nothing to do */
+		if (!written && !opts->flight_recorder && nr_ring_queue > 1)
+			written = steal_ring_bucket(queue);
 
-			/* check kernel data every 1ms */
-			clock_gettime(CLOCK_REALTIME, &timeout);
-			if (opts->kernel) {
-				timeout.tv_nsec += 100000;
+		if (!written)
+			wait_for_buffers(gen);
+	}
+	elapsed  = get_clock_nsec(CLOCK_MONOTONIC) - start_time;
+	cpu_time = get_clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+
+	pr_dbg("writer %d: %.3f MB in %.3f sec (%.3f MB/s), cpu %.3f sec, %lu opens, %lu steals\n",
+	       warg->idx, queue->nr_bytes / 1048576.0, elapsed / 1e9,
+	       elapsed ? queue->nr_bytes / 1048576.0 / (elapsed / 1e9) : 0,
+	       cpu_time / 1e9, queue->fds.nr_open, queue->nr_steal);
+	if (compress_level && queue->nr_bytes) {
+		pr_dbg("writer %d: compressed to %.3f MB (%.1f%%)\n", warg->idx,
+		       queue->nr_frame_bytes / 1048576.0,
+		       100.0 * queue->nr_frame_bytes / queue->nr_bytes);
+	}
+	pr_dbg2("stop writer thread %d\n", warg->idx);
 
-				if (timeout.tv_nsec > NSEC_PER_SEC) {
-					timeout.tv_nsec -= NSEC_PER_SEC;
-					timeout.tv_sec++;
-				}
-			}
-			else {
-				timeout.tv_sec++;
-			}
+	free(warg);
+	return NULL;
+}
 
-			pthread_cond_timedwait(&write_cond, &write_list_lock,
-					       &timeout);
-			if (opts->kernel)
-				break;
-		}
+struct kernel_arg {
+	struct ftrace_kernel	*kern;
+	int			cpu;
+};
 
-		if (!list_empty(&buf_write_list)) {
-			/* pick first unhandled buf  */
-			buf = list_first_entry(&buf_write_list,
-					       struct buf_list, list);
-			list_move(&buf->list, &head);
+/* to wake up kernel capture threads at the end */
+static int kernel_stop_fd = -1;
 
-			warg->tid = buf->tid;
-			list_add(&warg->list, &writer_list);
-		}
+/* time to wait for a partial page to be filled (in msec) */
+#define KERNEL_PARTIAL_WAIT  1
+
+/*
+ * Older kernels wake up as soon as there's a data but it can splice
+ * full pages only.  Don't spin on a partial page: wait for the timeout
+ * or the stop signal only (an error of the trace fd still wakes it up).
+ */
+static void wait_partial_page(struct pollfd *pfd, int nr_pfd)
+{
+	pfd[0].events = 0;
+	if (poll(pfd, nr_pfd, KERNEL_PARTIAL_WAIT) < 0)
+		pfd[1].revents = 0;
+	pfd[0].events = POLLIN;
+}
+
+/*
+ * kernel_thread - capture kernel trace data of a cpu
+ *
+ * It runs on the cpu it drains so that data in the ring buffer doesn't
+ * need to cross the cpus.  It sleeps in poll() until the kernel wakes it
+ * up (when the buffer reaches buffer_percent on recent kernels).
+ */
+static void *kernel_thread(void *arg)
+{
+	struct kernel_arg *karg = arg;
+	struct ftrace_kernel *kern = karg->kern;
+	int cpu = karg->cpu;
+	struct pollfd pfd[2] = {
+		{ .fd = kern->traces[cpu], .events = POLLIN, },
+		{ .fd = kernel_stop_fd,    .events = POLLIN, },
+	};
+	cpu_set_t set;
+	int n;
 
-		list_for_each_entry_safe(buf, pos, &buf_write_list, list) {
-			/* list may have multiple buf for this task */
-			if (buf->tid == warg->tid)
-				list_move_tail(&buf->list, &head);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		pr_dbg("cannot pin kernel thread to cpu %d\n", cpu);
+
+	pr_dbg2("start kernel thread for cpu %d\n", cpu);
+	while (true) {
+		if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_dbg("poll for kernel cpu %d failed: %m\n", cpu);
+			break;
 		}
 
-		pthread_mutex_unlock(&write_list_lock);
+		if (pfd[1].revents)
+			break;
 
-		if (opts->kernel) {
-			for (i = 0; i < warg->nr_cpu; i++) {
-				record_kernel_trace_pipe(warg->kern,
-							 warg->cpus[i]);
-			}
+		n = record_kernel_trace_pipe(kern, cpu);
+		if (n < 0) {
+			pr_dbg("record kernel data (cpu %d) failed\n", cpu);
+			break;
 		}
 
-		while (!list_empty(&head)) {
-			write_buf_list(&head, opts, warg);
+		while (n > 0)
+			n = record_kernel_trace_pipe(kern, cpu);
 
-			pthread_mutex_lock(&write_list_lock);
-			/* check someone sends bufs for me directly */
-			list_splice_tail_init(&warg->bufs, &head);
+		if (n == 0)
+			wait_partial_page(pfd, ARRAY_SIZE(pfd));
 
-			if (list_empty(&head)) {
-				/* I'm done with this tid */
-				warg->tid = -1;
-				list_del_init(&warg->list);
-			}
-			pthread_mutex_unlock(&write_list_lock);
+		/* it might get the stop signal while waiting */
+		if (pfd[1].revents)
+			break;
+	}
+	pr_dbg2("stop kernel thread for cpu %d\n", cpu);
 
-			if (!opts->kernel)
-				continue;
+	free(karg);
+	return NULL;
+}
 
-			for (i = 0; i < warg->nr_cpu; i++) {
-				record_kernel_trace_pipe(warg->kern,
-							 warg->cpus[i]);
-			}
+static pthread_t *start_kernel_threads(struct ftrace_kernel *kern)
+{
+	pthread_t *threads;
+	int i;
+
+	kernel_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (kernel_stop_fd < 0)
+		pr_err("creating eventfd failed");
+
+	threads = xcalloc(kern->nr_cpus, sizeof(*threads));
+
+	for (i = 0; i < kern->nr_cpus; i++) {
+		struct kernel_arg *karg = xmalloc(sizeof(*karg));
+
+		karg->kern = kern;
+		karg->cpu  = i;
+
+		pthread_create(&threads[i], NULL, kernel_thread, karg);
+	}
+
+	return threads;
+}
+
+static void stop_kernel_threads(struct ftrace_kernel *kern, pthread_t *threads)
+{
+	uint64_t stop = 1;
+	int i;
+
+	if (write(kernel_stop_fd, &stop, sizeof(stop)) != (ssize_t)sizeof(stop))
+		pr_err("signal to kernel threads failed");
+
+	for (i = 0; i < kern->nr_cpus; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	close(kernel_stop_fd);
+	kernel_stop_fd = -1;
+}
+
+static int cmp_hash_point(const void *a, const void *b)
+{
+	const struct hash_point *pa = a;
+	const struct hash_point *pb = b;
+
+	if (pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return pa->queue - pb->queue;
+}
+
+/* find the first point clockwise from @hash on the ring */
+static int hash_ring_lookup(struct hash_point *ring, int nr_points,
+			    uint32_t hash)
+{
+	int lo = 0, hi = nr_points;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ring[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* wrap around */
+	if (lo == nr_points)
+		lo = 0;
+
+	return ring[lo].queue;
+}
+
+static void setup_ring_queues(int nr_queue)
+{
+	struct hash_point *ring;
+	int nr_points = nr_queue * NR_HASH_POINTS;
+	int i, k;
+
+	ring_queues = xcalloc(nr_queue, sizeof(*ring_queues));
+	nr_ring_queue = nr_queue;
+
+	ring = xmalloc(nr_points * sizeof(*ring));
+	for (i = 0; i < nr_queue; i++) {
+		for (k = 0; k < NR_HASH_POINTS; k++) {
+			struct hash_point *hp = &ring[i * NR_HASH_POINTS + k];
+
+			hp->hash  = hash_int(i * NR_HASH_POINTS + k + 1);
+			hp->queue = i;
 		}
 	}
-out:
-	pr_dbg2("stop writer thread %d\n", warg->idx);
+	qsort(ring, nr_points, sizeof(*ring), cmp_hash_point);
+
+	for (i = 0; i < NR_TID_BUCKET; i++)
+		tid_bucket_owner[i] = hash_ring_lookup(ring, nr_points,
+						       hash_int(~i));
+	free(ring);
+
+	for (i = 0; i < nr_queue; i++) {
+		pthread_mutex_init(&ring_queues[i].lock, NULL);
+		INIT_LIST_HEAD(&ring_queues[i].rings);
+		fd_cache_init(&ring_queues[i].fds, FD_CACHE_SIZE);
+		ring_queues[i].pipe[0] = ring_queues[i].pipe[1] = -1;
+
+		if (compress_level &&
+		    setup_compressor(&ring_queues[i].comp, compress_level) < 0)
+			pr_err_ns("cannot setup compression\n");
+	}
+}
+
+static void queue_shmem_ring(struct shmem_ring_list *rl)
+{
+	unsigned bucket = tid_bucket(rl->tid);
+	int owner;
+
+	rl->flush = false;
+	rl->sent = rl->ring->tail;
+	rl->sent_seq = 0;
+	rl->zc_pending = false;
+	rl->all_sent = false;
+
+	/*
+	 * A steal changes the owner and then waits for the users.  So either
+	 * it sees the new owner, or the steal takes the ring from the old one.
+	 */
+	__atomic_add_fetch(&tid_bucket_users[bucket], 1, __ATOMIC_SEQ_CST);
+	owner = __atomic_load_n(&tid_bucket_owner[bucket], __ATOMIC_SEQ_CST);
+	push_incoming_ring(&ring_queues[owner], rl);
+	__atomic_sub_fetch(&tid_bucket_users[bucket], 1, __ATOMIC_RELEASE);
+}
+
+static void add_shmem_ring(char *sess_id)
+{
+	int fd;
+	struct stat stbuf;
+	struct shmem_ring_list *rl;
+
+	fd = shm_open(sess_id, O_RDWR, 0600);
+	if (fd < 0) {
+		pr_dbg("open shmem buffer failed: %s: %m\n", sess_id);
+		return;
+	}
+
+	if (fstat(fd, &stbuf) < 0)
+		pr_err("stat shmem buffer");
+
+	rl = xmalloc(sizeof(*rl));
+	rl->size = stbuf.st_size;
+	rl->ring = mmap(NULL, rl->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (rl->ring == MAP_FAILED)
+		pr_err("mmap shmem buffer");
+
+	close(fd);
+
+	/* both sides have it mapped, the name is not needed anymore */
+	shm_unlink(sess_id);
+
+	parse_msg_id(sess_id, NULL, &rl->tid, NULL);
+	rl->pool = NULL;
+
+	queue_shmem_ring(rl);
+}
+
+static void add_shmem_pool(char *pool_name)
+{
+	int fd;
+	struct stat stbuf;
+	struct shmem_pool_list *pl;
+	const char *prefix = "/uftrace-";
+
+	if (strncmp(pool_name, prefix, strlen(prefix)) ||
+	    strlen(pool_name) < strlen(prefix) + sizeof(pl->sid)) {
+		pr_dbg("invalid shmem pool name: %s\n", pool_name);
+		return;
+	}
+
+	fd = shm_open(pool_name, O_RDWR, 0600);
+	if (fd < 0) {
+		pr_dbg("open shmem pool failed: %s: %m\n", pool_name);
+		return;
+	}
+
+	if (fstat(fd, &stbuf) < 0)
+		pr_err("stat shmem pool");
+
+	pl = xmalloc(sizeof(*pl));
+	pl->size = stbuf.st_size;
+	pl->pool = mmap(NULL, pl->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (pl->pool == MAP_FAILED)
+		pr_err("mmap shmem pool");
+
+	close(fd);
+	shm_unlink(pool_name);
+
+	memcpy(pl->sid, pool_name + strlen(prefix), sizeof(pl->sid));
+	list_add(&pl->list, &shmem_pools);
+}
+
+static void add_pool_ring(struct ftrace_msg_ring *rmsg)
+{
+	struct shmem_pool_list *pl;
+	struct shmem_ring_list *rl;
+
+	list_for_each_entry(pl, &shmem_pools, list) {
+		if (!memcmp(pl->sid, rmsg->sid, sizeof(pl->sid)))
+			break;
+	}
+
+	if (list_no_entry(pl, &shmem_pools, list)) {
+		pr_dbg("cannot find shmem pool for task %d\n", rmsg->tid);
+		return;
+	}
+
+	if (rmsg->idx >= pl->pool->nr_ring)
+		pr_err_ns("invalid shmem pool index: %u\n", rmsg->idx);
+
+	rl = xmalloc(sizeof(*rl));
+	rl->ring = shmem_pool_ring(pl->pool, rmsg->idx);
+	rl->size = 0;
+	rl->tid = rmsg->tid;
+	rl->pool = pl->pool;
+	rl->idx = rmsg->idx;
+
+	queue_shmem_ring(rl);
+}
+
+static void release_shmem_pools(void)
+{
+	struct shmem_pool_list *pl, *tmp;
+
+	list_for_each_entry_safe(pl, tmp, &shmem_pools, list) {
+		list_del(&pl->list);
+		munmap(pl->pool, pl->size);
+		free(pl);
+	}
+}
+
+static void stop_all_writers(void)
+{
+	__atomic_store_n(&buf_done, true, __ATOMIC_RELEASE);
+	kick_writers();
+}
+
+/* remove <tid>.dat files saved by the previous snapshot */
+static void remove_task_data_files(const char *dirname)
+{
+	DIR *dp;
+	struct dirent *ent;
+	char *filename;
+	char *end;
+
+	dp = opendir(dirname);
+	if (dp == NULL)
+		return;
+
+	while ((ent = readdir(dp)) != NULL) {
+		strtol(ent->d_name, &end, 10);
+		if (end == ent->d_name || strcmp(end, ".dat"))
+			continue;
+
+		xasprintf(&filename, "%s/%s", dirname, ent->d_name);
+		unlink(filename);
+		free(filename);
+	}
+	closedir(dp);
+}
+
+/**
+ * take_snapshot - save current contents of all rings
+ * @dirname: directory to save the data
+ *
+ * This is for the flight recorder mode.  The data files are replaced
+ * so the directory always has the last snapshot only.
+ */
+static void take_snapshot(const char *dirname)
+{
+	struct shmem_ring_list *rl;
+	int i;
+
+	remove_task_data_files(dirname);
+
+	for (i = 0; i < nr_ring_queue; i++) {
+		struct shmem_ring_queue *queue = &ring_queues[i];
+
+		pthread_mutex_lock(&queue->lock);
+		drain_incoming_rings(queue);
+		list_for_each_entry(rl, &queue->rings, list)
+			snapshot_shmem_ring(rl, dirname);
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	nr_snapshot++;
+	pr_dbg("snapshot #%d saved\n", nr_snapshot);
+}
+
+static void snapshot_signal_handler(int sig)
+{
+	snapshot_requested = true;
+}
+
+static void setup_control(const char *dirname)
+{
+	int fd;
+
+	snprintf(control_name, sizeof(control_name),
+		 "/uftrace-control-%d", getpid());
+
+	fd = shm_open(control_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		pr_err("cannot create control shmem");
 
-	free(warg);
-	return NULL;
-}
+	if (ftruncate(fd, sizeof(*control)) < 0)
+		pr_err("cannot resize control shmem");
 
-static struct buf_list *make_write_buffer(void)
-{
-	struct buf_list *buf;
+	control = mmap(NULL, sizeof(*control), PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	if (control == MAP_FAILED)
+		pr_err("cannot map control shmem");
+	close(fd);
 
-	buf = malloc(sizeof(*buf));
-	if (buf == NULL)
-		return NULL;
+	control_dir = xstrdup(dirname);
+	xasprintf(&control_fifo, "%s/%s", dirname, MCOUNT_CONTROL_FIFO);
+	unlink(control_fifo);
 
-	INIT_LIST_HEAD(&buf->list);
+	if (mkfifo(control_fifo, 0600) < 0)
+		pr_err("cannot create control fifo");
 
-	return buf;
+	/* keep it opened for write too, not to get EOF after each request */
+	control_fd = open(control_fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (control_fd < 0)
+		pr_err("cannot open control fifo");
 }
 
-static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id)
+/*
+ * wake_control_threads - notify libmcount of a new control request
+ * @cleanup: remove all wake-up FIFOs instead
+ *
+ * Each traced process has a "control-<pid>" FIFO in the data directory
+ * and its control thread sleeps on it.  Writing a byte is enough to wake
+ * it up.  A FIFO without a reader belongs to a dead process.
+ */
+static void wake_control_threads(bool cleanup)
 {
-	struct buf_list *buf = NULL;
-	struct writer_arg *writer;
+	int len = strlen(MCOUNT_CONTROL_WAKE);
+	struct dirent *ent;
+	char *path;
+	DIR *dp;
+	int fd;
 
-	pthread_mutex_lock(&free_list_lock);
-	if (!list_empty(&buf_free_list)) {
-		buf = list_first_entry(&buf_free_list, struct buf_list, list);
-		list_del(&buf->list);
-	}
-	pthread_mutex_unlock(&free_list_lock);
+	dp = opendir(control_dir);
+	if (dp == NULL)
+		return;
 
-	if (buf == NULL) {
-		buf = make_write_buffer();
-		if (buf == NULL)
-			pr_err_ns("not enough memory!\n");
+	while ((ent = readdir(dp)) != NULL) {
+		if (strncmp(ent->d_name, MCOUNT_CONTROL_WAKE, len))
+			continue;
 
-		pr_dbg3("make a new write buffer\n");
-	}
+		xasprintf(&path, "%s/%s", control_dir, ent->d_name);
 
-	buf->shmem_buf = shm;
-	parse_msg_id(sess_id, NULL, &buf->tid, NULL);
+		if (cleanup) {
+			unlink(path);
+			free(path);
+			continue;
+		}
 
-	pthread_mutex_lock(&write_list_lock);
-	/* check some writers work for this tid */
-	list_for_each_entry(writer, &writer_list, list) {
-		if (buf->tid == writer->tid) {
-			/* if so, pass the buf directly */
-			list_add_tail(&buf->list, &writer->bufs);
-			break;
+		fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd >= 0) {
+			/* EAGAIN is ok, it's not read yet */
+			if (write(fd, "", 1) < 0 && errno != EAGAIN)
+				pr_dbg("cannot wake up %s: %m\n", ent->d_name);
+			close(fd);
 		}
+		else if (errno == ENXIO) {
+			unlink(path);
+		}
+		free(path);
 	}
-	if (list_no_entry(writer, &writer_list, list)) {
-		/* no writer is dealing with the tid */
-		list_add_tail(&buf->list, &buf_write_list);
-		pthread_cond_signal(&write_cond);
-	}
-	pthread_mutex_unlock(&write_list_lock);
+	closedir(dp);
 }
 
-static int record_mmap_file(const char *dirname, char *sess_id, int bufsize)
+static void finish_control(void)
 {
-	int fd;
-	struct shmem_list *sl;
-	struct mcount_shmem_buffer *shmem_buf;
-
-	/* write (append) it to disk */
-	fd = shm_open(sess_id, O_RDWR, 0600);
-	if (fd < 0) {
-		pr_dbg("open shmem buffer failed: %s: %m\n", sess_id);
-		return 0;
-	}
+	if (control == NULL)
+		return;
 
-	shmem_buf = mmap(NULL, bufsize, PROT_READ | PROT_WRITE,
-			 MAP_SHARED, fd, 0);
-	if (shmem_buf == MAP_FAILED)
-		pr_err("mmap shmem buffer");
+	close(control_fd);
+	unlink(control_fifo);
+	free(control_fifo);
 
-	close(fd);
+	wake_control_threads(true);
+	free(control_dir);
 
-	if (shmem_buf->flag & SHMEM_FL_RECORDING) {
-		if (shmem_buf->flag & SHMEM_FL_NEW) {
-			bool found = false;
+	munmap(control, sizeof(*control));
+	shm_unlink(control_name);
+	control = NULL;
+}
 
-			if (!list_empty(&shmem_need_unlink)) {
-				sl = list_last_entry(&shmem_need_unlink,
-						     struct shmem_list, list);
+static int parse_control_line(struct mcount_control *ctrl, char *line)
+{
+	char *val = strchr(line, '=');
 
-				/* length of "uftrace-<session id>-" is 25 */
-				if (!strncmp(sl->id, sess_id, 25))
-					found = true;
-			}
+	if (val == NULL)
+		return -1;
+	*val++ = '\0';
 
-			if (!found) {
-				sl = xmalloc(sizeof(*sl));
-				memcpy(sl->id, sess_id, sizeof(sl->id));
+	if (!strcmp(line, "filter") || !strcmp(line, "trigger")) {
+		char *str = line[0] == 'f' ? ctrl->filter : ctrl->trigger;
 
-				/* link to shmem_list */
-				list_add_tail(&sl->list, &shmem_need_unlink);
-			}
-		}
+		if (strlen(val) >= MCOUNT_CTRL_STRLEN)
+			return -1;
 
-		if (shmem_buf->size) {
-			/* shmem_buf will be unmapped */
-			copy_to_buffer(shmem_buf, sess_id);
-		}
+		strcpy(str, val);
+		ctrl->mask |= line[0] == 'f' ? MCOUNT_CTRL_FILTER :
+					       MCOUNT_CTRL_TRIGGER;
+	}
+	else if (!strcmp(line, "depth")) {
+		ctrl->depth = strtol(val, NULL, 0);
+		if (ctrl->depth <= 0)
+			return -1;
+		ctrl->mask |= MCOUNT_CTRL_DEPTH;
+	}
+	else if (!strcmp(line, "threshold")) {
+		ctrl->threshold = strtoull(val, NULL, 0);
+		ctrl->mask |= MCOUNT_CTRL_THRESHOLD;
 	}
+	else if (!strcmp(line, "enable")) {
+		ctrl->enable = strtol(val, NULL, 0);
+		ctrl->enable_gen = ctrl->gen + 1;
+		ctrl->mask |= MCOUNT_CTRL_ENABLE;
+	}
+	else
+		return -1;
 
 	return 0;
 }
 
-static void stop_all_writers(void)
-{
-	pthread_mutex_lock(&write_list_lock);
-	buf_done = true;
-	pthread_cond_broadcast(&write_cond);
-	pthread_mutex_unlock(&write_list_lock);
-}
-
-static void record_remaining_buffer(struct opts *opts, int sock)
+/*
+ * read_control_request - merge a request into the control shmem
+ *
+ * A request consists of "key=value" lines and is written to the FIFO by
+ * a single write() so it's never mixed with others.  The shmem is
+ * updated like a seqlock since libmcount reads it without any lock.
+ */
+static void read_control_request(void)
 {
-	struct buf_list *buf;
+	char buf[PIPE_BUF + 1];
+	struct mcount_control ctrl;
+	char *line, *pos;
+	ssize_t len;
 
-	/* called after all writers gone, no lock is needed */
-	while (!list_empty(&buf_write_list)) {
-		buf = list_first_entry(&buf_write_list, struct buf_list, list);
-		write_buffer(buf, opts, sock);
-		munmap(buf->shmem_buf, opts->bufsize);
+	len = read(control_fd, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
 
-		list_del(&buf->list);
-		free(buf);
-	}
+	memcpy(&ctrl, control, sizeof(ctrl));
 
-	while (!list_empty(&buf_free_list)) {
-		buf = list_first_entry(&buf_free_list, struct buf_list, list);
+	line = strtok_r(buf, "\n", &pos);
+	while (line) {
+		pr_dbg2("CONTROL: %s\n", line);
 
-		list_del(&buf->list);
-		free(buf);
+		if (parse_control_line(&ctrl, line) < 0) {
+			pr_log("invalid control request: %s\n", line);
+			return;
+		}
+		line = strtok_r(NULL, "\n", &pos);
 	}
-}
 
-static void flush_shmem_list(const char *dirname, int bufsize)
-{
-	struct shmem_list *sl, *tmp;
+	ctrl.gen++;
 
-	/* flush remaining list (due to abnormal termination) */
-	list_for_each_entry_safe(sl, tmp, &shmem_list_head, list) {
-		pr_dbg("flushing %s\n", sl->id);
+	__atomic_store_n(&control->seq, ctrl.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 
-		list_del(&sl->list);
-		record_mmap_file(dirname, sl->id, bufsize);
-		free(sl);
-	}
-}
+	memcpy((void *)control + sizeof(ctrl.seq), (void *)&ctrl + sizeof(ctrl.seq),
+	       sizeof(ctrl) - sizeof(ctrl.seq));
 
-static char shmem_session[20];
+	__atomic_store_n(&control->seq, ctrl.seq + 2, __ATOMIC_RELEASE);
 
-static int filter_shmem(const struct dirent *de)
-{
-	/* compare session ID after the "uftrace-" part */
-	return !memcmp(&de->d_name[8], shmem_session, 16);
+	pr_dbg("control request #%u received\n", ctrl.gen);
+	wake_control_threads(false);
 }
 
-static void unlink_shmem_list(void)
+static void record_remaining_buffer(struct opts *opts, int sock)
 {
-	struct shmem_list *sl, *tmp;
-
-	/* unlink shmem list (not used anymore) */
-	list_for_each_entry_safe(sl, tmp, &shmem_need_unlink, list) {
-		char sid[128];
-		struct dirent **shmem_bufs;
-		int i, num;
+	struct shmem_ring_list *rl, *tmp;
+	int i;
 
-		list_del(&sl->list);
+	/* called after all writers gone, consume all rings in order */
+	for (i = 0; i < nr_ring_queue; i++) {
+		struct shmem_ring_queue *queue = &ring_queues[i];
 
-		sscanf(sl->id, "/uftrace-%[^-]-%*d-%*d", shmem_session);
-		pr_dbg2("unlink for session: %s\n", shmem_session);
+		drain_incoming_rings(queue);
 
-		num = scandir("/dev/shm/", &shmem_bufs, filter_shmem, alphasort);
-		for (i = 0; i < num; i++) {
-			sid[0] = '/';
-			strcpy(&sid[1], shmem_bufs[i]->d_name);
-			pr_dbg3("unlink %s\n", sid);
-			shm_unlink(sid);
-			free(shmem_bufs[i]);
+		/* snapshots were already taken, just discard them */
+		if (opts->flight_recorder) {
+			list_for_each_entry_safe(rl, tmp, &queue->rings, list)
+				release_shmem_ring(rl);
 		}
 
-		free(shmem_bufs);
-		free(sl);
-	}
-}
+		while (!list_empty(&queue->rings))
+			consume_ring_queue(queue, opts, sock, true);
 
-static void flush_old_shmem(const char *dirname, int tid, int bufsize)
-{
-	struct shmem_list *sl;
+		fd_cache_release(&queue->fds);
+		if (queue->pipe[0] >= 0) {
+			close(queue->pipe[0]);
+			close(queue->pipe[1]);
+		}
+		if (compress_level)
+			finish_compressor(&queue->comp);
+		pthread_mutex_destroy(&queue->lock);
+	}
 
-	/* flush remaining list (due to abnormal termination) */
-	list_for_each_entry(sl, &shmem_list_head, list) {
-		int sl_tid;
+	free(ring_queues);
+	ring_queues = NULL;
 
-		sscanf(sl->id, "/uftrace-%*x-%d-%*d", &sl_tid);
+	release_shmem_pools();
+}
 
-		if (tid == sl_tid) {
-			pr_dbg3("flushing %s\n", sl->id);
+static void add_lost_entry(struct ftrace_lost_entry **entries, int *nr,
+			   int id, unsigned long count)
+{
+	int i;
 
-			list_del(&sl->list);
-			record_mmap_file(dirname, sl->id, bufsize);
-			free(sl);
+	for (i = 0; i < *nr; i++) {
+		if ((*entries)[i].id == id) {
+			(*entries)[i].count += count;
 			return;
 		}
 	}
+
+	*entries = xrealloc(*entries, (*nr + 1) * sizeof(**entries));
+	(*entries)[*nr].id = id;
+	(*entries)[*nr].count = count;
+	(*nr)++;
 }
 
-static int shmem_lost_count;
+static void account_lost_records(struct ftrace_msg_lost *lmsg)
+{
+	uint64_t time = lmsg->task.time;
+	int window = 0;
+
+	if (use_tsc_clock)
+		time = tsc_to_nsec(&tsc_clock, time);
+
+	/* it's the time when the task got a new buffer */
+	if (time > record_start_time)
+		window = (time - record_start_time) / LOST_WINDOW;
+
+	lost_info.window = LOST_WINDOW;
+	lost_info.total += lmsg->count;
+	add_lost_entry(&lost_info.tasks, &lost_info.nr_task,
+		       lmsg->task.tid, lmsg->count);
+	add_lost_entry(&lost_info.windows, &lost_info.nr_window,
+		       window, lmsg->count);
+}
 
 struct tid_list {
 	struct list_head list;
 	int pid;
 	int tid;
-	bool exited;
 };
 
 static LIST_HEAD(tid_list_head);
 
+/* number of FORK_START messages waiting for matching FORK_END */
+static int nr_pending_fork;
+
 static void add_tid_list(int pid, int tid)
 {
 	struct tid_list *tl;
@@ -724,7 +1897,6 @@ static void add_tid_list(int pid, int tid)
 
 	tl->pid = pid;
 	tl->tid = tid;
-	tl->exited = false;
 
 	/* link to tid_list */
 	list_add(&tl->list, &tid_list_head);
@@ -740,62 +1912,246 @@ static void free_tid_list(void)
 	}
 }
 
-static bool check_tid_list(void)
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open  434
+#endif
+
+/*
+ * A traced process is watched using a pidfd which becomes readable when
+ * the process (all threads in it) exited.  So the recorder doesn't need
+ * to poll /proc to know whether all tasks are finished.  Threads are
+ * covered by the pidfd of the process.  If pidfd is not available, the
+ * process is checked via /proc/<pid>/stat as before.
+ */
+struct task_watch {
+	struct rb_node node;
+	int pid;
+	int fd;
+	bool exited;
+};
+
+static struct rb_root task_watches = RB_ROOT;
+static int task_epfd = -1;
+static int nr_live_task;	/* watched processes not exited yet */
+static int nr_proc_check;	/* processes should be checked via /proc */
+static bool use_pidfd = true;
+
+static int open_pidfd(int pid)
 {
-	struct tid_list *tl;
-	char buf[128];
+	return syscall(SYS_pidfd_open, pid, 0);
+}
 
-	list_for_each_entry(tl, &tid_list_head, list) {
-		int fd, len;
-		char state;
-		char line[4096];
+/* returns a new watch or NULL if it's already watched */
+static struct task_watch *new_task_watch(int pid)
+{
+	struct task_watch *tw;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &task_watches.rb_node;
 
-		if (tl->exited || tl->tid < 0)
-			continue;
+	while (*p) {
+		parent = *p;
+		tw = rb_entry(parent, struct task_watch, node);
 
-		snprintf(buf, sizeof(buf), "/proc/%d/stat", tl->tid);
+		if (tw->pid == pid)
+			return NULL;
 
-		fd = open(buf, O_RDONLY);
-		if (fd < 0) {
-			tl->exited = true;
-			continue;
+		if (tw->pid > pid)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	tw = xmalloc(sizeof(*tw));
+	tw->pid = pid;
+	tw->fd = -1;
+	tw->exited = false;
+
+	rb_link_node(&tw->node, parent, p);
+	rb_insert_color(&tw->node, &task_watches);
+
+	return tw;
+}
+
+static void task_exited(struct task_watch *tw)
+{
+	if (tw->exited)
+		return;
+
+	if (tw->fd >= 0) {
+		/* it's removed from the epoll set too */
+		close(tw->fd);
+		tw->fd = -1;
+	}
+	else {
+		nr_proc_check--;
+	}
+
+	tw->exited = true;
+	nr_live_task--;
+
+	pr_dbg3("task %d exited\n", tw->pid);
+}
+
+/**
+ * watch_task - start to watch exit of a task
+ * @pid: process id
+ * @tid: thread id
+ *
+ * This function finds a process of the task and watches it.  Note that
+ * @pid can be a parent of @tid if it's a vfork-ed child.
+ */
+static void watch_task(int pid, int tid)
+{
+	struct task_watch *tw;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	int fd = -1;
+
+	if (use_pidfd) {
+		/*
+		 * pidfd can only be opened for a thread group leader.
+		 * Older kernels return EINVAL for others, newer ENOENT.
+		 */
+		fd = open_pidfd(tid);
+		if (fd < 0 && (errno == EINVAL || errno == ENOENT))
+			fd = open_pidfd(pid);
+		else
+			pid = tid;
+
+		/* already exited */
+		if (fd < 0 && errno == ESRCH)
+			return;
+
+		if (fd < 0 && errno == ENOSYS) {
+			pr_dbg("pidfd is not supported: checking /proc instead\n");
+			use_pidfd = false;
 		}
+	}
+	else {
+		/* check every thread in /proc */
+		pid = tid;
+	}
 
-		len = read(fd, line, sizeof(line) - 1);
-		if (len < 0) {
-			tl->exited = true;
+	tw = new_task_watch(pid);
+	if (tw == NULL) {
+		if (fd >= 0)
 			close(fd);
-			continue;
-		}
+		return;
+	}
 
-		line[len] = '\0';
+	nr_live_task++;
 
-		sscanf(line, "%*d %*s %c", &state);
-		if (state == 'Z')
-			tl->exited = true;
+	ev.data.ptr = tw;
+	if (fd >= 0 && epoll_ctl(task_epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+		tw->fd = fd;
+		return;
+	}
 
+	/* no pidfd (e.g. too many open files), check it later */
+	if (fd >= 0)
 		close(fd);
-	}
+	nr_proc_check++;
+}
+
+static bool check_proc_exited(int pid)
+{
+	int fd, len;
+	char state = 0;
+	char buf[64];
+	char line[4096];
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+
+	fd = open(buf, O_RDONLY);
+	if (fd < 0)
+		return true;
+
+	len = read(fd, line, sizeof(line) - 1);
+	close(fd);
 
-	list_for_each_entry(tl, &tid_list_head, list) {
-		if (!tl->exited)
-			return false;
+	if (len < 0)
+		return true;
+
+	line[len] = '\0';
+
+	sscanf(line, "%*d %*s %c", &state);
+	return state == 'Z';
+}
+
+static bool check_task_exit(void)
+{
+	struct rb_node *node;
+	struct task_watch *tw;
+
+	if (nr_proc_check) {
+		node = rb_first(&task_watches);
+		while (node) {
+			tw = rb_entry(node, struct task_watch, node);
+			node = rb_next(node);
+
+			if (!tw->exited && tw->fd < 0 &&
+			    check_proc_exited(tw->pid))
+				task_exited(tw);
+		}
 	}
 
+	if (nr_live_task || nr_pending_fork)
+		return false;
+
 	pr_dbg2("all process/thread exited\n");
 	return true;
 }
 
-static void read_record_mmap(int pfd, const char *dirname, int bufsize)
+/* wait for (at most a second) watched tasks to exit */
+static void wait_task_exit(void)
+{
+	struct epoll_event ev[16];
+	int i, n;
+
+	/* nothing to wait in the epoll set, but a signal */
+	if (nr_live_task == nr_proc_check) {
+		usleep(1000);
+		return;
+	}
+
+	n = epoll_wait(task_epfd, ev, ARRAY_SIZE(ev), 1000);
+	for (i = 0; i < n; i++)
+		task_exited(ev[i].data.ptr);
+}
+
+static void free_task_watches(void)
+{
+	struct rb_node *node;
+	struct task_watch *tw;
+
+	while (!RB_EMPTY_ROOT(&task_watches)) {
+		node = rb_first(&task_watches);
+		tw = rb_entry(node, struct task_watch, node);
+
+		rb_erase(node, &task_watches);
+
+		if (tw->fd >= 0)
+			close(tw->fd);
+		free(tw);
+	}
+
+	nr_live_task = 0;
+	nr_proc_check = 0;
+}
+
+static void read_record_mmap(int pfd, const char *dirname)
 {
 	char buf[128];
-	struct shmem_list *sl, *tmp;
 	struct tid_list *tl, *pos;
 	struct ftrace_msg msg;
 	struct ftrace_msg_task tmsg;
 	struct ftrace_msg_sess sess;
+	struct ftrace_msg_ring rmsg;
+	struct ftrace_msg_lost lmsg;
+	struct ftrace_msg_ctrl *cmsg;
+	char cbuf[sizeof(*cmsg) + 2 * MCOUNT_CTRL_STRLEN + 128];
 	char *exename;
-	int lost;
 
 	if (read_all(pfd, &msg, sizeof(msg)) < 0)
 		pr_err("reading pipe failed:");
@@ -808,19 +2164,16 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		if (msg.len > SHMEM_NAME_SIZE)
 			pr_err_ns("invalid message length\n");
 
-		sl = xmalloc(sizeof(*sl));
-
-		if (read_all(pfd, sl->id, msg.len) < 0)
+		if (read_all(pfd, buf, msg.len) < 0)
 			pr_err("reading pipe failed");
 
-		sl->id[msg.len] = '\0';
-		pr_dbg2("MSG START: %s\n", sl->id);
+		buf[msg.len] = '\0';
+		pr_dbg2("MSG START: %s\n", buf);
 
-		/* link to shmem_list */
-		list_add_tail(&sl->list, &shmem_list_head);
+		add_shmem_ring(buf);
 		break;
 
-	case FTRACE_MSG_REC_END:
+	case FTRACE_MSG_REC_POOL:
 		if (msg.len > SHMEM_NAME_SIZE)
 			pr_err_ns("invalid message length\n");
 
@@ -828,18 +2181,34 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 			pr_err("reading pipe failed");
 
 		buf[msg.len] = '\0';
-		pr_dbg2("MSG  END : %s\n", buf);
+		pr_dbg2("MSG POOL : %s\n", buf);
 
-		/* remove from shmem_list */
-		list_for_each_entry_safe(sl, tmp, &shmem_list_head, list) {
-			if (!strncmp(sl->id, buf, SHMEM_NAME_SIZE)) {
-				list_del(&sl->list);
-				free(sl);
-				break;
-			}
-		}
+		add_shmem_pool(buf);
+		break;
+
+	case FTRACE_MSG_REC_RING:
+		if (msg.len != sizeof(rmsg))
+			pr_err_ns("invalid message length\n");
+
+		if (read_all(pfd, &rmsg, sizeof(rmsg)) < 0)
+			pr_err("reading pipe failed");
+
+		pr_dbg2("MSG RING : %d [%u]\n", rmsg.tid, rmsg.idx);
+
+		add_pool_ring(&rmsg);
+		break;
+
+	case FTRACE_MSG_SNAPSHOT:
+		if (msg.len != sizeof(tmsg))
+			pr_err_ns("invalid message length\n");
+
+		if (read_all(pfd, &tmsg, sizeof(tmsg)) < 0)
+			pr_err("reading pipe failed");
 
-		record_mmap_file(dirname, buf, bufsize);
+		pr_dbg2("MSG SNAPSHOT: %d/%d\n", tmsg.pid, tmsg.tid);
+
+		if (flight_recorder)
+			take_snapshot(dirname);
 		break;
 
 	case FTRACE_MSG_TID:
@@ -853,14 +2222,14 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 
 		/* check existing tid (due to exec) */
 		list_for_each_entry(pos, &tid_list_head, list) {
-			if (pos->tid == tmsg.tid) {
-				flush_old_shmem(dirname, tmsg.tid, bufsize);
+			if (pos->tid == tmsg.tid)
 				break;
-			}
 		}
 
-		if (list_no_entry(pos, &tid_list_head, list))
+		if (list_no_entry(pos, &tid_list_head, list)) {
 			add_tid_list(tmsg.pid, tmsg.tid);
+			watch_task(tmsg.pid, tmsg.tid);
+		}
 
 		write_task_info(dirname, &tmsg);
 		break;
@@ -875,6 +2244,7 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		pr_dbg2("MSG FORK1: %d/%d\n", tmsg.pid, -1);
 
 		add_tid_list(tmsg.pid, -1);
+		nr_pending_fork++;
 		break;
 
 	case FTRACE_MSG_FORK_END:
@@ -909,6 +2279,10 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 			pr_err("cannot find fork pid: %d\n", tmsg.pid);
 
 		tl->tid = tmsg.tid;
+		nr_pending_fork--;
+
+		/* the child is a new process */
+		watch_task(tmsg.tid, tmsg.tid);
 
 		pr_dbg2("MSG FORK2: %d/%d\n", tl->pid, tl->tid);
 
@@ -936,13 +2310,32 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		break;
 
 	case FTRACE_MSG_LOST:
-		if (msg.len < sizeof(lost))
+		if (msg.len != sizeof(lmsg))
 			pr_err_ns("invalid message length\n");
 
-		if (read_all(pfd, &lost, sizeof(lost)) < 0)
+		if (read_all(pfd, &lmsg, sizeof(lmsg)) < 0)
 			pr_err("reading pipe failed");
 
-		shmem_lost_count += lost;
+		pr_dbg2("MSG LOST: %d: %d records\n", lmsg.task.tid, lmsg.count);
+
+		account_lost_records(&lmsg);
+		break;
+
+	case FTRACE_MSG_CONTROL:
+		if (msg.len < sizeof(*cmsg) || msg.len > sizeof(cbuf) - 1)
+			pr_err_ns("invalid message length\n");
+
+		if (read_all(pfd, cbuf, msg.len) < 0)
+			pr_err("reading pipe failed");
+
+		cmsg = (void *)cbuf;
+		if (cmsg->len != msg.len - sizeof(*cmsg))
+			pr_err_ns("invalid message length\n");
+		cmsg->settings[cmsg->len] = '\0';
+
+		pr_dbg2("MSG CONTROL: %d: #%u\n", cmsg->task.pid, cmsg->gen);
+
+		write_control_info(dirname, cmsg);
 		break;
 
 	default:
@@ -1183,20 +2576,21 @@ static void save_module_symbols(struct opts *opts, struct symtabs *symtabs)
 	ftrace_cleanup_filter_module(&modules);
 }
 
+static void write_index_files(struct opts *opts)
+{
+	struct ftrace_file_handle handle;
+
+	if (open_data_file(opts, &handle) < 0)
+		return;
+
+	write_task_index(&handle);
+	close_data_file(opts, &handle);
+}
+
 static bool child_exited;
 
 static void sigchld_handler(int sig, siginfo_t *sainfo, void *context)
 {
-	int tid = sainfo->si_pid;
-	struct tid_list *tl;
-
-	list_for_each_entry(tl, &tid_list_head, list) {
-		if (tl->tid == tid) {
-			tl->exited = true;
-			break;
-		}
-	}
-
 	child_exited = true;
 }
 
@@ -1301,6 +2695,10 @@ static void check_binary(struct opts *opts)
 			/* there's no function to trace */
 			pr_err_ns(MCOUNT_MSG, "mcount", opts->exename);
 		}
+		else if (chk == 3) {
+			/* compiled with -mnop-mcount and -mrecord-mcount */
+			need_dynamic_patch = true;
+		}
 		else if (chk == 2 && (opts->args || opts->retval)) {
 			/* arg/retval doesn't support -finstrument-functions */
 			pr_err_ns(ARGUMENT_MSG);
@@ -1328,12 +2726,27 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	struct timespec ts1, ts2;
 	struct rusage usage;
 	pthread_t *writers;
+	pthread_t *kernel_threads = NULL;
 	struct ftrace_kernel kern;
+	struct epoll_event pipe_ev = {
+		.events = EPOLLIN,
+	};
 	int efd;
 	uint64_t go = 1;
 	int sock = -1;
 	int nr_cpu;
-	int i, k;
+	int i;
+
+	if (opts->summary && opts->host) {
+		pr_use("summary mode cannot be used with --host\n");
+		return -1;
+	}
+
+	if (opts->flight_recorder && (opts->host || opts->summary)) {
+		pr_use("flight recorder mode cannot be used with %s\n",
+		       opts->host ? "--host" : "--summary");
+		return -1;
+	}
 
 	if (pipe(pfd) < 0)
 		pr_err("cannot setup internal pipe");
@@ -1343,12 +2756,27 @@ int command_record(int argc, char *argv[], struct opts *opts)
 
 	check_binary(opts);
 
+	if (opts->clock && !strcmp(opts->clock, "tsc")) {
+		if (setup_tsc_clock(&tsc_clock) < 0)
+			pr_log("TSC clock is not available: using monotonic clock\n");
+		else
+			use_tsc_clock = true;
+	}
+
 	fflush(stdout);
 
 	efd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
 	if (efd < 0)
 		pr_dbg("creating eventfd failed: %d\n", efd);
 
+	if (opts->control)
+		setup_control(opts->dirname);
+
+	/* it should be inherited by the program (no EFD_CLOEXEC) */
+	ring_event_fd = eventfd(0, EFD_NONBLOCK);
+	if (ring_event_fd < 0)
+		pr_dbg("creating ring eventfd failed: %m\n");
+
 	pid = fork();
 	if (pid < 0)
 		pr_err("cannot start child process");
@@ -1373,6 +2801,7 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	record_start_time = (uint64_t)ts1.tv_sec * NSEC_PER_SEC + ts1.tv_nsec;
 	close(pfd[1]);
 
 	sigfillset(&sa.sa_mask);
@@ -1381,8 +2810,57 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	sa.sa_flags = SA_NOCLDSTOP | SA_SIGINFO;
 	sigaction(SIGCHLD, &sa, NULL);
 
+	task_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (task_epfd < 0)
+		pr_err("cannot create epoll");
+
+	pipe_ev.data.ptr = NULL;
+	if (epoll_ctl(task_epfd, EPOLL_CTL_ADD, pfd[0], &pipe_ev) < 0)
+		pr_err("cannot add internal pipe to epoll");
+
+	watch_task(pid, pid);
+
+	if (control) {
+		struct epoll_event ctrl_ev = {
+			.events = EPOLLIN,
+			.data.ptr = &control_fd,
+		};
+
+		if (epoll_ctl(task_epfd, EPOLL_CTL_ADD, control_fd, &ctrl_ev) < 0)
+			pr_err("cannot add control fifo to epoll");
+	}
+
+	if (ring_event_fd >= 0) {
+		struct epoll_event ring_ev = {
+			.events = EPOLLIN,
+			.data.ptr = &ring_event_fd,
+		};
+
+		if (epoll_ctl(task_epfd, EPOLL_CTL_ADD, ring_event_fd, &ring_ev) < 0)
+			pr_err("cannot add ring eventfd to epoll");
+	}
+
+	zero_copy = opts->zero_copy;
+	compress_level = opts->compress;
+
+	/* compressed frames are written from a separate buffer */
+	if (zero_copy && compress_level) {
+		pr_log("--zero-copy is ignored when --compress is used\n");
+		zero_copy = false;
+	}
+
+	if (opts->flight_recorder) {
+		flight_recorder = true;
+
+		sa.sa_handler = snapshot_signal_handler;
+		sa.sa_flags = 0;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
 	if (opts->host) {
 		sock = setup_client_socket(opts);
+		if (opts->zero_copy && !opts->compress)
+			setup_client_zerocopy(sock, kick_writers);
 		send_trace_header(sock, opts->dirname);
 	}
 
@@ -1421,30 +2899,15 @@ int command_record(int argc, char *argv[], struct opts *opts)
 
 	pr_dbg("creating %d thread(s) for recording\n", opts->nr_thread);
 	writers = xmalloc(opts->nr_thread * sizeof(*writers));
+	setup_ring_queues(opts->nr_thread);
 
 	for (i = 0; i < opts->nr_thread; i++) {
 		struct writer_arg *warg;
-		int cpu_per_thread = DIV_ROUND_UP(nr_cpu, opts->nr_thread);
-		size_t sizeof_warg = sizeof(*warg) + sizeof(int) * cpu_per_thread;
 
-		warg = xmalloc(sizeof_warg);
+		warg = xmalloc(sizeof(*warg));
 		warg->opts = opts;
 		warg->idx  = i;
 		warg->sock = sock;
-		warg->kern = &kern;
-		INIT_LIST_HEAD(&warg->list);
-		INIT_LIST_HEAD(&warg->bufs);
-
-		if (opts->kernel) {
-			warg->nr_cpu = cpu_per_thread;
-
-			for (k = 0; k < cpu_per_thread; k++) {
-				if (i * cpu_per_thread + k < nr_cpu)
-					warg->cpus[k] = i * cpu_per_thread + k;
-				else
-					warg->cpus[k] = -1;
-			}
-		}
 
 		pthread_create(&writers[i], NULL, writer_thread, warg);
 	}
@@ -1454,6 +2917,9 @@ int command_record(int argc, char *argv[], struct opts *opts)
 		pr_log("kernel tracing disabled due to an error\n");
 	}
 
+	if (opts->kernel)
+		kernel_threads = start_kernel_threads(&kern);
+
 	/* signal child that I'm ready */
 	if (write(efd, &go, sizeof(go)) != (ssize_t)sizeof(go))
 		pr_err("signal to child failed");
@@ -1461,33 +2927,64 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	close(efd);
 
 	while (!ftrace_done) {
-		struct pollfd pollfd = {
-			.fd = pfd[0],
-			.events = POLLIN,
-		};
-		int ret;
+		struct epoll_event ev[16];
+		bool hangup = false;
+		int n;
+
+		if (snapshot_requested) {
+			snapshot_requested = false;
+			take_snapshot(opts->dirname);
+		}
 
-		ret = poll(&pollfd, 1, 1000);
-		if (ret < 0 && errno == EINTR)
+		n = epoll_wait(task_epfd, ev, ARRAY_SIZE(ev), 1000);
+		if (n < 0 && errno == EINTR)
 			continue;
-		if (ret < 0)
+		if (n < 0)
 			pr_err("error during poll");
 
-		if (pollfd.revents & POLLIN)
-			read_record_mmap(pfd[0], opts->dirname, opts->bufsize);
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == &control_fd) {
+				read_control_request();
+				continue;
+			}
+
+			if (ev[i].data.ptr == &ring_event_fd) {
+				read_ring_event();
+				continue;
+			}
+
+			/* pidfd of an exited task */
+			if (ev[i].data.ptr) {
+				task_exited(ev[i].data.ptr);
+				continue;
+			}
+
+			if (ev[i].events & EPOLLIN)
+				read_record_mmap(pfd[0], opts->dirname);
+
+			if (ev[i].events & (EPOLLERR | EPOLLHUP))
+				hangup = true;
+		}
 
-		if (pollfd.revents & (POLLERR | POLLHUP))
+		if (hangup)
 			break;
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &ts2);
 
+	/* only remaining data will be read from the pipe */
+	epoll_ctl(task_epfd, EPOLL_CTL_DEL, pfd[0], NULL);
+	if (control)
+		epoll_ctl(task_epfd, EPOLL_CTL_DEL, control_fd, NULL);
+	if (ring_event_fd >= 0)
+		epoll_ctl(task_epfd, EPOLL_CTL_DEL, ring_event_fd, NULL);
+
 	while (!ftrace_done) {
 		if (ioctl(pfd[0], FIONREAD, &remaining) < 0)
 			break;
 
 		if (remaining) {
-			read_record_mmap(pfd[0], opts->dirname, opts->bufsize);
+			read_record_mmap(pfd[0], opts->dirname);
 			continue;
 		}
 
@@ -1497,11 +2994,11 @@ int command_record(int argc, char *argv[], struct opts *opts)
 		 * order to get proper pid.  Otherwise replay will fail with
 		 * pid of -1.
 		 */
-		if (child_exited && check_tid_list())
+		if (child_exited && check_task_exit())
 			break;
 
 		pr_dbg2("waiting for FORK2\n");
-		usleep(1000);
+		wait_task_exit();
 	}
 
 	if (child_exited) {
@@ -1517,9 +3014,13 @@ int command_record(int argc, char *argv[], struct opts *opts)
 		getrusage(RUSAGE_CHILDREN, &usage);
 	}
 
+	finish_control();
+
 	stop_all_writers();
-	if (opts->kernel)
+	if (opts->kernel) {
 		stop_kernel_tracing(&kern);
+		stop_kernel_threads(&kern, kernel_threads);
+	}
 
 	if (fill_file_header(opts, status, &usage) < 0)
 		pr_err("cannot generate data file");
@@ -1529,25 +3030,37 @@ int command_record(int argc, char *argv[], struct opts *opts)
 		print_child_usage(&usage);
 	}
 
-	if (shmem_lost_count)
-		pr_log("LOST %d records\n", shmem_lost_count);
+	if (lost_info.total)
+		pr_log("LOST %lu records\n", lost_info.total);
 
 	for (i = 0; i < opts->nr_thread; i++)
 		pthread_join(writers[i], NULL);
 
-	flush_shmem_list(opts->dirname, opts->bufsize);
+	/* save the last moment when it crashed or no snapshot was taken */
+	if (opts->flight_recorder &&
+	    ((child_exited && WIFSIGNALED(status)) || nr_snapshot == 0))
+		take_snapshot(opts->dirname);
+
 	record_remaining_buffer(opts, sock);
-	unlink_shmem_list();
 	free_tid_list();
+	free_task_watches();
+	close(task_epfd);
+	if (ring_event_fd >= 0)
+		close(ring_event_fd);
 
 	load_symtabs(&symtabs, opts->dirname, opts->exename);
 	save_symbol_file(&symtabs, opts->dirname, opts->exename);
 	save_module_symbols(opts, &symtabs);
 
+	/* live mode removes the data soon */
+	if (opts->mode == UFTRACE_MODE_RECORD && !opts->host && !opts->summary)
+		write_index_files(opts);
+
 	if (opts->kernel)
 		finish_kernel_tracing(&kern);
 
 	if (opts->host) {
+		finish_client_zerocopy(sock);
 		send_task_file(sock, opts->dirname, &symtabs);
 		send_map_files(sock, opts->dirname);
 		send_sym_files(sock, opts->dirname);
@@ -2,6 +2,7 @@
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <inttypes.h>
@@ -11,16 +12,21 @@
 #include <netdb.h>
 #include <sys/signalfd.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <pthread.h>
 #include <linux/limits.h>
+#include <linux/errqueue.h>
 
 #include "uftrace.h"
 #include "utils/utils.h"
 #include "utils/list.h"
+#include "utils/fdcache.h"
 
 struct client_data {
 	struct list_head	list;
 	int			sock;
 	char			*dirname;
+	struct fd_cache		fds;	/* open <tid>.dat files */
 };
 
 static LIST_HEAD(client_list);
@@ -100,6 +106,290 @@ int setup_client_socket(struct opts *opts)
 	return sock;
 }
 
+#ifndef SO_ZEROCOPY
+# define SO_ZEROCOPY  60
+#endif
+#ifndef MSG_ZEROCOPY
+# define MSG_ZEROCOPY  0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+# define SO_EE_ORIGIN_ZEROCOPY  5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+# define SO_EE_CODE_ZEROCOPY_COPIED  1
+#endif
+
+/*
+ * Zero-copy send state of a socket.  The kernel keeps referencing the
+ * pages sent by MSG_ZEROCOPY until it gets the ACK and notifies the
+ * completion in the error queue.  Each zero-copy sendmsg() gets a
+ * sequence number (starting from 1) and a thread reads notifications
+ * asynchronously to update the number of completed calls.  So senders
+ * never wait for the network, they check the sequence number later to
+ * release the buffers.
+ */
+struct zerocopy_sock {
+	int			sock;
+	bool			enabled;
+	bool			stop;
+	uint64_t		sent;	/* number of zero-copy sendmsg() calls */
+	uint64_t		done;	/* number of completed sendmsg() calls */
+	pthread_mutex_t		send_lock;  /* not to mix messages of writers */
+	pthread_t		thread;
+	int			wake_fd[2];
+	void			(*notify)(void);
+};
+
+static struct zerocopy_sock client_zc = {
+	.sock		= -1,
+	.send_lock	= PTHREAD_MUTEX_INITIALIZER,
+	.wake_fd	= { -1, -1 },
+};
+
+/* read all notifications in the error queue, returns true if any */
+static bool read_zerocopy_completion(struct zerocopy_sock *zc)
+{
+	char control[128];
+	struct msghdr msg = {
+		.msg_control = control,
+	};
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	uint64_t done = zc->done;
+
+	while (true) {
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (void *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/*
+			 * notifications are for the range of [ee_info, ee_data]
+			 * and TCP completes them in order.  They are 32-bit.
+			 */
+			done += (uint32_t)(serr->ee_data + 1 - (uint32_t)done);
+
+			/* kernel copied the data anyway (e.g. loopback) */
+			if (zc->enabled &&
+			    (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+				pr_dbg("MSG_ZEROCOPY is not effective, disabling\n");
+				__atomic_store_n(&zc->enabled, false, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	if (done == zc->done)
+		return false;
+
+	__atomic_store_n(&zc->done, done, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *zerocopy_thread(void *arg)
+{
+	struct zerocopy_sock *zc = arg;
+	struct pollfd pfd[2] = {
+		/* POLLERR is reported when the error queue has one */
+		{ .fd = zc->sock, },
+		{ .fd = zc->wake_fd[0], .events = POLLIN, },
+	};
+	char buf[16];
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+
+	while (true) {
+		if (read_zerocopy_completion(zc) && zc->notify)
+			zc->notify();
+
+		if (__atomic_load_n(&zc->stop, __ATOMIC_ACQUIRE) &&
+		    zc->done == __atomic_load_n(&zc->sent, __ATOMIC_ACQUIRE))
+			break;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			if (read(zc->wake_fd[0], buf, sizeof(buf)) < 0)
+				pr_dbg("cannot read zerocopy wake fd: %m\n");
+		}
+
+		/* POLLERR without a notification means a socket error */
+		if (pfd[0].revents & POLLERR)
+			getsockopt(zc->sock, SOL_SOCKET, SO_ERROR, &err, &errlen);
+
+		/* no more notifications will come, the pages are freed */
+		if ((pfd[0].revents & (POLLHUP | POLLNVAL)) || err) {
+			read_zerocopy_completion(zc);
+			__atomic_store_n(&zc->done, zc->sent, __ATOMIC_RELEASE);
+			if (zc->notify)
+				zc->notify();
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * setup_client_zerocopy - enable MSG_ZEROCOPY for sending trace data
+ * @sock: socket connected to the server
+ * @notify: called (in another thread) when some sends are completed
+ *
+ * Old kernels don't support it, just use normal writev() then.
+ */
+void setup_client_zerocopy(int sock, void (*notify)(void))
+{
+	struct zerocopy_sock *zc = &client_zc;
+	int one = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		pr_dbg("cannot use MSG_ZEROCOPY: %m\n");
+		return;
+	}
+
+	if (pipe2(zc->wake_fd, O_CLOEXEC) < 0) {
+		pr_dbg("cannot create zerocopy wake pipe: %m\n");
+		return;
+	}
+
+	zc->sock = sock;
+	zc->notify = notify;
+
+	if (pthread_create(&zc->thread, NULL, zerocopy_thread, zc) != 0) {
+		pr_dbg("cannot start zerocopy thread\n");
+		close(zc->wake_fd[0]);
+		close(zc->wake_fd[1]);
+		zc->sock = -1;
+		return;
+	}
+	zc->enabled = true;
+}
+
+/**
+ * finish_client_zerocopy - wait for all zero-copy sends to complete
+ * @sock: socket connected to the server
+ */
+void finish_client_zerocopy(int sock)
+{
+	struct zerocopy_sock *zc = &client_zc;
+
+	if (zc->sock != sock)
+		return;
+
+	__atomic_store_n(&zc->stop, true, __ATOMIC_RELEASE);
+	if (write(zc->wake_fd[1], "", 1) < 0)
+		pr_dbg("cannot wake zerocopy thread: %m\n");
+
+	pthread_join(zc->thread, NULL);
+
+	close(zc->wake_fd[0]);
+	close(zc->wake_fd[1]);
+	zc->sock = -1;
+	zc->enabled = false;
+}
+
+/**
+ * zerocopy_completed - check if a zero-copy send is done
+ * @seq: sequence number returned by send_trace_data()
+ *
+ * This function returns true if the kernel doesn't use the pages sent
+ * with @seq (and before) anymore.  @seq of 0 means it was copied.
+ */
+bool zerocopy_completed(uint64_t seq)
+{
+	return __atomic_load_n(&client_zc.done, __ATOMIC_ACQUIRE) >= seq;
+}
+
+/*
+ * Send the data without copying.  The header is copied since it's on
+ * the stack, only the data pages are sent with MSG_ZEROCOPY.  The lock
+ * is held during the sendmsg() calls only to keep the message in one
+ * piece, it doesn't wait for the completion.  It returns the sequence
+ * number of the last zero-copy send, or 0 if all were copied.
+ */
+static int sendmsg_zerocopy(struct zerocopy_sock *zc, struct iovec *iov,
+			    int count, int nr_hdr, uint64_t *seq)
+{
+	struct msghdr msg = {};
+	struct pollfd pfd = {
+		.fd = zc->sock,
+		.events = POLLOUT,
+	};
+	ssize_t len;
+	int flags;
+	int ret = 0;
+
+	*seq = 0;
+
+	pthread_mutex_lock(&zc->send_lock);
+	while (count) {
+		msg.msg_iov = iov;
+
+		if (nr_hdr) {
+			/* the header on the stack might change before ACK */
+			msg.msg_iovlen = nr_hdr;
+			flags = MSG_MORE | MSG_DONTWAIT;
+		}
+		else if (__atomic_load_n(&zc->enabled, __ATOMIC_RELAXED)) {
+			msg.msg_iovlen = count;
+			flags = MSG_ZEROCOPY | MSG_DONTWAIT;
+		}
+		else {
+			msg.msg_iovlen = count;
+			flags = MSG_DONTWAIT;
+		}
+
+		len = sendmsg(zc->sock, &msg, flags);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* too many pages are pinned, just copy this time */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				ret = writev_all(zc->sock, iov, count);
+				break;
+			}
+			if (errno != EAGAIN) {
+				ret = -1;
+				break;
+			}
+
+			/* socket buffer is full */
+			poll(&pfd, 1, -1);
+			continue;
+		}
+
+		if (flags & MSG_ZEROCOPY)
+			*seq = __atomic_add_fetch(&zc->sent, 1, __ATOMIC_RELEASE);
+
+		/* skip the data sent */
+		while (count && len >= (ssize_t)iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			count--;
+			if (nr_hdr)
+				nr_hdr--;
+		}
+		if (count && len) {
+			iov->iov_base += len;
+			iov->iov_len  -= len;
+		}
+	}
+	pthread_mutex_unlock(&zc->send_lock);
+
+	return ret;
+}
+
 void send_trace_header(int sock, char *name)
 {
 	ssize_t len = strlen(name);
@@ -118,7 +408,18 @@ void send_trace_header(int sock, char *name)
 		pr_err("send header failed");
 }
 
-void send_trace_data(int sock, int tid, void *data, size_t len)
+/**
+ * send_trace_data - send a buffer of a task to the server
+ * @sock: socket connected to the server
+ * @tid: task id
+ * @data: buffer to send
+ * @len: size of the buffer
+ *
+ * With MSG_ZEROCOPY, the kernel still uses @data after it returns.  It
+ * returns a sequence number to check with zerocopy_completed() before
+ * reusing the buffer, or 0 if it's not needed.
+ */
+uint64_t send_trace_data(int sock, int tid, void *data, size_t len)
 {
 	int32_t msg_tid = htonl(tid);
 	struct ftrace_msg msg = {
@@ -131,10 +432,18 @@ void send_trace_data(int sock, int tid, void *data, size_t len)
 		{ .iov_base = &msg_tid, .iov_len = sizeof(msg_tid), },
 		{ .iov_base = data,     .iov_len = len, },
 	};
+	uint64_t seq = 0;
 
 	pr_dbg2("send FTRACE_MSG_SEND_DATA\n");
+	if (sock == client_zc.sock) {
+		if (sendmsg_zerocopy(&client_zc, iov, ARRAY_SIZE(iov), 2, &seq) < 0)
+			pr_err("send data failed");
+		return seq;
+	}
+
 	if (writev_all(sock, iov, ARRAY_SIZE(iov)) < 0)
 		pr_err("send data failed");
+	return 0;
 }
 
 void send_trace_task(int sock, struct ftrace_msg *hmsg,
@@ -332,6 +641,7 @@ static void recv_trace_header(int sock, int len)
 	client->sock = sock;
 	client->dirname = xstrdup(dirname);
 	INIT_LIST_HEAD(&client->list);
+	fd_cache_init(&client->fds, FD_CACHE_SIZE);
 
 	create_directory(dirname);
 	pr_dbg3("create directory: %s\n", dirname);
@@ -343,8 +653,9 @@ static void recv_trace_data(int sock, int len)
 {
 	struct client_data *client;
 	int32_t tid;
-	char *filename = NULL;
+	char filename[PATH_MAX];
 	void *buffer;
+	int fd;
 
 	client = find_client(sock);
 	if (client == NULL)
@@ -354,18 +665,22 @@ static void recv_trace_data(int sock, int len)
 		pr_err("recv tid failed");
 	tid = ntohl(tid);
 
-	xasprintf(&filename, "%d.dat", tid);
-
 	len -= sizeof(tid);
 	buffer = xmalloc(len);
 
 	if (read_all(sock, buffer, len) < 0)
 		pr_err("recv buffer failed");
 
-	write_client_file(client, filename, 1, buffer, len);
+	/* data files are written frequently, keep them open */
+	snprintf(filename, sizeof(filename), "%s/%d.dat", client->dirname, tid);
+	fd = fd_cache_get(&client->fds, tid, filename, O_CLIENT_FLAGS);
+	if (fd < 0)
+		pr_err("file open failed: %s", filename);
+
+	if (write_all(fd, buffer, len) < 0)
+		pr_err("write client data failed on %s", filename);
 
 	free(buffer);
-	free(filename);
 }
 
 static void recv_trace_task(int sock, int len)
@@ -546,6 +861,7 @@ static void recv_trace_end(int sock, int efd)
 	if (client) {
 		list_del(&client->list);
 
+		fd_cache_release(&client->fds);
 		free(client->dirname);
 		free(client);
 	}
@@ -58,8 +58,7 @@ static int print_flat_rstack(struct ftrace_file_handle *handle,
 {
 	static int count;
 	struct ftrace_ret_stack *rstack = task->rstack;
-	struct ftrace_session *sess = find_task_session(task->tid, rstack->time);
-	struct symtabs *symtabs;
+	struct ftrace_session *sess = get_task_session(task, rstack->time);
 	struct sym *sym;
 	char *name;
 	struct fstack *fstack;
@@ -67,8 +66,7 @@ static int print_flat_rstack(struct ftrace_file_handle *handle,
 	if (sess == NULL)
 		return 0;
 
-	symtabs = &sess->symtabs;
-	sym = find_symtabs(symtabs, rstack->addr);
+	sym = find_session_sym(sess, rstack->addr);
 	name = symbol_getname(sym, rstack->addr);
 	fstack = &task->func_stack[rstack->depth];
 
@@ -97,6 +95,42 @@ static void print_task_newline(int current_tid)
 	prev_tid = current_tid;
 }
 
+/*
+ * Show settings changed by 'uftrace control' before the record of @task.
+ * They're applied to the whole process so it uses the current task.
+ */
+static void print_control_events(struct ftrace_file_handle *handle,
+				 struct ftrace_task_handle *task,
+				 struct opts *opts)
+{
+	struct ftrace_ret_stack *rstack = task->rstack;
+	struct ftrace_session *sess;
+	struct ftrace_ctrl_event *ctrl;
+	int depth;
+
+	sess = get_task_session(task, rstack->time);
+	if (sess == NULL)
+		return;
+
+	while ((ctrl = sess->ctrl_next) != NULL && ctrl->time <= rstack->time) {
+		sess->ctrl_next = ctrl->next;
+
+		if (check_time_range(&handle->time_range, ctrl->time))
+			continue;
+
+		/* give a new line when tid is changed */
+		if (opts->task_newline)
+			print_task_newline(task->tid);
+
+		depth = task->display_depth + task_column_depth(task, opts);
+
+		print_time_unit(0UL);
+		pr_out(" [%5d] |", task->tid);
+		pr_gray(" %*s/* control #%u:%s */\n", depth * 2, "",
+			ctrl->gen, ctrl->settings);
+	}
+}
+
 void get_argspec_string(struct ftrace_task_handle *task,
 		        char *args, size_t len,
 		        enum argspec_string_bits str_mode)
@@ -290,7 +324,6 @@ static int print_graph_rstack(struct ftrace_file_handle *handle,
 {
 	struct ftrace_ret_stack *rstack = task->rstack;
 	struct ftrace_session *sess;
-	struct symtabs *symtabs;
 	struct sym *sym = NULL;
 	enum argspec_string_bits str_mode = 0;
 	char *symname = NULL;
@@ -301,12 +334,11 @@ static int print_graph_rstack(struct ftrace_file_handle *handle,
 	if (rstack->type == FTRACE_LOST)
 		goto lost;
 
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess == NULL && !is_kernel_address(rstack->addr))
 		return 0;
 
-	symtabs = &sess->symtabs;
-	sym = find_symtabs(symtabs, rstack->addr);
+	sym = find_session_sym(sess, rstack->addr);
 	symname = symbol_getname(sym, rstack->addr);
 
 	if (rstack->type == FTRACE_ENTRY && symname[strlen(symname) - 1] != ')')
@@ -597,8 +629,10 @@ int command_replay(int argc, char *argv[], struct opts *opts)
 
 		if (opts->flat)
 			ret = print_flat_rstack(&handle, task, opts);
-		else
+		else {
+			print_control_events(&handle, task, opts);
 			ret = print_graph_rstack(&handle, task, opts);
+		}
 
 		if (ret)
 			break;
@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "uftrace.h"
 #include "utils/utils.h"
@@ -37,7 +41,6 @@ static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thre
 	struct trace_entry *entry;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &root->rb_node;
-	uint64_t entry_time = 0;
 
 	pr_dbg3("%s: [%5d] %"PRIu64"/%"PRIu64" (%lu) %-s\n",
 		__func__, te->pid, te->time_total, te->time_self, te->nr_called,
@@ -59,15 +62,10 @@ static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thre
 			entry->time_self  += te->time_self;
 			entry->nr_called  += te->nr_called;
 
-			if (avg_mode == AVG_TOTAL)
-				entry_time = te->time_total;
-			else if (avg_mode == AVG_SELF)
-				entry_time = te->time_self;
-
-			if (entry->time_min > entry_time)
-				entry->time_min = entry_time;
-			if (entry->time_max < entry_time)
-				entry->time_max = entry_time;
+			if (entry->time_min > te->time_min)
+				entry->time_min = te->time_min;
+			if (entry->time_max < te->time_max)
+				entry->time_max = te->time_max;
 
 			entry->time_recursive += te->time_recursive;
 
@@ -91,78 +89,519 @@ static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thre
 	entry->time_self  = te->time_self;
 	entry->nr_called  = te->nr_called;
 	entry->pair = NULL;
+	entry->time_min = te->time_min;
+	entry->time_max = te->time_max;
+	entry->time_recursive = te->time_recursive;
+
+	rb_link_node(&entry->link, parent, p);
+	rb_insert_color(&entry->link, root);
+}
+
+static void set_min_max_time(struct trace_entry *te)
+{
+	uint64_t entry_time = 0;
 
 	if (avg_mode == AVG_TOTAL)
 		entry_time = te->time_total;
 	else if (avg_mode == AVG_SELF)
 		entry_time = te->time_self;
 
-	entry->time_min = entry_time;
-	entry->time_max = entry_time;
-	entry->time_recursive = te->time_recursive;
+	te->time_min = entry_time;
+	te->time_max = entry_time;
+}
 
-	rb_link_node(&entry->link, parent, p);
-	rb_insert_color(&entry->link, root);
+static int filter_summary(const struct dirent *de)
+{
+	size_t len = strlen(de->d_name);
+
+	return len > 4 && !strcmp(de->d_name + len - 4, ".sum");
 }
 
-static void build_function_tree(struct ftrace_file_handle *handle,
-				struct rb_root *root, struct opts *opts)
+static bool summary_task_filtered(struct ftrace_file_handle *handle,
+				  struct opts *opts, int tid)
+{
+	int i;
+
+	if (opts->tid == NULL)
+		return false;
+
+	for (i = 0; i < handle->nr_tasks; i++) {
+		if (handle->tasks[i].tid == tid)
+			return false;
+	}
+	return true;
+}
+
+/* convert a duration in TSC ticks into nsec */
+static uint64_t summary_time(struct ftrace_file_handle *handle, uint64_t time)
+{
+	struct ftrace_tsc_clock *tsc = &handle->info.tsc;
+
+	if (!(handle->hdr.info_mask & (1UL << CLOCK_INFO)))
+		return time;
+
+	return tsc_to_nsec(tsc, tsc->tsc_base + time) - tsc->mono_base;
+}
+
+/**
+ * read_summary_file - read function statistics saved in summary mode
+ * @handle: file handle of the data
+ * @opts: report options
+ * @name: name of the summary file
+ * @callback: function to be called for each (converted) entry
+ * @arg: argument to @callback
+ *
+ * This function reads a <tid>-<sid>.sum file and passes its entries to
+ * @callback.  It returns 0 on success or -1 if the file is invalid or
+ * filtered out.
+ */
+static int read_summary_file(struct ftrace_file_handle *handle,
+			     struct opts *opts, const char *name,
+			     void (*callback)(struct trace_entry *te, void *arg),
+			     void *arg)
+{
+	struct ftrace_summary_header hdr;
+	struct ftrace_summary_entry fe;
+	struct ftrace_session *sess;
+	struct trace_entry te;
+	char *filename = NULL;
+	FILE *fp;
+	unsigned i;
+	int ret = -1;
+
+	xasprintf(&filename, "%s/%s", handle->dirname, name);
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		pr_log("cannot open summary file: %s: %m\n", filename);
+		goto out;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, UFTRACE_SUMMARY_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != UFTRACE_SUMMARY_VERSION) {
+		pr_log("invalid summary file: %s\n", filename);
+		goto close;
+	}
+
+	if (summary_task_filtered(handle, opts, hdr.tid))
+		goto close;
+
+	if (hdr.lost)
+		pr_log("task %d: %u calls were not counted\n", hdr.tid, hdr.lost);
+
+	sess = find_task_session(hdr.tid, hdr.time);
+	if (sess == NULL) {
+		pr_dbg("cannot find session for tid %d\n", hdr.tid);
+		goto close;
+	}
+
+	for (i = 0; i < hdr.nr_func; i++) {
+		if (fread(&fe, sizeof(fe), 1, fp) != 1) {
+			pr_log("summary file is truncated: %s\n", filename);
+			break;
+		}
+
+		te.pid = hdr.tid;
+		te.sym = find_symtabs(&sess->symtabs, fe.addr);
+		te.addr = fe.addr;
+		te.nr_called = fe.nr_called;
+		te.time_total = summary_time(handle, fe.time_total);
+		te.time_self = summary_time(handle, fe.time_self);
+		te.time_recursive = summary_time(handle, fe.time_recursive);
+
+		if (avg_mode == AVG_TOTAL) {
+			te.time_min = summary_time(handle, fe.total_min);
+			te.time_max = summary_time(handle, fe.total_max);
+		}
+		else if (avg_mode == AVG_SELF) {
+			te.time_min = summary_time(handle, fe.self_min);
+			te.time_max = summary_time(handle, fe.self_max);
+		}
+		else {
+			te.time_min = te.time_max = 0;
+		}
+
+		callback(&te, arg);
+	}
+	ret = 0;
+
+close:
+	fclose(fp);
+out:
+	free(filename);
+	return ret;
+}
+
+static void walk_summary_files(struct ftrace_file_handle *handle,
+			       struct opts *opts,
+			       void (*callback)(struct trace_entry *te, void *arg),
+			       void *arg)
+{
+	struct dirent **list;
+	int i, nr;
+
+	nr = scandir(handle->dirname, &list, filter_summary, versionsort);
+	if (nr < 0)
+		pr_err("cannot scan summary files");
+
+	for (i = 0; i < nr; i++) {
+		read_summary_file(handle, opts, list[i]->d_name, callback, arg);
+		free(list[i]);
+	}
+	free(list);
+}
+
+/*
+ * Estimate the actual calls and times of data recorded with sampling.
+ * The first call of a function is always recorded, so N recorded calls
+ * mean at least (N - 1) * scale + 1 calls.  Use it not to report more
+ * calls than actual (e.g. a function called once), and scale the times
+ * by the same ratio.
+ */
+static void scale_sampled_entries(struct ftrace_file_handle *handle,
+				  struct rb_root *root)
+{
+	struct ftrace_info *info = &handle->info;
+	struct rb_node *node;
+	double scale = 1.0;
+
+	if (!(handle->hdr.info_mask & (1UL << SAMPLE_INFO)))
+		return;
+
+	if (info->sample_count > 1)
+		scale *= info->sample_count;
+	if (info->sample_on && info->sample_period)
+		scale *= (double)info->sample_period / info->sample_on;
+
+	pr_dbg("scaling sampled data by %.3f\n", scale);
+
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		struct trace_entry *entry;
+		unsigned long nr_called;
+		double ratio;
+
+		entry = rb_entry(node, struct trace_entry, link);
+		if (entry->nr_called == 0)
+			continue;
+
+		nr_called = (entry->nr_called - 1) * scale + 1;
+		ratio = (double)nr_called / entry->nr_called;
+
+		entry->nr_called      = nr_called;
+		entry->time_total     = entry->time_total * ratio;
+		entry->time_self      = entry->time_self * ratio;
+		entry->time_recursive = entry->time_recursive * ratio;
+	}
+}
+
+static void add_summary_function(struct trace_entry *te, void *arg)
+{
+	insert_entry(arg, te, false);
+}
+
+static void add_function_entry(struct ftrace_task_handle *task,
+			       struct rb_root *root, struct opts *opts)
 {
 	struct sym *sym;
 	struct trace_entry te;
-	struct ftrace_ret_stack *rstack;
-	struct ftrace_task_handle *task;
+	struct ftrace_ret_stack *rstack = task->rstack;
 	struct ftrace_session *sess;
 	struct fstack *fstack;
 	int i;
 
-	while (read_rstack(handle, &task) >= 0) {
-		rstack = task->rstack;
-		if (rstack->type != FTRACE_EXIT)
-			continue;
+	if (rstack->type != FTRACE_EXIT)
+		return;
 
-		if (opts->kernel_skip_out) {
-			/* skip kernel functions outside user functions */
-			if (is_kernel_address(task->func_stack[0].addr) &&
-			    is_kernel_address(rstack->addr))
-				continue;
+	if (opts->kernel_skip_out) {
+		/* skip kernel functions outside user functions */
+		if (is_kernel_address(task->func_stack[0].addr) &&
+		    is_kernel_address(rstack->addr))
+			return;
+	}
+
+	if (rstack == &task->kstack)
+		sess = first_session;
+	else
+		sess = get_task_session(task, rstack->time);
+
+	if (sess == NULL)
+		return;
+
+	sym = find_symtabs(&sess->symtabs, rstack->addr);
+
+	fstack = &task->func_stack[task->stack_count];
+
+	te.pid = task->tid;
+	te.sym = sym;
+	te.addr = rstack->addr;
+	te.time_total = fstack->total_time;
+	te.time_self = te.time_total - fstack->child_time;
+	te.nr_called = 1;
+
+	/* some LOST entries make invalid self tiem */
+	if (te.time_self > te.time_total)
+		te.time_self = te.time_total;
+
+	te.time_recursive = 0;
+	for (i = 0; i < task->stack_count; i++) {
+		if (rstack->addr == task->func_stack[i].addr) {
+			te.time_recursive = te.time_total;
+			break;
 		}
+	}
 
-		if (rstack == &task->kstack)
-			sess = first_session;
-		else
-			sess = find_task_session(task->tid, rstack->time);
+	set_min_max_time(&te);
+	insert_entry(root, &te, false);
+}
 
-		if (sess == NULL)
-			continue;
+static struct sym * find_task_sym(struct ftrace_file_handle *handle,
+				  struct ftrace_task_handle *task,
+				  struct ftrace_ret_stack *rstack)
+{
+	struct sym *sym;
+	struct ftrace_session *sess = get_task_session(task, rstack->time);
+	struct symtabs *symtabs = &sess->symtabs;
 
-		sym = find_symtabs(&sess->symtabs, rstack->addr);
+	if (task->func)
+		return task->func;
 
-		fstack = &task->func_stack[task->stack_count];
+	if (sess == NULL) {
+		pr_dbg("cannot find session for tid %d\n", task->tid);
+		return NULL;
+	}
 
-		te.pid = task->tid;
-		te.sym = sym;
-		te.addr = rstack->addr;
+	if (task->tid == handle->info.tids[0]) {
+		/* This is the main thread */
+		task->func = sym = find_symname(&symtabs->symtab, "main");
+		if (sym)
+			return sym;
+
+		pr_dbg("no main thread???\n");
+		/* fall through */
+	}
+
+	task->func = sym = find_symtabs(symtabs, rstack->addr);
+	if (sym == NULL)
+		pr_dbg("cannot find symbol for %lx\n", rstack->addr);
+
+	return sym;
+}
+
+static void add_thread_entry(struct ftrace_file_handle *handle,
+			     struct ftrace_task_handle *task,
+			     struct rb_root *root, struct opts *opts)
+{
+	struct trace_entry te;
+	struct ftrace_ret_stack *rstack = task->rstack;
+	struct fstack *fstack;
+
+	if (rstack->type == FTRACE_ENTRY && task->func)
+		return;
+	if (rstack->type == FTRACE_LOST)
+		return;
+
+	if (opts->kernel_skip_out) {
+		/* skip kernel functions outside user functions */
+		if (is_kernel_address(task->func_stack[0].addr) &&
+		    is_kernel_address(rstack->addr))
+			return;
+	}
+
+	fstack = &task->func_stack[task->stack_count];
+
+	te.pid = task->tid;
+	te.sym = find_task_sym(handle, task, rstack);
+	te.addr = rstack->addr;
+
+	if (rstack->type == FTRACE_ENTRY) {
+		te.time_total = te.time_self = 0;
+		te.nr_called = 0;
+	}
+	else {
 		te.time_total = fstack->total_time;
 		te.time_self = te.time_total - fstack->child_time;
 		te.nr_called = 1;
+	}
+
+	te.time_min = te.time_max = 0;
+	insert_entry(root, &te, true);
+}
 
-		/* some LOST entries make invalid self tiem */
-		if (te.time_self > te.time_total)
-			te.time_self = te.time_total;
+/*
+ * The statistics don't need the global time order of records.  So each
+ * task is read independently (with kernel records of the task) by a
+ * pool of threads and the entries are merged after all tasks are done.
+ */
+struct report_data {
+	struct ftrace_file_handle	*handle;
+	struct ftrace_kernel		*kernels;
+	struct opts			*opts;
+	bool				thread;
+	int				*tasks;
+	int				nr_tasks;
+	int				next;
+	struct ftrace_file_handle	*singles;  /* set up before workers */
+};
 
-		te.time_recursive = 0;
-		for (i = 0; i < task->stack_count; i++) {
-			if (rstack->addr == task->func_stack[i].addr) {
-				te.time_recursive = te.time_total;
-				break;
-			}
-		}
+struct report_worker {
+	pthread_t			thread;
+	struct report_data		*data;
+	struct rb_root			root;
+};
+
+static void setup_report_handle(struct report_data *data, int idx,
+				struct ftrace_file_handle *handle)
+{
+	setup_single_task_handle(data->handle, handle, idx);
+	if (data->kernels)
+		handle->kern = &data->kernels[idx];
+}
+
+/*
+ * Records before the time range are skipped by the first read and it
+ * updates the filter state using the session lookup which is not
+ * thread-safe (and global states of fstack).  So do it for all tasks
+ * before starting the workers.
+ */
+static void skip_report_time_range(struct report_data *data)
+{
+	struct ftrace_task_handle *task;
+	int i, idx;
+
+	data->singles = xcalloc(data->handle->info.nr_tid,
+				sizeof(*data->singles));
+
+	for (i = 0; i < data->nr_tasks; i++) {
+		idx = data->tasks[i];
 
-		insert_entry(root, &te, false);
+		setup_report_handle(data, idx, &data->singles[idx]);
+		peek_rstack(&data->singles[idx], &task);
 	}
 }
 
+static void report_task(struct report_data *data, int idx,
+			struct rb_root *root)
+{
+	struct ftrace_file_handle single;
+	struct ftrace_file_handle *handle = &single;
+	struct ftrace_task_handle *task;
+
+	if (data->singles)
+		handle = &data->singles[idx];
+	else
+		setup_report_handle(data, idx, handle);
+
+	while (read_rstack(handle, &task) >= 0) {
+		if (data->thread)
+			add_thread_entry(data->handle, task, root, data->opts);
+		else
+			add_function_entry(task, root, data->opts);
+	}
+
+	reset_task_handle(handle);
+}
+
+static void *report_worker(void *arg)
+{
+	struct report_worker *worker = arg;
+	struct report_data *data = worker->data;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&data->next, 1)) < data->nr_tasks)
+		report_task(data, data->tasks[i], &worker->root);
+
+	return NULL;
+}
+
+static void merge_entries(struct rb_root *root, struct rb_root *from,
+			  bool thread)
+{
+	struct rb_node *node;
+	struct trace_entry *entry;
+
+	while (!RB_EMPTY_ROOT(from)) {
+		node = rb_first(from);
+		rb_erase(node, from);
+
+		entry = rb_entry(node, struct trace_entry, link);
+		insert_entry(root, entry, thread);
+		free(entry);
+	}
+}
+
+static void build_report_tree(struct ftrace_file_handle *handle,
+			      struct rb_root *root, struct opts *opts,
+			      bool thread)
+{
+	struct report_data data = {
+		.handle = handle,
+		.opts   = opts,
+		.thread = thread,
+	};
+	struct report_worker *workers;
+	int nr_workers;
+	int i;
+
+	data.tasks = xcalloc(handle->info.nr_tid, sizeof(*data.tasks));
+	for (i = 0; i < handle->info.nr_tid; i++) {
+		/* skip tasks filtered out by setup_task_filter() */
+		if (i < handle->nr_tasks && handle->tasks[i].done)
+			continue;
+
+		data.tasks[data.nr_tasks++] = i;
+	}
+
+	if (handle->kern) {
+		data.kernels = split_kernel_data(handle->kern, handle->info.nr_tid,
+						 handle->info.tids);
+	}
+
+	if (handle->time_range.start)
+		skip_report_time_range(&data);
+
+	nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers > data.nr_tasks)
+		nr_workers = data.nr_tasks;
+	if (nr_workers < 1)
+		nr_workers = 1;
+
+	pr_dbg("reading %d tasks using %d threads\n", data.nr_tasks, nr_workers);
+
+	workers = xcalloc(nr_workers, sizeof(*workers));
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].data = &data;
+		workers[i].root = RB_ROOT;
+
+		if (pthread_create(&workers[i].thread, NULL,
+				   report_worker, &workers[i]) != 0)
+			pr_err_ns("cannot create report thread\n");
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		merge_entries(root, &workers[i].root, thread);
+	}
+
+	if (data.kernels)
+		finish_split_kernel_data(data.kernels, handle->info.nr_tid);
+
+	free(workers);
+	free(data.tasks);
+	free(data.singles);
+}
+
+static void build_function_tree(struct ftrace_file_handle *handle,
+				struct rb_root *root, struct opts *opts)
+{
+	if (handle->hdr.feat_mask & SUMMARY)
+		walk_summary_files(handle, opts, add_summary_function, root);
+	else
+		build_report_tree(handle, root, opts, false);
+
+	scale_sampled_entries(handle, root);
+}
+
 struct sort_item {
 	const char *name;
 	int (*cmp)(struct trace_entry *a, struct trace_entry *b);
@@ -470,6 +909,116 @@ static void print_function(struct trace_entry *entry)
 	symbol_putname(entry->sym, symname);
 }
 
+struct throttle_entry {
+	char *name;
+	unsigned long nr_short;
+	unsigned long nr_skip;
+};
+
+static int filter_throttle(const struct dirent *de)
+{
+	size_t len = strlen(de->d_name);
+
+	return len > 9 && !strcmp(de->d_name + len - 9, ".throttle");
+}
+
+static int cmp_throttle(const void *a, const void *b)
+{
+	const struct throttle_entry *ta = a;
+	const struct throttle_entry *tb = b;
+
+	if (ta->nr_skip != tb->nr_skip)
+		return ta->nr_skip < tb->nr_skip ? 1 : -1;
+	return strcmp(ta->name, tb->name);
+}
+
+static int read_throttle_file(const char *dirname, const char *name,
+			      struct throttle_entry **entries, int nr)
+{
+	struct throttle_entry *te;
+	unsigned long addr, nr_short, nr_skip;
+	char *filename = NULL;
+	char buf[4096];
+	FILE *fp;
+	int pos, i;
+
+	xasprintf(&filename, "%s/%s", dirname, name);
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		pr_log("cannot open throttle file: %s: %m\n", filename);
+		goto out;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%lx %lu %lu %n", &addr, &nr_short,
+			   &nr_skip, &pos) != 3)
+			continue;
+
+		buf[strcspn(buf, "\n")] = '\0';
+
+		/* merge the same function from other processes */
+		for (i = 0; i < nr; i++) {
+			if (!strcmp((*entries)[i].name, buf + pos))
+				break;
+		}
+
+		if (i == nr) {
+			*entries = xrealloc(*entries, (nr + 1) * sizeof(**entries));
+			te = &(*entries)[nr++];
+			te->name = xstrdup(buf + pos);
+			te->nr_short = 0;
+			te->nr_skip = 0;
+		}
+
+		te = &(*entries)[i];
+		te->nr_short += nr_short;
+		te->nr_skip  += nr_skip;
+	}
+	fclose(fp);
+
+out:
+	free(filename);
+	return nr;
+}
+
+/* show functions not traced due to --throttle option */
+static void report_throttled(struct ftrace_file_handle *handle)
+{
+	const char f_format[] = "  %10.10s  %10.10s  %-s\n";
+	const char line[] = "====================================";
+	struct throttle_entry *entries = NULL;
+	struct dirent **list;
+	int i, nr_files, nr = 0;
+
+	nr_files = scandir(handle->dirname, &list, filter_throttle, versionsort);
+	if (nr_files <= 0)
+		return;
+
+	for (i = 0; i < nr_files; i++) {
+		nr = read_throttle_file(handle->dirname, list[i]->d_name,
+					&entries, nr);
+		free(list[i]);
+	}
+	free(list);
+
+	if (nr == 0)
+		return;
+
+	qsort(entries, nr, sizeof(*entries), cmp_throttle);
+
+	pr_out("\n");
+	pr_out(f_format, "Calls", "Skipped", "Throttled function");
+	pr_out(f_format, line, line, line);
+
+	for (i = 0; i < nr; i++) {
+		pr_out("  %10lu  %10lu  %-s\n", entries[i].nr_short,
+		       entries[i].nr_skip, entries[i].name);
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
 static void report_functions(struct ftrace_file_handle *handle, struct opts *opts)
 {
 	struct rb_root name_tree = RB_ROOT;
@@ -505,95 +1054,95 @@ static void report_functions(struct ftrace_file_handle *handle, struct opts *opt
 	pr_out(f_format, line, line, line, line);
 
 	print_and_delete(&sort_tree, print_function);
+
+	report_throttled(handle);
 }
 
-static struct sym * find_task_sym(struct ftrace_file_handle *handle,
-				  struct ftrace_task_handle *task,
-				  struct ftrace_ret_stack *rstack)
+static void print_thread(struct trace_entry *entry)
 {
-	struct sym *sym;
-	struct ftrace_task_handle *main_task = &handle->tasks[0];
-	struct ftrace_session *sess = find_task_session(task->tid, rstack->time);
-	struct symtabs *symtabs = &sess->symtabs;
+	char *symname = symbol_getname(entry->sym, entry->addr);
 
-	if (task->func)
-		return task->func;
+	pr_out("  %5d ", entry->pid);
+	print_time_unit(entry->time_self);
+	pr_out("  %10lu  %-s\n", entry->nr_called, symname);
 
-	if (sess == NULL) {
-		pr_dbg("cannot find session for tid %d\n", task->tid);
-		return NULL;
-	}
+	symbol_putname(entry->sym, symname);
+}
 
-	if (task == main_task) {
-		/* This is the main thread */
-		task->func = sym = find_symname(&symtabs->symtab, "main");
-		if (sym)
-			return sym;
+static struct trace_entry *find_thread_entry(struct rb_root *root, int pid)
+{
+	struct rb_node *node = root->rb_node;
 
-		pr_dbg("no main thread???\n");
-		/* fall through */
+	while (node) {
+		struct trace_entry *entry;
+
+		entry = rb_entry(node, struct trace_entry, link);
+		if (entry->pid == pid)
+			return entry;
+
+		if (pid < entry->pid)
+			node = node->rb_left;
+		else
+			node = node->rb_right;
 	}
+	return NULL;
+}
 
-	task->func = sym = find_symtabs(symtabs, rstack->addr);
-	if (sym == NULL)
-		pr_dbg("cannot find symbol for %lx\n", rstack->addr);
+static void add_summary_thread(struct trace_entry *te, void *arg)
+{
+	struct rb_root *root = arg;
+	struct trace_entry *entry;
 
-	return sym;
+	te->time_min = te->time_max = 0;
+	insert_entry(root, te, true);
+
+	/*
+	 * use a function with the largest total time as the start function
+	 * and keep the time in time_max as it's not shown for threads.
+	 */
+	entry = find_thread_entry(root, te->pid);
+	if (entry->time_max < te->time_total - te->time_recursive) {
+		entry->time_max = te->time_total - te->time_recursive;
+		entry->sym = te->sym;
+		entry->addr = te->addr;
+	}
 }
 
-static void print_thread(struct trace_entry *entry)
+static void report_summary_threads(struct ftrace_file_handle *handle,
+				   struct opts *opts, struct rb_root *root)
 {
-	char *symname = symbol_getname(entry->sym, entry->addr);
+	struct trace_entry *entry;
+	struct sym *sym;
 
-	pr_out("  %5d ", entry->pid);
-	print_time_unit(entry->time_self);
-	pr_out("  %10lu  %-s\n", entry->nr_called, symname);
+	walk_summary_files(handle, opts, add_summary_thread, root);
 
-	symbol_putname(entry->sym, symname);
+	if (handle->info.nr_tid == 0 || first_session == NULL)
+		return;
+
+	/* This is the main thread */
+	entry = find_thread_entry(root, handle->info.tids[0]);
+	sym = find_symname(&first_session->symtabs.symtab, "main");
+	if (entry && sym) {
+		entry->sym = sym;
+		entry->addr = sym->addr;
+	}
 }
 
 static void report_threads(struct ftrace_file_handle *handle, struct opts *opts)
 {
-	struct trace_entry te;
-	struct ftrace_ret_stack *rstack;
 	struct rb_root name_tree = RB_ROOT;
-	struct ftrace_task_handle *task;
-	struct fstack *fstack;
 	const char t_format[] = "  %5.5s  %10.10s  %10.10s  %-s\n";
 	const char line[] = "====================================";
 
-	while (read_rstack(handle, &task) >= 0) {
-		rstack = task->rstack;
-		if (rstack->type == FTRACE_ENTRY && task->func)
-			continue;
-		if (rstack->type == FTRACE_LOST)
-			continue;
-
-		if (opts->kernel_skip_out) {
-			/* skip kernel functions outside user functions */
-			if (is_kernel_address(task->func_stack[0].addr) &&
-			    is_kernel_address(rstack->addr))
-				continue;
-		}
-
-		fstack = &task->func_stack[task->stack_count];
-
-		te.pid = task->tid;
-		te.sym = find_task_sym(handle, task, rstack);
-		te.addr = rstack->addr;
+	if (handle->hdr.feat_mask & SUMMARY) {
+		report_summary_threads(handle, opts, &name_tree);
+		goto print;
+	}
 
-		if (rstack->type == FTRACE_ENTRY) {
-			te.time_total = te.time_self = 0;
-			te.nr_called = 0;
-		}
-		else {
-			te.time_total = fstack->total_time;
-			te.time_self = te.time_total - fstack->child_time;
-			te.nr_called = 1;
-		}
+	build_report_tree(handle, &name_tree, opts, true);
 
-		insert_entry(&name_tree, &te, true);
-	}
+print:
+	scale_sampled_entries(handle, &name_tree);
 
 	pr_out(t_format, "TID", "Run time", "Num funcs", "Start function");
 	pr_out(t_format, line, line, line, line);
@@ -612,6 +1161,8 @@ static void sort_by_name(struct rb_root *root, struct trace_entry *te)
 	struct trace_entry *entry;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &root->rb_node;
+	char *name = symbol_getname(te->sym, te->addr);
+	char *entry_name;
 	int ret;
 
 	while (*p) {
@@ -626,7 +1177,10 @@ static void sort_by_name(struct rb_root *root, struct trace_entry *te)
 			continue;
 		}
 
-		ret = strcmp(entry->sym->name, te->sym->name);
+		entry_name = symbol_getname(entry->sym, entry->addr);
+		ret = strcmp(entry_name, name);
+		symbol_putname(entry->sym, entry_name);
+
 		if (ret == 0) {
 			entry->time_total += te->time_total;
 			entry->time_self  += te->time_self;
@@ -642,6 +1196,7 @@ static void sort_by_name(struct rb_root *root, struct trace_entry *te)
 			if (entry->time_max < te->time_max)
 				entry->time_max = te->time_max;
 
+			symbol_putname(te->sym, name);
 			free(te);
 			return;
 		};
@@ -652,6 +1207,7 @@ static void sort_by_name(struct rb_root *root, struct trace_entry *te)
 			p = &parent->rb_right;
 	}
 
+	symbol_putname(te->sym, name);
 	rb_link_node(&te->link, parent, p);
 	rb_insert_color(&te->link, root);
 }
@@ -661,15 +1217,21 @@ static struct trace_entry * find_by_name(struct rb_root *root, char *name)
 	struct trace_entry *entry;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &root->rb_node;
+	char *entry_name;
+	int ret;
 
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct trace_entry, link);
 
-		if (strcmp(entry->sym->name, name) == 0)
+		entry_name = symbol_getname(entry->sym, entry->addr);
+		ret = strcmp(entry_name, name);
+		symbol_putname(entry->sym, entry_name);
+
+		if (ret == 0)
 			return entry;
 
-		if (strcmp(entry->sym->name, name) < 0)
+		if (ret < 0)
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
@@ -714,12 +1276,16 @@ static void calculate_diff(struct rb_root *base, struct rb_root *pair,
 	while (!RB_EMPTY_ROOT(base)) {
 		struct rb_node *node;
 		struct trace_entry *e, *p;
+		char *name;
 
 		node = rb_first(base);
 		rb_erase(node, base);
 
 		e = rb_entry(node, struct trace_entry, link);
-		p = find_by_name(pair, e->sym->name);
+		name = symbol_getname(e->sym, e->addr);
+		p = find_by_name(pair, name);
+		symbol_putname(e->sym, name);
+
 		if (p == NULL) {
 			sort_entries(remaining, e);
 			continue;
@@ -0,0 +1,307 @@
+/*
+ * dynamic patching of -mnop-mcount / -mrecord-mcount call sites
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <sys/mman.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "dynamic"
+#define PR_DOMAIN  DBG_MCOUNT
+
+#include "libmcount/mcount.h"
+#include "utils/utils.h"
+#include "utils/symbol.h"
+#include "utils/filter.h"
+#include "utils/compiler.h"
+
+/* entry points which might not exist on some architectures */
+extern void __fentry__(void) __weak;
+extern void mcount(void) __weak;
+
+static struct mcount_dynamic_info mdi;
+static struct mcount_dynamic_site *sites;
+static size_t nr_sites;
+static bool tramp_disabled;
+
+/* return address of __mcount_loc section (in memory) and its size */
+static unsigned long *find_mcount_loc(char *exename, unsigned long text_addr,
+				      size_t *nr_loc)
+{
+	int fd;
+	Elf *elf;
+	Elf_Scn *sec = NULL;
+	GElf_Ehdr ehdr;
+	GElf_Phdr phdr;
+	size_t i, nr_phdr, shstr_idx;
+	unsigned long base = 0;
+	unsigned long *loc = NULL;
+
+	fd = open(exename, O_RDONLY);
+	if (fd < 0) {
+		pr_dbg("cannot open %s: %m\n", exename);
+		return NULL;
+	}
+
+	elf_version(EV_CURRENT);
+
+	elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+	if (elf == NULL)
+		goto elf_error;
+
+	if (gelf_getehdr(elf, &ehdr) == NULL)
+		goto elf_error;
+
+	if (elf_getphdrnum(elf, &nr_phdr) < 0)
+		goto elf_error;
+
+	/* PIE is loaded at a random address: use the text map for offset */
+	for (i = 0; ehdr.e_type == ET_DYN && i < nr_phdr; i++) {
+		if (!gelf_getphdr(elf, i, &phdr))
+			goto elf_error;
+
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+			base = text_addr - (phdr.p_vaddr & ~(getpagesize() - 1UL));
+			break;
+		}
+	}
+
+	if (elf_getshdrstrndx(elf, &shstr_idx) < 0)
+		goto elf_error;
+
+	while ((sec = elf_nextscn(elf, sec)) != NULL) {
+		GElf_Shdr shdr;
+		char *shstr;
+
+		if (gelf_getshdr(sec, &shdr) == NULL)
+			goto elf_error;
+
+		shstr = elf_strptr(elf, shstr_idx, shdr.sh_name);
+		if (shstr == NULL || strcmp(shstr, "__mcount_loc"))
+			continue;
+
+		/* it's already relocated by the dynamic linker */
+		loc = (void *)(shdr.sh_addr + base);
+		*nr_loc = shdr.sh_size / sizeof(*loc);
+		break;
+	}
+
+out:
+	elf_end(elf);
+	close(fd);
+	return loc;
+
+elf_error:
+	pr_dbg("ELF error during reading %s: %s\n", exename,
+	       elf_errmsg(elf_errno()));
+	loc = NULL;
+	goto out;
+}
+
+static bool match_patch_filter(struct rb_root *root, enum filter_mode mode,
+			       struct sym *sym)
+{
+	struct ftrace_trigger tr = {};
+
+	if (mode == FILTER_MODE_NONE)
+		return true;
+
+	if (ftrace_match_filter(root, sym->addr, &tr))
+		return tr.fmode == FILTER_MODE_IN;
+
+	return mode == FILTER_MODE_OUT;
+}
+
+/**
+ * mcount_dynamic_update - patch call sites recorded in __mcount_loc
+ * @symtabs:   symbol tables of the executable
+ * @exename:   path of the executable
+ * @patch_str: functions to be patched (same syntax as -F/-N), NULL for all
+ *
+ * Binaries built with -mnop-mcount have a nop instead of a call to
+ * mcount (or __fentry__) in every function.  Convert the nops of the
+ * selected functions into calls so that other functions don't pay
+ * the cost of tracing at all.  Likewise, calls in unselected functions
+ * are converted to nops for binaries built with -mrecord-mcount.
+ *
+ * This should be called before other threads run the executable.
+ */
+int mcount_dynamic_update(struct symtabs *symtabs, char *exename,
+			  char *patch_str)
+{
+	unsigned long *loc;
+	size_t i, nr_loc = 0;
+	struct rb_root patch_root = RB_ROOT;
+	enum filter_mode patch_mode = FILTER_MODE_NONE;
+	int nr_patched = 0;
+	int nr_unpatched = 0;
+
+	if (symtabs->maps == NULL)
+		return -1;
+
+	/* the first executable map is the text of the executable */
+	mdi.text_addr = symtabs->maps->start;
+	mdi.text_size = symtabs->maps->end - symtabs->maps->start;
+
+	loc = find_mcount_loc(exename, mdi.text_addr, &nr_loc);
+	if (loc == NULL || nr_loc == 0)
+		return 0;
+
+	pr_dbg("found %zd call sites in __mcount_loc\n", nr_loc);
+
+	mdi.fentry_addr = (unsigned long)__fentry__;
+	mdi.mcount_addr = (unsigned long)mcount;
+
+	if (mcount_arch_setup_trampoline(&mdi) < 0) {
+		pr_dbg("skip dynamic patching: no trampoline\n");
+		return -1;
+	}
+
+	ftrace_setup_filter(patch_str, symtabs, NULL, &patch_root, &patch_mode);
+
+	if (mprotect((void *)mdi.text_addr, mdi.text_size,
+		     PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		pr_dbg("cannot make text writable: %m\n");
+		ftrace_cleanup_filter(&patch_root);
+		return -1;
+	}
+
+	sites = xcalloc(nr_loc, sizeof(*sites));
+
+	for (i = 0; i < nr_loc; i++) {
+		struct mcount_dynamic_site *site = &sites[nr_sites];
+		struct sym *sym;
+
+		if (loc[i] < mdi.text_addr ||
+		    loc[i] >= mdi.text_addr + mdi.text_size)
+			continue;
+
+		sym = find_symtabs(symtabs, loc[i]);
+		if (sym == NULL)
+			continue;
+
+		site->addr = loc[i];
+
+		if (match_patch_filter(&patch_root, patch_mode, sym)) {
+			bool fentry;
+
+			fentry = loc[i] == mcount_arch_fentry_addr(sym->addr);
+			if (mcount_arch_patch_site(&mdi, site, fentry) < 0)
+				continue;
+
+			pr_dbg3("patch %s at %#lx\n", sym->name, site->addr);
+			nr_patched++;
+		}
+		else {
+			if (mcount_arch_unpatch_site(&mdi, site) < 0)
+				continue;
+
+			pr_dbg3("unpatch %s at %#lx\n", sym->name, site->addr);
+			nr_unpatched++;
+		}
+		nr_sites++;
+	}
+
+	mprotect((void *)mdi.text_addr, mdi.text_size, PROT_READ | PROT_EXEC);
+	ftrace_cleanup_filter(&patch_root);
+
+	pr_dbg("dynamic patching: %d patched, %d unpatched\n",
+	       nr_patched, nr_unpatched);
+	return 0;
+}
+
+/**
+ * mcount_dynamic_enable - turn on/off tracing of patched functions
+ * @enable: whether patched functions call into libmcount
+ *
+ * It's called when tracing is disabled by --disable or 'uftrace control'
+ * (and enabled back).  It's safe to call at any time since it only
+ * changes the target of the trampoline.  Patched functions just return
+ * from the trampoline when disabled.
+ */
+void mcount_dynamic_enable(bool enable)
+{
+	if (mdi.trampoline == 0 || enable == !tramp_disabled)
+		return;
+
+	mcount_arch_enable_trampoline(&mdi, enable);
+	tramp_disabled = !enable;
+
+	pr_dbg2("%s patched functions\n", enable ? "enable" : "disable");
+}
+
+/**
+ * mcount_dynamic_finish - revert the patched call sites
+ *
+ * Restore original instructions of the patched (or unpatched) sites.
+ * If it cannot be done safely while other threads are running, the
+ * patched sites keep calling the (disabled) trampoline.
+ */
+void mcount_dynamic_finish(void)
+{
+	int nr_restored;
+
+	if (mdi.trampoline == 0)
+		return;
+
+	mcount_dynamic_enable(false);
+
+	if (mprotect((void *)mdi.text_addr, mdi.text_size,
+		     PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+		pr_dbg("cannot make text writable: %m\n");
+		return;
+	}
+
+	nr_restored = mcount_arch_restore_sites(&mdi, sites, nr_sites);
+
+	mprotect((void *)mdi.text_addr, mdi.text_size, PROT_READ | PROT_EXEC);
+
+	pr_dbg("restored %d of %zd call sites\n", nr_restored, nr_sites);
+
+	/*
+	 * the trampoline is not unmapped as other threads might use it,
+	 * and the sites are not freed as other threads might be trapped.
+	 */
+}
+
+/* for architectures which don't support dynamic patching */
+__weak int mcount_arch_setup_trampoline(struct mcount_dynamic_info *mdi)
+{
+	return -1;
+}
+
+__weak void mcount_arch_enable_trampoline(struct mcount_dynamic_info *mdi,
+					  bool enable)
+{
+}
+
+__weak unsigned long mcount_arch_fentry_addr(unsigned long addr)
+{
+	return addr;
+}
+
+__weak int mcount_arch_patch_site(struct mcount_dynamic_info *mdi,
+				  struct mcount_dynamic_site *site, bool fentry)
+{
+	return -1;
+}
+
+__weak int mcount_arch_unpatch_site(struct mcount_dynamic_info *mdi,
+				    struct mcount_dynamic_site *site)
+{
+	return -1;
+}
+
+__weak int mcount_arch_restore_sites(struct mcount_dynamic_info *mdi,
+				     struct mcount_dynamic_site *sites,
+				     size_t nr_sites)
+{
+	return 0;
+}
@@ -16,9 +16,11 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <gelf.h>
 
 /* This should be defined before #include "utils.h" */
@@ -32,13 +34,20 @@
 #include "utils/filter.h"
 #include "utils/compiler.h"
 
-uint64_t mcount_threshold;  /* nsec */
+uint64_t mcount_threshold;  /* nsec (or TSC ticks) */
 struct symtabs symtabs = {
 	.flags = SYMTAB_FL_DEMANGLE | SYMTAB_FL_ADJ_OFFSET,
 };
 int shmem_bufsize = SHMEM_BUFFER_SIZE;
+int shmem_ring_slots = SHMEM_RING_SLOTS;
 bool mcount_setup_done;
 bool mcount_finished;
+bool mcount_use_tsc;
+bool mcount_summary_mode;
+bool mcount_flight_mode;
+
+/* max depth of all threads, lowered by the 'degrade' buffer policy */
+int mcount_depth_limit = INT_MAX;
 
 pthread_key_t mtd_key;
 TLS struct mcount_thread_data mtd;
@@ -50,9 +59,34 @@ static char *mcount_exename;
 #ifndef DISABLE_MCOUNT_FILTER
 static int mcount_depth = MCOUNT_DEFAULT_DEPTH;
 static bool mcount_enabled = true;
-static enum filter_mode mcount_filter_mode = FILTER_MODE_NONE;
 
-static struct rb_root mcount_triggers = RB_ROOT;
+/*
+ * Filters and triggers can be replaced by 'uftrace control' at runtime.
+ * A new set is built by the control thread and published by switching
+ * the pointer so that the hot path never takes a lock.  Old sets are
+ * kept until the end since rstacks might refer to their arg specs.
+ */
+struct mcount_filter_set {
+	struct rb_root			triggers;
+	enum filter_mode		mode;
+	struct mcount_filter_set	*retired;
+};
+
+static struct mcount_filter_set mcount_init_filters = {
+	.triggers	= { NULL, },
+	.mode		= FILTER_MODE_NONE,
+};
+static struct mcount_filter_set *mcount_filters = &mcount_init_filters;
+
+static inline struct mcount_filter_set *mcount_filter_set(void)
+{
+	return __atomic_load_n(&mcount_filters, __ATOMIC_ACQUIRE);
+}
+
+/* sampling: 1 of every N calls and/or ON (nsec or TSC ticks) of PERIOD */
+static unsigned mcount_sample_count;
+static uint64_t mcount_sample_on;
+static uint64_t mcount_sample_period;
 #endif /* DISABLE_MCOUNT_FILTER */
 
 uint64_t mcount_gettime(void)
@@ -62,6 +96,215 @@ uint64_t mcount_gettime(void)
 	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+/* timestamp of function records - it'd be converted to nsec at replay */
+uint64_t mcount_timestamp(void)
+{
+#ifdef ARCH_SUPPORT_TSC
+	if (mcount_use_tsc)
+		return mcount_arch_read_tsc();
+#endif
+	return mcount_gettime();
+}
+
+/* TSC frequency (Hz) to convert time settings, 0 if not using TSC */
+static uint64_t mcount_tsc_freq;
+
+static void mcount_setup_clock(char *clock_str, char *freq_str)
+{
+	if (clock_str == NULL || strcmp(clock_str, "tsc"))
+		return;
+
+#ifdef ARCH_SUPPORT_TSC
+	uint64_t freq = 0;
+
+	mcount_use_tsc = true;
+
+	if (freq_str)
+		freq = strtoull(freq_str, NULL, 0);
+
+	/* time filter should be compared in TSC ticks */
+	if (mcount_threshold && freq)
+		mcount_threshold = (double)mcount_threshold * freq / NSEC_PER_SEC;
+
+	mcount_tsc_freq = freq;
+
+	pr_dbg("using TSC clock (%"PRIu64" Hz)\n", freq);
+#else
+	pr_dbg("TSC clock is not supported: using monotonic clock\n");
+#endif
+}
+
+/* auto-throttling: stop tracing functions after CALLS short calls */
+static struct mcount_throttle *throttle_table;
+static unsigned long throttle_calls;
+static uint64_t throttle_time;  /* nsec (or TSC ticks) */
+static char *throttle_dir;
+
+static struct mcount_throttle *find_throttle(unsigned long addr, bool create)
+{
+	struct mcount_throttle *t;
+	unsigned hash;
+	unsigned i;
+
+	hash = ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >>
+		(64 - MCOUNT_THROTTLE_BITS);
+
+	for (i = 0; i < MCOUNT_THROTTLE_PROBE; i++) {
+		t = &throttle_table[(hash + i) % MCOUNT_THROTTLE_SIZE];
+
+		if (t->addr == addr)
+			return t;
+
+		if (t->addr == 0) {
+			if (!create)
+				return NULL;
+
+			/* other thread might take this slot */
+			if (__sync_bool_compare_and_swap(&t->addr, 0, addr) ||
+			    t->addr == addr)
+				return t;
+		}
+	}
+	return NULL;
+}
+
+static inline bool mcount_throttled(unsigned long addr)
+{
+	struct mcount_throttle *t = find_throttle(addr, false);
+
+	if (t == NULL || !t->throttled)
+		return false;
+
+	/* it's ok to lose some counts due to races */
+	t->nr_skip++;
+	return true;
+}
+
+#define THROTTLE_SKIP_FLAGS  (MCOUNT_FL_SETJMP | MCOUNT_FL_LONGJMP |	\
+			      MCOUNT_FL_NORECORD | MCOUNT_FL_NOTRACE |	\
+			      MCOUNT_FL_FILTERED | MCOUNT_FL_VFORK |	\
+			      MCOUNT_FL_RECOVER | MCOUNT_FL_RETVAL |	\
+			      MCOUNT_FL_TRACE | MCOUNT_FL_ARGUMENT)
+
+/* called at function exit - it should not use floating-point registers */
+static void mcount_update_throttle(struct mcount_ret_stack *rstack)
+{
+	struct mcount_throttle *t;
+
+	if (rstack->flags & THROTTLE_SKIP_FLAGS)
+		return;
+
+	if (rstack->end_time - rstack->start_time >= throttle_time)
+		return;
+
+	t = find_throttle(rstack->child_ip, true);
+	if (t == NULL || t->throttled || t->ignore)
+		return;
+
+	if (++t->nr_short < throttle_calls)
+		return;
+
+#ifndef DISABLE_MCOUNT_FILTER
+	{
+		struct ftrace_trigger tr = {
+			.flags = 0,
+		};
+
+		/* functions with triggers should not be skipped */
+		ftrace_match_filter(&mcount_filter_set()->triggers,
+				    t->addr, &tr);
+		if (tr.flags) {
+			t->ignore = true;
+			return;
+		}
+	}
+#endif
+
+	t->throttled = true;
+}
+
+static void mcount_setup_throttle(char *throttle_str, char *freq_str,
+				  const char *dirname)
+{
+	uint64_t freq = 0;
+
+	if (throttle_str == NULL)
+		return;
+
+	if (sscanf(throttle_str, "%lu/%"SCNu64,
+		   &throttle_calls, &throttle_time) != 2 ||
+	    throttle_calls == 0 || throttle_time == 0)
+		return;
+
+	pr_dbg("throttle functions after %lu calls shorter than %"PRIu64" nsec\n",
+	       throttle_calls, throttle_time);
+
+	if (mcount_use_tsc && freq_str)
+		freq = strtoull(freq_str, NULL, 0);
+
+	/* time should be compared in TSC ticks */
+	if (freq)
+		throttle_time = (double)throttle_time * freq / NSEC_PER_SEC;
+
+	throttle_dir = realpath(dirname, NULL);
+	if (throttle_dir == NULL)
+		throttle_dir = xstrdup(dirname);
+
+	throttle_table = xcalloc(MCOUNT_THROTTLE_SIZE, sizeof(*throttle_table));
+}
+
+/* save throttled functions to <pid>-<sid>.throttle file */
+static void write_throttle_file(void)
+{
+	struct mcount_throttle *t;
+	char *filename = NULL;
+	FILE *fp = NULL;
+	unsigned i;
+
+	for (i = 0; i < MCOUNT_THROTTLE_SIZE; i++) {
+		struct sym *sym;
+		char *name;
+
+		t = &throttle_table[i];
+		if (!t->throttled)
+			continue;
+
+		if (fp == NULL) {
+			xasprintf(&filename, "%s/%d-%s.throttle",
+				  throttle_dir, getpid(), session_name());
+
+			fp = fopen(filename, "w");
+			if (fp == NULL) {
+				pr_log("cannot open %s: %m\n", filename);
+				free(filename);
+				return;
+			}
+		}
+
+		/* it might not be demangled yet */
+		sym = find_symtabs(&symtabs, t->addr);
+		name = symbol_getname(sym, t->addr);
+		fprintf(fp, "%lx %lu %lu %s\n", t->addr,
+			t->nr_short, t->nr_skip, name);
+		symbol_putname(sym, name);
+	}
+
+	if (fp)
+		fclose(fp);
+	free(filename);
+}
+
+/* only count calls in the child */
+static void reset_throttle_fork(void)
+{
+	unsigned i;
+
+	for (i = 0; i < MCOUNT_THROTTLE_SIZE; i++) {
+		throttle_table[i].nr_short = 0;
+		throttle_table[i].nr_skip = 0;
+	}
+}
+
 int gettid(struct mcount_thread_data *mtdp)
 {
 	if (!mtdp->tid)
@@ -149,7 +392,8 @@ static void mtd_dtor(void *arg)
 
 	free(mtdp->rstack);
 #ifndef DISABLE_MCOUNT_FILTER
-	free(mtdp->argbuf);
+	free_argbuf(mtdp);
+	free(mtdp->filter.sample_count);
 #endif
 	shmem_finish(mtdp);
 }
@@ -176,8 +420,13 @@ void mcount_prepare(void)
 
 #ifndef DISABLE_MCOUNT_FILTER
 	mtd.filter.depth  = mcount_depth;
+	mtd.filter.base_depth = mcount_depth;
 	mtd.enable_cached = mcount_enabled;
-	mtd.argbuf = xmalloc(mcount_rstack_max * ARGBUF_SIZE);
+	/* argbuf is allocated when a function has arguments or retval */
+
+	if (mcount_sample_count)
+		mtd.filter.sample_count = xcalloc(MCOUNT_SAMPLE_SIZE,
+						  sizeof(*mtd.filter.sample_count));
 #endif
 	mtd.rstack = xmalloc(mcount_rstack_max * sizeof(*mtd.rstack));
 
@@ -207,16 +456,96 @@ bool mcount_check_rstack(struct mcount_thread_data *mtdp)
 }
 
 #ifndef DISABLE_MCOUNT_FILTER
+/* returns true if this call should be traced according to the sampling */
+static bool mcount_sample_check(struct mcount_thread_data *mtdp,
+				unsigned long child)
+{
+	if (mcount_sample_period) {
+		uint64_t now = mcount_timestamp();
+
+		if (now % mcount_sample_period >= mcount_sample_on)
+			return false;
+	}
+
+	if (mcount_sample_count) {
+		unsigned *count;
+		unsigned hash;
+
+		hash = ((uint64_t)child * 0x9e3779b97f4a7c15ULL) >>
+			(64 - MCOUNT_SAMPLE_BITS);
+		count = &mtdp->filter.sample_count[hash];
+
+		if ((*count)++ % mcount_sample_count)
+			return false;
+	}
+
+	return true;
+}
+
+static void mcount_setup_sample(char *count_str, char *window_str,
+				char *freq_str)
+{
+	uint64_t freq = 0;
+
+	if (count_str)
+		mcount_sample_count = strtoul(count_str, NULL, 0);
+
+	if (window_str &&
+	    sscanf(window_str, "%"SCNu64"/%"SCNu64,
+		   &mcount_sample_on, &mcount_sample_period) != 2)
+		mcount_sample_on = mcount_sample_period = 0;
+
+	if (mcount_sample_on >= mcount_sample_period)
+		mcount_sample_on = mcount_sample_period = 0;
+
+	/* sampling window should be compared in TSC ticks */
+	if (mcount_use_tsc && freq_str)
+		freq = strtoull(freq_str, NULL, 0);
+
+	if (mcount_sample_period && freq) {
+		mcount_sample_on = (double)mcount_sample_on * freq / NSEC_PER_SEC;
+		mcount_sample_period = (double)mcount_sample_period * freq / NSEC_PER_SEC;
+	}
+
+	if (mcount_sample_count || mcount_sample_period)
+		pr_dbg("sampling: 1/%u calls, %"PRIu64"/%"PRIu64" time\n",
+		       mcount_sample_count ?: 1,
+		       mcount_sample_on, mcount_sample_period);
+}
+
+/*
+ * A call not to be recorded still needs to hook the return address if it
+ * changed the filter state (counts or depth) so that it can be restored
+ * at exit.  Otherwise just skip it to reduce the overhead.
+ */
+static enum filter_result mcount_filter_skip(struct ftrace_trigger *tr)
+{
+	if (tr->flags & (TRIGGER_FL_FILTER | TRIGGER_FL_DEPTH))
+		return FILTER_NORECORD;
+
+	return FILTER_OUT;
+}
+
 /* update filter state from trigger result */
 enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 					     unsigned long child,
 					     struct ftrace_trigger *tr)
 {
+	struct mcount_filter_set *fs;
+	int depth;
+
 	pr_dbg3("<%d> enter %lx\n", mtdp->idx, child);
 
 	if (mcount_check_rstack(mtdp))
 		return FILTER_RSTACK;
 
+	/* the default depth was changed by 'uftrace control' */
+	depth = __atomic_load_n(&mcount_depth, __ATOMIC_RELAXED);
+	if (unlikely(mtdp->filter.base_depth != depth)) {
+		mtdp->filter.depth += depth - mtdp->filter.base_depth;
+		mtdp->filter.base_depth = depth;
+	}
+
 	/* save original depth to restore at exit time */
 	mtdp->filter.saved_depth = mtdp->filter.depth;
 
@@ -224,10 +553,11 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 	if (mtdp->filter.out_count > 0)
 		return FILTER_OUT;
 
-	ftrace_match_filter(&mcount_triggers, child, tr);
+	fs = mcount_filter_set();
+	ftrace_match_filter(&fs->triggers, child, tr);
 
 	pr_dbg3(" tr->flags: %lx, filter mode, count: [%d] %d/%d\n",
-		tr->flags, mcount_filter_mode, mtdp->filter.in_count,
+		tr->flags, fs->mode, mtdp->filter.in_count,
 		mtdp->filter.out_count);
 
 	if (tr->flags & TRIGGER_FL_FILTER) {
@@ -237,16 +567,17 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 			mtdp->filter.out_count++;
 
 		/* apply default filter depth when match */
-		mtdp->filter.depth = mcount_depth;
+		mtdp->filter.depth = depth;
 	}
 	else {
 		/* not matched by filter */
-		if (mcount_filter_mode == FILTER_MODE_IN &&
+		if (fs->mode == FILTER_MODE_IN &&
 		    mtdp->filter.in_count == 0)
 			return FILTER_OUT;
 	}
 
-#define FLAGS_TO_CHECK  (TRIGGER_FL_DEPTH | TRIGGER_FL_TRACE_ON | TRIGGER_FL_TRACE_OFF)
+#define FLAGS_TO_CHECK  (TRIGGER_FL_DEPTH | TRIGGER_FL_TRACE_ON | TRIGGER_FL_TRACE_OFF | \
+			TRIGGER_FL_SNAPSHOT)
 
 	if (tr->flags & FLAGS_TO_CHECK) {
 		if (tr->flags & TRIGGER_FL_DEPTH)
@@ -257,10 +588,22 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 
 		if (tr->flags & TRIGGER_FL_TRACE_OFF)
 			mcount_enabled = false;
+
+		if (tr->flags & TRIGGER_FL_SNAPSHOT)
+			mcount_request_snapshot(mtdp);
 	}
 
 #undef FLAGS_TO_CHECK
 
+	/* too deep to record since buffers were full */
+	if (mtdp->idx >= mcount_depth_limit)
+		return mcount_filter_skip(tr);
+
+	/* sampling only decides whether to record this call */
+	if ((mcount_sample_count || mcount_sample_period) &&
+	    !mcount_sample_check(mtdp, child))
+		return mcount_filter_skip(tr);
+
 	if (!mcount_enabled)
 		return FILTER_IN;
 
@@ -278,10 +621,13 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp,
 				struct mcount_regs *regs)
 {
 	if (mtdp->filter.out_count > 0 ||
-	    (mtdp->filter.in_count == 0 && mcount_filter_mode == FILTER_MODE_IN))
+	    (mtdp->filter.in_count == 0 &&
+	     mcount_filter_set()->mode == FILTER_MODE_IN))
 		rstack->flags |= MCOUNT_FL_NORECORD;
 
-	rstack->filter_depth = mtdp->filter.saved_depth;
+	/* keep it relative to the default depth which can be changed */
+	rstack->filter_depth = mtdp->filter.saved_depth - mtdp->filter.base_depth;
+	rstack->argbuf = NULL;
 
 #define FLAGS_TO_CHECK  (TRIGGER_FL_FILTER | TRIGGER_FL_RETVAL | TRIGGER_FL_TRACE)
 
@@ -311,8 +657,13 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp,
 		if (!mcount_enabled) {
 			rstack->flags |= MCOUNT_FL_DISABLED;
 		}
-		else if (tr->flags & TRIGGER_FL_ARGUMENT) {
-			save_argument(mtdp, rstack, tr->pargs, regs);
+		else {
+			/* retval is saved on exit, but reserve the space now */
+			if (rstack->flags & MCOUNT_FL_RETVAL)
+				prepare_argbuf(mtdp, rstack);
+
+			if (tr->flags & TRIGGER_FL_ARGUMENT)
+				save_argument(mtdp, rstack, tr->pargs, regs);
 		}
 
 		if (mtdp->enable_cached != mcount_enabled) {
@@ -357,7 +708,7 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp,
 
 #undef FLAGS_TO_CHECK
 
-	mtdp->filter.depth = rstack->filter_depth;
+	mtdp->filter.depth = rstack->filter_depth + mtdp->filter.base_depth;
 
 	if (!(rstack->flags & MCOUNT_FL_NORECORD)) {
 		if (mtdp->record_idx > 0)
@@ -366,15 +717,356 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp,
 		if (!(rstack->flags & MCOUNT_FL_RETVAL))
 			retval = NULL;
 
-		if (rstack->end_time - rstack->start_time > mcount_threshold ||
-		    rstack->flags & (MCOUNT_FL_WRITTEN | MCOUNT_FL_TRACE)) {
-			if (!mcount_enabled)
-				return;
-
+		if ((rstack->end_time - rstack->start_time > mcount_threshold ||
+		     rstack->flags & (MCOUNT_FL_WRITTEN | MCOUNT_FL_TRACE)) &&
+		    mcount_enabled) {
 			if (record_trace_data(mtdp, rstack, retval) < 0)
 				pr_err("error during record");
 		}
 	}
+
+	release_argbuf(mtdp, rstack);
+}
+
+/* runtime control by 'uftrace control' */
+#define MCOUNT_CONTROL_TIMEOUT  1000   /* msec */
+#define MCOUNT_CONTROL_INTERVAL  10000  /* usec, if it has no FIFO */
+#define MCOUNT_CONTROL_RETRY    100
+
+static struct mcount_control *mcount_ctrl;
+static struct mcount_control mcount_ctrl_applied;
+static char *mcount_ctrl_dir;
+static char *mcount_ctrl_wake;
+static int mcount_ctrl_fd = -1;
+
+/*
+ * The recorder updates the shmem within a memcpy(), so the seq is odd
+ * only briefly unless it's preempted (or killed) in the middle.  Back off
+ * and give up after some retries, the caller will try again later.
+ */
+static bool read_control(struct mcount_control *ctrl)
+{
+	unsigned seq;
+	int i;
+
+	for (i = 0; i < MCOUNT_CONTROL_RETRY; i++) {
+		seq = __atomic_load_n(&mcount_ctrl->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			memcpy(ctrl, mcount_ctrl, sizeof(*ctrl));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if (__atomic_load_n(&mcount_ctrl->seq,
+					    __ATOMIC_RELAXED) == seq)
+				break;
+		}
+
+		if (i < 10)
+			sched_yield();
+		else
+			usleep(i * 10);
+	}
+
+	if (i == MCOUNT_CONTROL_RETRY) {
+		pr_dbg("control shmem is busy, try again later\n");
+		return false;
+	}
+
+	ctrl->filter[MCOUNT_CTRL_STRLEN - 1] = '\0';
+	ctrl->trigger[MCOUNT_CTRL_STRLEN - 1] = '\0';
+	return true;
+}
+
+static struct mcount_filter_set *build_filter_set(char *filter, char *trigger)
+{
+	struct mcount_filter_set *fs = xzalloc(sizeof(*fs));
+
+	fs->triggers = RB_ROOT;
+	fs->mode = FILTER_MODE_NONE;
+
+	ftrace_setup_filter(filter, &symtabs, NULL, &fs->triggers, &fs->mode);
+	ftrace_setup_trigger(trigger, &symtabs, NULL, &fs->triggers);
+	ftrace_setup_argument(getenv("UFTRACE_ARGUMENT"), &symtabs, NULL,
+			      &fs->triggers);
+	ftrace_setup_retval(getenv("UFTRACE_RETVAL"), &symtabs, NULL,
+			    &fs->triggers);
+
+	if (getenv("UFTRACE_PLTHOOK")) {
+		ftrace_setup_filter(filter, &symtabs, "PLT",
+				    &fs->triggers, &fs->mode);
+		ftrace_setup_trigger(trigger, &symtabs, "PLT", &fs->triggers);
+		ftrace_setup_argument(getenv("UFTRACE_ARGUMENT"), &symtabs,
+				      "PLT", &fs->triggers);
+		ftrace_setup_retval(getenv("UFTRACE_RETVAL"), &symtabs,
+				    "PLT", &fs->triggers);
+	}
+
+	return fs;
+}
+
+static void send_control_msg(struct mcount_control *ctrl)
+{
+	char buf[sizeof(struct ftrace_msg_ctrl) + 2 * MCOUNT_CTRL_STRLEN + 128];
+	struct ftrace_msg_ctrl *cmsg = (void *)buf;
+	size_t size = sizeof(buf) - sizeof(*cmsg);
+	char *pos = cmsg->settings;
+	int len = 0;
+
+	/* use the same clock as the records so that it can be lined up */
+	cmsg->task.time = mcount_timestamp();
+	cmsg->task.pid  = getpid();
+	cmsg->task.tid  = syscall(SYS_gettid);
+	cmsg->gen = ctrl->gen;
+
+	/* only the settings changed by 'uftrace control' */
+	if (ctrl->mask & MCOUNT_CTRL_FILTER)
+		len += snprintf(pos + len, size - len, " filter=\"%s\"",
+				ctrl->filter);
+	if (ctrl->mask & MCOUNT_CTRL_TRIGGER)
+		len += snprintf(pos + len, size - len, " trigger=\"%s\"",
+				ctrl->trigger);
+	if (ctrl->mask & MCOUNT_CTRL_DEPTH)
+		len += snprintf(pos + len, size - len, " depth=%d",
+				ctrl->depth);
+	if (ctrl->mask & MCOUNT_CTRL_THRESHOLD)
+		len += snprintf(pos + len, size - len, " threshold=%"PRIu64,
+				ctrl->threshold);
+	if (ctrl->mask & MCOUNT_CTRL_ENABLE)
+		len += snprintf(pos + len, size - len, " enable=%d",
+				ctrl->enable);
+
+	cmsg->len = len;
+	ftrace_send_message(FTRACE_MSG_CONTROL, cmsg, sizeof(*cmsg) + len);
+}
+
+/* check if a trace_on trigger can enable tracing again */
+static bool has_trace_on_trigger(struct rb_root *root)
+{
+	struct rb_node *node;
+	struct ftrace_filter *filter;
+
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		filter = rb_entry(node, struct ftrace_filter, node);
+		if (filter->trigger.flags & TRIGGER_FL_TRACE_ON)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Dynamically patched functions don't need to call into libmcount
+ * while tracing is disabled, unless a trace_on trigger is set.
+ */
+static void update_dynamic_patch(void)
+{
+	bool enable = __atomic_load_n(&mcount_enabled, __ATOMIC_RELAXED);
+
+	if (!enable)
+		enable = has_trace_on_trigger(&mcount_filter_set()->triggers);
+
+	mcount_dynamic_enable(enable);
+}
+
+/*
+ * apply_control - apply new settings to the process
+ * @ctrl: a copy of current settings in the shmem
+ *
+ * Filters and triggers are rebuilt only if they were changed.  The new
+ * trigger tree is published at once, and the old one is kept since
+ * other threads might still use it.  The enable state is changed only
+ * by the request which sets it, not to override trace_on/off triggers.
+ */
+static void apply_control(struct mcount_control *ctrl)
+{
+	struct mcount_control *prev = &mcount_ctrl_applied;
+	struct mcount_filter_set *fs;
+	bool rebuild = false;
+	uint64_t threshold;
+
+	if ((ctrl->mask & MCOUNT_CTRL_FILTER) &&
+	    (!(prev->mask & MCOUNT_CTRL_FILTER) ||
+	     strcmp(ctrl->filter, prev->filter)))
+		rebuild = true;
+
+	if ((ctrl->mask & MCOUNT_CTRL_TRIGGER) &&
+	    (!(prev->mask & MCOUNT_CTRL_TRIGGER) ||
+	     strcmp(ctrl->trigger, prev->trigger)))
+		rebuild = true;
+
+	if (rebuild) {
+		fs = build_filter_set(ctrl->mask & MCOUNT_CTRL_FILTER ?
+				      ctrl->filter : getenv("UFTRACE_FILTER"),
+				      ctrl->mask & MCOUNT_CTRL_TRIGGER ?
+				      ctrl->trigger : getenv("UFTRACE_TRIGGER"));
+
+		fs->retired = mcount_filters;
+		__atomic_store_n(&mcount_filters, fs, __ATOMIC_RELEASE);
+	}
+
+	if (ctrl->mask & MCOUNT_CTRL_DEPTH)
+		__atomic_store_n(&mcount_depth, ctrl->depth, __ATOMIC_RELAXED);
+
+	if (ctrl->mask & MCOUNT_CTRL_THRESHOLD) {
+		threshold = ctrl->threshold;
+		if (mcount_use_tsc && mcount_tsc_freq)
+			threshold = (double)threshold * mcount_tsc_freq / NSEC_PER_SEC;
+
+		__atomic_store_n(&mcount_threshold, threshold, __ATOMIC_RELAXED);
+	}
+
+	if ((ctrl->mask & MCOUNT_CTRL_ENABLE) &&
+	    ctrl->enable_gen != prev->enable_gen) {
+		__atomic_store_n(&mcount_enabled, !!ctrl->enable, __ATOMIC_RELAXED);
+		update_dynamic_patch();
+	}
+	else if (rebuild) {
+		/* trace_on triggers might be added or removed */
+		update_dynamic_patch();
+	}
+
+	pr_dbg("control #%u applied (%s)\n", ctrl->gen,
+	       rebuild ? "new filters" : "same filters");
+
+	*prev = *ctrl;
+	send_control_msg(ctrl);
+}
+
+/* sleep until the recorder wakes us up, poll periodically if no FIFO */
+static void wait_control(void)
+{
+	struct pollfd pfd = {
+		.fd = mcount_ctrl_fd,
+		.events = POLLIN,
+	};
+	char buf[64];
+
+	if (mcount_ctrl_fd < 0) {
+		usleep(MCOUNT_CONTROL_INTERVAL);
+		return;
+	}
+
+	/* the timeout is just to recover from a busy shmem */
+	if (poll(&pfd, 1, MCOUNT_CONTROL_TIMEOUT) <= 0)
+		return;
+
+	while (read(mcount_ctrl_fd, buf, sizeof(buf)) > 0)
+		continue;
+}
+
+static void *mcount_control_thread(void *arg)
+{
+	struct mcount_control ctrl;
+
+	/* it never runs traced functions, but just in case */
+	mtd.recursion_guard = true;
+
+	while (!mcount_finished) {
+		if (__atomic_load_n(&mcount_ctrl->gen, __ATOMIC_ACQUIRE) !=
+		    mcount_ctrl_applied.gen && read_control(&ctrl))
+			apply_control(&ctrl);
+
+		wait_control();
+	}
+	return NULL;
+}
+
+/*
+ * open_control_wake - create the wake-up FIFO of this process
+ *
+ * The recorder writes to every "control-<pid>" FIFO in the data directory
+ * after it updates the control shmem, so the control thread can sleep in
+ * poll() until a new request comes.  It's called again in a forked child
+ * to have its own FIFO.
+ */
+static void open_control_wake(void)
+{
+	if (mcount_ctrl_fd >= 0)
+		close(mcount_ctrl_fd);
+	free(mcount_ctrl_wake);
+
+	xasprintf(&mcount_ctrl_wake, "%s/%s%d",
+		  mcount_ctrl_dir, MCOUNT_CONTROL_WAKE, getpid());
+	unlink(mcount_ctrl_wake);
+
+	if (mkfifo(mcount_ctrl_wake, 0600) < 0) {
+		pr_dbg("cannot create control FIFO: %m\n");
+		goto out;
+	}
+
+	/* keep it opened for write too, not to get POLLHUP */
+	mcount_ctrl_fd = open(mcount_ctrl_wake, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (mcount_ctrl_fd >= 0)
+		return;
+
+	pr_dbg("cannot open control FIFO: %m\n");
+	unlink(mcount_ctrl_wake);
+out:
+	mcount_ctrl_fd = -1;
+	free(mcount_ctrl_wake);
+	mcount_ctrl_wake = NULL;
+}
+
+static void mcount_start_control(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	/* create it before the thread checks the gen not to miss a request */
+	open_control_wake();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, mcount_control_thread, NULL))
+		pr_log("cannot start control thread: runtime control disabled\n");
+
+	pthread_attr_destroy(&attr);
+}
+
+static void mcount_setup_control(char *ctrl_str, char *dirname)
+{
+	int fd;
+
+	if (ctrl_str == NULL)
+		return;
+
+	fd = shm_open(ctrl_str, O_RDONLY, 0600);
+	if (fd < 0) {
+		pr_dbg("cannot open control shmem: %s: %m\n", ctrl_str);
+		return;
+	}
+
+	mcount_ctrl = mmap(NULL, sizeof(*mcount_ctrl), PROT_READ,
+			   MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mcount_ctrl == MAP_FAILED) {
+		pr_dbg("cannot map control shmem: %m\n");
+		mcount_ctrl = NULL;
+		return;
+	}
+
+	/* it might chdir() later */
+	mcount_ctrl_dir = realpath(dirname, NULL);
+	if (mcount_ctrl_dir == NULL)
+		mcount_ctrl_dir = xstrdup(dirname);
+
+	mcount_start_control();
+}
+
+static void mcount_cleanup_filters(void)
+{
+	struct mcount_filter_set *fs = mcount_filters;
+	struct mcount_filter_set *next;
+
+	while (fs) {
+		next = fs->retired;
+
+		ftrace_cleanup_filter(&fs->triggers);
+		if (fs != &mcount_init_filters)
+			free(fs);
+
+		fs = next;
+	}
 }
 
 #else /* DISABLE_MCOUNT_FILTER */
@@ -436,6 +1128,10 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 	if (unlikely(mcount_should_stop()))
 		return -1;
 
+	/* bail out before touching the thread data */
+	if (unlikely(throttle_table) && mcount_throttled(child))
+		return -1;
+
 	mtd.recursion_guard = true;
 
 	/* Access the mtd through TSD pointer to reduce TLS overhead */
@@ -448,7 +1144,7 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 	}
 
 	filtered = mcount_entry_filter_check(mtdp, child, &tr);
-	if (filtered != FILTER_IN) {
+	if (filtered == FILTER_OUT || filtered == FILTER_RSTACK) {
 		mtdp->recursion_guard = false;
 		return -1;
 	}
@@ -463,11 +1159,12 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 	rstack->parent_loc = parent_loc;
 	rstack->parent_ip  = *parent_loc;
 	rstack->child_ip   = child;
-	rstack->start_time = mcount_gettime();
+	rstack->start_time = filtered == FILTER_IN ? mcount_timestamp() : 0;
 	rstack->end_time   = 0;
-	rstack->flags      = 0;
+	rstack->child_time = 0;
+	rstack->flags      = filtered == FILTER_IN ? 0 : MCOUNT_FL_NORECORD;
 
-	/* hijack the return address */
+	/* hijack the return address (to restore the filter state at least) */
 	*parent_loc = (unsigned long)mcount_return;
 
 	mcount_entry_filter_record(mtdp, rstack, &tr, regs);
@@ -488,9 +1185,12 @@ unsigned long mcount_exit(long *retval)
 
 	rstack = &mtdp->rstack[mtdp->idx - 1];
 
-	rstack->end_time = mcount_gettime();
+	rstack->end_time = mcount_timestamp();
 	mcount_exit_filter_record(mtdp, rstack, retval);
 
+	if (unlikely(throttle_table))
+		mcount_update_throttle(rstack);
+
 	retaddr = rstack->parent_ip;
 
 	compiler_barrier();
@@ -509,6 +1209,20 @@ static void mcount_finish(void)
 	mtd_dtor(&mtd);
 	pthread_key_delete(mtd_key);
 
+	if (mcount_summary_mode)
+		mcount_finish_summary();
+
+	if (throttle_table)
+		write_throttle_file();
+
+#ifndef DISABLE_MCOUNT_FILTER
+	mcount_dynamic_finish();
+
+	/* the control thread might still poll the fd, just remove the file */
+	if (mcount_ctrl_wake)
+		unlink(mcount_ctrl_wake);
+#endif
+
 	if (pfd != -1) {
 		close(pfd);
 		pfd = -1;
@@ -540,6 +1254,16 @@ static int cygprof_entry(unsigned long parent, unsigned long child)
 		assert(mtdp);
 	}
 
+	/* cygprof_exit() will be called anyway, just mark it */
+	if (unlikely(throttle_table) && mcount_throttled(child)) {
+		if (mtdp->idx < mcount_rstack_max)
+			mtdp->rstack[mtdp->idx].flags = MCOUNT_FL_THROTTLED;
+
+		mtdp->idx++;
+		mtdp->recursion_guard = false;
+		return 0;
+	}
+
 	filtered = mcount_entry_filter_check(mtdp, child, &tr);
 
 	rstack = &mtdp->rstack[mtdp->idx++];
@@ -558,9 +1282,10 @@ static int cygprof_entry(unsigned long parent, unsigned long child)
 	rstack->parent_ip  = parent;
 	rstack->child_ip   = child;
 	rstack->end_time   = 0;
+	rstack->child_time = 0;
 
 	if (filtered == FILTER_IN) {
-		rstack->start_time = mcount_gettime();
+		rstack->start_time = mcount_timestamp();
 		rstack->flags      = 0;
 	}
 	else {
@@ -601,11 +1326,17 @@ static void cygprof_exit(unsigned long parent, unsigned long child)
 
 	rstack = &mtdp->rstack[mtdp->idx - 1];
 
+	if (rstack->flags & MCOUNT_FL_THROTTLED)
+		goto out;
+
 	if (!(rstack->flags & MCOUNT_FL_NORECORD))
-		rstack->end_time = mcount_gettime();
+		rstack->end_time = mcount_timestamp();
 
 	mcount_exit_filter_record(mtdp, rstack, NULL);
 
+	if (unlikely(throttle_table))
+		mcount_update_throttle(rstack);
+
 	compiler_barrier();
 
 out:
@@ -642,6 +1373,18 @@ static void atfork_child_handler(void)
 
 	mtd.tid = 0;
 
+	if (mcount_summary_mode)
+		reset_summary_fork();
+
+	if (throttle_table)
+		reset_throttle_fork();
+
+#ifndef DISABLE_MCOUNT_FILTER
+	/* threads are not copied to the child */
+	if (mcount_ctrl)
+		mcount_start_control();
+#endif
+
 	clear_shmem_buffer(&mtd);
 	prepare_shmem_buffer(&mtd);
 
@@ -741,6 +1484,12 @@ void __visible_default __monstartup(unsigned long low, unsigned long high)
 	if (bufsize_str)
 		shmem_bufsize = strtol(bufsize_str, NULL, 0);
 
+	if (getenv("UFTRACE_BUFFER_COUNT")) {
+		shmem_ring_slots = strtol(getenv("UFTRACE_BUFFER_COUNT"), NULL, 0);
+		if (shmem_ring_slots < 2 || shmem_ring_slots > SHMEM_RING_MAX)
+			shmem_ring_slots = SHMEM_RING_SLOTS;
+	}
+
 	dirname = getenv("UFTRACE_DIR");
 	if (dirname == NULL)
 		dirname = UFTRACE_DIR_NAME;
@@ -758,22 +1507,26 @@ void __visible_default __monstartup(unsigned long low, unsigned long high)
 	load_module_symtabs(&symtabs, &modules);
 
 	ftrace_setup_filter(getenv("UFTRACE_FILTER"), &symtabs, NULL,
-			    &mcount_triggers, &mcount_filter_mode);
+			    &mcount_init_filters.triggers,
+			    &mcount_init_filters.mode);
 
 	ftrace_setup_trigger(getenv("UFTRACE_TRIGGER"), &symtabs, NULL,
-			     &mcount_triggers);
+			     &mcount_init_filters.triggers);
 
 	ftrace_setup_argument(getenv("UFTRACE_ARGUMENT"), &symtabs, NULL,
-			      &mcount_triggers);
+			      &mcount_init_filters.triggers);
 
 	ftrace_setup_retval(getenv("UFTRACE_RETVAL"), &symtabs, NULL,
-			      &mcount_triggers);
+			      &mcount_init_filters.triggers);
 
 	if (getenv("UFTRACE_DEPTH"))
 		mcount_depth = strtol(getenv("UFTRACE_DEPTH"), NULL, 0);
 
 	if (getenv("UFTRACE_DISABLED"))
 		mcount_enabled = false;
+
+	mcount_dynamic_update(&symtabs, mcount_exename, getenv("UFTRACE_PATCH"));
+	update_dynamic_patch();
 #endif /* DISABLE_MCOUNT_FILTER */
 
 	if (maxstack_str)
@@ -782,6 +1535,29 @@ void __visible_default __monstartup(unsigned long low, unsigned long high)
 	if (threshold_str)
 		mcount_threshold = strtoull(threshold_str, NULL, 0);
 
+	mcount_setup_clock(getenv("UFTRACE_CLOCK"), getenv("UFTRACE_TSC_FREQ"));
+
+#ifndef DISABLE_MCOUNT_FILTER
+	mcount_setup_sample(getenv("UFTRACE_SAMPLE"),
+			    getenv("UFTRACE_SAMPLE_WINDOW"),
+			    getenv("UFTRACE_TSC_FREQ"));
+#endif
+
+	mcount_setup_throttle(getenv("UFTRACE_THROTTLE"),
+			      getenv("UFTRACE_TSC_FREQ"), dirname);
+
+	if (getenv("UFTRACE_FLIGHT"))
+		mcount_flight_mode = true;
+
+	mcount_setup_buffer_policy(getenv("UFTRACE_BUFFER_POLICY"),
+				   getenv("UFTRACE_BUFFER_WAIT"));
+	mcount_setup_ring_event(getenv("UFTRACE_RING_EVENT"));
+
+	if (getenv("UFTRACE_SUMMARY"))
+		mcount_setup_summary(dirname);
+	else if (pfd >= 0)
+		mcount_setup_shmem_pool();
+
 	if (getenv("UFTRACE_PLTHOOK")) {
 		if (symtabs.loaded && symtabs.dsymtab.nr_sym == 0) {
 			pr_dbg("skip PLT hooking due to no dynamic symbols\n");
@@ -792,16 +1568,17 @@ void __visible_default __monstartup(unsigned long low, unsigned long high)
 
 #ifndef DISABLE_MCOUNT_FILTER
 		ftrace_setup_filter(getenv("UFTRACE_FILTER"), &symtabs, "PLT",
-				    &mcount_triggers, &mcount_filter_mode);
+				    &mcount_init_filters.triggers,
+				    &mcount_init_filters.mode);
 
 		ftrace_setup_trigger(getenv("UFTRACE_TRIGGER"), &symtabs, "PLT",
-				    &mcount_triggers);
+				    &mcount_init_filters.triggers);
 
 		ftrace_setup_argument(getenv("UFTRACE_ARGUMENT"), &symtabs, "PLT",
-				      &mcount_triggers);
+				      &mcount_init_filters.triggers);
 
 		ftrace_setup_retval(getenv("UFTRACE_RETVAL"), &symtabs, "PLT",
-				      &mcount_triggers);
+				      &mcount_init_filters.triggers);
 #endif /* DISABLE_MCOUNT_FILTER */
 
 		if (hook_pltgot(mcount_exename, symtabs.maps->start) < 0)
@@ -815,6 +1592,8 @@ out:
 
 #ifndef DISABLE_MCOUNT_FILTER
 	ftrace_cleanup_filter_module(&modules);
+
+	mcount_setup_control(getenv("UFTRACE_CONTROL"), dirname);
 #endif /* DISABLE_MCOUNT_FILTER */
 
 	compiler_barrier();
@@ -829,7 +1608,7 @@ void __visible_default _mcleanup(void)
 	destroy_dynsym_indexes();
 
 #ifndef DISABLE_MCOUNT_FILTER
-	ftrace_cleanup_filter(&mcount_triggers);
+	mcount_cleanup_filters();
 #endif
 }
 
@@ -38,6 +38,7 @@ enum mcount_flag {
 	MCOUNT_FL_RETVAL	= (1U << 9),
 	MCOUNT_FL_TRACE		= (1U << 10),
 	MCOUNT_FL_ARGUMENT	= (1U << 11),
+	MCOUNT_FL_THROTTLED	= (1U << 12),
 };
 
 struct mcount_ret_stack {
@@ -48,12 +49,16 @@ struct mcount_ret_stack {
 	/* time in nsec (CLOCK_MONOTONIC) */
 	uint64_t start_time;
 	uint64_t end_time;
+	/* sum of children's time (for summary mode) */
+	uint64_t child_time;
 	int tid;
 	int filter_depth;
 	unsigned short depth;
 	unsigned short dyn_idx;
 	/* set arg_spec at function entry and use it at exit */
 	struct list_head *pargs;
+	/* saved arguments (or retval) in the argbuf arena */
+	void *argbuf;
 };
 
 void __monstartup(unsigned long low, unsigned long high);
@@ -62,12 +67,9 @@ void mcount_restore(void);
 void mcount_reset(void);
 
 #define SHMEM_BUFFER_SIZE  (128 * 1024)
-
-enum shmem_buffer_flags {
-	SHMEM_FL_NEW		= (1U << 0),
-	SHMEM_FL_WRITTEN	= (1U << 1),
-	SHMEM_FL_RECORDING	= (1U << 2),
-};
+#define SHMEM_RING_SLOTS   8  /* default, see --buffer-count */
+#define SHMEM_RING_MAX     1024
+#define SHMEM_POOL_RINGS   16
 
 struct mcount_shmem_buffer {
 	unsigned size;
@@ -76,6 +78,94 @@ struct mcount_shmem_buffer {
 	char data[];
 };
 
+/*
+ * Per-thread ring of shmem buffers shared with the recorder.
+ *
+ * The libmcount (producer) fills the buffer at @head and publishes it
+ * by advancing @head.  The recorder (consumer) writes the buffers
+ * between @tail and @head and gives them back by advancing @tail.
+ * Both indices are free-running and published with release semantic
+ * so the ring can stay mapped on both sides without any messages.
+ *
+ * When the ring is full and the policy is 'block', libmcount sets
+ * @waiting and sleeps on @tail with futex(2).  The recorder wakes it up
+ * after advancing @tail if @waiting is set.
+ */
+struct mcount_shmem_ring {
+	/* written by libmcount */
+	unsigned	head;
+	unsigned	done;
+	unsigned	nr_slot;
+	unsigned	slot_size;
+	unsigned	waiting;
+
+	/* written by recorder (in a separate cache line) */
+	unsigned	tail __attribute__((aligned(64)));
+
+	char		slots[] __attribute__((aligned(64)));
+};
+
+static inline struct mcount_shmem_buffer *
+shmem_ring_slot(struct mcount_shmem_ring *ring, unsigned idx)
+{
+	return (void *)ring->slots + (size_t)(idx % ring->nr_slot) * ring->slot_size;
+}
+
+/*
+ * Per-session pool of rings created once in __monstartup() so that new
+ * threads don't need to create and map their own shmem.  A thread claims
+ * a free ring by setting @owner to its tid, and the recorder sets it back
+ * to 0 when the ring is done and fully consumed.  Threads fall back to a
+ * separate shmem ring when all rings in the pool are in use.
+ */
+struct mcount_shmem_pool {
+	unsigned	nr_ring;
+	unsigned	unused;
+	uint64_t	ring_size;
+	int		owner[SHMEM_POOL_RINGS];
+
+	char		rings[] __attribute__((aligned(64)));
+};
+
+static inline struct mcount_shmem_ring *
+shmem_pool_ring(struct mcount_shmem_pool *pool, unsigned idx)
+{
+	return (void *)pool->rings + (size_t)idx * pool->ring_size;
+}
+
+/* name of the control FIFO in the data directory */
+#define MCOUNT_CONTROL_FIFO  "control"
+
+/* prefix of the per-process FIFOs ("control-<pid>") to wake up libmcount */
+#define MCOUNT_CONTROL_WAKE  "control-"
+
+#define MCOUNT_CTRL_STRLEN  1024
+
+#define MCOUNT_CTRL_FILTER     (1U << 0)
+#define MCOUNT_CTRL_TRIGGER    (1U << 1)
+#define MCOUNT_CTRL_DEPTH      (1U << 2)
+#define MCOUNT_CTRL_THRESHOLD  (1U << 3)
+#define MCOUNT_CTRL_ENABLE     (1U << 4)
+
+/*
+ * Settings changed by 'uftrace control' at runtime.  The recorder keeps
+ * this in a shmem (UFTRACE_CONTROL) and merges each request into it.
+ * The @seq is odd while the recorder is updating it, so readers should
+ * retry if it's odd or changed after reading.  The @mask has the
+ * MCOUNT_CTRL_* bits which were set by any request so far.
+ */
+struct mcount_control {
+	unsigned	seq;
+	unsigned	gen;
+	unsigned	mask;
+	unsigned	enable_gen;	/* last request changed @enable */
+	int		enable;
+	int		depth;
+	uint64_t	threshold;	/* nsec */
+	char		filter[MCOUNT_CTRL_STRLEN];
+	char		trigger[MCOUNT_CTRL_STRLEN];
+};
+
 /* must be in sync with enum debug_domain (bits) */
 #define DBG_DOMAIN_STR  "TSDFfsKM"
 
@@ -83,32 +173,96 @@ enum filter_result {
 	FILTER_RSTACK = -1,
 	FILTER_OUT,
 	FILTER_IN,
+	FILTER_NORECORD,	/* hook the return, but don't record */
 };
 
 #ifndef DISABLE_MCOUNT_FILTER
+/* per-thread call counters for sampling (indexed by hash of address) */
+#define MCOUNT_SAMPLE_BITS  10
+#define MCOUNT_SAMPLE_SIZE  (1U << MCOUNT_SAMPLE_BITS)
+
 struct filter_control {
 	int in_count;
 	int out_count;
 	int depth;
 	int saved_depth;
+	int base_depth;		/* default depth seen by this thread */
+	unsigned *sample_count;
 };
 #else
 struct filter_control {};
 #endif
 
+/* per-function counters for auto-throttling (shared by all threads) */
+#define MCOUNT_THROTTLE_BITS   12
+#define MCOUNT_THROTTLE_SIZE   (1U << MCOUNT_THROTTLE_BITS)
+#define MCOUNT_THROTTLE_PROBE  8
+
+struct mcount_throttle {
+	unsigned long			addr;
+	unsigned long			nr_short;  /* short calls before throttled */
+	unsigned long			nr_skip;   /* calls skipped after throttled */
+	bool				throttled;
+	bool				ignore;    /* it has triggers */
+};
+
+/* per-thread function index table for the compact record format */
+#define MCOUNT_FUNC_INDEX_BITS  10
+#define MCOUNT_FUNC_INDEX_SIZE  (1U << MCOUNT_FUNC_INDEX_BITS)
+#define MCOUNT_FUNC_INDEX_MAX   (MCOUNT_FUNC_INDEX_SIZE / 2)
+
+struct mcount_func_index {
+	unsigned long			addr;
+	unsigned			gen;
+	unsigned			idx;
+};
+
+/* per-thread function accumulators for the summary mode */
+#define MCOUNT_SUMMARY_BITS  12
+#define MCOUNT_SUMMARY_SIZE  (1U << MCOUNT_SUMMARY_BITS)
+#define MCOUNT_SUMMARY_MAX   (MCOUNT_SUMMARY_SIZE * 3 / 4)
+
+struct mcount_summary {
+	struct mcount_summary		*next;
+	int				owner;  /* tid, or 0 if unused */
+	unsigned			nr_func;
+	unsigned			lost;
+	/* index (+1) of func[] */
+	unsigned short			hash[MCOUNT_SUMMARY_SIZE];
+	struct ftrace_summary_entry	func[MCOUNT_SUMMARY_MAX];
+};
+
 struct mcount_shmem {
 	unsigned			seqnum;
 	int				losts;
-	int				curr;
-	int				nr_buf;
-	int				max_buf;
 	bool				done;
-	struct mcount_shmem_buffer	**buffer;
+	struct mcount_shmem_ring	*ring;
+	struct mcount_shmem_buffer	*curr;
+	/* states of the compact encoding, reset for each buffer */
+	uint64_t			last_time;
+	unsigned			gen;
+	unsigned			nr_func;
+	struct mcount_func_index	*func_index;
+	/* used instead of the ring in summary mode */
+	struct mcount_summary		*summary;
 };
 
 /* first 4 byte saves the actual size of the argbuf */
 #define ARGBUF_SIZE  1024
 
+/*
+ * Argument buffers are allocated from a per-thread arena which consists
+ * of (aligned) chunks.  Each function takes only the space it used and
+ * gives it back on return, so that the arena only grows with the depth
+ * of functions which have arguments or return values.
+ */
+#define ARGBUF_CHUNK_SIZE  (16 * 1024)
+
+struct mcount_argbuf_chunk {
+	struct mcount_argbuf_chunk	*next;
+	char				data[] __attribute__((aligned(8)));
+};
+
 /*
  * The idx and record_idx are to save current index of the rstack.
  * In general, both will have same value but in case of cygprof
@@ -127,7 +281,9 @@ struct mcount_thread_data {
 	bool				plthook_guard;
 	unsigned long			plthook_addr;
 	struct mcount_ret_stack		*rstack;
-	void				*argbuf;
+	struct mcount_argbuf_chunk	*argbuf;       /* list of chunks */
+	struct mcount_argbuf_chunk	*argbuf_curr;  /* chunk of the top */
+	void				*argbuf_top;   /* next free space */
 	struct filter_control		filter;
 	bool				enable_cached;
 	struct mcount_shmem		shmem;
@@ -145,11 +301,16 @@ struct mcount_thread_data {
 
 extern TLS struct mcount_thread_data mtd;
 
-extern uint64_t mcount_threshold;  /* nsec */
+extern uint64_t mcount_threshold;  /* nsec (or TSC ticks) */
 extern pthread_key_t mtd_key;
 extern int shmem_bufsize;
+extern int shmem_ring_slots;
 extern bool mcount_setup_done;
 extern bool mcount_finished;
+extern bool mcount_summary_mode;
+extern bool mcount_flight_mode;
+extern int mcount_depth_limit;
+extern bool mcount_use_tsc;
 
 extern unsigned long plthook_resolver_addr;
 
@@ -157,22 +318,64 @@ extern void __monstartup(unsigned long low, unsigned long high);
 extern void mcount_return(void);
 extern void mcount_prepare(void);
 extern uint64_t mcount_gettime(void);
+extern uint64_t mcount_timestamp(void);
 extern bool mcount_check_rstack(struct mcount_thread_data *mtdp);
 extern void ftrace_send_message(int type, void *data, size_t len);
 extern const char *session_name(void);
 extern int gettid(struct mcount_thread_data *mtdp);
 
+extern void mcount_setup_shmem_pool(void);
+extern void mcount_setup_buffer_policy(char *policy_str, char *wait_str);
+extern void mcount_setup_ring_event(char *event_str);
 extern void prepare_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void get_new_shmem_buffer(struct mcount_thread_data *mtdp);
-extern void finish_shmem_buffer(struct mcount_thread_data *mtdp, int idx);
+extern void finish_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void clear_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void shmem_finish(struct mcount_thread_data *mtdp);
+extern void mcount_request_snapshot(struct mcount_thread_data *mtdp);
+
+extern void mcount_setup_summary(const char *dirname);
+extern void mcount_finish_summary(void);
+extern void reset_summary_fork(void);
 
 extern int hook_pltgot(char *exename, unsigned long offset);
 extern void plthook_setup(struct symtabs *symtabs);
 extern void setup_dynsym_indexes(struct symtabs *symtabs);
 extern void destroy_dynsym_indexes(void);
 
+/* max size of the (patched) instruction at a call site */
+#define MCOUNT_INSN_SIZE_MAX  8
+
+struct mcount_dynamic_info {
+	unsigned long text_addr;
+	unsigned long text_size;
+	unsigned long trampoline;
+	unsigned long fentry_addr;   /* target of call at function entry */
+	unsigned long mcount_addr;   /* target of call after the prologue */
+};
+
+struct mcount_dynamic_site {
+	unsigned long addr;
+	unsigned char orig[MCOUNT_INSN_SIZE_MAX];
+};
+
+extern int mcount_dynamic_update(struct symtabs *symtabs, char *exename,
+				 char *patch_str);
+extern void mcount_dynamic_enable(bool enable);
+extern void mcount_dynamic_finish(void);
+
+extern int mcount_arch_setup_trampoline(struct mcount_dynamic_info *mdi);
+extern void mcount_arch_enable_trampoline(struct mcount_dynamic_info *mdi,
+					  bool enable);
+extern unsigned long mcount_arch_fentry_addr(unsigned long addr);
+extern int mcount_arch_patch_site(struct mcount_dynamic_info *mdi,
+				  struct mcount_dynamic_site *site, bool fentry);
+extern int mcount_arch_unpatch_site(struct mcount_dynamic_info *mdi,
+				    struct mcount_dynamic_site *site);
+extern int mcount_arch_restore_sites(struct mcount_dynamic_info *mdi,
+				     struct mcount_dynamic_site *sites,
+				     size_t nr_sites);
+
 static inline bool mcount_should_stop(void)
 {
 	return !mcount_setup_done || mcount_finished || mtd.recursion_guard;
@@ -219,6 +422,11 @@ extern void record_proc_maps(char *dirname, const char *sess_id,
 			     struct symtabs *symtabs);
 
 #ifndef DISABLE_MCOUNT_FILTER
+extern void *prepare_argbuf(struct mcount_thread_data *mtdp,
+			    struct mcount_ret_stack *rstack);
+extern void release_argbuf(struct mcount_thread_data *mtdp,
+			   struct mcount_ret_stack *rstack);
+extern void free_argbuf(struct mcount_thread_data *mtdp);
 extern void save_argument(struct mcount_thread_data *mtdp,
 			  struct mcount_ret_stack *rstack,
 			  struct list_head *args_spec,
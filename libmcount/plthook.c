@@ -408,8 +408,9 @@ unsigned long plthook_entry(unsigned long *ret_addr, unsigned long child_idx,
 	rstack->parent_loc = ret_addr;
 	rstack->parent_ip  = *ret_addr;
 	rstack->child_ip   = child_ip;
-	rstack->start_time = skip ? 0 : mcount_gettime();
+	rstack->start_time = skip ? 0 : mcount_timestamp();
 	rstack->end_time   = 0;
+	rstack->child_time = 0;
 	rstack->flags      = skip ? MCOUNT_FL_NORECORD : 0;
 
 	mcount_entry_filter_record(mtdp, rstack, &tr, regs);
@@ -486,7 +487,7 @@ again:
 		find_dynsym(&symtabs, dyn_idx)->name);
 
 	if (!(rstack->flags & MCOUNT_FL_NORECORD))
-		rstack->end_time = mcount_gettime();
+		rstack->end_time = mcount_timestamp();
 
 	mcount_exit_filter_record(mtdp, rstack, retval);
 
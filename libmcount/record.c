@@ -2,9 +2,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <time.h>
+#include <linux/futex.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "mcount"
@@ -14,16 +22,47 @@
 #include "mcount-arch.h"
 #include "utils/utils.h"
 #include "utils/filter.h"
+#include "utils/compiler.h"
 
 #define SHMEM_SESSION_FMT  "/uftrace-%s-%d-%03d" /* session-id, tid, seq */
+#define SHMEM_POOL_FMT     "/uftrace-%s-pool"     /* session-id */
 
-static struct mcount_shmem_buffer *allocate_shmem_buffer(char *buf, size_t size,
-							 int tid, int idx)
+/* default time to wait for the recorder when the ring is full (nsec) */
+#define SHMEM_RING_WAIT  (1000 * 1000 * 1000)
+
+/* what to do when the recorder cannot keep up (--buffer-policy) */
+enum shmem_policy {
+	SHMEM_POLICY_DROP,	/* drop records immediately */
+	SHMEM_POLICY_BLOCK,	/* wait for a while, then drop */
+	SHMEM_POLICY_DEGRADE,	/* reduce max depth, then wait */
+};
+
+/* do not stall the traced program unless asked */
+static enum shmem_policy shmem_policy = SHMEM_POLICY_DROP;
+static uint64_t shmem_wait_time = SHMEM_RING_WAIT;
+
+/* eventfd to wake up the recorder when a buffer is published */
+static int ring_event_fd = -1;
+
+/* min interval between snapshot requests by triggers (nsec) */
+#define SNAPSHOT_INTERVAL  (1000 * 1000 * 1000)
+
+static size_t shmem_ring_size(void)
 {
+	return sizeof(struct mcount_shmem_ring) +
+		(size_t)shmem_ring_slots * shmem_bufsize;
+}
+
+static struct mcount_shmem_ring *allocate_shmem_ring(char *buf, size_t size,
+						     int tid)
+{
+	static unsigned ring_seq;
 	int fd;
-	struct mcount_shmem_buffer *buffer = NULL;
+	struct mcount_shmem_ring *ring = NULL;
 
-	snprintf(buf, size, SHMEM_SESSION_FMT, session_name(), tid, idx);
+	/* use unique name in case a thread allocates it again */
+	snprintf(buf, size, SHMEM_SESSION_FMT, session_name(), tid,
+		 __sync_fetch_and_add(&ring_seq, 1));
 
 	fd = shm_open(buf, O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0) {
@@ -31,200 +70,958 @@ static struct mcount_shmem_buffer *allocate_shmem_buffer(char *buf, size_t size,
 		goto out;
 	}
 
-	if (ftruncate(fd, shmem_bufsize) < 0) {
+	if (ftruncate(fd, shmem_ring_size()) < 0) {
 		pr_dbg("failed to resizing shmem buffer: %s\n", buf);
 		goto out;
 	}
 
-	buffer = mmap(NULL, shmem_bufsize, PROT_READ | PROT_WRITE,
-		      MAP_SHARED, fd, 0);
-	if (buffer == MAP_FAILED) {
+	ring = mmap(NULL, shmem_ring_size(), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
 		pr_dbg("failed to mmap shmem buffer: %s\n", buf);
-		buffer = NULL;
+		ring = NULL;
 		goto out;
 	}
 
+	ring->nr_slot = shmem_ring_slots;
+	ring->slot_size = shmem_bufsize;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	return ring;
+}
+
+static struct mcount_shmem_pool *shmem_pool;
+static size_t shmem_pool_size;
+
+/**
+ * mcount_setup_shmem_pool - create a shmem pool of rings for the session
+ *
+ * It creates a single shmem region having SHMEM_POOL_RINGS rings and
+ * lets the recorder map it once.  Threads (and forked children) take a
+ * ring from the pool with an atomic operation only.
+ */
+void mcount_setup_shmem_pool(void)
+{
+	char buf[128];
+	int fd;
+	size_t ring_size;
+	void *pool;
+
+	ring_size = ALIGN(shmem_ring_size(), getpagesize());
+	shmem_pool_size = sizeof(*shmem_pool) + SHMEM_POOL_RINGS * ring_size;
+	shmem_pool_size = ALIGN(shmem_pool_size, getpagesize());
+
+	snprintf(buf, sizeof(buf), SHMEM_POOL_FMT, session_name());
+
+	fd = shm_open(buf, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_dbg("failed to open shmem pool: %s\n", buf);
+		return;
+	}
+
+	if (ftruncate(fd, shmem_pool_size) < 0) {
+		pr_dbg("failed to resizing shmem pool: %s\n", buf);
+		goto err;
+	}
+
+	pool = mmap(NULL, shmem_pool_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (pool == MAP_FAILED) {
+		pr_dbg("failed to mmap shmem pool: %s\n", buf);
+		goto err;
+	}
 	close(fd);
 
+	shmem_pool = pool;
+	shmem_pool->nr_ring = SHMEM_POOL_RINGS;
+	shmem_pool->ring_size = ring_size;
+
+	pr_dbg2("shmem pool: %d rings of %zd bytes\n", SHMEM_POOL_RINGS, ring_size);
+
+	/* the recorder will map the pool and unlink the name */
+	ftrace_send_message(FTRACE_MSG_REC_POOL, buf, strlen(buf));
+	return;
+
+err:
+	close(fd);
+	shm_unlink(buf);
+}
+
+static struct mcount_shmem_ring *claim_pool_ring(int tid, unsigned *idx)
+{
+	struct mcount_shmem_ring *ring;
+	unsigned i;
+
+	if (shmem_pool == NULL)
+		return NULL;
+
+	for (i = 0; i < shmem_pool->nr_ring; i++) {
+		if (shmem_pool->owner[i])
+			continue;
+		if (!__sync_bool_compare_and_swap(&shmem_pool->owner[i], 0, tid))
+			continue;
+
+		/* the recorder released it, no one else uses the ring now */
+		ring = shmem_pool_ring(shmem_pool, i);
+		ring->head = 0;
+		ring->done = 0;
+		ring->tail = 0;
+		ring->waiting = 0;
+		ring->nr_slot = shmem_ring_slots;
+		ring->slot_size = shmem_bufsize;
+
+		*idx = i;
+		return ring;
+	}
+	return NULL;
+}
+
+static bool is_pool_ring(struct mcount_shmem_ring *ring)
+{
+	return shmem_pool && (void *)shmem_pool < (void *)ring &&
+		(void *)ring < (void *)shmem_pool + shmem_pool_size;
+}
+
+/*
+ * Summary mode keeps per-function accumulators in each thread instead of
+ * writing records.  The accumulators are saved to <tid>-<sid>.sum file
+ * when the thread exits, before exec and when it receives SIGUSR2.
+ */
+static char *summary_dir;
+
+/* all accumulators ever allocated - reused after the owner exits */
+static struct mcount_summary *summary_list;
+
+static struct mcount_summary *get_summary(int tid)
+{
+	struct mcount_summary *s;
+
+	for (s = summary_list; s; s = s->next) {
+		if (s->owner == 0 &&
+		    __sync_bool_compare_and_swap(&s->owner, 0, tid))
+			goto out;
+	}
+
+	/* func[] will be touched (and zero-filled) only when it's used */
+	s = xmalloc(sizeof(*s));
+	s->owner = tid;
+
+	do {
+		s->next = summary_list;
+	}
+	while (!__sync_bool_compare_and_swap(&summary_list, s->next, s));
+
 out:
-	return buffer;
+	memset(s->hash, 0, sizeof(s->hash));
+	s->nr_func = 0;
+	s->lost = 0;
+	return s;
+}
+
+static void put_summary(struct mcount_summary *s)
+{
+	__sync_lock_release(&s->owner);
+}
+
+static struct ftrace_summary_entry *
+find_summary_entry(struct mcount_summary *s, unsigned long addr)
+{
+	struct ftrace_summary_entry *fe;
+	unsigned short *slot;
+	unsigned hash;
+	unsigned i;
+
+	hash = ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >>
+		(64 - MCOUNT_SUMMARY_BITS);
+
+	/* the table is never full, so it'll find an empty slot */
+	for (i = 0; i < MCOUNT_SUMMARY_SIZE; i++) {
+		slot = &s->hash[(hash + i) % MCOUNT_SUMMARY_SIZE];
+
+		if (*slot == 0)
+			break;
+
+		fe = &s->func[*slot - 1];
+		if (fe->addr == addr)
+			return fe;
+	}
+
+	if (s->nr_func >= MCOUNT_SUMMARY_MAX)
+		return NULL;
+
+	fe = &s->func[s->nr_func];
+	memset(fe, 0, sizeof(*fe));
+	fe->addr      = addr;
+	fe->total_min = -1ULL;
+	fe->self_min  = -1ULL;
+
+	/* make the entry visible after it's set (for the flush thread) */
+	__atomic_store_n(&s->nr_func, s->nr_func + 1, __ATOMIC_RELEASE);
+	*slot = s->nr_func;
+
+	return fe;
+}
+
+/* save accumulators of a thread, other threads might update it */
+static void write_summary(struct mcount_summary *s)
+{
+	struct ftrace_summary_header hdr = {
+		.magic   = UFTRACE_SUMMARY_MAGIC,
+		.version = UFTRACE_SUMMARY_VERSION,
+		.tid     = s->owner,
+		.nr_func = __atomic_load_n(&s->nr_func, __ATOMIC_ACQUIRE),
+		.lost    = s->lost,
+		.time    = mcount_gettime(),
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr,    .iov_len = sizeof(hdr), },
+		{ .iov_base = s->func, .iov_len = hdr.nr_func * sizeof(*s->func), },
+	};
+	char filename[PATH_MAX];
+	char tmpname[PATH_MAX + 16];
+	ssize_t len = iov[0].iov_len + iov[1].iov_len;
+	int fd;
+
+	if (hdr.tid == 0)
+		return;
+
+	snprintf(filename, sizeof(filename), "%s/%d-%s.sum",
+		 summary_dir, hdr.tid, session_name());
+	/* other thread might write it at the same time */
+	snprintf(tmpname, sizeof(tmpname), "%s.%ld",
+		 filename, syscall(SYS_gettid));
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_dbg("cannot open summary file: %s\n", tmpname);
+		return;
+	}
+
+	if (writev(fd, iov, 2) != len) {
+		pr_dbg("cannot write summary file: %s\n", tmpname);
+		close(fd);
+		unlink(tmpname);
+		return;
+	}
+
+	close(fd);
+	rename(tmpname, filename);
+}
+
+/*
+ * SIGUSR2 only wakes up the flush thread using the pipe since writing
+ * files is not async-signal-safe.  The previous handler of the program
+ * (if any) is called as well.
+ */
+static int summary_pipe[2] = { -1, -1 };
+static struct sigaction summary_old_sa;
+
+static void flush_summaries(void)
+{
+	struct mcount_summary *s;
+
+	for (s = summary_list; s; s = s->next)
+		write_summary(s);
+}
+
+static void summary_signal_handler(int sig, siginfo_t *info, void *arg)
+{
+	int saved_errno = errno;
+
+	/* a flush is already pending if the pipe is full */
+	if (summary_pipe[1] >= 0 && write(summary_pipe[1], "", 1) < 0)
+		errno = saved_errno;
+
+	if (summary_old_sa.sa_flags & SA_SIGINFO)
+		summary_old_sa.sa_sigaction(sig, info, arg);
+	else if (summary_old_sa.sa_handler != SIG_DFL &&
+		 summary_old_sa.sa_handler != SIG_IGN)
+		summary_old_sa.sa_handler(sig);
+}
+
+static void *summary_flush_thread(void *arg)
+{
+	int fd = (long)arg;
+	char buf[64];
+	ssize_t n;
+
+	/* it never runs traced functions, but just in case */
+	mtd.recursion_guard = true;
+
+	while (true) {
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		flush_summaries();
+	}
+	return NULL;
+}
+
+static void start_summary_thread(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (pipe2(summary_pipe, O_CLOEXEC) < 0) {
+		pr_dbg("cannot create summary pipe: %m\n");
+		summary_pipe[0] = summary_pipe[1] = -1;
+		return;
+	}
+
+	/* the signal handler should not block */
+	fcntl(summary_pipe[1], F_SETFL, O_NONBLOCK);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, summary_flush_thread,
+			   (void *)(long)summary_pipe[0])) {
+		pr_log("cannot start summary thread: SIGUSR2 is ignored\n");
+		close(summary_pipe[0]);
+		close(summary_pipe[1]);
+		summary_pipe[0] = summary_pipe[1] = -1;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * mcount_setup_summary - start summary mode
+ * @dirname: data directory to save summary files
+ */
+void mcount_setup_summary(const char *dirname)
+{
+	struct sigaction sa = {
+		.sa_flags = SA_SIGINFO | SA_RESTART,
+	};
+
+	summary_dir = realpath(dirname, NULL);
+	if (summary_dir == NULL)
+		summary_dir = xstrdup(dirname);
+
+	start_summary_thread();
+
+	sa.sa_sigaction = summary_signal_handler;
+	sigfillset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, &summary_old_sa);
+
+	mcount_summary_mode = true;
+	pr_dbg("summary mode: saving to %s\n", summary_dir);
+}
+
+/* save accumulators of threads still running at exit */
+void mcount_finish_summary(void)
+{
+	flush_summaries();
+}
+
+/* other threads are gone in the child, release their accumulators */
+void reset_summary_fork(void)
+{
+	struct mcount_summary *s;
+
+	for (s = summary_list; s; s = s->next)
+		s->owner = 0;
+
+	/* the pipe is shared with the parent, use a new one */
+	if (summary_pipe[0] >= 0) {
+		close(summary_pipe[0]);
+		close(summary_pipe[1]);
+	}
+	start_summary_thread();
+}
+
+static int record_summary(struct mcount_thread_data *mtdp,
+			  struct mcount_ret_stack *mrstack)
+{
+	struct mcount_summary *s = mtdp->shmem.summary;
+	struct ftrace_summary_entry *fe;
+	struct mcount_ret_stack *rstack;
+	uint64_t total, self;
+
+	if (s == NULL)
+		return 0;
+
+	/* flush request before exec (or exit) */
+	if (mrstack->end_time == 0) {
+		write_summary(s);
+		return 0;
+	}
+
+	if (mrstack->flags & (MCOUNT_FL_NORECORD | MCOUNT_FL_DISABLED))
+		return 0;
+
+	total = mrstack->end_time - mrstack->start_time;
+	self  = total > mrstack->child_time ? total - mrstack->child_time : 0;
+
+	if (mrstack > mtdp->rstack)
+		(mrstack - 1)->child_time += total;
+
+	fe = find_summary_entry(s, mrstack->child_ip);
+	if (fe == NULL) {
+		s->lost++;
+		return 0;
+	}
+
+	fe->nr_called++;
+	fe->time_total += total;
+	fe->time_self  += self;
+
+	if (fe->total_min > total)
+		fe->total_min = total;
+	if (fe->total_max < total)
+		fe->total_max = total;
+	if (fe->self_min > self)
+		fe->self_min = self;
+	if (fe->self_max < self)
+		fe->self_max = self;
+
+	/* recursive calls should not be added to the total time */
+	for (rstack = mtdp->rstack; rstack < mrstack; rstack++) {
+		if (rstack->child_ip == mrstack->child_ip) {
+			fe->time_recursive += total;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* start a new buffer with a sync marker and reset encoding states */
+static void start_shmem_buffer(struct mcount_shmem *shmem,
+			       struct mcount_shmem_buffer *buf)
+{
+	buf->data[0] = FTRACE_COMPACT_SYNC;
+	buf->size = 1;
+
+	shmem->last_time = 0;
+	shmem->nr_func = 0;
+
+	/* invalidate all function indices at once */
+	if (++shmem->gen == 0) {
+		memset(shmem->func_index, 0, MCOUNT_FUNC_INDEX_SIZE *
+		       sizeof(*shmem->func_index));
+		shmem->gen = 1;
+	}
+}
+
+/* find (or define) index of the function in the current buffer */
+static enum ftrace_compact_addr get_func_index(struct mcount_shmem *shmem,
+					       unsigned long addr,
+					       unsigned *idx)
+{
+	struct mcount_func_index *fi;
+	unsigned hash;
+	unsigned i;
+
+	hash = ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >>
+		(64 - MCOUNT_FUNC_INDEX_BITS);
+
+	/* linear probing, give up after a few collisions */
+	for (i = 0; i < 8; i++) {
+		fi = &shmem->func_index[(hash + i) % MCOUNT_FUNC_INDEX_SIZE];
+
+		if (fi->gen != shmem->gen) {
+			if (shmem->nr_func >= MCOUNT_FUNC_INDEX_MAX)
+				break;
+
+			fi->gen  = shmem->gen;
+			fi->addr = addr;
+			fi->idx  = shmem->nr_func++;
+			return FTRACE_ADDR_DEFINE;
+		}
+
+		if (fi->addr == addr) {
+			*idx = fi->idx;
+			return FTRACE_ADDR_INDEX;
+		}
+	}
+
+	return FTRACE_ADDR_LITERAL;
+}
+
+/* encode a record in the compact format and return its size */
+static unsigned encode_ret_stack(struct mcount_shmem *shmem, uint8_t *buf,
+				 enum ftrace_ret_stack_type type, bool more,
+				 unsigned depth, unsigned long addr,
+				 uint64_t timestamp)
+{
+	enum ftrace_compact_addr mode = FTRACE_ADDR_LITERAL;
+	int64_t delta = 0;
+	unsigned idx = 0;
+	unsigned n = 1;
+
+	/* lost records has no timestamp and saves the count in the addr */
+	if (type != FTRACE_LOST) {
+		delta = timestamp - shmem->last_time;
+		shmem->last_time = timestamp;
+
+		mode = get_func_index(shmem, addr, &idx);
+	}
+
+	n += put_varint(buf + n, zigzag_encode(delta));
+	n += put_varint(buf + n, depth);
+
+	if (mode == FTRACE_ADDR_INDEX)
+		n += put_varint(buf + n, idx);
+	else
+		n += put_varint(buf + n, addr);
+
+	buf[0] = type | (more ? FTRACE_COMPACT_MORE : 0) |
+		(mode << FTRACE_COMPACT_ADDR_SHIFT);
+
+	return n;
 }
 
 void prepare_shmem_buffer(struct mcount_thread_data *mtdp)
 {
 	char buf[128];
-	int idx;
-	int tid = gettid(mtdp);
+	struct ftrace_msg_ring rmsg;
 	struct mcount_shmem *shmem = &mtdp->shmem;
 
+	if (mcount_summary_mode) {
+		shmem->summary = get_summary(gettid(mtdp));
+		shmem->done = false;
+		return;
+	}
+
 	pr_dbg2("preparing shmem buffers\n");
 
-	shmem->nr_buf = 2;
-	shmem->max_buf = 2;
-	shmem->buffer = xcalloc(sizeof(*shmem->buffer), 2);
+	shmem->ring = claim_pool_ring(gettid(mtdp), &rmsg.idx);
+	if (shmem->ring) {
+		memcpy(rmsg.sid, session_name(), sizeof(rmsg.sid));
+		rmsg.tid = gettid(mtdp);
 
-	for (idx = 0; idx < shmem->nr_buf; idx++) {
-		shmem->buffer[idx] = allocate_shmem_buffer(buf, sizeof(buf),
-							   tid, idx);
-		if (shmem->buffer[idx] == NULL)
+		ftrace_send_message(FTRACE_MSG_REC_RING, &rmsg, sizeof(rmsg));
+	}
+	else {
+		shmem->ring = allocate_shmem_ring(buf, sizeof(buf), gettid(mtdp));
+		if (shmem->ring == NULL)
 			pr_err("mmap shmem buffer");
+
+		/* the recorder will map the ring and consume buffers directly */
+		ftrace_send_message(FTRACE_MSG_REC_START, buf, strlen(buf));
 	}
 
-	/* set idx 0 as current buffer */
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, session_name(), tid, 0);
-	ftrace_send_message(FTRACE_MSG_REC_START, buf, strlen(buf));
+	if (shmem->func_index == NULL) {
+		shmem->func_index = xcalloc(MCOUNT_FUNC_INDEX_SIZE,
+					    sizeof(*shmem->func_index));
+	}
 
 	shmem->done = false;
-	shmem->curr = 0;
-	shmem->buffer[0]->flag = SHMEM_FL_RECORDING | SHMEM_FL_NEW;
+	shmem->curr = shmem_ring_slot(shmem->ring, 0);
+	start_shmem_buffer(shmem, shmem->curr);
 }
 
-void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
+static bool is_ring_full(struct mcount_shmem_ring *ring, unsigned tail)
 {
-	char buf[128];
-	struct mcount_shmem *shmem = &mtdp->shmem;
-	struct mcount_shmem_buffer *curr_buf = NULL;
-	struct mcount_shmem_buffer **new_buffer;
-	int idx;
+	return ring->head - tail >= ring->nr_slot;
+}
 
-	/* always use first buffer available */
-	for (idx = 0; idx < shmem->nr_buf; idx++) {
-		curr_buf = shmem->buffer[idx];
-		if (!(curr_buf->flag & SHMEM_FL_RECORDING))
-			goto reuse;
-	}
+/*
+ * wait for the recorder to consume a buffer, return false on timeout.
+ * It's paired with cmd-record.c::wake_shmem_ring().
+ */
+static bool wait_shmem_ring(struct mcount_shmem_ring *ring, uint64_t timeout)
+{
+	uint64_t start, elapsed;
+	struct timespec ts;
+	unsigned tail;
+	bool ret = true;
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (!is_ring_full(ring, tail))
+		return true;
+	if (timeout == 0)
+		return false;
+
+	start = mcount_gettime();
+
+	/* the recorder checks it after updating the tail */
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+	while (true) {
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+		if (!is_ring_full(ring, tail))
+			break;
+
+		elapsed = mcount_gettime() - start;
+		if (elapsed >= timeout) {
+			ret = false;
+			break;
+		}
 
-	new_buffer = realloc(shmem->buffer, sizeof(*new_buffer) * (idx + 1));
-	if (new_buffer) {
-		/*
-		 * it already free'd the old buffer, keep the new buffer
-		 * regardless of allocation failure.
-		 */
-		shmem->buffer = new_buffer;
+		ts.tv_sec  = (timeout - elapsed) / NSEC_PER_SEC;
+		ts.tv_nsec = (timeout - elapsed) % NSEC_PER_SEC;
 
-		curr_buf = allocate_shmem_buffer(buf, sizeof(buf),
-						 gettid(mtdp), idx);
+		/* the ring is shared with the recorder, not a private futex */
+		syscall(SYS_futex, &ring->tail, FUTEX_WAIT, tail, &ts, NULL, 0);
 	}
 
-	if (new_buffer == NULL || curr_buf == NULL) {
-		shmem->losts++;
-		shmem->curr = -1;
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * mcount_setup_buffer_policy - set what to do when the shmem ring is full
+ * @policy_str: one of "block", "drop" or "degrade"
+ * @wait_str:   max time to wait for the recorder (nsec)
+ */
+void mcount_setup_buffer_policy(char *policy_str, char *wait_str)
+{
+	if (policy_str == NULL || !strcmp(policy_str, "drop"))
+		shmem_policy = SHMEM_POLICY_DROP;
+	else if (!strcmp(policy_str, "block"))
+		shmem_policy = SHMEM_POLICY_BLOCK;
+	else if (!strcmp(policy_str, "degrade"))
+		shmem_policy = SHMEM_POLICY_DEGRADE;
+
+	if (wait_str)
+		shmem_wait_time = strtoull(wait_str, NULL, 0);
+
+	pr_dbg("buffer policy: %s (wait %"PRIu64" nsec)\n",
+	       policy_str ?: "drop", shmem_wait_time);
+}
+
+/**
+ * mcount_setup_ring_event - set the eventfd to notify the recorder
+ * @event_str: file descriptor number inherited from the recorder
+ */
+void mcount_setup_ring_event(char *event_str)
+{
+	struct stat statbuf;
+	int fd;
+
+	if (event_str == NULL)
+		return;
+
+	fd = strtol(event_str, NULL, 0);
+
+	/* minimal sanity check */
+	if (fstat(fd, &statbuf) < 0) {
+		pr_dbg("ignore invalid ring event fd: %d\n", fd);
 		return;
 	}
+	ring_event_fd = fd;
+}
 
-	shmem->buffer[idx] = curr_buf;
-	shmem->nr_buf++;
-	if (shmem->nr_buf > shmem->max_buf)
-		shmem->max_buf = shmem->nr_buf;
+/* let the recorder know that a buffer is ready (or the ring is done) */
+static void kick_recorder(void)
+{
+	uint64_t one = 1;
 
-reuse:
-	/*
-	 * Start a new buffer and mark it recording data.
-	 * See cmd-record.c::writer_thread().
-	 */
-	__sync_fetch_and_or(&curr_buf->flag, SHMEM_FL_RECORDING);
+	if (ring_event_fd < 0 || mcount_flight_mode)
+		return;
 
-	shmem->seqnum++;
-	shmem->curr = idx;
-	curr_buf->size = 0;
-
-	/* shrink unused buffers */
-	if (idx + 3 <= shmem->nr_buf) {
-		int i;
-		int count = 0;
-		struct mcount_shmem_buffer *b;
-
-		for (i = idx + 1; i < shmem->nr_buf; i++) {
-			b = shmem->buffer[i];
-			if (b->flag == SHMEM_FL_WRITTEN)
-				count++;
-		}
+	if (write(ring_event_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+		pr_dbg2("cannot kick the recorder: %m\n");
+}
 
-		/* if 3 or more buffers are unused, free the last one */
-		if (count >= 3 && b->flag == SHMEM_FL_WRITTEN) {
-			shmem->nr_buf--;
-			munmap(b, shmem_bufsize);
-		}
-	}
+/* halve the max depth of all threads to reduce the amount of records */
+static void degrade_depth_limit(struct mcount_thread_data *mtdp)
+{
+	int old = mcount_depth_limit;
+	int new = (old < mtdp->idx ? old : mtdp->idx) / 2;
+
+	if (new < 1)
+		new = 1;
+	if (new >= old)
+		return;
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT,
-		 session_name(), gettid(mtdp), idx);
+	if (__sync_bool_compare_and_swap(&mcount_depth_limit, old, new))
+		pr_dbg("shmem ring is full: limit depth to %d\n", new);
+}
 
-	pr_dbg2("new buffer: [%d] %s\n", idx, buf);
-	ftrace_send_message(FTRACE_MSG_REC_START, buf, strlen(buf));
+/* return true if there's a buffer available in the ring */
+static bool wait_for_shmem_buffer(struct mcount_thread_data *mtdp)
+{
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_ring *ring = shmem->ring;
 
-	if (shmem->losts) {
-		struct ftrace_ret_stack *frstack = (void *)curr_buf->data;
+	/* do not wait again if it's already losing data */
+	if (shmem_policy == SHMEM_POLICY_DROP || shmem->losts)
+		return wait_shmem_ring(ring, 0);
 
-		frstack->time   = 0;
-		frstack->type   = FTRACE_LOST;
-		frstack->unused = FTRACE_UNUSED;
-		frstack->more   = 0;
-		frstack->addr   = shmem->losts;
+	if (shmem_policy == SHMEM_POLICY_DEGRADE &&
+	    !wait_shmem_ring(ring, 0))
+		degrade_depth_limit(mtdp);
 
-		ftrace_send_message(FTRACE_MSG_LOST, &shmem->losts,
-				    sizeof(shmem->losts));
+	return wait_shmem_ring(ring, shmem_wait_time);
+}
 
-		curr_buf->size = sizeof(*frstack);
+/* let the recorder know how many records are lost */
+static void send_lost_message(struct mcount_thread_data *mtdp)
+{
+	struct ftrace_msg_lost lmsg = {
+		.task = {
+			.time = mcount_gettime(),
+			.pid = getpid(),
+			.tid = gettid(mtdp),
+		},
+		.count = mtdp->shmem.losts,
+	};
+
+	ftrace_send_message(FTRACE_MSG_LOST, &lmsg, sizeof(lmsg));
+}
+
+void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
+{
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_ring *ring = shmem->ring;
+	struct mcount_shmem_buffer *curr_buf;
+
+	/*
+	 * The recorder doesn't consume buffers in the flight recorder mode,
+	 * just overwrite the oldest one.  The fence makes the new head
+	 * visible before the buffer is reused, so that a snapshot can
+	 * detect it.  It's paired with cmd-record.c::snapshot_shmem_ring().
+	 */
+	if (mcount_flight_mode)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	else if (!wait_for_shmem_buffer(mtdp)) {
+		pr_dbg2("shmem ring is full: losing data\n");
+		shmem->curr = NULL;
+		return;
+	}
+
+	/* the buffer at head is owned by mcount until it's published */
+	curr_buf = shmem_ring_slot(ring, ring->head);
+	start_shmem_buffer(shmem, curr_buf);
+
+	shmem->seqnum++;
+	shmem->curr = curr_buf;
+
+	pr_dbg2("new buffer: [%u] seq = %u\n", ring->head % ring->nr_slot,
+		shmem->seqnum);
+
+	if (shmem->losts) {
+		curr_buf->size += encode_ret_stack(shmem,
+					(void *)curr_buf->data + curr_buf->size,
+					FTRACE_LOST, false, 0, shmem->losts, 0);
+
+		send_lost_message(mtdp);
 		shmem->losts = 0;
 	}
 }
 
-void finish_shmem_buffer(struct mcount_thread_data *mtdp, int idx)
+void finish_shmem_buffer(struct mcount_thread_data *mtdp)
 {
-	char buf[64];
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_ring *ring = shmem->ring;
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT,
-		 session_name(), gettid(mtdp), idx);
+	/*
+	 * Publish the current buffer to the recorder.
+	 * This is paired with cmd-record.c::consume_shmem_ring().
+	 */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+	shmem->curr = NULL;
 
-	ftrace_send_message(FTRACE_MSG_REC_END, buf, strlen(buf));
+	kick_recorder();
 }
 
 void clear_shmem_buffer(struct mcount_thread_data *mtdp)
 {
 	struct mcount_shmem *shmem = &mtdp->shmem;
-	int i;
+
+	if (shmem->summary) {
+		put_summary(shmem->summary);
+		shmem->summary = NULL;
+		return;
+	}
 
 	pr_dbg2("releasing all shmem buffers for task %d\n", gettid(mtdp));
 
-	for (i = 0; i < shmem->nr_buf; i++)
-		munmap(shmem->buffer[i], shmem_bufsize);
+	/* rings in the pool are released by the recorder */
+	if (shmem->ring && !is_pool_ring(shmem->ring))
+		munmap(shmem->ring, shmem_ring_size());
+
+	free(shmem->func_index);
 
-	free(shmem->buffer);
-	shmem->buffer = NULL;
-	shmem->nr_buf = 0;
+	shmem->ring = NULL;
+	shmem->curr = NULL;
+	shmem->func_index = NULL;
 }
 
 void shmem_finish(struct mcount_thread_data *mtdp)
 {
 	struct mcount_shmem *shmem = &mtdp->shmem;
-	struct mcount_shmem_buffer *curr_buf;
-	int curr = shmem->curr;
+	struct mcount_shmem_ring *ring = shmem->ring;
 
-	if (curr >= 0 && shmem->buffer) {
-		curr_buf = shmem->buffer[curr];
+	if (shmem->summary) {
+		write_summary(shmem->summary);
+		shmem->done = true;
+		clear_shmem_buffer(mtdp);
+		return;
+	}
+
+	if (ring == NULL)
+		return;
 
-		if (curr_buf->flag & SHMEM_FL_RECORDING)
-			finish_shmem_buffer(mtdp, curr);
+	/* it cannot be saved in the data file, report it at least */
+	if (shmem->losts) {
+		send_lost_message(mtdp);
+		shmem->losts = 0;
 	}
 
+	/* skip the empty buffer having the sync marker only */
+	if (shmem->curr && shmem->curr->size > 1)
+		finish_shmem_buffer(mtdp);
+
 	shmem->done = true;
-	shmem->curr = -1;
+	shmem->curr = NULL;
+
+	/* no more buffers will be published */
+	__atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+	kick_recorder();
 
-	pr_dbg("%s: tid: %d seqnum = %u curr = %d, nr_buf = %d max_buf = %d\n",
-	       __func__, gettid(mtdp), shmem->seqnum, curr,
-	       shmem->nr_buf, shmem->max_buf);
+	pr_dbg("%s: tid: %d seqnum = %u head = %u tail = %u\n",
+	       __func__, gettid(mtdp), shmem->seqnum, ring->head,
+	       __atomic_load_n(&ring->tail, __ATOMIC_RELAXED));
 
 	clear_shmem_buffer(mtdp);
 }
 
+/**
+ * mcount_request_snapshot - ask the recorder to save current buffers
+ * @mtdp: thread data of the current task
+ *
+ * This is for the 'snapshot' trigger in the flight recorder mode.
+ * Requests are ignored if the last one was made less than a second ago
+ * so that a hot function doesn't flood the recorder.
+ */
+void mcount_request_snapshot(struct mcount_thread_data *mtdp)
+{
+	static uint64_t last_time;
+	uint64_t prev = last_time;
+	struct ftrace_msg_task tmsg = {
+		.time = mcount_gettime(),
+		.pid = getpid(),
+		.tid = gettid(mtdp),
+	};
+
+	if (prev && tmsg.time - prev < SNAPSHOT_INTERVAL)
+		return;
+	if (!__sync_bool_compare_and_swap(&last_time, prev, tmsg.time))
+		return;
+
+	pr_dbg("request snapshot\n");
+	ftrace_send_message(FTRACE_MSG_SNAPSHOT, &tmsg, sizeof(tmsg));
+}
+
 #ifndef DISABLE_MCOUNT_FILTER
+static bool argbuf_in_chunk(struct mcount_argbuf_chunk *chunk, void *ptr)
+{
+	return (void *)chunk->data <= ptr &&
+		ptr <= (void *)chunk + ARGBUF_CHUNK_SIZE;
+}
+
+static struct mcount_argbuf_chunk *alloc_argbuf_chunk(void)
+{
+	struct mcount_argbuf_chunk *chunk;
+
+	/* use mmap() directly as it's called during function entry */
+	chunk = mmap(NULL, ARGBUF_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED) {
+		pr_log("cannot allocate argument buffer: %m\n");
+		return NULL;
+	}
+
+	chunk->next = NULL;
+	return chunk;
+}
+
+/**
+ * prepare_argbuf - reserve space for arguments of a function
+ * @mtdp:   thread data
+ * @rstack: return stack of the function
+ *
+ * This function reserves an argbuf (of ARGBUF_SIZE at most) at the top
+ * of the arena.  Actual space is determined by save_argument() and
+ * given back by release_argbuf() when the function returns.
+ */
+void *prepare_argbuf(struct mcount_thread_data *mtdp,
+		     struct mcount_ret_stack *rstack)
+{
+	struct mcount_argbuf_chunk *chunk = mtdp->argbuf_curr;
+	void *top = mtdp->argbuf_top;
+
+	if (rstack->argbuf)
+		return rstack->argbuf;
+
+	if (chunk == NULL) {
+		if (mtdp->argbuf == NULL)
+			mtdp->argbuf = alloc_argbuf_chunk();
+
+		chunk = mtdp->argbuf;
+		if (chunk == NULL)
+			return NULL;
+		top = chunk->data;
+	}
+	else if (top + ARGBUF_SIZE > (void *)chunk + ARGBUF_CHUNK_SIZE) {
+		if (chunk->next == NULL)
+			chunk->next = alloc_argbuf_chunk();
+
+		chunk = chunk->next;
+		if (chunk == NULL)
+			return NULL;
+		top = chunk->data;
+	}
+
+	*(unsigned *)top = 0;
+
+	rstack->argbuf = top;
+	mtdp->argbuf_curr = chunk;
+	mtdp->argbuf_top = top + ALIGN(sizeof(unsigned), 8);
+
+	return top;
+}
+
+/* give the argbuf space of the (returning) function back to the arena */
+void release_argbuf(struct mcount_thread_data *mtdp,
+		    struct mcount_ret_stack *rstack)
+{
+	struct mcount_argbuf_chunk *chunk;
+
+	if (rstack->argbuf == NULL)
+		return;
+
+	/* it might be allocated in a previous chunk */
+	chunk = mtdp->argbuf_curr;
+	if (!argbuf_in_chunk(chunk, rstack->argbuf)) {
+		chunk = mtdp->argbuf;
+		while (!argbuf_in_chunk(chunk, rstack->argbuf))
+			chunk = chunk->next;
+	}
+
+	mtdp->argbuf_curr = chunk;
+	mtdp->argbuf_top = rstack->argbuf;
+	rstack->argbuf = NULL;
+}
+
+void free_argbuf(struct mcount_thread_data *mtdp)
+{
+	struct mcount_argbuf_chunk *chunk, *next;
+
+	for (chunk = mtdp->argbuf; chunk; chunk = next) {
+		next = chunk->next;
+		munmap(chunk, ARGBUF_CHUNK_SIZE);
+	}
+
+	mtdp->argbuf = NULL;
+	mtdp->argbuf_curr = NULL;
+	mtdp->argbuf_top = NULL;
+}
+
 void *get_argbuf(struct mcount_thread_data *mtdp,
 		 struct mcount_ret_stack *rstack)
 {
-	ptrdiff_t idx = rstack - mtdp->rstack;
-
-	return mtdp->argbuf + (idx * ARGBUF_SIZE);
+	return rstack->argbuf;
 }
 
 static unsigned save_to_argbuf(void *argbuf, struct list_head *args_spec,
@@ -296,13 +1093,16 @@ void save_argument(struct mcount_thread_data *mtdp,
 		   struct list_head *args_spec,
 		   struct mcount_regs *regs)
 {
-	void *argbuf = get_argbuf(mtdp, rstack);
+	void *argbuf = prepare_argbuf(mtdp, rstack);
 	unsigned size;
 	struct mcount_arg_context ctx = {
 		.regs = regs,
 		.stack_base = rstack->parent_loc,
 	};
 
+	if (argbuf == NULL)
+		return;
+
 	size = save_to_argbuf(argbuf, args_spec, &ctx);
 	if (size == -1U) {
 		pr_log("argument data is too big\n");
@@ -311,6 +1111,9 @@ void save_argument(struct mcount_thread_data *mtdp,
 
 	*(unsigned *)argbuf = size;
 	rstack->flags |= MCOUNT_FL_ARGUMENT;
+
+	/* keep the data until it returns */
+	mtdp->argbuf_top = argbuf + ALIGN(sizeof(size) + size, 8);
 }
 
 void save_retval(struct mcount_thread_data *mtdp,
@@ -323,6 +1126,12 @@ void save_retval(struct mcount_thread_data *mtdp,
 		.retval = retval,
 	};
 
+	/* it should be reserved at entry, do not allocate here */
+	if (argbuf == NULL) {
+		rstack->flags &= ~MCOUNT_FL_RETVAL;
+		return;
+	}
+
 	size = save_to_argbuf(argbuf, args_spec, &ctx);
 	if (size == -1U) {
 		pr_log("retval data is too big\n");
@@ -349,13 +1158,13 @@ static int record_ret_stack(struct mcount_thread_data *mtdp,
 			    enum ftrace_ret_stack_type type,
 			    struct mcount_ret_stack *mrstack)
 {
-	struct ftrace_ret_stack *frstack;
 	uint64_t timestamp = mrstack->start_time;
 	struct mcount_shmem *shmem = &mtdp->shmem;
-	const size_t maxsize = (size_t)shmem_bufsize - sizeof(**shmem->buffer);
-	struct mcount_shmem_buffer *curr_buf = shmem->buffer[shmem->curr];
-	size_t size = sizeof(*frstack);
+	const size_t maxsize = (size_t)shmem_bufsize - sizeof(*shmem->curr);
+	struct mcount_shmem_buffer *curr_buf = shmem->curr;
+	size_t size = FTRACE_COMPACT_MAX;
 	void *argbuf = NULL;
+	unsigned pos;
 
 	if ((type == FTRACE_ENTRY && mrstack->flags & MCOUNT_FL_ARGUMENT) ||
 	    (type == FTRACE_EXIT  && mrstack->flags & MCOUNT_FL_RETVAL)) {
@@ -364,41 +1173,39 @@ static int record_ret_stack(struct mcount_thread_data *mtdp,
 			size += *(unsigned *)argbuf;
 	}
 
-	if (unlikely(shmem->curr == -1 || curr_buf->size + size > maxsize)) {
+	if (unlikely(curr_buf == NULL || curr_buf->size + size > maxsize)) {
 		if (shmem->done)
 			return 0;
-		if (shmem->curr > -1)
-			finish_shmem_buffer(mtdp, shmem->curr);
+		if (curr_buf)
+			finish_shmem_buffer(mtdp);
 		get_new_shmem_buffer(mtdp);
 
-		if (shmem->curr == -1) {
+		if (shmem->curr == NULL) {
 			shmem->losts++;
 			return -1;
 		}
 
-		curr_buf = shmem->buffer[shmem->curr];
+		curr_buf = shmem->curr;
 	}
 
 	if (type == FTRACE_EXIT)
 		timestamp = mrstack->end_time;
 
-	frstack = (void *)(curr_buf->data + curr_buf->size);
-
-	frstack->time   = timestamp;
-	frstack->type   = type;
-	frstack->unused = FTRACE_UNUSED;
-	frstack->more   = !!argbuf;
-	frstack->depth  = mrstack->depth;
-	frstack->addr   = mrstack->child_ip;
-
-	curr_buf->size += sizeof(*frstack);
+	pos = curr_buf->size;
+	pos += encode_ret_stack(shmem, (void *)curr_buf->data + pos,
+				type, !!argbuf, mrstack->depth,
+				mrstack->child_ip, timestamp);
 	mrstack->flags |= MCOUNT_FL_WRITTEN;
 
 	if (argbuf) {
-		unsigned int *ptr = (void *)curr_buf->data + curr_buf->size;
+		/* records are not aligned in the compact format */
+		struct unaligned_word {
+			unsigned int val;
+		} __attribute__((packed)) *ptr;
 		unsigned i;
 
-		size -= sizeof(*frstack);
+		ptr  = (void *)curr_buf->data + pos;
+		size = *(unsigned *)argbuf;
 
 		/*
 		 * Calling memcpy() here (esp. with a large size) can
@@ -406,11 +1213,14 @@ static int record_ret_stack(struct mcount_thread_data *mtdp,
 		 * As the argbuf was aligned to 4-bytes, copy the words.
 		 */
 		for (i = 0; i < size; i += 4, ptr++)
-			*ptr = *(unsigned int *)(argbuf + sizeof(unsigned) + i);
+			ptr->val = *(unsigned int *)(argbuf + sizeof(unsigned) + i);
 
-		curr_buf->size += ALIGN(size, 8);
+		pos += size;
 	}
 
+	/* a snapshot should see the whole record (with arguments) or none */
+	__atomic_store_n(&curr_buf->size, pos, __ATOMIC_RELEASE);
+
 	pr_dbg3("rstack[%d] %s %lx\n", mrstack->depth,
 	       type == FTRACE_ENTRY? "ENTRY" : "EXIT ", mrstack->child_ip);
 	return 0;
@@ -421,8 +1231,6 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 		      long *retval)
 {
 	struct mcount_ret_stack *non_written_mrstack = NULL;
-	struct ftrace_ret_stack *frstack;
-	size_t size = 0;
 	int count = 0;
 
 #define SKIP_FLAGS  (MCOUNT_FL_NORECORD | MCOUNT_FL_DISABLED)
@@ -430,6 +1238,9 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 	if (mrstack < mtdp->rstack)
 		return 0;
 
+	if (mcount_summary_mode)
+		return record_summary(mtdp, mrstack);
+
 	if (!(mrstack->flags & MCOUNT_FL_WRITTEN)) {
 		non_written_mrstack = mrstack;
 
@@ -442,18 +1253,9 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 			if (prev->flags & MCOUNT_FL_WRITTEN)
 				break;
 
-			if (!(prev->flags & SKIP_FLAGS)) {
+			if (!(prev->flags & SKIP_FLAGS))
 				count++;
 
-				if (prev->flags & MCOUNT_FL_ARGUMENT) {
-					unsigned *argbuf_size;
-
-					argbuf_size = get_argbuf(mtdp, prev);
-					if (argbuf_size)
-						size += *argbuf_size;
-				}
-			}
-
 			non_written_mrstack = prev;
 		}
 	}
@@ -461,18 +1263,13 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 	if (mrstack->end_time)
 		count++;  /* for exit */
 
-	size += count * sizeof(*frstack);
-
-	pr_dbg3("task %d recorded %zd bytes (record count = %d)\n",
-		gettid(mtdp), size, count);
+	pr_dbg3("task %d record count = %d\n", gettid(mtdp), count);
 
 	while (non_written_mrstack && non_written_mrstack < mrstack) {
 		if (!(non_written_mrstack->flags & SKIP_FLAGS)) {
 			if (record_ret_stack(mtdp, FTRACE_ENTRY,
-					     non_written_mrstack)) {
-				mtdp->shmem.losts += count - 1;
-				return 0;
-			}
+					     non_written_mrstack))
+				goto lost;
 
 			count--;
 		}
@@ -481,7 +1278,7 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 
 	if (!(mrstack->flags & (MCOUNT_FL_WRITTEN | SKIP_FLAGS))) {
 		if (record_ret_stack(mtdp, FTRACE_ENTRY, non_written_mrstack))
-			return 0;
+			goto lost;
 
 		count--;
 	}
@@ -491,13 +1288,18 @@ int record_trace_data(struct mcount_thread_data *mtdp,
 			save_retval(mtdp, mrstack, retval);
 
 		if (record_ret_stack(mtdp, FTRACE_EXIT, mrstack))
-			return 0;
+			goto lost;
 
 		count--;
 	}
 
 	assert(count == 0);
 	return 0;
+
+lost:
+	/* record_ret_stack() already counted the failed one */
+	mtdp->shmem.losts += count - 1;
+	return 0;
 }
 
 void record_proc_maps(char *dirname, const char *sess_id,
@@ -550,6 +1352,8 @@ void record_proc_maps(char *dirname, const char *sess_id,
 		map->symtab.sym_names = NULL;
 		map->symtab.nr_sym = 0;
 		map->symtab.nr_alloc = 0;
+		map->symtab.name_sorted = false;
+		map->symtab.names = NULL;
 		memcpy(map->libname, path, namelen);
 		map->libname[strlen(path)] = '\0';
 
@@ -0,0 +1,27 @@
+#include <unistd.h>
+
+volatile int count;
+
+void foo(void)
+{
+	count++;
+}
+
+void bar(void)
+{
+	foo();
+}
+
+int main(int argc, char *argv[])
+{
+	foo();
+
+	/* wait until the test changes the filter */
+	if (argc > 1) {
+		while (access(argv[1], F_OK) < 0)
+			usleep(1000);
+	}
+
+	bar();
+	return 0;
+}
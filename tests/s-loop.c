@@ -0,0 +1,28 @@
+#include <stdlib.h>
+
+volatile int count;
+
+void foo(int n)
+{
+	count += n;
+}
+
+void bar(void)
+{
+	foo(-1);
+	count++;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n = 10;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+
+	for (i = 0; i < n; i++)
+		foo(i);
+
+	bar();
+	return 0;
+}
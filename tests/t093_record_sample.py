@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+
+TDIR='xxx'
+
+# It records 1 of every 2 calls of each function and the report should
+# show the (estimated) call count scaled by the sampling rate.  The first
+# call is always recorded, so N recorded calls are (N - 1) * 2 + 1 calls.
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'sort', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+   10.233 ms   26.923 us           1  bar
+    1.850 ms    1.850 ms           5  loop
+    1.120 ms    5.171 us           1  foo
+   11.428 ms   64.612 us           1  main
+   10.204 ms   10.204 ms           1  usleep
+""")
+
+    def pre(self):
+        record_cmd = '%s record --sample=2 -d %s %s' % (TestBase.ftrace, TDIR, 't-sort')
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s report -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and remaining functions.  """
+        result = []
+        for ln in output.split('\n'):
+            if ln.strip() == '':
+                continue
+            line = ln.split()
+            if line[0] == 'Total':
+                continue
+            if line[0].startswith('='):
+                continue
+            # A report line consists of following data
+            # [0]         [1]   [2]        [3]   [4]     [5]
+            # total_time  unit  self_time  unit  called  function
+            if line[5].startswith('__'):
+                continue
+            result.append('%s %s' % (line[4], line[5]))
+
+        return '\n'.join(sorted(result, key=lambda l: l.split()[1]))
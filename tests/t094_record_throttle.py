@@ -0,0 +1,63 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+
+TDIR='xxx'
+
+# loop() and foo() are throttled after 2 calls (shorter than 5ms).
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'sort', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+   10.293 ms   55.428 us           1  bar
+   10.238 ms   10.238 ms           1  usleep
+   10.448 ms  125.802 us           1  main
+   30.013 us   22.121 us           2  foo
+    7.892 us    7.892 us           2  loop
+
+       Calls     Skipped  Throttled function
+  ==========  ==========  ====================================
+           2           4  loop
+           2           0  foo
+""")
+
+    def pre(self):
+        record_cmd = '%s record --throttle=2@5ms -d %s %s' % (TestBase.ftrace, TDIR, 't-sort')
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s report -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and remaining functions.  """
+        result = []
+        for ln in output.split('\n'):
+            if ln.strip() == '':
+                continue
+            line = ln.split()
+            if line[0] in ['Total', 'Calls']:
+                continue
+            if line[0].startswith('='):
+                continue
+            # A report line consists of following data
+            # [0]         [1]   [2]        [3]   [4]     [5]
+            # total_time  unit  self_time  unit  called  function
+            # or throttled function
+            # [0]    [1]      [2]
+            # calls  skipped  function
+            if line[-1].startswith('__'):
+                continue
+            if len(line) == 3:
+                result.append('throttled %s %s %s' % (line[2], line[0], line[1]))
+            else:
+                result.append('%s %s' % (line[5], line[4]))
+
+        return '\n'.join(sorted(result))
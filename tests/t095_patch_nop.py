@@ -0,0 +1,40 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+# functions are compiled with a nop instead of a call to __fentry__,
+# only a() and b() are patched to call it at runtime.  So c() is not
+# traced even if it's called under a().
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# DURATION    TID     FUNCTION
+            [ 1234] | a() {
+            [ 1234] |   b() {
+   2.415 us [ 1234] |     getpid();
+   3.693 us [ 1234] |   } /* b */
+   4.181 us [ 1234] | } /* a */
+""", cflags='-mfentry -mnop-mcount -mrecord-mcount -fno-pie',
+     ldflags='-no-pie')
+
+    def build(self, cflags='', ldflags=''):
+        # -mnop-mcount works only with -pg
+        if cflags.find('-pg') < 0:
+            return TestBase.TEST_SKIP
+        return TestBase.build(self, cflags, ldflags)
+
+    def runcmd(self):
+        return '%s -P a -P b -F a %s' % (TestBase.ftrace, 't-abc')
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and remaining functions.  """
+        result = []
+        for ln in output.split('\n'):
+            # ignore blank lines and comments
+            if ln.strip() == '' or ln.startswith('#'):
+                continue
+            func = ln.split('|', 1)[-1]
+            result.append(func)
+
+        return '\n'.join(result)
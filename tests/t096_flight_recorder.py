@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+
+TDIR='xxx'
+
+# the buffers are small so old data (including the start of main)
+# is overwritten, the last snapshot is saved when the program exits.
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'loop', """
+# DURATION    TID     FUNCTION
+   0.070 us [ 7011] |   foo();
+   0.069 us [ 7011] |   foo();
+            [ 7011] |   bar() {
+   0.068 us [ 7011] |     foo();
+   0.425 us [ 7011] |   } /* bar */
+            [ 7011] | } /* main */
+""")
+
+    def pre(self):
+        record_cmd = '%s record --flight-recorder -b 4096 -d %s %s 5000' % \
+                     (TestBase.ftrace, TDIR, 't-loop')
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s replay -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and compares the last
+            part of the output only.  """
+        result = []
+        for ln in output.split('\n'):
+            # ignore blank lines and comments
+            if ln.strip() == '' or ln.startswith('#'):
+                continue
+            func = ln.split('|', 1)[-1]
+            # it should start in the middle of main()
+            if func == ' main() {':
+                return 'main() was not overwritten'
+            result.append(func)
+
+        return '\n'.join(result[-6:])
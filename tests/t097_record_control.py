@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+import os, time
+
+TDIR='xxx'
+DONE='xxx.done'
+
+# foo() called after 'uftrace control -N foo' should not be recorded
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'control', """
+# DURATION    TID     FUNCTION
+            [ 8301] | main() {
+   0.070 us [ 8301] |   foo();
+            [ 8301] |   /* control #1: filter="!foo" */
+   0.425 us [ 8301] |   bar();
+   2.346 ms [ 8301] | } /* main */
+""")
+
+    def wait_for(self, check):
+        for i in range(500):
+            if check():
+                return True
+            time.sleep(0.01)
+        return False
+
+    def applied(self):
+        try:
+            return 'CTRL' in open(TDIR + '/task.txt').read()
+        except IOError:
+            return False
+
+    def pre(self):
+        sp.call(['rm', '-rf', TDIR, DONE])
+
+        record_cmd = '%s record --control -d %s %s %s' % \
+                     (TestBase.ftrace, TDIR, 't-control', DONE)
+        p = sp.Popen(record_cmd.split())
+
+        if not self.wait_for(lambda: os.path.exists(TDIR + '/control')):
+            p.kill()
+            return TestBase.TEST_NONZERO_RETURN
+
+        control_cmd = '%s control -d %s -N foo' % (TestBase.ftrace, TDIR)
+        sp.call(control_cmd.split())
+
+        # libmcount saves it after the new filter is applied
+        self.wait_for(self.applied)
+
+        open(DONE, 'w').close()
+        p.wait()
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s replay -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR, DONE])
+        return ret
@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+import json
+
+TDIR='xxx'
+
+# events are grouped by task in the order of tasks
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'fork', """
+{"traceEvents":[
+{"ts":5839617412,"ph":"B","pid":26125,"name":"__cxa_atexit"},
+{"ts":5839617415,"ph":"E","pid":26125,"name":"__cxa_atexit"},
+{"ts":5839617418,"ph":"B","pid":26125,"name":"main"},
+{"ts":5839617419,"ph":"B","pid":26125,"name":"fork"},
+{"ts":5839617422,"ph":"E","pid":26125,"name":"fork"},
+{"ts":5839617425,"ph":"B","pid":26125,"name":"wait"},
+{"ts":5839617428,"ph":"E","pid":26125,"name":"wait"},
+{"ts":5839617431,"ph":"B","pid":26125,"name":"a"},
+{"ts":5839617434,"ph":"B","pid":26125,"name":"b"},
+{"ts":5839617437,"ph":"B","pid":26125,"name":"c"},
+{"ts":5839617440,"ph":"B","pid":26125,"name":"getpid"},
+{"ts":5839617443,"ph":"E","pid":26125,"name":"getpid"},
+{"ts":5839617446,"ph":"E","pid":26125,"name":"c"},
+{"ts":5839617449,"ph":"E","pid":26125,"name":"b"},
+{"ts":5839617452,"ph":"E","pid":26125,"name":"a"},
+{"ts":5839617455,"ph":"E","pid":26125,"name":"main"},
+{"ts":5839617737,"ph":"E","pid":26126,"name":"fork"},
+{"ts":5839617740,"ph":"B","pid":26126,"name":"a"},
+{"ts":5839617743,"ph":"B","pid":26126,"name":"b"},
+{"ts":5839617746,"ph":"B","pid":26126,"name":"c"},
+{"ts":5839617749,"ph":"B","pid":26126,"name":"getpid"},
+{"ts":5839617752,"ph":"E","pid":26126,"name":"getpid"},
+{"ts":5839617755,"ph":"E","pid":26126,"name":"c"},
+{"ts":5839617758,"ph":"E","pid":26126,"name":"b"},
+{"ts":5839617761,"ph":"E","pid":26126,"name":"a"},
+{"ts":5839617764,"ph":"E","pid":26126,"name":"main"}
+], "metadata": {
+"command_line":"uftrace record -d xxx t-fork ",
+"recorded_time":"Fri Oct 16 22:40:12 2026"
+} }
+""")
+
+    def pre(self):
+        record_cmd = '%s record -d %s %s' % (TestBase.ftrace, TDIR, 't-fork')
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s dump --chrome -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared.
+            It parses the JSON and replaces pids with the order of tasks.  """
+        result = []
+        pids = []
+        try:
+            events = json.loads(output)['traceEvents']
+        except ValueError:
+            return ''  # this leads to failure with 'NG'
+
+        for ev in events:
+            if ev['pid'] not in pids:
+                pids.append(ev['pid'])
+            result.append('%d %s %s' % (pids.index(ev['pid']), ev['ph'], ev['name']))
+
+        return '\n'.join(result)
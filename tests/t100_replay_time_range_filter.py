@@ -0,0 +1,59 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+
+TDIR='xxx'
+
+# it starts in the middle of bar() and the filter state should be
+# rebuilt from the restored function stack to show the rest of bar().
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'loop', """
+# DURATION    TID     FUNCTION
+   0.068 us [ 7011] |   foo();
+   0.425 us [ 7011] | } /* bar */
+""")
+        self.start = ''
+
+    def pre(self):
+        # small buffers to have many sync points in the data
+        record_cmd = '%s record -b 4096 -d %s %s 10000' % \
+                     (TestBase.ftrace, TDIR, 't-loop')
+        sp.call(record_cmd.split())
+
+        dump_cmd = '%s dump -d %s' % (TestBase.ftrace, TDIR)
+        p = sp.Popen(dump_cmd.split(), stdout=sp.PIPE)
+        in_bar = False
+        for ln in p.communicate()[0].decode().split('\n'):
+            if '[entry] bar(' in ln:
+                in_bar = True
+            elif in_bar and '[entry] foo(' in ln:
+                self.start = ln.split()[0]
+                break
+
+        if self.start == '':
+            return TestBase.TEST_NONZERO_RETURN
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s replay -d %s -F bar --time-range=%s~' % \
+            (TestBase.ftrace, TDIR, self.start)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and remaining functions.  """
+        result = []
+        for ln in output.split('\n'):
+            if ln.startswith('#'):
+                continue
+            # ignore result of remaining functions which follows a blank line
+            if ln.strip() == '':
+                break
+            result.append(ln.split('|', 1)[-1])
+
+        return '\n'.join(result)
@@ -0,0 +1,39 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+# same as t095 but functions start with endbr64 (CET), so the fentry
+# call site is not at the function address.
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# DURATION    TID     FUNCTION
+            [ 1234] | a() {
+            [ 1234] |   b() {
+   2.415 us [ 1234] |     getpid();
+   3.693 us [ 1234] |   } /* b */
+   4.181 us [ 1234] | } /* a */
+""", cflags='-mfentry -mnop-mcount -mrecord-mcount -fcf-protection=full -fno-pie',
+     ldflags='-no-pie')
+
+    def build(self, cflags='', ldflags=''):
+        # -mnop-mcount works only with -pg
+        if cflags.find('-pg') < 0:
+            return TestBase.TEST_SKIP
+        return TestBase.build(self, cflags, ldflags)
+
+    def runcmd(self):
+        return '%s -P a -P b -F a %s' % (TestBase.ftrace, 't-abc')
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared .
+            It ignores blank and comment (#) lines and remaining functions.  """
+        result = []
+        for ln in output.split('\n'):
+            # ignore blank lines and comments
+            if ln.strip() == '' or ln.startswith('#'):
+                continue
+            func = ln.split('|', 1)[-1]
+            result.append(func)
+
+        return '\n'.join(result)
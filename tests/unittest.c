@@ -151,6 +151,16 @@ int __attribute__((weak)) arch_fill_cpuinfo_model(int fd)
 	return 0;
 }
 
+bool __attribute__((weak)) arch_has_invariant_tsc(void)
+{
+	return false;
+}
+
+uint64_t __attribute__((weak)) arch_read_tsc(void)
+{
+	return 0;
+}
+
 #undef main
 int main(int argc, char *argv[])
 {
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <argp.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +33,7 @@
 #include "uftrace.h"
 #include "version.h"
 #include "libmcount/mcount.h"
+#include "mcount-arch.h"
 #include "libtraceevent/kbuffer.h"
 #include "utils/utils.h"
 #include "utils/symbol.h"
@@ -81,6 +83,20 @@ enum options {
 	OPT_kernel_skip_out,
 	OPT_kernel_full,
 	OPT_kernel_only,
+	OPT_clock,
+	OPT_summary,
+	OPT_sample,
+	OPT_sample_window,
+	OPT_throttle,
+	OPT_patch,
+	OPT_flight_recorder,
+	OPT_buffer_policy,
+	OPT_zero_copy,
+	OPT_compress,
+	OPT_control,
+	OPT_enable,
+	OPT_time_range,
+	OPT_buffer_count,
 };
 
 static struct argp_option ftrace_options[] = {
@@ -135,6 +151,20 @@ static struct argp_option ftrace_options[] = {
 	{ "kernel-skip-out", OPT_kernel_skip_out, 0, 0, "Skip kernel functions outside of user (deprecated)" },
 	{ "kernel-full", OPT_kernel_full, 0, 0, "Show kernel functions outside of user" },
 	{ "kernel-only", OPT_kernel_only, 0, 0, "Dump kernel data only" },
+	{ "clock", OPT_clock, "CLOCK", 0, "Clock source for timestamps: mono, tsc" },
+	{ "summary", OPT_summary, 0, 0, "Record function statistics only" },
+	{ "sample", OPT_sample, "N", 0, "Trace 1 of every N calls of each function" },
+	{ "sample-window", OPT_sample_window, "ON/PERIOD", 0, "Trace only for ON time in every PERIOD" },
+	{ "throttle", OPT_throttle, "CALLS[@TIME]", 0, "Stop tracing functions after CALLS calls shorter than TIME (default: 1us)" },
+	{ "patch", 'P', "FUNC", 0, "Patch FUNC compiled with -mnop-mcount dynamically" },
+	{ "flight-recorder", OPT_flight_recorder, 0, 0, "Keep recent data in memory and save it by snapshots" },
+	{ "zero-copy", OPT_zero_copy, 0, 0, "Write trace data using splice or MSG_ZEROCOPY if possible" },
+	{ "compress", OPT_compress, "LEVEL", OPTION_ARG_OPTIONAL, "Compress trace data with LEVEL 1 (fastest) to 9 (default: 1)" },
+	{ "control", OPT_control, 0, 0, "Allow changing filters at runtime by 'uftrace control'" },
+	{ "enable", OPT_enable, 0, 0, "Enable tracing (for 'uftrace control')" },
+	{ "time-range", OPT_time_range, "START~END", 0, "Show output only within the time range (timestamps as in dump)" },
+	{ "buffer-policy", OPT_buffer_policy, "POLICY[@TIME]", 0, "What to do when buffers are full: drop, block, degrade (default: drop)" },
+	{ "buffer-count", OPT_buffer_count, "COUNT", 0, "Number of buffers per thread (default: 8)" },
 	{ 0 }
 };
 
@@ -303,6 +333,115 @@ static uint64_t parse_time(char *arg)
 	return val;
 }
 
+static int parse_sample_window(char *arg, struct opts *opts)
+{
+	char *str = xstrdup(arg);
+	char *pos = strchr(str, '/');
+	int ret = -1;
+
+	if (pos == NULL)
+		goto out;
+
+	*pos++ = '\0';
+	opts->sample_on = parse_time(str);
+	opts->sample_period = parse_time(pos);
+
+	if (opts->sample_on == 0 || opts->sample_on >= opts->sample_period) {
+		opts->sample_on = opts->sample_period = 0;
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(str);
+	return ret;
+}
+
+static void parse_throttle(char *arg, struct opts *opts)
+{
+	char *pos;
+
+	opts->throttle_calls = strtoul(arg, &pos, 0);
+	opts->throttle_time = 1000;  /* 1us */
+
+	if (*pos == '@')
+		opts->throttle_time = parse_time(pos + 1);
+
+	if (opts->throttle_calls == 0 || opts->throttle_time == 0) {
+		pr_use("invalid throttle: %s (ignoring..)\n", arg);
+		opts->throttle_calls = 0;
+	}
+}
+
+static void parse_buffer_policy(char *arg, struct opts *opts)
+{
+	char *str = xstrdup(arg);
+	char *pos = strchr(str, '@');
+	uint64_t wait = 0;
+
+	if (pos) {
+		*pos++ = '\0';
+		wait = parse_time(pos);
+	}
+
+	if (strcmp(str, "drop") && strcmp(str, "block") &&
+	    strcmp(str, "degrade")) {
+		pr_use("invalid buffer policy: %s (ignoring..)\n", arg);
+		free(str);
+		return;
+	}
+
+	if (pos && (!strcmp(str, "drop") || wait == 0)) {
+		pr_use("invalid buffer wait time: %s (ignoring..)\n", arg);
+		wait = 0;
+	}
+
+	free(opts->buffer_policy);
+	opts->buffer_policy = str;
+	opts->buffer_wait = wait;
+}
+
+/* timestamp in "SEC.NSEC" format (as dump shows) or in nsec */
+static uint64_t parse_timestamp(char *arg)
+{
+	char *pos;
+	uint64_t sec, nsec = 0;
+	int digits = 0;
+
+	sec = strtoull(arg, &pos, 10);
+	if (*pos != '.')
+		return parse_time(arg);
+
+	for (pos++; isdigit(*pos) && digits < 9; pos++, digits++)
+		nsec = nsec * 10 + *pos - '0';
+	for (; digits < 9; digits++)
+		nsec *= 10;
+
+	return sec * NSEC_PER_SEC + nsec;
+}
+
+static void parse_time_range(char *arg, struct opts *opts)
+{
+	char *str = xstrdup(arg);
+	char *pos = strchr(str, '~');
+
+	if (pos == NULL) {
+		pr_use("invalid time range: %s (ignoring..)\n", arg);
+		free(str);
+		return;
+	}
+
+	*pos++ = '\0';
+	opts->range.start = *str ? parse_timestamp(str) : 0;
+	opts->range.stop  = *pos ? parse_timestamp(pos) : 0;
+
+	if (opts->range.stop && opts->range.start > opts->range.stop) {
+		pr_use("invalid time range: %s (ignoring..)\n", arg);
+		memset(&opts->range, 0, sizeof(opts->range));
+	}
+	free(str);
+}
+
 static error_t parse_option(int key, char *arg, struct argp_state *state)
 {
 	struct opts *opts = state->input;
@@ -324,6 +463,10 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 		opts->trigger = opt_add_string(opts->trigger, arg);
 		break;
 
+	case 'P':
+		opts->patch = opt_add_string(opts->patch, arg);
+		break;
+
 	case 'D':
 		opts->depth = strtol(arg, NULL, 0);
 		if (opts->depth <= 0) {
@@ -565,6 +708,78 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 		opts->kernel_only = true;
 		break;
 
+	case OPT_clock:
+		if (strcmp(arg, "mono") && strcmp(arg, "tsc")) {
+			pr_use("unknown clock source: %s (ignoring..)\n", arg);
+			break;
+		}
+#ifndef ARCH_SUPPORT_TSC
+		if (!strcmp(arg, "tsc")) {
+			pr_use("TSC clock is not supported on this arch (ignoring..)\n");
+			break;
+		}
+#endif
+		opts->clock = arg;
+		break;
+
+	case OPT_summary:
+		opts->summary = true;
+		break;
+
+	case OPT_sample:
+		opts->sample_count = strtoul(arg, NULL, 0);
+		break;
+
+	case OPT_sample_window:
+		if (parse_sample_window(arg, opts) < 0)
+			pr_use("invalid sample window: %s (ignoring..)\n", arg);
+		break;
+
+	case OPT_throttle:
+		parse_throttle(arg, opts);
+		break;
+
+	case OPT_flight_recorder:
+		opts->flight_recorder = true;
+		break;
+
+	case OPT_buffer_policy:
+		parse_buffer_policy(arg, opts);
+		break;
+
+	case OPT_buffer_count:
+		opts->buffer_count = strtol(arg, NULL, 0);
+		if (opts->buffer_count < 2 || opts->buffer_count > SHMEM_RING_MAX) {
+			pr_use("invalid buffer count: %s (ignoring..)\n", arg);
+			opts->buffer_count = SHMEM_RING_SLOTS;
+		}
+		break;
+
+	case OPT_zero_copy:
+		opts->zero_copy = true;
+		break;
+
+	case OPT_compress:
+		opts->compress = arg ? strtol(arg, NULL, 0) : 1;
+		if (opts->compress < 1 || opts->compress > 9) {
+			pr_use("invalid compression level: %s (ignoring..)\n",
+			       arg);
+			opts->compress = 0;
+		}
+		break;
+
+	case OPT_control:
+		opts->control = true;
+		break;
+
+	case OPT_enable:
+		opts->enable = true;
+		break;
+
+	case OPT_time_range:
+		parse_time_range(arg, opts);
+		break;
+
 	case ARGP_KEY_ARG:
 		if (state->arg_num) {
 			/*
@@ -590,6 +805,8 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 			opts->mode = UFTRACE_MODE_DUMP;
 		else if (!strcmp("graph", arg))
 			opts->mode = UFTRACE_MODE_GRAPH;
+		else if (!strcmp("control", arg))
+			opts->mode = UFTRACE_MODE_CONTROL;
 		else
 			return ARGP_ERR_UNKNOWN; /* almost same as fall through */
 		break;
@@ -637,6 +854,7 @@ int main(int argc, char *argv[])
 		.dirname	= UFTRACE_DIR_NAME,
 		.libcall	= true,
 		.bufsize	= SHMEM_BUFFER_SIZE,
+		.buffer_count	= SHMEM_RING_SLOTS,
 		.depth		= MCOUNT_DEFAULT_DEPTH,
 		.max_stack	= MCOUNT_RSTACK_MAX,
 		.port		= UFTRACE_RECV_PORT,
@@ -649,7 +867,7 @@ int main(int argc, char *argv[])
 	struct argp argp = {
 		.options = ftrace_options,
 		.parser = parse_option,
-		.args_doc = "[record|replay|live|report|info|dump|recv|graph] [<program>]",
+		.args_doc = "[record|replay|live|report|info|dump|recv|graph|control] [<program>]",
 		.doc = "uftrace -- function (graph) tracer for userspace",
 	};
 
@@ -715,6 +933,9 @@ int main(int argc, char *argv[])
 	case UFTRACE_MODE_GRAPH:
 		command_graph(argc, argv, &opts);
 		break;
+	case UFTRACE_MODE_CONTROL:
+		command_control(argc, argv, &opts);
+		break;
 	case UFTRACE_MODE_INVALID:
 		break;
 	}
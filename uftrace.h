@@ -14,7 +14,7 @@
 
 #define UFTRACE_MAGIC_LEN  8
 #define UFTRACE_MAGIC_STR  "Ftrace!"
-#define UFTRACE_FILE_VERSION  4
+#define UFTRACE_FILE_VERSION  6
 #define UFTRACE_FILE_VERSION_MIN  3
 #define UFTRACE_DIR_NAME     "uftrace.data"
 #define UFTRACE_DIR_OLD_NAME  "ftrace.dir"
@@ -45,6 +45,8 @@ enum ftrace_feat_bits {
 	RETVAL_BIT,
 	SYM_REL_ADDR_BIT,
 	MAX_STACK_BIT,
+	SUMMARY_BIT,
+	COMPRESSED_BIT,
 
 	/* bit mask */
 	PLTHOOK			= (1U << PLTHOOK_BIT),
@@ -54,6 +56,10 @@ enum ftrace_feat_bits {
 	RETVAL			= (1U << RETVAL_BIT),
 	SYM_REL_ADDR		= (1U << SYM_REL_ADDR_BIT),
 	MAX_STACK		= (1U << MAX_STACK_BIT),
+	SUMMARY			= (1U << SUMMARY_BIT),
+	COMPRESSED		= (1U << COMPRESSED_BIT),
+
+	FEAT_MASK_ALL		= (COMPRESSED << 1) - 1,
 };
 
 enum ftrace_info_bits {
@@ -68,6 +74,34 @@ enum ftrace_info_bits {
 	USAGEINFO,
 	LOADINFO,
 	ARG_SPEC,
+	CLOCK_INFO,
+	SAMPLE_INFO,
+	LOST_INFO,
+};
+
+/* calibration data to convert TSC values into CLOCK_MONOTONIC (nsec) */
+struct ftrace_tsc_clock {
+	uint64_t freq;		/* TSC ticks per second */
+	uint64_t mono_base;	/* CLOCK_MONOTONIC at the anchor */
+	uint64_t tsc_base;	/* TSC value at the anchor */
+	uint64_t mono_last;	/* CLOCK_MONOTONIC at the last calibration */
+	uint64_t tsc_last;	/* TSC value at the last calibration */
+};
+
+/* number of lost records for a task or a time window */
+struct ftrace_lost_entry {
+	int id;			/* tid or index of the time window */
+	unsigned long count;
+};
+
+struct ftrace_lost_info {
+	unsigned long total;
+	char *policy;		/* buffer policy used for recording */
+	uint64_t window;	/* length of the time window (nsec) */
+	int nr_task;
+	int nr_window;
+	struct ftrace_lost_entry *tasks;
+	struct ftrace_lost_entry *windows;
 };
 
 struct ftrace_info {
@@ -97,10 +131,21 @@ struct ftrace_info {
 	float load1;
 	float load5;
 	float load15;
+	struct ftrace_tsc_clock tsc;
+	unsigned sample_count;
+	uint64_t sample_on;
+	uint64_t sample_period;
+	struct ftrace_lost_info lost;
 };
 
 struct ftrace_kernel;
 
+/* timestamps (in nsec) to limit records to read, 0 means no limit */
+struct ftrace_time_range {
+	uint64_t start;
+	uint64_t stop;
+};
+
 struct ftrace_file_handle {
 	FILE *fp;
 	int sock;
@@ -110,7 +155,11 @@ struct ftrace_file_handle {
 	struct ftrace_kernel *kern;
 	struct ftrace_task_handle *tasks;
 	int nr_tasks;
+	int *task_heap;
+	int nr_task_heap;
 	int depth;
+	struct ftrace_time_range time_range;
+	bool time_range_skipped;
 };
 
 #define UFTRACE_MODE_INVALID 0
@@ -122,6 +171,7 @@ struct ftrace_file_handle {
 #define UFTRACE_MODE_RECV    6
 #define UFTRACE_MODE_DUMP    7
 #define UFTRACE_MODE_GRAPH   8
+#define UFTRACE_MODE_CONTROL 9
 
 #define UFTRACE_MODE_DEFAULT  UFTRACE_MODE_LIVE
 
@@ -138,6 +188,8 @@ struct opts {
 	char *args;
 	char *retval;
 	char *diff;
+	char *clock;
+	char *patch;
 	int mode;
 	int idx;
 	int depth;
@@ -152,6 +204,16 @@ struct opts {
 	unsigned long bufsize;
 	unsigned long kernel_bufsize;
 	uint64_t threshold;
+	uint64_t sample_on;
+	uint64_t sample_period;
+	unsigned sample_count;
+	int compress;
+	unsigned long throttle_calls;
+	uint64_t throttle_time;
+	char *buffer_policy;
+	uint64_t buffer_wait;
+	int buffer_count;
+	struct ftrace_time_range range;
 	bool flat;
 	bool libcall;
 	bool print_symtab;
@@ -175,6 +237,11 @@ struct opts {
 	bool kernel;
 	bool kernel_skip_out;
 	bool kernel_only;
+	bool summary;
+	bool flight_recorder;
+	bool zero_copy;
+	bool control;
+	bool enable;
 };
 
 int command_record(int argc, char *argv[], struct opts *opts);
@@ -185,6 +252,7 @@ int command_info(int argc, char *argv[], struct opts *opts);
 int command_recv(int argc, char *argv[], struct opts *opts);
 int command_dump(int argc, char *argv[], struct opts *opts);
 int command_graph(int argc, char *argv[], struct opts *opts);
+int command_control(int argc, char *argv[], struct opts *opts);
 
 extern volatile bool ftrace_done;
 extern struct ftrace_proc_maps *proc_maps;
@@ -192,7 +260,28 @@ extern struct ftrace_proc_maps *proc_maps;
 int open_data_file(struct opts *opts, struct ftrace_file_handle *handle);
 void close_data_file(struct opts *opts, struct ftrace_file_handle *handle);
 int read_task_file(char *dirname, bool needs_session, bool sym_rel_addr);
-int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr);
+int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr,
+		       struct ftrace_tsc_clock *tsc);
+
+struct ftrace_filter;
+
+/* cached lookup results of an address in a session */
+struct ftrace_sess_addr {
+	unsigned long		 addr;
+	struct sym		*sym;
+	struct ftrace_filter	*filter;
+	struct ftrace_filter	*fixup;
+	bool			 valid;
+};
+
+/* settings changed by 'uftrace control' during the session */
+struct ftrace_ctrl_event {
+	struct ftrace_ctrl_event *next;
+	uint64_t		 time;
+	int			 tid;
+	unsigned		 gen;
+	char			 settings[];
+};
 
 struct ftrace_session {
 	struct rb_node		 node;
@@ -202,6 +291,11 @@ struct ftrace_session {
 	struct symtabs		 symtabs;
 	struct rb_root		 filters;
 	struct rb_root		 fixups;
+	struct ftrace_sess_addr	*addr_cache;
+	unsigned		 nr_addr_cache;
+	unsigned		 addr_cache_size;
+	struct ftrace_ctrl_event *ctrls;
+	struct ftrace_ctrl_event *ctrl_next;  /* not shown yet */
 	int 			 namelen;
 	char 			 exename[];
 };
@@ -236,6 +330,10 @@ struct ftrace_task {
 #define FTRACE_MSG_SEND_SYM      13U
 #define FTRACE_MSG_SEND_INFO     14U
 #define FTRACE_MSG_SEND_END      15U
+#define FTRACE_MSG_REC_POOL      16U
+#define FTRACE_MSG_REC_RING      17U
+#define FTRACE_MSG_SNAPSHOT      18U
+#define FTRACE_MSG_CONTROL       19U
 
 /* msg format for communicating by pipe */
 struct ftrace_msg {
@@ -251,6 +349,13 @@ struct ftrace_msg_task {
 	int32_t  tid;
 };
 
+/* records of the task were lost since the buffer was full */
+struct ftrace_msg_lost {
+	struct ftrace_msg_task task;
+	int32_t  count;
+	int32_t  unused;
+};
+
 struct ftrace_msg_sess {
 	struct ftrace_msg_task task;
 	char sid[16];
@@ -259,12 +364,33 @@ struct ftrace_msg_sess {
 	char exename[];
 };
 
+/* new settings from 'uftrace control' were applied to the process */
+struct ftrace_msg_ctrl {
+	struct ftrace_msg_task task;
+	uint32_t gen;
+	uint32_t len;
+	char     settings[];
+};
+
+/* a ring in the shmem pool of the session is used by the task */
+struct ftrace_msg_ring {
+	char     sid[16];
+	int32_t  tid;
+	uint32_t idx;
+};
+
 extern struct ftrace_session *first_session;
 
 void create_session(struct ftrace_msg_sess *msg, char *dirname, char *exename,
 		    bool sym_rel_addr);
 struct ftrace_session *find_session(int pid, uint64_t timestamp);
 struct ftrace_session *find_task_session(int pid, uint64_t timestamp);
+struct ftrace_session *find_task_session_range(int pid, uint64_t timestamp,
+					       uint64_t *start, uint64_t *end);
+struct ftrace_sess_addr *find_session_addr(struct ftrace_session *sess,
+					   unsigned long addr);
+struct sym *find_session_sym(struct ftrace_session *sess, unsigned long addr);
+void add_session_control(struct ftrace_msg_ctrl *cmsg);
 void create_task(struct ftrace_msg_task *msg, bool fork, bool needs_session);
 struct ftrace_task *find_task(int tid);
 void read_session_map(char *dirname, struct symtabs *symtabs, char *sid);
@@ -275,8 +401,11 @@ typedef int (*walk_tasks_cb_t)(struct ftrace_task *task, void *arg);
 void walk_tasks(walk_tasks_cb_t callback, void *arg);
 
 int setup_client_socket(struct opts *opts);
+void setup_client_zerocopy(int sock, void (*notify)(void));
+void finish_client_zerocopy(int sock);
+bool zerocopy_completed(uint64_t seq);
 void send_trace_header(int sock, char *name);
-void send_trace_data(int sock, int tid, void *data, size_t len);
+uint64_t send_trace_data(int sock, int tid, void *data, size_t len);
 void send_trace_task(int sock, struct ftrace_msg *hmsg,
 		     struct ftrace_msg_task *tmsg);
 void send_trace_session(int sock, struct ftrace_msg *hmsg,
@@ -292,6 +421,7 @@ void write_task_info(const char *dirname, struct ftrace_msg_task *tmsg);
 void write_fork_info(const char *dirname, struct ftrace_msg_task *tmsg);
 void write_session_info(const char *dirname, struct ftrace_msg_sess *smsg,
 			const char *exename);
+void write_control_info(const char *dirname, struct ftrace_msg_ctrl *cmsg);
 
 enum ftrace_ret_stack_type {
 	FTRACE_ENTRY,
@@ -319,6 +449,123 @@ static inline bool is_v3_compat(struct ftrace_ret_stack *stack)
 	return stack->unused == FTRACE_UNUSED && stack->more == 0;
 }
 
+/*
+ * Compact record format (file version 5)
+ *
+ * Each record is a header byte followed by three varints: a (zigzag)
+ * time delta from the previous record, the depth and the address.
+ * The address is either an index of the function defined earlier in
+ * the same buffer, or a full address (optionally defining a new index).
+ * A buffer starts with FTRACE_COMPACT_SYNC which resets the timestamp
+ * and the function index so that each buffer can be decoded alone.
+ *
+ *   header: type (2 bits) | more (1 bit) | addr mode (2 bits) | 0 (3 bits)
+ */
+#define UFTRACE_COMPACT_VERSION  5
+
+/* <tid>.dat files consist of compressed frames, see utils/compress.h */
+#define UFTRACE_COMPRESS_VERSION  6
+
+#define FTRACE_COMPACT_SYNC      0xa3
+#define FTRACE_COMPACT_MAX       24  /* max size of a compact record */
+
+#define FTRACE_COMPACT_TYPE_MASK     0x03
+#define FTRACE_COMPACT_MORE          0x04
+#define FTRACE_COMPACT_ADDR_SHIFT    3
+#define FTRACE_COMPACT_ADDR_MASK     0x18
+#define FTRACE_COMPACT_RESERVED      0xe0
+
+enum ftrace_compact_addr {
+	FTRACE_ADDR_INDEX,
+	FTRACE_ADDR_DEFINE,
+	FTRACE_ADDR_LITERAL,
+};
+
+static inline unsigned put_varint(void *buf, uint64_t val)
+{
+	uint8_t *p = buf;
+	unsigned n = 0;
+
+	while (val >= 0x80) {
+		p[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	p[n++] = val;
+
+	return n;
+}
+
+static inline uint64_t zigzag_encode(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t val)
+{
+	return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+/*
+ * Summary file (<tid>-<sid>.sum) written by libmcount in summary mode.
+ * It has a header followed by @nr_func entries.  Times are in the same
+ * unit of the record timestamps (nsec or TSC ticks).
+ */
+#define UFTRACE_SUMMARY_MAGIC    "Ftrace!S"
+#define UFTRACE_SUMMARY_VERSION  1
+
+struct ftrace_summary_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	tid;
+	uint32_t	nr_func;
+	uint32_t	lost;  /* calls not counted due to a full table */
+	uint64_t	time;  /* time of writing (in nsec) to find a session */
+};
+
+struct ftrace_summary_entry {
+	uint64_t	addr;
+	uint64_t	nr_called;
+	uint64_t	time_total;
+	uint64_t	time_self;
+	uint64_t	time_recursive;
+	uint64_t	total_min;
+	uint64_t	total_max;
+	uint64_t	self_min;
+	uint64_t	self_max;
+};
+
+/*
+ * Index file (<tid>.idx) written at the end of recording.  It has a
+ * header, @nr_entry checkpoints sorted by time and @nr_frame frames of
+ * functions not returned yet at each checkpoint.  Reading can start
+ * from the @offset of the data file with the func_stack restored from
+ * the frames.  A frame with zero @addr is unknown due to lost records.
+ */
+#define UFTRACE_INDEX_MAGIC     "Ftrace!I"
+#define UFTRACE_INDEX_VERSION   1
+#define UFTRACE_INDEX_INTERVAL  4096  /* records between checkpoints */
+
+struct ftrace_index_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	tid;
+	uint32_t	nr_entry;
+	uint32_t	nr_frame;
+};
+
+struct ftrace_index_entry {
+	uint64_t	time;    /* timestamp of the first record */
+	uint64_t	offset;  /* file offset of the first record */
+	uint32_t	depth;   /* number of frames */
+	uint32_t	frame;   /* index of the first frame */
+};
+
+struct ftrace_index_frame {
+	uint64_t	addr;
+	uint64_t	time;        /* entry timestamp */
+	uint64_t	child_time;
+};
+
 enum ftrace_ext_type {
 	FTRACE_ARGUMENT		= 1,
 };
@@ -333,6 +580,7 @@ struct ftrace_kernel {
 	unsigned long bufsize;
 	int *traces;
 	int *fds;
+	int *pipes;
 	int64_t *offsets;
 	int64_t *sizes;
 	void **mmaps;
@@ -342,6 +590,13 @@ struct ftrace_kernel {
 	bool *rstack_valid;
 	bool *rstack_done;
 	int *missed_events;
+	int *heap;
+	int nr_heap;
+	/* records of a single task, see split_kernel_data() */
+	struct mcount_ret_stack *records;
+	int *records_missed;
+	int nr_records;
+	int records_idx;
 	char *output_dir;
 	struct list_head filters;
 	struct list_head notrace;
@@ -360,15 +615,25 @@ int setup_kernel_data(struct ftrace_kernel *kernel);
 int read_kernel_stack(struct ftrace_kernel *kernel, struct mcount_ret_stack *rstack);
 int read_kernel_cpu_data(struct ftrace_kernel *kernel, int cpu);
 int finish_kernel_data(struct ftrace_kernel *kernel);
+struct ftrace_kernel *split_kernel_data(struct ftrace_kernel *kernel,
+					int nr_tid, int *tids);
+void finish_split_kernel_data(struct ftrace_kernel *kernels, int nr_tid);
 
 struct rusage;
 
 void fill_ftrace_info(uint64_t *info_mask, int fd, struct opts *opts, int status,
-		      struct rusage *rusage);
+		      struct rusage *rusage, struct ftrace_tsc_clock *tsc,
+		      struct ftrace_lost_info *lost);
 int read_ftrace_info(uint64_t info_mask, struct ftrace_file_handle *handle);
 void clear_ftrace_info(struct ftrace_info *info);
 
 int arch_fill_cpuinfo_model(int fd);
 int arch_register_index(char *reg_name);
+bool arch_has_invariant_tsc(void);
+uint64_t arch_read_tsc(void);
+
+int setup_tsc_clock(struct ftrace_tsc_clock *tsc);
+void update_tsc_clock(struct ftrace_tsc_clock *tsc);
+uint64_t tsc_to_nsec(struct ftrace_tsc_clock *tsc, uint64_t tsc_val);
 
 #endif /* __UFTRACE_H__ */
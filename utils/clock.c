@@ -0,0 +1,131 @@
+/*
+ * TSC clock calibration routines for uftrace
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uftrace.h"
+#include "utils/utils.h"
+
+/* time to wait for the initial calibration */
+#define TSC_CALIBRATE_USEC  10000
+
+static uint64_t get_mono_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* read a pair of (monotonic, TSC) timestamps as close as possible */
+static void read_clock_pair(uint64_t *mono, uint64_t *tsc)
+{
+	uint64_t tsc1, tsc2;
+
+	tsc1  = arch_read_tsc();
+	*mono = get_mono_nsec();
+	tsc2  = arch_read_tsc();
+
+	*tsc = tsc1 + (tsc2 - tsc1) / 2;
+}
+
+static void calc_tsc_freq(struct ftrace_tsc_clock *tsc)
+{
+	double ticks = tsc->tsc_last - tsc->tsc_base;
+	double nsec  = tsc->mono_last - tsc->mono_base;
+
+	if (nsec > 0)
+		tsc->freq = ticks * NSEC_PER_SEC / nsec;
+}
+
+/**
+ * setup_tsc_clock - take an anchor and do initial TSC calibration
+ * @tsc: clock data to be filled
+ *
+ * This function returns 0 if the TSC can be used as a trace clock,
+ * or -1 if it's not available (or not invariant) in this system.
+ */
+int setup_tsc_clock(struct ftrace_tsc_clock *tsc)
+{
+	if (!arch_has_invariant_tsc())
+		return -1;
+
+	read_clock_pair(&tsc->mono_base, &tsc->tsc_base);
+	usleep(TSC_CALIBRATE_USEC);
+	read_clock_pair(&tsc->mono_last, &tsc->tsc_last);
+
+	calc_tsc_freq(tsc);
+	if (tsc->freq == 0)
+		return -1;
+
+	pr_dbg("TSC frequency: %"PRIu64" Hz\n", tsc->freq);
+	return 0;
+}
+
+/**
+ * update_tsc_clock - recalibrate TSC frequency using a new anchor
+ * @tsc: clock data set up by setup_tsc_clock()
+ *
+ * It uses the whole recording time to get a more accurate frequency.
+ */
+void update_tsc_clock(struct ftrace_tsc_clock *tsc)
+{
+	read_clock_pair(&tsc->mono_last, &tsc->tsc_last);
+	calc_tsc_freq(tsc);
+
+	pr_dbg("TSC frequency: %"PRIu64" Hz\n", tsc->freq);
+}
+
+/**
+ * tsc_to_nsec - convert a TSC value to CLOCK_MONOTONIC in nsec
+ * @tsc: calibrated clock data
+ * @tsc_val: TSC value to convert
+ */
+uint64_t tsc_to_nsec(struct ftrace_tsc_clock *tsc, uint64_t tsc_val)
+{
+	uint64_t delta;
+	uint64_t nsec;
+
+	/* split the division in order not to overflow */
+	if (tsc_val >= tsc->tsc_base) {
+		delta = tsc_val - tsc->tsc_base;
+		nsec  = (delta / tsc->freq) * NSEC_PER_SEC;
+		nsec += (delta % tsc->freq) * NSEC_PER_SEC / tsc->freq;
+		return tsc->mono_base + nsec;
+	}
+
+	delta = tsc->tsc_base - tsc_val;
+	nsec  = (delta / tsc->freq) * NSEC_PER_SEC;
+	nsec += (delta % tsc->freq) * NSEC_PER_SEC / tsc->freq;
+	return tsc->mono_base - nsec;
+}
+
+#ifdef UNIT_TEST
+
+TEST_CASE(tsc_convert)
+{
+	struct ftrace_tsc_clock tsc = {
+		.freq      = 2500000000ULL,  /* 2.5 GHz */
+		.mono_base = 1000000000ULL,
+		.tsc_base  = 5000000000ULL,
+	};
+
+	TEST_EQ(tsc_to_nsec(&tsc, tsc.tsc_base), tsc.mono_base);
+	TEST_EQ(tsc_to_nsec(&tsc, tsc.tsc_base + 2500), tsc.mono_base + 1000);
+	TEST_EQ(tsc_to_nsec(&tsc, tsc.tsc_base - 2500), tsc.mono_base - 1000);
+
+	/* one hour later: should not overflow */
+	TEST_EQ(tsc_to_nsec(&tsc, tsc.tsc_base + 3600 * tsc.freq),
+		tsc.mono_base + 3600ULL * NSEC_PER_SEC);
+
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
@@ -0,0 +1,307 @@
+/*
+ * streaming compression of trace data for uftrace
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "utils/utils.h"
+#include "utils/compress.h"
+
+
+/**
+ * setup_compressor - prepare compression of trace data
+ * @comp: compressor to setup
+ * @level: compression level (1: fastest, 9: smallest)
+ *
+ * The compressor keeps the deflate state and the output buffer so that
+ * it can be reused for each frame.  It returns 0 on success, -1 otherwise.
+ */
+int setup_compressor(struct ftrace_compressor *comp, int level)
+{
+	memset(comp, 0, sizeof(*comp));
+
+	if (deflateInit(&comp->zs, level) != Z_OK) {
+		pr_dbg("cannot init compression: %s\n", comp->zs.msg);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * compress_frame - compress data into a frame
+ * @comp: compressor set up by setup_compressor()
+ * @data: data to compress (usually a shmem buffer)
+ * @len: length of the data
+ * @frame_size: pointer to save size of the frame
+ *
+ * It returns a pointer to the frame which is valid until next call.
+ * If the data doesn't shrink, the frame will have the original data.
+ */
+void *compress_frame(struct ftrace_compressor *comp, void *data, size_t len,
+		     size_t *frame_size)
+{
+	struct ftrace_frame_header *hdr;
+	size_t bound = sizeof(*hdr) + deflateBound(&comp->zs, len);
+	int ret;
+
+	if (comp->size < bound) {
+		comp->buf = xrealloc(comp->buf, bound);
+		comp->size = bound;
+	}
+
+	hdr = comp->buf;
+	hdr->magic = FTRACE_FRAME_MAGIC;
+	hdr->flags = 0;
+	hdr->raw_size = len;
+
+	deflateReset(&comp->zs);
+	comp->zs.next_in   = data;
+	comp->zs.avail_in  = len;
+	comp->zs.next_out  = comp->buf + sizeof(*hdr);
+	comp->zs.avail_out = comp->size - sizeof(*hdr);
+
+	ret = deflate(&comp->zs, Z_FINISH);
+	if (ret != Z_STREAM_END || comp->zs.total_out >= len) {
+		hdr->flags = FTRACE_FRAME_FL_RAW;
+		hdr->data_size = len;
+		memcpy(comp->buf + sizeof(*hdr), data, len);
+	}
+	else {
+		hdr->data_size = comp->zs.total_out;
+	}
+
+	*frame_size = sizeof(*hdr) + hdr->data_size;
+	return comp->buf;
+}
+
+void finish_compressor(struct ftrace_compressor *comp)
+{
+	deflateEnd(&comp->zs);
+	free(comp->buf);
+	comp->buf = NULL;
+	comp->size = 0;
+}
+
+/* reader side: decompress frames on the fly using a custom stream */
+struct compressed_file {
+	int		fd;
+	z_stream	zs;
+	void		*in;
+	size_t		in_size;
+	void		*out;
+	size_t		out_size;
+	size_t		out_len;
+	size_t		out_pos;
+};
+
+/* returns 1 if read a frame, 0 at EOF or -1 on error */
+static int read_frame(struct compressed_file *cf)
+{
+	struct ftrace_frame_header hdr;
+	ssize_t ret;
+
+	do {
+		ret = read(cf->fd, &hdr, sizeof(hdr));
+	}
+	while (ret < 0 && errno == EINTR);
+
+	if (ret == 0)
+		return 0;
+	if (ret < 0)
+		return -1;
+
+	/* short read, it should be rare */
+	if (ret != sizeof(hdr) && read_all(cf->fd, (void *)&hdr + ret,
+					   sizeof(hdr) - ret) < 0)
+		return -1;
+
+	if (hdr.magic != FTRACE_FRAME_MAGIC ||
+	    hdr.raw_size > FTRACE_FRAME_MAX ||
+	    hdr.data_size > FTRACE_FRAME_MAX) {
+		pr_dbg("invalid compressed frame\n");
+		return -1;
+	}
+
+	if (cf->in_size < hdr.data_size) {
+		cf->in = xrealloc(cf->in, hdr.data_size);
+		cf->in_size = hdr.data_size;
+	}
+	if (cf->out_size < hdr.raw_size) {
+		cf->out = xrealloc(cf->out, hdr.raw_size);
+		cf->out_size = hdr.raw_size;
+	}
+
+	if (read_all(cf->fd, cf->in, hdr.data_size) < 0)
+		return -1;
+
+	cf->out_pos = 0;
+	cf->out_len = hdr.raw_size;
+
+	if (hdr.flags & FTRACE_FRAME_FL_RAW) {
+		memcpy(cf->out, cf->in, hdr.data_size);
+		cf->out_len = hdr.data_size;
+		return 1;
+	}
+
+	inflateReset(&cf->zs);
+	cf->zs.next_in   = cf->in;
+	cf->zs.avail_in  = hdr.data_size;
+	cf->zs.next_out  = cf->out;
+	cf->zs.avail_out = hdr.raw_size;
+
+	if (inflate(&cf->zs, Z_FINISH) != Z_STREAM_END ||
+	    cf->zs.total_out != hdr.raw_size) {
+		pr_dbg("cannot decompress frame: %s\n", cf->zs.msg ?: "size mismatch");
+		return -1;
+	}
+	return 1;
+}
+
+static ssize_t compressed_file_read(void *cookie, char *buf, size_t size)
+{
+	struct compressed_file *cf = cookie;
+	size_t copied = 0;
+	size_t len;
+	int ret;
+
+	while (copied < size) {
+		if (cf->out_pos == cf->out_len) {
+			ret = read_frame(cf);
+			if (ret < 0) {
+				errno = EIO;
+				return copied ? (ssize_t)copied : -1;
+			}
+			if (ret == 0)
+				break;
+			continue;
+		}
+
+		len = cf->out_len - cf->out_pos;
+		if (len > size - copied)
+			len = size - copied;
+
+		memcpy(buf + copied, cf->out + cf->out_pos, len);
+		cf->out_pos += len;
+		copied += len;
+	}
+	return copied;
+}
+
+static int compressed_file_close(void *cookie)
+{
+	struct compressed_file *cf = cookie;
+
+	inflateEnd(&cf->zs);
+	close(cf->fd);
+	free(cf->in);
+	free(cf->out);
+	free(cf);
+	return 0;
+}
+
+/**
+ * open_compressed_file - open a file having compressed frames
+ * @filename: name of the file
+ *
+ * It returns a read-only stream which returns decompressed data.
+ * Seeking is not supported.  It returns %NULL if failed to open.
+ */
+FILE *open_compressed_file(const char *filename)
+{
+	struct compressed_file *cf;
+	cookie_io_functions_t io = {
+		.read  = compressed_file_read,
+		.close = compressed_file_close,
+	};
+	FILE *fp;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	cf = xzalloc(sizeof(*cf));
+	cf->fd = fd;
+
+	if (inflateInit(&cf->zs) != Z_OK) {
+		pr_dbg("cannot init decompression: %s\n", cf->zs.msg);
+		goto err;
+	}
+
+	fp = fopencookie(cf, "rb", io);
+	if (fp == NULL) {
+		inflateEnd(&cf->zs);
+		goto err;
+	}
+	return fp;
+
+err:
+	close(fd);
+	free(cf);
+	errno = EINVAL;
+	return NULL;
+}
+
+#ifdef UNIT_TEST
+
+TEST_CASE(compress_frames)
+{
+	struct ftrace_compressor comp;
+	char filename[] = "/tmp/uftrace-compress-XXXXXX";
+	unsigned char data[4096];
+	unsigned char rand_data[512];
+	unsigned char buf[sizeof(data) + sizeof(rand_data)];
+	size_t size;
+	void *frame;
+	FILE *fp;
+	int i, fd;
+
+	/* repetitive records are compressible */
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i % 16;
+
+	/* small random data would be saved as is */
+	srand(1);
+	for (i = 0; i < (int)sizeof(rand_data); i++)
+		rand_data[i] = rand();
+
+	TEST_EQ(setup_compressor(&comp, 1), 0);
+
+	fd = mkstemp(filename);
+	TEST_NE(fd, -1);
+
+	frame = compress_frame(&comp, data, sizeof(data), &size);
+	TEST_LT(size, sizeof(data));
+	TEST_EQ(write_all(fd, frame, size), 0);
+
+	frame = compress_frame(&comp, rand_data, sizeof(rand_data), &size);
+	TEST_EQ(((struct ftrace_frame_header *)frame)->flags,
+		FTRACE_FRAME_FL_RAW);
+	TEST_EQ(write_all(fd, frame, size), 0);
+
+	close(fd);
+	finish_compressor(&comp);
+
+	fp = open_compressed_file(filename);
+	TEST_NE(fp, NULL);
+
+	/* read across the frame boundary */
+	TEST_EQ(fread(buf, 1, sizeof(buf), fp), sizeof(buf));
+	TEST_MEMEQ(buf, data, sizeof(data));
+	TEST_MEMEQ(buf + sizeof(data), rand_data, sizeof(rand_data));
+	TEST_EQ(fread(buf, 1, 1, fp), 0);
+	TEST_NE(feof(fp), 0);
+
+	fclose(fp);
+	unlink(filename);
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
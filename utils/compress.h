@@ -0,0 +1,41 @@
+#ifndef __FTRACE_COMPRESS_H__
+#define __FTRACE_COMPRESS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * When COMPRESSED feature bit is set, the <tid>.dat file is a sequence
+ * of frames each of which has (compressed) data of a shmem buffer.
+ * Frames are independent so that the reader can start from any frame.
+ */
+#define FTRACE_FRAME_MAGIC  0x465a  /* "ZF" */
+
+/* data is stored as is since compression didn't help */
+#define FTRACE_FRAME_FL_RAW  (1U << 0)
+
+/* sanity check for reading a frame */
+#define FTRACE_FRAME_MAX  (1U << 30)
+
+struct ftrace_frame_header {
+	uint16_t magic;
+	uint16_t flags;
+	uint32_t raw_size;	/* size of the original data */
+	uint32_t data_size;	/* size of the data in this frame */
+};
+
+struct ftrace_compressor {
+	z_stream	zs;
+	void		*buf;
+	size_t		size;
+};
+
+int setup_compressor(struct ftrace_compressor *comp, int level);
+void *compress_frame(struct ftrace_compressor *comp, void *data, size_t len,
+		     size_t *frame_size);
+void finish_compressor(struct ftrace_compressor *comp);
+
+FILE *open_compressed_file(const char *filename);
+
+#endif /* __FTRACE_COMPRESS_H__ */
@@ -88,13 +88,16 @@ int read_task_file(char *dirname, bool needs_session, bool sym_rel_addr)
  * @dirname: name of the data directory
  * @needs_session: read session info too
  * @sym_rel_addr: whethere symbol address is relative
+ * @tsc: TSC clock data if the records use it, or %NULL
  *
  * This function read the task.txt file in the @dirname and build task
- * (and session when @needs_session is %true) information.
+ * (and session when @needs_session is %true) information.  Control
+ * events are saved in the session with the time converted by @tsc.
  *
  * It returns 0 for success, -1 for error.
  */
-int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
+int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr,
+		       struct ftrace_tsc_clock *tsc)
 {
 	FILE *fp;
 	char *fname = NULL;
@@ -150,6 +153,38 @@ int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
 
 			create_session(&sess, dirname, exename, sym_rel_addr);
 		}
+		else if (!strncmp(line, "CTRL", 4)) {
+			struct ftrace_msg_ctrl *cmsg;
+			uint64_t time;
+
+			/* filters were changed by 'uftrace control' */
+			pr_dbg("control: %s", line + 5);
+
+			if (!needs_session)
+				continue;
+
+			cmsg = xmalloc(sizeof(*cmsg) + strlen(line) + 1);
+			if (sscanf(line + 5, "time=%"SCNu64" tid=%d pid=%d gen=%u",
+				   &time, &cmsg->task.tid, &cmsg->task.pid,
+				   &cmsg->gen) != 4) {
+				pr_dbg("invalid control info: %s", line);
+				free(cmsg);
+				continue;
+			}
+
+			/* it's in the record clock */
+			cmsg->task.time = tsc ? tsc_to_nsec(tsc, time) : time;
+
+			pos = strstr(line, " gen=") + 5;
+			pos += strspn(pos, "0123456789");
+			pos[strcspn(pos, "\n")] = '\0';
+
+			cmsg->len = strlen(pos);
+			memcpy(cmsg->settings, pos, cmsg->len + 1);
+
+			add_session_control(cmsg);
+			free(cmsg);
+		}
 	}
 
 	fclose(fp);
@@ -224,6 +259,29 @@ void write_session_info(const char *dirname, struct ftrace_msg_sess *smsg,
 	free(fname);
 }
 
+/*
+ * Unlike other messages, the timestamp of the control message is in the
+ * record clock (e.g. TSC) so it's saved as is and converted when read.
+ */
+void write_control_info(const char *dirname, struct ftrace_msg_ctrl *cmsg)
+{
+	FILE *fp;
+	char *fname = NULL;
+
+	xasprintf(&fname, "%s/%s", dirname, "task.txt");
+
+	fp = fopen(fname, "a");
+	if (fp == NULL)
+		pr_err("cannot open %s", fname);
+
+	fprintf(fp, "CTRL time=%"PRIu64" tid=%d pid=%d gen=%u%s\n",
+		cmsg->task.time, cmsg->task.tid, cmsg->task.pid,
+		cmsg->gen, cmsg->settings);
+
+	fclose(fp);
+	free(fname);
+}
+
 #define RECORD_MSG  "Was '%s' compiled with -pg or\n"		\
 "\t-finstrument-functions flag and ran with ftrace record?\n"
 
@@ -275,6 +333,10 @@ retry:
 	handle->kern = NULL;
 	handle->nr_tasks = 0;
 	handle->tasks = NULL;
+	handle->nr_task_heap = 0;
+	handle->task_heap = NULL;
+	handle->time_range = opts->range;
+	handle->time_range_skipped = false;
 
 	if (fread(&handle->hdr, sizeof(handle->hdr), 1, fp) != 1)
 		pr_err("cannot read header data");
@@ -286,6 +348,10 @@ retry:
 	    handle->hdr.version > UFTRACE_FILE_VERSION)
 		pr_err("unsupported file version: %u", handle->hdr.version);
 
+	if (handle->hdr.feat_mask & ~FEAT_MASK_ALL)
+		pr_err_ns("unsupported feature in the data: %#"PRIx64"\n",
+			  handle->hdr.feat_mask & ~FEAT_MASK_ALL);
+
 	if (read_ftrace_info(handle->hdr.info_mask, handle) < 0)
 		pr_err("cannot read ftrace header info!");
 
@@ -296,12 +362,16 @@ retry:
 
 	if (handle->hdr.feat_mask & TASK_SESSION) {
 		bool sym_rel = false;
+		struct ftrace_tsc_clock *tsc = NULL;
 
 		if (handle->hdr.feat_mask & SYM_REL_ADDR)
 			sym_rel = true;
 
+		if (handle->hdr.info_mask & (1UL << CLOCK_INFO))
+			tsc = &handle->info.tsc;
+
 		// read task.txt first and then try old task file
-		if (read_task_txt_file(opts->dirname, true, sym_rel) < 0 &&
+		if (read_task_txt_file(opts->dirname, true, sym_rel, tsc) < 0 &&
 		    read_task_file(opts->dirname, true, sym_rel) < 0)
 			pr_err("invalid task file");
 	}
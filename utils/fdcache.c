@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "utils/utils.h"
+#include "utils/fdcache.h"
+
+
+/**
+ * fd_cache_init - initialize a cache of open files
+ * @cache: cache to initialize
+ * @max_entry: max number of files kept open
+ */
+void fd_cache_init(struct fd_cache *cache, int max_entry)
+{
+	cache->nr_entry = 0;
+	cache->max_entry = max_entry ?: FD_CACHE_SIZE;
+	cache->clock = 0;
+	cache->nr_open = 0;
+	cache->entries = xcalloc(cache->max_entry, sizeof(*cache->entries));
+}
+
+/**
+ * fd_cache_get - return an open file descriptor for @key
+ * @cache: cache of open files
+ * @key: key of the file (usually tid)
+ * @filename: name of the file to open if not cached
+ * @flags: flags to open the file
+ *
+ * If the cache is full, the least recently used file is closed.  A new
+ * file is positioned at the end even if @flags doesn't have O_APPEND.
+ * It returns the file descriptor or -1 if it failed to open.  The
+ * returned descriptor should not be closed by the caller.
+ */
+int fd_cache_get(struct fd_cache *cache, int key, const char *filename,
+		 int flags)
+{
+	struct fd_cache_entry *entry = NULL;
+	int i, fd;
+
+	for (i = 0; i < cache->nr_entry; i++) {
+		if (cache->entries[i].key == key) {
+			entry = &cache->entries[i];
+			entry->last_use = ++cache->clock;
+			return entry->fd;
+		}
+	}
+
+	fd = open(filename, flags, 0644);
+	if (fd < 0)
+		return -1;
+
+	/* the files are only appended, even without O_APPEND */
+	if (!(flags & O_APPEND))
+		lseek(fd, 0, SEEK_END);
+
+	cache->nr_open++;
+
+	if (cache->nr_entry < cache->max_entry) {
+		entry = &cache->entries[cache->nr_entry++];
+	}
+	else {
+		/* evict the least recently used one */
+		entry = &cache->entries[0];
+		for (i = 1; i < cache->nr_entry; i++) {
+			if (cache->entries[i].last_use < entry->last_use)
+				entry = &cache->entries[i];
+		}
+		close(entry->fd);
+	}
+
+	entry->key = key;
+	entry->fd = fd;
+	entry->last_use = ++cache->clock;
+
+	return fd;
+}
+
+/**
+ * fd_cache_close - close the file for @key if it's in the cache
+ * @cache: cache of open files
+ * @key: key of the file
+ */
+void fd_cache_close(struct fd_cache *cache, int key)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_entry; i++) {
+		if (cache->entries[i].key != key)
+			continue;
+
+		close(cache->entries[i].fd);
+		cache->entries[i] = cache->entries[--cache->nr_entry];
+		return;
+	}
+}
+
+/**
+ * fd_cache_release - close all files and free the cache
+ * @cache: cache of open files
+ */
+void fd_cache_release(struct fd_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_entry; i++)
+		close(cache->entries[i].fd);
+
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->nr_entry = 0;
+}
+
+#ifdef UNIT_TEST
+
+TEST_CASE(fdcache_lru)
+{
+	struct fd_cache cache;
+	char filename[] = "/tmp/uftrace-fdcache-XXXXXX";
+	int fd, fd1, fd2;
+
+	fd = mkstemp(filename);
+	TEST_NE(fd, -1);
+	close(fd);
+
+	fd_cache_init(&cache, 2);
+
+	fd1 = fd_cache_get(&cache, 1, filename, O_WRONLY);
+	fd2 = fd_cache_get(&cache, 2, filename, O_WRONLY);
+	TEST_NE(fd1, -1);
+	TEST_NE(fd2, -1);
+	TEST_EQ(cache.nr_open, 2);
+
+	/* cached one is returned and becomes the most recent */
+	TEST_EQ(fd_cache_get(&cache, 1, filename, O_WRONLY), fd1);
+	TEST_EQ(cache.nr_open, 2);
+
+	/* key 2 is evicted */
+	fd_cache_get(&cache, 3, filename, O_WRONLY);
+	TEST_EQ(cache.nr_entry, 2);
+	TEST_EQ(cache.nr_open, 3);
+	TEST_EQ(fd_cache_get(&cache, 1, filename, O_WRONLY), fd1);
+
+	fd_cache_get(&cache, 2, filename, O_WRONLY);
+	TEST_EQ(cache.nr_open, 4);
+
+	fd_cache_close(&cache, 1);
+	TEST_EQ(cache.nr_entry, 1);
+
+	fd_cache_release(&cache);
+	TEST_EQ(cache.nr_entry, 0);
+
+	unlink(filename);
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
@@ -0,0 +1,32 @@
+#ifndef __FTRACE_FDCACHE_H__
+#define __FTRACE_FDCACHE_H__
+
+/* default number of open files kept in a cache */
+#define FD_CACHE_SIZE  16
+
+struct fd_cache_entry {
+	int		key;
+	int		fd;
+	unsigned long	last_use;
+};
+
+/*
+ * Small LRU cache of open files (usually <tid>.dat) so that writing
+ * a buffer doesn't need to open and close the file every time.
+ * It's not thread-safe, callers should serialize the access.
+ */
+struct fd_cache {
+	int			nr_entry;
+	int			max_entry;
+	unsigned long		clock;
+	unsigned long		nr_open;	/* for statistics */
+	struct fd_cache_entry	*entries;
+};
+
+void fd_cache_init(struct fd_cache *cache, int max_entry);
+int fd_cache_get(struct fd_cache *cache, int key, const char *filename,
+		 int flags);
+void fd_cache_close(struct fd_cache *cache, int key);
+void fd_cache_release(struct fd_cache *cache);
+
+#endif /* __FTRACE_FDCACHE_H__ */
@@ -37,6 +37,8 @@ static void print_trigger(struct ftrace_trigger *tr)
 		pr_dbg("\ttrigger: trace_off\n");
 	if (tr->flags & TRIGGER_FL_RECOVER)
 		pr_dbg("\ttrigger: recover\n");
+	if (tr->flags & TRIGGER_FL_SNAPSHOT)
+		pr_dbg("\ttrigger: snapshot\n");
 
 	if (tr->flags & TRIGGER_FL_ARGUMENT) {
 		struct ftrace_arg_spec *arg;
@@ -231,7 +233,7 @@ static int add_exact_filter(struct rb_root *root, struct symtab *symtab,
 	if (sym == NULL)
 		return 0;
 
-	filter.name = sym->name;
+	filter.name = symbol_getname(sym, sym->addr);
 	filter.start = sym->addr;
 	filter.end = sym->addr + sym->size;
 
@@ -256,11 +258,11 @@ static int add_regex_filter(struct rb_root *root, struct symtab *symtab,
 
 	for (i = 0; i < symtab->nr_sym; i++) {
 		sym = &symtab->sym[i];
+		filter.name = symbol_getname(sym, sym->addr);
 
-		if (regexec(&re, sym->name, 0, NULL, 0))
+		if (regexec(&re, filter.name, 0, NULL, 0))
 			continue;
 
-		filter.name = sym->name;
 		filter.start = sym->addr;
 		filter.end = sym->addr + sym->size;
 
@@ -554,6 +556,11 @@ static int setup_module_and_trigger(char *str, char *module,
 				continue;
 			}
 
+			if (!strcasecmp(pos, "snapshot")) {
+				tr->flags |= TRIGGER_FL_SNAPSHOT;
+				continue;
+			}
+
 			if (!strncasecmp(pos, "color=", 6)) {
 				const char *color = pos + 6;
 				tr->flags |= TRIGGER_FL_COLOR;
@@ -770,6 +777,8 @@ void ftrace_setup_filter_module(char *trigger_str, struct list_head *head)
 				continue;
 			if (!strcasecmp(pos, "recover"))
 				continue;
+			if (!strcasecmp(pos, "snapshot"))
+				continue;
 			if (!strncasecmp(pos, "arg", 3) && isdigit(pos[3]))
 				continue;
 			if (!strncasecmp(pos, "fparg", 5) && isdigit(pos[5]))
@@ -1085,6 +1094,11 @@ TEST_CASE(trigger_setup)
 	TEST_EQ(tr.flags, TRIGGER_FL_TRACE_OFF | TRIGGER_FL_DEPTH);
 	TEST_EQ(tr.depth, 1);
 
+	ftrace_setup_trigger("foo::baz2@snapshot", &stabs, NULL, &root);
+	memset(&tr, 0, sizeof(tr));
+	TEST_NE(ftrace_match_filter(&root, 0x4000, &tr), NULL);
+	TEST_EQ(tr.flags, TRIGGER_FL_SNAPSHOT);
+
 	ftrace_cleanup_filter(&root);
 	TEST_EQ(RB_EMPTY_ROOT(&root), true);
 
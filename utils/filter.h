@@ -23,6 +23,7 @@ enum trigger_flag {
 	TRIGGER_FL_RECOVER	= (1U << 7),
 	TRIGGER_FL_RETVAL	= (1U << 8),
 	TRIGGER_FL_COLOR	= (1U << 9),
+	TRIGGER_FL_SNAPSHOT	= (1U << 10),
 };
 
 enum filter_mode {
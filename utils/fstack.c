@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "fstack"
@@ -14,6 +18,7 @@
 #include "utils/filter.h"
 #include "utils/fstack.h"
 #include "utils/rbtree.h"
+#include "utils/compress.h"
 #include "libmcount/mcount.h"
 
 
@@ -35,6 +40,210 @@ struct ftrace_task_handle *get_task_handle(struct ftrace_file_handle *handle,
 	return NULL;
 }
 
+/**
+ * get_task_session - find a session of the task
+ * @task: tracee task
+ * @timestamp: timestamp of a record
+ *
+ * This function returns a session of @task at @timestamp like
+ * find_task_session().  The session is cached in @task and it looks
+ * up the session again only if @timestamp is out of its time range.
+ */
+struct ftrace_session *get_task_session(struct ftrace_task_handle *task,
+					uint64_t timestamp)
+{
+	if (task->sess && task->sess_start <= timestamp &&
+	    timestamp < task->sess_end)
+		return task->sess;
+
+	task->sess = find_task_session_range(task->tid, timestamp,
+					     &task->sess_start, &task->sess_end);
+	return task->sess;
+}
+
+/*
+ * Task data files are mapped as a whole if it's smaller than the limit,
+ * otherwise a window of the file slides along the read position.
+ * Compressed files cannot be mapped and are read into a buffer instead.
+ */
+#define TASK_DATA_MAP_MAX   (sizeof(long) == 8 ? (1UL << 30) : (16UL << 20))
+#define TASK_DATA_WINDOW    (sizeof(long) == 8 ? (64UL << 20) : (1UL << 20))
+#define TASK_DATA_BUFSIZE   (64 * 1024)
+
+static size_t task_data_map_max = TASK_DATA_MAP_MAX;
+static size_t task_data_window = TASK_DATA_WINDOW;
+
+static int open_task_data(struct task_data *data, char *filename,
+			  bool compressed)
+{
+	struct stat stbuf;
+
+	memset(data, 0, sizeof(*data));
+	data->fd = -1;
+
+	if (compressed) {
+		data->fp = open_compressed_file(filename);
+		if (data->fp == NULL)
+			return -1;
+
+		data->alloc = TASK_DATA_BUFSIZE;
+		data->buf = xmalloc(data->alloc);
+		return 0;
+	}
+
+	data->fd = open(filename, O_RDONLY);
+	if (data->fd < 0)
+		return -1;
+
+	if (fstat(data->fd, &stbuf) < 0) {
+		close(data->fd);
+		data->fd = -1;
+		return -1;
+	}
+
+	data->file_size = stbuf.st_size;
+	return 0;
+}
+
+static void close_task_data(struct task_data *data)
+{
+	if (data->fp) {
+		fclose(data->fp);
+		free(data->buf);
+	}
+	else if (data->fd >= 0) {
+		if (data->buf)
+			munmap(data->buf, data->alloc);
+		close(data->fd);
+	}
+
+	memset(data, 0, sizeof(*data));
+	data->fd = -1;
+}
+
+static int map_task_data(struct task_data *data, size_t len)
+{
+	size_t pagesize = getpagesize();
+	size_t alloc;
+	off_t start;
+	void *buf;
+
+	start = data->pos & ~((off_t)pagesize - 1);
+
+	if ((size_t)data->file_size <= task_data_map_max) {
+		start = 0;
+		alloc = data->file_size;
+	}
+	else {
+		alloc = data->pos - start + len;
+		if (alloc < task_data_window)
+			alloc = task_data_window;
+		alloc = ALIGN(alloc, pagesize);
+	}
+
+	if (alloc > (size_t)(data->file_size - start))
+		alloc = data->file_size - start;
+
+	if (data->buf) {
+		munmap(data->buf, data->alloc);
+		data->buf = NULL;
+	}
+
+	buf = mmap(NULL, alloc, PROT_READ, MAP_PRIVATE, data->fd, start);
+	if (buf == MAP_FAILED) {
+		pr_log("cannot map task data: %m\n");
+		return -1;
+	}
+	madvise(buf, alloc, MADV_SEQUENTIAL);
+
+	data->buf   = buf;
+	data->alloc = alloc;
+	data->size  = alloc;
+	data->start = start;
+	return 0;
+}
+
+static int fill_task_data(struct task_data *data, size_t len)
+{
+	off_t end = data->start + data->size;
+	size_t n;
+
+	if (data->pos > end) {
+		/* discard data skipped without reading */
+		off_t skip = data->pos - end;
+
+		while (skip > 0) {
+			n = data->alloc < (size_t)skip ? data->alloc : (size_t)skip;
+			n = fread(data->buf, 1, n, data->fp);
+			if (n == 0)
+				break;
+			skip -= n;
+		}
+		data->start = data->pos - skip;
+		data->size = 0;
+
+		if (skip)
+			goto out;
+	}
+	else {
+		/* move remaining data to the beginning */
+		data->size = end - data->pos;
+		memmove(data->buf, data->buf + (data->pos - data->start),
+			data->size);
+		data->start = data->pos;
+	}
+
+	if (len > data->alloc) {
+		data->alloc = ALIGN(len, TASK_DATA_BUFSIZE);
+		data->buf = xrealloc(data->buf, data->alloc);
+	}
+
+	while (data->size < len) {
+		n = fread(data->buf + data->size, 1,
+			  data->alloc - data->size, data->fp);
+		if (n == 0)
+			break;
+		data->size += n;
+	}
+
+out:
+	if (ferror(data->fp))
+		pr_log("error reading task data: %m\n");
+
+	return data->start == data->pos && data->size >= len ? 0 : -1;
+}
+
+/*
+ * task_data_peek - return a pointer to @len bytes at the current position
+ *
+ * The data is accessed in place and the returned pointer is valid until
+ * the window moves by a next call.  It returns %NULL at the end of file.
+ */
+static void *task_data_peek(struct task_data *data, size_t len)
+{
+	if (data->buf && data->pos >= data->start &&
+	    data->pos + (off_t)len <= data->start + (off_t)data->size)
+		return data->buf + (data->pos - data->start);
+
+	if (data->fp) {
+		if (fill_task_data(data, len) < 0)
+			return NULL;
+	}
+	else {
+		if (data->fd < 0 || data->pos + (off_t)len > data->file_size)
+			return NULL;
+		if (map_task_data(data, len) < 0)
+			return NULL;
+	}
+
+	return data->buf + (data->pos - data->start);
+}
+
+static void task_data_skip(struct task_data *data, size_t len)
+{
+	data->pos += len;
+}
+
 void setup_task_handle(struct ftrace_file_handle *handle,
 		       struct ftrace_task_handle *task, int tid)
 {
@@ -50,8 +259,8 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 	task->t = find_task(tid);
 
 	task->tid = tid;
-	task->fp = fopen(filename, "rb");
-	if (task->fp == NULL) {
+	if (open_task_data(&task->data, filename,
+			   handle->hdr.feat_mask & COMPRESSED) < 0) {
 		pr_dbg("cannot open task data file: %s: %m\n", filename);
 		task->done = true;
 	}
@@ -70,6 +279,10 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 	/* FIXME: save filter depth at fork() and restore */
 	for (i = 0; i < max_stack; i++)
 		task->func_stack[i].orig_depth = handle->depth;
+
+	/* start from a checkpoint near the time range if possible */
+	if (handle->time_range.start && !task->done)
+		seek_task_index(handle, task, handle->time_range.start);
 }
 
 void reset_task_handle(struct ftrace_file_handle *handle)
@@ -82,22 +295,58 @@ void reset_task_handle(struct ftrace_file_handle *handle)
 
 		task->done = true;
 
-		if (task->fp) {
-			fclose(task->fp);
-			task->fp = NULL;
-		}
-
-		free(task->args.data);
+		close_task_data(&task->data);
 		task->args.data = NULL;
 
 		free(task->func_stack);
 		task->func_stack = NULL;
+
+		free(task->compact.addrs);
+		task->compact.addrs = NULL;
+
+		free(task->index_frames);
+		task->index_frames = NULL;
 	}
 
 	free(handle->tasks);
 	handle->tasks = NULL;
 
 	handle->nr_tasks = 0;
+
+	free(handle->task_heap);
+	handle->task_heap = NULL;
+	handle->nr_task_heap = 0;
+}
+
+/**
+ * setup_single_task_handle - setup a file handle for a single task
+ * @handle: original file handle
+ * @single: file handle to setup
+ * @idx: index of the task in @handle
+ *
+ * This function sets up @single to read records of @idx-th task in
+ * @handle only.  It has its own task state so different tasks can be
+ * read in parallel using read_rstack() on each handle, except for the
+ * first read with a time range which should be done serially since it
+ * updates the filter state (see read_rstack_range).  The caller can
+ * set @single->kern to kernel records of the task.  It should be
+ * released by reset_task_handle() and the @handle should be alive
+ * until then.
+ */
+void setup_single_task_handle(struct ftrace_file_handle *handle,
+			      struct ftrace_file_handle *single, int idx)
+{
+	memcpy(single, handle, sizeof(*single));
+
+	single->info.tids = &handle->info.tids[idx];
+	single->info.nr_tid = 1;
+
+	single->kern = NULL;
+	single->tasks = NULL;
+	single->nr_tasks = 0;
+	single->task_heap = NULL;
+	single->nr_task_heap = 0;
+	single->time_range_skipped = false;
 }
 
 /**
@@ -312,7 +561,6 @@ int fstack_entry(struct ftrace_task_handle *task,
 {
 	struct fstack *fstack;
 	struct ftrace_session *sess;
-	unsigned long addr = rstack->addr;
 
 	/* stack_count was increased in __read_rstack */
 	fstack = &task->func_stack[task->stack_count - 1];
@@ -330,18 +578,17 @@ int fstack_entry(struct ftrace_task_handle *task,
 		return -1;
 	}
 
-	if (is_kernel_address(addr))
-		addr = get_real_address(addr);
-
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess == NULL)
 		sess = find_task_session(task->t->pid, rstack->time);
 
 	if (sess) {
-		struct ftrace_filter *fixup;
+		struct ftrace_sess_addr *sa = find_session_addr(sess, rstack->addr);
+		struct ftrace_filter *fixup = sa->fixup;
 
-		fixup = ftrace_match_filter(&sess->fixups, addr, tr);
 		if (unlikely(fixup)) {
+			memcpy(tr, &fixup->trigger, sizeof(*tr));
+
 			if (!strncmp(fixup->name, "exec", 4))
 				fstack->flags |= FSTACK_FL_EXEC;
 			else if (strstr(fixup->name, "setjmp")) {
@@ -352,7 +599,8 @@ int fstack_entry(struct ftrace_task_handle *task,
 				fstack->flags |= FSTACK_FL_LONGJMP;
 		}
 
-		ftrace_match_filter(&sess->filters, addr, tr);
+		if (sa->filter)
+			memcpy(tr, &sa->filter->trigger, sizeof(*tr));
 	}
 
 
@@ -490,25 +738,27 @@ static int fstack_check_skip(struct ftrace_task_handle *task,
 			     struct ftrace_ret_stack *rstack)
 {
 	struct ftrace_session *sess;
-	unsigned long addr = rstack->addr;
+	struct ftrace_sess_addr *sa;
 	struct ftrace_trigger tr = { 0 };
 	int depth = task->filter.depth;
 
 	if (task->filter.out_count > 0)
 		return -1;
 
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess == NULL)
 		sess = find_task_session(task->t->pid, rstack->time);
 
 	if (sess == NULL) {
-		if (is_kernel_address(addr))
+		if (is_kernel_address(rstack->addr))
 			sess = first_session;
 		else
 			return -1;
 	}
 
-	ftrace_match_filter(&sess->filters, addr, &tr);
+	sa = find_session_addr(sess, rstack->addr);
+	if (sa->filter)
+		memcpy(&tr, &sa->filter->trigger, sizeof(tr));
 
 	if (tr.flags & TRIGGER_FL_FILTER) {
 		if (tr.fmode == FILTER_MODE_OUT)
@@ -597,18 +847,119 @@ struct ftrace_task_handle *fstack_skip(struct ftrace_file_handle *handle,
 	return next;
 }
 
-static int __read_task_ustack(struct ftrace_task_handle *task)
+static int task_data_getc(struct task_data *data)
 {
-	FILE *fp = task->fp;
+	unsigned char *p = task_data_peek(data, 1);
 
-	if (fread(&task->ustack, sizeof(task->ustack), 1, fp) != 1) {
-		if (feof(fp))
+	if (p == NULL)
+		return EOF;
+
+	task_data_skip(data, 1);
+	return *p;
+}
+
+static int read_varint(struct task_data *data, uint64_t *val)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	int c;
+
+	do {
+		c = task_data_getc(data);
+		if (c == EOF || shift > 63)
 			return -1;
 
-		pr_log("error reading rstack: %s\n", strerror(errno));
+		v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	}
+	while (c & 0x80);
+
+	*val = v;
+	return 0;
+}
+
+static int read_compact_ustack(struct ftrace_task_handle *task)
+{
+	struct task_data *data = &task->data;
+	struct compact *cs = &task->compact;
+	struct ftrace_ret_stack *rstack = &task->ustack;
+	uint64_t delta, depth, addr;
+	int hdr;
+
+	/* each buffer starts with a sync marker */
+	while ((hdr = task_data_getc(data)) == FTRACE_COMPACT_SYNC) {
+		cs->time = 0;
+		cs->nr_addr = 0;
+		cs->sync = data->pos - 1;
+	}
+
+	if (hdr == EOF)
 		return -1;
+
+	if ((hdr & FTRACE_COMPACT_RESERVED) ||
+	    (hdr & FTRACE_COMPACT_TYPE_MASK) > FTRACE_LOST)
+		goto invalid;
+
+	if (read_varint(data, &delta) < 0 || read_varint(data, &depth) < 0 ||
+	    read_varint(data, &addr) < 0)
+		goto invalid;
+
+	rstack->type   = hdr & FTRACE_COMPACT_TYPE_MASK;
+	rstack->more   = !!(hdr & FTRACE_COMPACT_MORE);
+	rstack->unused = FTRACE_UNUSED;
+	rstack->depth  = depth;
+
+	if (rstack->type == FTRACE_LOST) {
+		rstack->time = 0;
+		rstack->addr = addr;
+		return 0;
+	}
+
+	cs->time += zigzag_decode(delta);
+	rstack->time = cs->time;
+
+	switch ((hdr & FTRACE_COMPACT_ADDR_MASK) >> FTRACE_COMPACT_ADDR_SHIFT) {
+	case FTRACE_ADDR_INDEX:
+		if (addr >= cs->nr_addr)
+			goto invalid;
+		rstack->addr = cs->addrs[addr];
+		break;
+	case FTRACE_ADDR_DEFINE:
+		if (cs->nr_addr == cs->alloc_addr) {
+			cs->alloc_addr = cs->alloc_addr ? cs->alloc_addr * 2 : 64;
+			cs->addrs = xrealloc(cs->addrs, cs->alloc_addr *
+					     sizeof(*cs->addrs));
+		}
+		cs->addrs[cs->nr_addr++] = addr;
+		/* fall through */
+	case FTRACE_ADDR_LITERAL:
+		rstack->addr = addr;
+		break;
+	default:
+		goto invalid;
 	}
 
+	return 0;
+
+invalid:
+	pr_dbg("invalid rstack read\n");
+	return -1;
+}
+
+static int __read_task_ustack(struct ftrace_task_handle *task)
+{
+	struct ftrace_ret_stack *rstack;
+
+	if (task->h->hdr.version >= UFTRACE_COMPACT_VERSION)
+		return read_compact_ustack(task);
+
+	rstack = task_data_peek(&task->data, sizeof(*rstack));
+	if (rstack == NULL)
+		return -1;
+
+	memcpy(&task->ustack, rstack, sizeof(*rstack));
+	task_data_skip(&task->data, sizeof(*rstack));
+
 	if (task->ustack.unused != FTRACE_UNUSED) {
 		pr_dbg("invalid rstack read\n");
 		return -1;
@@ -617,40 +968,26 @@ static int __read_task_ustack(struct ftrace_task_handle *task)
 	return 0;
 }
 
+/* calculate size of the argument at @len from current position */
 static int read_task_arg(struct ftrace_task_handle *task,
-			 struct ftrace_arg_spec *spec)
+			 struct ftrace_arg_spec *spec, unsigned *len)
 {
-	FILE *fp = task->fp;
-	struct fstack_arguments *args = &task->args;
 	unsigned size = spec->size;
-	int rem;
 
 	if (spec->fmt == ARG_FMT_STR) {
-		args->data = xrealloc(args->data, args->len + 2);
-
-		if (fread(args->data + args->len, 2, 1, fp) != 1) {
-			if (feof(fp))
-				return -1;
-		}
+		unsigned char *p = task_data_peek(&task->data, *len + 2);
 
-		size = *(unsigned short *)(args->data + args->len);
-		args->len += 2;
-	}
-
-	args->data = xrealloc(args->data, args->len + size);
-
-	if (fread(args->data + args->len, size, 1, fp) != 1) {
-		if (feof(fp))
+		if (p == NULL)
 			return -1;
+
+		size = *(unsigned short *)(p + *len);
+		*len += 2;
 	}
 
-	args->len += size;
+	*len = ALIGN(*len + size, 4);
 
-	rem = args->len % 4;
-	if (rem) {
-		fseek(fp, 4 - rem, SEEK_CUR);
-		args->len += 4 - rem;
-	}
+	if (task_data_peek(&task->data, *len) == NULL)
+		return -1;
 
 	return 0;
 }
@@ -672,9 +1009,10 @@ int read_task_args(struct ftrace_task_handle *task,
 	struct ftrace_trigger tr = {};
 	struct ftrace_filter *fl;
 	struct ftrace_arg_spec *arg;
+	unsigned len = 0;
 	int rem;
 
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess == NULL) {
 		pr_dbg("cannot find session\n");
 		return -1;
@@ -691,6 +1029,7 @@ int read_task_args(struct ftrace_task_handle *task,
 	}
 
 	task->args.len = 0;
+	task->args.data = NULL;
 	task->args.args = &fl->args;
 
 	list_for_each_entry(arg, &fl->args, list) {
@@ -698,13 +1037,24 @@ int read_task_args(struct ftrace_task_handle *task,
 		if (is_retval != (arg->idx == RETVAL_IDX))
 			continue;
 
-		if (read_task_arg(task, arg) < 0)
+		if (read_task_arg(task, arg, &len) < 0)
 			return -1;
 	}
 
-	rem = task->args.len % 8;
+	/* the argument data is used in place */
+	if (len) {
+		task->args.data = task_data_peek(&task->data, len);
+		task->args.len = len;
+		task_data_skip(&task->data, len);
+	}
+
+	/* no padding after arguments in the compact format */
+	if (task->h->hdr.version >= UFTRACE_COMPACT_VERSION)
+		return 0;
+
+	rem = len % 8;
 	if (rem)
-		fseek(task->fp, 8 - rem, SEEK_CUR);
+		task_data_skip(&task->data, 8 - rem);
 
 	return 0;
 }
@@ -728,16 +1078,21 @@ int read_task_ustack(struct ftrace_file_handle *handle,
 	if (task->valid)
 		return 0;
 
-	if (task->done || task->fp == NULL)
+	if (task->done)
 		return -1;
 
 	if (__read_task_ustack(task) < 0) {
 		task->done = true;
-		fclose(task->fp);
-		task->fp = NULL;
+		close_task_data(&task->data);
 		return -1;
 	}
 
+	/* convert TSC timestamp into nsec */
+	if (handle->hdr.info_mask & (1UL << CLOCK_INFO) &&
+	    task->ustack.type != FTRACE_LOST)
+		task->ustack.time = tsc_to_nsec(&handle->info.tsc,
+						task->ustack.time);
+
 	if (task->lost_seen) {
 		int i;
 
@@ -789,7 +1144,7 @@ get_task_ustack(struct ftrace_file_handle *handle, int idx)
 		setup_task_handle(handle, &handle->tasks[idx],
 				  handle->info.tids[idx]);
 
-		if (handle->tasks[idx].fp == NULL)
+		if (handle->tasks[idx].done)
 			return NULL;
 	}
 
@@ -801,30 +1156,112 @@ get_task_ustack(struct ftrace_file_handle *handle, int idx)
 	return &task->ustack;
 }
 
-static int read_user_stack(struct ftrace_file_handle *handle,
-			   struct ftrace_task_handle **task)
+static bool task_heap_less(struct ftrace_file_handle *handle, int a, int b)
+{
+	uint64_t ta = handle->tasks[a].ustack.time;
+	uint64_t tb = handle->tasks[b].ustack.time;
+
+	/* keep the task order for records with a same timestamp */
+	if (ta != tb)
+		return ta < tb;
+	return a < b;
+}
+
+static void task_heap_down(struct ftrace_file_handle *handle, int pos)
 {
-	int i, next_i = -1;
-	uint64_t next_time;
-	struct ftrace_ret_stack *tmp;
+	int *heap = handle->task_heap;
+	int nr = handle->nr_task_heap;
+	int idx = heap[pos];
+
+	while (2 * pos + 1 < nr) {
+		int child = 2 * pos + 1;
+
+		if (child + 1 < nr &&
+		    task_heap_less(handle, heap[child + 1], heap[child]))
+			child++;
+
+		if (!task_heap_less(handle, heap[child], idx))
+			break;
+
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = idx;
+}
+
+static void task_heap_up(struct ftrace_file_handle *handle, int pos)
+{
+	int *heap = handle->task_heap;
+	int idx = heap[pos];
+
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+
+		if (!task_heap_less(handle, idx, heap[parent]))
+			break;
+
+		heap[pos] = heap[parent];
+		pos = parent;
+	}
+	heap[pos] = idx;
+}
+
+static void setup_task_heap(struct ftrace_file_handle *handle)
+{
+	int i;
+
+	handle->task_heap = xcalloc(handle->info.nr_tid + 1,
+				    sizeof(*handle->task_heap));
+	handle->nr_task_heap = 0;
 
 	for (i = 0; i < handle->info.nr_tid; i++) {
-		tmp = get_task_ustack(handle, i);
-		if (tmp == NULL)
+		if (get_task_ustack(handle, i) == NULL)
 			continue;
 
-		if (next_i < 0 || tmp->time < next_time) {
-			next_time = tmp->time;
-			next_i = i;
+		handle->task_heap[handle->nr_task_heap] = i;
+		task_heap_up(handle, handle->nr_task_heap++);
+	}
+}
+
+/*
+ * The tasks are kept in a min-heap ordered by the timestamp of their
+ * current record so that it doesn't need to scan all tasks for every
+ * record.  Only the task on the top can be consumed by read_rstack(),
+ * so it just needs to read the next record of the top task (if it was
+ * consumed) and to move it down to a proper position.
+ */
+static int read_user_stack(struct ftrace_file_handle *handle,
+			   struct ftrace_task_handle **task)
+{
+	struct ftrace_task_handle *top;
+	int idx;
+
+	if (handle->task_heap == NULL)
+		setup_task_heap(handle);
+
+	while (handle->nr_task_heap > 0) {
+		idx = handle->task_heap[0];
+		top = &handle->tasks[idx];
+
+		if (top->valid)
+			break;
+
+		if (read_task_ustack(handle, top) < 0) {
+			/* no more record in this task */
+			handle->task_heap[0] = handle->task_heap[--handle->nr_task_heap];
+			if (handle->nr_task_heap == 0)
+				break;
 		}
+		task_heap_down(handle, 0);
 	}
 
-	if (next_i < 0)
+	if (handle->nr_task_heap == 0)
 		return -1;
 
-	*task = &handle->tasks[next_i];
+	idx = handle->task_heap[0];
+	*task = &handle->tasks[idx];
 
-	return next_i;
+	return idx;
 }
 
 static int __read_rstack(struct ftrace_file_handle *handle,
@@ -1047,6 +1484,134 @@ kernel:
 	return 0;
 }
 
+/**
+ * check_time_range - check if a timestamp is in the time range
+ * @range: time range
+ * @timestamp: timestamp of a record
+ *
+ * This function returns 0 if @timestamp is in the @range, negative
+ * if it's before the range and positive if it's after the range.
+ */
+int check_time_range(struct ftrace_time_range *range, uint64_t timestamp)
+{
+	if (range->start && timestamp < range->start)
+		return -1;
+	if (range->stop && timestamp > range->stop)
+		return 1;
+	return 0;
+}
+
+/*
+ * Update the filter state and the display depth for a record consumed
+ * before the time range, like replay does when it prints the record.
+ */
+static void skip_fstack_rstack(struct ftrace_task_handle *task,
+			       struct ftrace_ret_stack *rstack)
+{
+	struct ftrace_trigger tr = { 0 };
+	struct fstack *fstack;
+
+	if (rstack->type == FTRACE_ENTRY) {
+		fstack = &task->func_stack[task->stack_count - 1];
+
+		if (fstack_entry(task, rstack, &tr) == 0)
+			fstack_update(FTRACE_ENTRY, task, fstack);
+	}
+	else if (rstack->type == FTRACE_EXIT) {
+		fstack = &task->func_stack[task->stack_count];
+
+		if (!(fstack->flags & FSTACK_FL_NORECORD) && fstack_enabled)
+			fstack_update(FTRACE_EXIT, task, fstack);
+
+		fstack_exit(task);
+	}
+}
+
+/*
+ * The frames restored from the index have no filter state.  Pass them
+ * to fstack_entry() as if their entry records were read.
+ */
+static void rebuild_index_frames(struct ftrace_task_handle *task)
+{
+	struct ftrace_ret_stack rstack = {
+		.type = FTRACE_ENTRY,
+	};
+	struct fstack *fstack;
+	unsigned i;
+
+	if (task->index_frames == NULL)
+		return;
+
+	task->stack_count = 0;
+	task->display_depth = 0;
+	task->filter.depth = task->h->depth;
+
+	for (i = 0; i < task->nr_index_frames; i++) {
+		rstack.addr  = task->index_frames[i].addr;
+		rstack.time  = task->index_frames[i].time;
+		rstack.depth = i;
+
+		/* fstack_entry() expects the stack_count was increased */
+		fstack = &task->func_stack[task->stack_count++];
+		skip_fstack_rstack(task, &rstack);
+
+		/* it cannot be in the middle of the stack */
+		fstack->flags &= ~(FSTACK_FL_EXEC | FSTACK_FL_LONGJMP);
+	}
+
+	task->user_stack_count = task->stack_count;
+	task->user_display_depth = task->display_depth;
+	task->display_depth_set = true;
+
+	free(task->index_frames);
+	task->index_frames = NULL;
+	task->nr_index_frames = 0;
+}
+
+/*
+ * Records before the time range are consumed at first so that func_stack
+ * and the filter state are same as if replay read them all.  Records are
+ * read in time order so it can stop when it sees a record after the range.
+ * It uses fstack_entry() and friends which are not thread-safe.
+ */
+static int read_rstack_range(struct ftrace_file_handle *handle,
+			     struct ftrace_task_handle **taskp,
+			     bool invalidate)
+{
+	struct ftrace_time_range *range = &handle->time_range;
+	struct ftrace_ret_stack *rstack;
+	int i;
+
+	if (range->start && !handle->time_range_skipped) {
+		handle->time_range_skipped = true;
+
+		/* all tasks are set up by the first read */
+		if (__read_rstack(handle, taskp, false) < 0)
+			return -1;
+
+		for (i = 0; i < handle->nr_tasks; i++)
+			rebuild_index_frames(&handle->tasks[i]);
+
+		while (__read_rstack(handle, taskp, false) == 0 &&
+		       (*taskp)->rstack->time < range->start) {
+			rstack = (*taskp)->rstack;
+
+			__read_rstack(handle, taskp, true);
+			skip_fstack_rstack(*taskp, rstack);
+		}
+	}
+
+	if (range->stop) {
+		if (__read_rstack(handle, taskp, false) < 0)
+			return -1;
+
+		if ((*taskp)->rstack->time > range->stop)
+			return -1;
+	}
+
+	return __read_rstack(handle, taskp, invalidate);
+}
+
 /**
  * read_rstack - read and consume the oldest ftrace stack
  * @handle: file handle
@@ -1064,7 +1629,7 @@ kernel:
 int read_rstack(struct ftrace_file_handle *handle,
 		struct ftrace_task_handle **task)
 {
-	return __read_rstack(handle, task, true);
+	return read_rstack_range(handle, task, true);
 }
 
 /**
@@ -1084,13 +1649,14 @@ int read_rstack(struct ftrace_file_handle *handle,
 int peek_rstack(struct ftrace_file_handle *handle,
 		struct ftrace_task_handle **task)
 {
-	return __read_rstack(handle, task, false);
+	return read_rstack_range(handle, task, false);
 }
 
 
 #ifdef UNIT_TEST
 
-#include <sys/stat.h>
+#include <time.h>
+#include <inttypes.h>
 
 #define NUM_TASK    2
 #define NUM_RECORD  4
@@ -1216,6 +1782,36 @@ TEST_CASE(fstack_read)
 	return TEST_OK;
 }
 
+TEST_CASE(fstack_read_single)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_file_handle single;
+	struct ftrace_task_handle *task;
+	int i;
+
+	TEST_EQ(fstack_test_setup_file(handle, ARRAY_SIZE(test_tids)), 0);
+
+	/* it should read records of the second task only */
+	setup_single_task_handle(handle, &single, 1);
+
+	for (i = 0; i < NUM_RECORD; i++) {
+		TEST_EQ(read_rstack(&single, &task), 0);
+		TEST_EQ(task->tid, test_tids[1]);
+		TEST_EQ((uint64_t)task->rstack->type,  (uint64_t)test_record[1][i].type);
+		TEST_EQ((uint64_t)task->rstack->depth, (uint64_t)test_record[1][i].depth);
+		TEST_EQ((uint64_t)task->rstack->addr,  (uint64_t)test_record[1][i].addr);
+	}
+	TEST_LT(read_rstack(&single, &task), 0);
+
+	/* the stack state of the task was updated */
+	TEST_EQ(task->stack_count, 0);
+	TEST_EQ(task->func_stack[0].total_time,
+		test_record[1][3].time - test_record[1][0].time);
+
+	reset_task_handle(&single);
+	return TEST_OK;
+}
+
 TEST_CASE(fstack_skip)
 {
 	struct ftrace_file_handle *handle = &fstack_test_handle;
@@ -1251,4 +1847,242 @@ TEST_CASE(fstack_skip)
 	return TEST_OK;
 }
 
+TEST_CASE(fstack_time_range)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+
+	/* this makes to skip depth 1 records */
+	handle->depth = 1;
+
+	/* start in the middle of the depth 1 function */
+	handle->time_range.start = 250;
+	handle->time_range_skipped = false;
+
+	/* records are skipped in the first read, set up the task before */
+	handle->nr_tasks = 1;
+	handle->tasks = xcalloc(1, sizeof(*handle->tasks));
+	setup_task_handle(handle, &handle->tasks[0], test_tids[0]);
+
+	/* for fstack_entry not to crash */
+	handle->tasks[0].t = &test_tasks[0];
+
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ(task->tid, test_tids[0]);
+	TEST_EQ((uint64_t)task->rstack->type,  (uint64_t)test_record[0][2].type);
+	TEST_EQ((uint64_t)task->rstack->depth, (uint64_t)test_record[0][2].depth);
+	TEST_EQ((uint64_t)task->rstack->time,  (uint64_t)test_record[0][2].time);
+
+	/* the filter state should be same as replay read the skipped ones */
+	TEST_EQ(task->display_depth, 1);
+	TEST_EQ(task->filter.depth, 0);
+	TEST_NE(task->func_stack[1].flags & FSTACK_FL_NORECORD, 0UL);
+
+	return TEST_OK;
+}
+
+static void fstack_test_write_compact(FILE *fp, struct ftrace_ret_stack *rstack,
+				      int nr)
+{
+	uint8_t buf[FTRACE_COMPACT_MAX];
+	uint64_t prev_time = 0;
+	unsigned long addrs[NUM_RECORD];
+	int nr_addr = 0;
+	int i, k;
+
+	fputc(FTRACE_COMPACT_SYNC, fp);
+
+	for (i = 0; i < nr; i++) {
+		enum ftrace_compact_addr mode = FTRACE_ADDR_DEFINE;
+		unsigned n = 1;
+
+		n += put_varint(buf + n, zigzag_encode(rstack[i].time - prev_time));
+		n += put_varint(buf + n, rstack[i].depth);
+		prev_time = rstack[i].time;
+
+		for (k = 0; k < nr_addr; k++) {
+			if (addrs[k] == rstack[i].addr)
+				break;
+		}
+
+		if (k < nr_addr) {
+			mode = FTRACE_ADDR_INDEX;
+			n += put_varint(buf + n, k);
+		}
+		else {
+			addrs[nr_addr++] = rstack[i].addr;
+			n += put_varint(buf + n, rstack[i].addr);
+		}
+
+		buf[0] = rstack[i].type | (mode << FTRACE_COMPACT_ADDR_SHIFT);
+		fwrite(buf, n, 1, fp);
+	}
+}
+
+TEST_CASE(fstack_read_compact)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	char *filename;
+	FILE *fp;
+	int i;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+	handle->hdr.version = UFTRACE_COMPACT_VERSION;
+
+	/* overwrite the data file in the compact format */
+	TEST_NE(asprintf(&filename, "%s/%d.dat", handle->dirname,
+			 test_tids[0]), -1);
+	fp = fopen(filename, "w");
+	TEST_NE(fp, NULL);
+	fstack_test_write_compact(fp, test_record[0], NUM_RECORD);
+	fclose(fp);
+	free(filename);
+
+	for (i = 0; i < NUM_RECORD; i++) {
+		TEST_EQ(read_rstack(handle, &task), 0);
+		TEST_EQ(task->tid, test_tids[0]);
+		TEST_EQ(task->rstack->time,  test_record[0][i].time);
+		TEST_EQ((uint64_t)task->rstack->type,  (uint64_t)test_record[0][i].type);
+		TEST_EQ((uint64_t)task->rstack->depth, (uint64_t)test_record[0][i].depth);
+		TEST_EQ((uint64_t)task->rstack->addr,  (uint64_t)test_record[0][i].addr);
+	}
+	TEST_LT(read_rstack(handle, &task), 0);
+
+	handle->hdr.version = 0;
+	return TEST_OK;
+}
+
+TEST_CASE(fstack_read_window)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	struct ftrace_ret_stack rstack[1024];
+	char *filename;
+	FILE *fp;
+	int i;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+	handle->hdr.version = UFTRACE_COMPACT_VERSION;
+
+	for (i = 0; i < (int)ARRAY_SIZE(rstack); i++) {
+		rstack[i] = test_record[0][i % NUM_RECORD];
+		rstack[i].time += (i / NUM_RECORD) * 1000;
+	}
+
+	/* records will cross the page boundary in the compact format */
+	TEST_NE(asprintf(&filename, "%s/%d.dat", handle->dirname,
+			 test_tids[0]), -1);
+	fp = fopen(filename, "w");
+	TEST_NE(fp, NULL);
+	fstack_test_write_compact(fp, rstack, ARRAY_SIZE(rstack));
+	fclose(fp);
+	free(filename);
+
+	/* force to use a small sliding window */
+	task_data_map_max = 0;
+	task_data_window = getpagesize();
+
+	for (i = 0; i < (int)ARRAY_SIZE(rstack); i++) {
+		TEST_EQ(read_rstack(handle, &task), 0);
+		TEST_EQ(task->rstack->time, rstack[i].time);
+		TEST_EQ((uint64_t)task->rstack->type,  (uint64_t)rstack[i].type);
+		TEST_EQ((uint64_t)task->rstack->addr,  (uint64_t)rstack[i].addr);
+	}
+	TEST_LT(read_rstack(handle, &task), 0);
+
+	task_data_map_max = TASK_DATA_MAP_MAX;
+	task_data_window = TASK_DATA_WINDOW;
+	handle->hdr.version = 0;
+	return TEST_OK;
+}
+
+#define NUM_MANY_TASK    256
+#define NUM_MANY_RECORD  64
+
+static int test_many_tids[NUM_MANY_TASK];
+
+static int fstack_test_setup_many(struct ftrace_file_handle *handle)
+{
+	struct ftrace_ret_stack rstack[NUM_MANY_RECORD];
+	char *filename;
+	int i, k;
+
+	handle->dirname = "tmp.dir";
+	handle->info.tids = test_many_tids;
+	handle->info.nr_tid = NUM_MANY_TASK;
+	handle->hdr.max_stack = 16;
+
+	if (mkdir(handle->dirname, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	atexit(fstack_test_finish_file);
+
+	for (i = 0; i < NUM_MANY_TASK; i++) {
+		FILE *fp;
+
+		test_many_tids[i] = 10000 + i;
+
+		/* interleave records of all tasks in a different order */
+		for (k = 0; k < NUM_MANY_RECORD; k++) {
+			rstack[k].time   = (uint64_t)k * NUM_MANY_TASK +
+					   (i * 37) % NUM_MANY_TASK;
+			rstack[k].type   = (k % 2) ? FTRACE_EXIT : FTRACE_ENTRY;
+			rstack[k].more   = 0;
+			rstack[k].unused = FTRACE_UNUSED;
+			rstack[k].depth  = 0;
+			rstack[k].addr   = 0x40000 + i;
+		}
+
+		if (asprintf(&filename, "%s/%d.dat", handle->dirname,
+			     test_many_tids[i]) < 0)
+			return -1;
+
+		fp = fopen(filename, "w");
+		free(filename);
+		if (fp == NULL)
+			return -1;
+
+		fwrite(rstack, sizeof(rstack[0]), NUM_MANY_RECORD, fp);
+		fclose(fp);
+	}
+	return 0;
+}
+
+TEST_CASE(fstack_read_many)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	struct timespec start, end;
+	uint64_t prev_time = 0;
+	uint64_t elapsed;
+	int nr = 0;
+
+	TEST_EQ(fstack_test_setup_many(handle), 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (read_rstack(handle, &task) == 0) {
+		TEST_GE(task->rstack->time, prev_time);
+		TEST_EQ((uint64_t)task->rstack->addr,
+			(uint64_t)0x40000 + task->tid - 10000);
+
+		prev_time = task->rstack->time;
+		nr++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	TEST_EQ(nr, NUM_MANY_TASK * NUM_MANY_RECORD);
+
+	elapsed = (end.tv_sec - start.tv_sec) * NSEC_PER_SEC +
+		  end.tv_nsec - start.tv_nsec;
+	pr_dbg("read %d records of %d tasks in %"PRIu64" usec\n",
+	       nr, NUM_MANY_TASK, elapsed / 1000);
+
+	return TEST_OK;
+}
+
 #endif /* UNIT_TEST */
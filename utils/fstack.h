@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #include "../uftrace.h"
 
@@ -36,10 +37,13 @@ struct ftrace_task_handle {
 	bool done;
 	bool lost_seen;
 	bool display_depth_set;
-	FILE *fp;
 	struct sym *func;
 	struct ftrace_task *t;
 	struct ftrace_file_handle *h;
+	/* cached session and the time range it's valid */
+	struct ftrace_session *sess;
+	uint64_t sess_start;
+	uint64_t sess_end;
 	struct ftrace_ret_stack ustack;
 	struct ftrace_ret_stack kstack;
 	struct ftrace_ret_stack *rstack;
@@ -64,6 +68,28 @@ struct ftrace_task_handle {
 		uint64_t child_time;
 	} *func_stack;
 	struct fstack_arguments args;
+	/* window of the data file which records are read from in place */
+	struct task_data {
+		int		fd;
+		FILE		*fp;	/* decompressed stream (not mapped) */
+		char		*buf;
+		size_t		size;	/* valid bytes in the buf */
+		size_t		alloc;	/* mapped or allocated bytes */
+		off_t		start;	/* file offset of the buf */
+		off_t		pos;	/* current read position */
+		off_t		file_size;
+	} data;
+	/* states to decode the compact format (v5) */
+	struct compact {
+		uint64_t	time;
+		unsigned long	*addrs;
+		unsigned	nr_addr;
+		unsigned	alloc_addr;
+		off_t		sync;	/* offset of the last sync marker */
+	} compact;
+	/* frames restored from the index, see rebuild_index_frames() */
+	struct ftrace_index_frame *index_frames;
+	unsigned nr_index_frames;
 };
 
 enum argspec_string_bits {
@@ -91,6 +117,8 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 struct ftrace_task_handle *get_task_handle(struct ftrace_file_handle *handle,
 					   int tid);
 void reset_task_handle(struct ftrace_file_handle *handle);
+void setup_single_task_handle(struct ftrace_file_handle *handle,
+			      struct ftrace_file_handle *single, int idx);
 
 int read_rstack(struct ftrace_file_handle *handle,
 		struct ftrace_task_handle **task);
@@ -99,12 +127,19 @@ int peek_rstack(struct ftrace_file_handle *handle,
 
 struct ftrace_ret_stack *
 get_task_ustack(struct ftrace_file_handle *handle, int idx);
+struct ftrace_session *get_task_session(struct ftrace_task_handle *task,
+					uint64_t timestamp);
 int read_task_ustack(struct ftrace_file_handle *handle,
 		     struct ftrace_task_handle *task);
 int read_task_args(struct ftrace_task_handle *task,
 		   struct ftrace_ret_stack *rstack,
 		   bool is_retval);
 
+int check_time_range(struct ftrace_time_range *range, uint64_t timestamp);
+int write_task_index(struct ftrace_file_handle *handle);
+int seek_task_index(struct ftrace_file_handle *handle,
+		    struct ftrace_task_handle *task, uint64_t time);
+
 void setup_task_filter(char *tid_filter, struct ftrace_file_handle *handle);
 int setup_fstack_filters(char *filter_str, char *trigger_str);
 void setup_fstack_args(char *argspec);
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "index"
+#define PR_DOMAIN  DBG_FSTACK
+
+#include "uftrace.h"
+#include "utils/utils.h"
+#include "utils/fstack.h"
+
+
+static char *index_filename(struct ftrace_file_handle *handle, int tid)
+{
+	char *filename;
+
+	xasprintf(&filename, "%s/%d.idx", handle->dirname, tid);
+	return filename;
+}
+
+/* update the open frames like __read_rstack() does for func_stack */
+static void update_index_stack(struct ftrace_index_frame *stack, int max_stack,
+			       struct ftrace_ret_stack *rstack)
+{
+	struct ftrace_index_frame *frame;
+	uint64_t delta = 0;
+	int depth = rstack->depth;
+
+	if (rstack->type == FTRACE_LOST) {
+		memset(stack, 0, max_stack * sizeof(*stack));
+		return;
+	}
+
+	if (depth >= max_stack)
+		return;
+
+	frame = &stack[depth];
+
+	if (rstack->type == FTRACE_ENTRY) {
+		frame->addr = rstack->addr;
+		frame->time = rstack->time;
+		frame->child_time = 0;
+		return;
+	}
+
+	if (frame->addr)
+		delta = rstack->time - frame->time;
+	if (depth > 0)
+		frame[-1].child_time += delta;
+
+	memset(frame, 0, sizeof(*frame));
+}
+
+static int write_index_file(struct ftrace_file_handle *handle, int tid)
+{
+	struct ftrace_task_handle task;
+	struct ftrace_ret_stack *rstack = &task.ustack;
+	struct ftrace_index_header hdr;
+	struct ftrace_index_entry *entries = NULL;
+	struct ftrace_index_frame *frames = NULL;
+	struct ftrace_index_frame *stack;
+	unsigned nr_entry = 0, nr_frame = 0;
+	unsigned alloc_entry = 0, alloc_frame = 0;
+	int max_stack = handle->hdr.max_stack;
+	unsigned count = 0;
+	char *filename;
+	FILE *fp;
+	int ret = -1;
+
+	setup_task_handle(handle, &task, tid);
+	if (task.done)
+		goto out;
+
+	stack = xcalloc(max_stack, sizeof(*stack));
+
+	while (true) {
+		off_t offset = task.data.pos;
+		bool can_seek = true;
+		unsigned depth;
+
+		if (read_task_ustack(handle, &task) < 0)
+			break;
+		task.valid = false;
+
+		/* the compact format can be read from a sync marker only */
+		if (handle->hdr.version >= UFTRACE_COMPACT_VERSION) {
+			can_seek = task.compact.sync >= offset;
+			offset = task.compact.sync;
+		}
+
+		depth = rstack->depth;
+		if (rstack->type == FTRACE_EXIT)
+			depth++;
+
+		if (++count >= UFTRACE_INDEX_INTERVAL && can_seek &&
+		    rstack->type != FTRACE_LOST && depth <= (unsigned)max_stack) {
+			struct ftrace_index_entry *entry;
+
+			if (nr_entry == alloc_entry) {
+				alloc_entry = alloc_entry ? alloc_entry * 2 : 64;
+				entries = xrealloc(entries, alloc_entry * sizeof(*entries));
+			}
+			if (nr_frame + depth > alloc_frame) {
+				alloc_frame = alloc_frame ? alloc_frame * 2 : 1024;
+				alloc_frame += depth;
+				frames = xrealloc(frames, alloc_frame * sizeof(*frames));
+			}
+
+			entry = &entries[nr_entry++];
+			entry->time   = rstack->time;
+			entry->offset = offset;
+			entry->depth  = depth;
+			entry->frame  = nr_frame;
+
+			memcpy(&frames[nr_frame], stack, depth * sizeof(*stack));
+			nr_frame += depth;
+			count = 0;
+		}
+
+		update_index_stack(stack, max_stack, rstack);
+	}
+
+	free(stack);
+
+	/* small file doesn't need an index */
+	if (nr_entry == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	filename = index_filename(handle, tid);
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		pr_log("cannot open index file: %s: %m\n", filename);
+		free(filename);
+		goto out;
+	}
+
+	memcpy(hdr.magic, UFTRACE_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version  = UFTRACE_INDEX_VERSION;
+	hdr.tid      = tid;
+	hdr.nr_entry = nr_entry;
+	hdr.nr_frame = nr_frame;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(entries, sizeof(*entries), nr_entry, fp) != nr_entry ||
+	    fwrite(frames, sizeof(*frames), nr_frame, fp) != nr_frame) {
+		pr_log("cannot write index file: %s\n", filename);
+		fclose(fp);
+		unlink(filename);
+		free(filename);
+		goto out;
+	}
+
+	pr_dbg2("%s: %u checkpoints\n", filename, nr_entry);
+	fclose(fp);
+	free(filename);
+	ret = 0;
+
+out:
+	free(entries);
+	free(frames);
+	free(task.func_stack);
+	free(task.compact.addrs);
+	return ret;
+}
+
+/**
+ * write_task_index - write index files of all tasks
+ * @handle: file handle
+ *
+ * This function reads all records of each task and saves checkpoints
+ * in every %UFTRACE_INDEX_INTERVAL records to <tid>.idx file so that
+ * readers can start from the middle of the data.  Compressed data is
+ * not supported since it cannot be read from the middle.
+ */
+int write_task_index(struct ftrace_file_handle *handle)
+{
+	int i;
+
+	if (handle->hdr.feat_mask & COMPRESSED)
+		return -1;
+
+	/* it needs to read all records */
+	memset(&handle->time_range, 0, sizeof(handle->time_range));
+
+	for (i = 0; i < handle->info.nr_tid; i++)
+		write_index_file(handle, handle->info.tids[i]);
+
+	return 0;
+}
+
+/**
+ * seek_task_index - move the read position of the task using index
+ * @handle: file handle
+ * @task: task handle just set up
+ * @time: timestamp to seek
+ *
+ * This function finds the last checkpoint before @time in the index
+ * file and moves the read position of @task to the checkpoint.  The
+ * func_stack is restored as if it read the records before, and the
+ * frames are kept in @task to rebuild the filter state later.  The
+ * caller still needs to skip records until @time.
+ *
+ * It returns 0 if succeeded, -1 if the index cannot be used.
+ */
+int seek_task_index(struct ftrace_file_handle *handle,
+		    struct ftrace_task_handle *task, uint64_t time)
+{
+	struct ftrace_index_header hdr;
+	struct ftrace_index_entry *entries = NULL;
+	struct ftrace_index_entry *entry;
+	struct ftrace_index_frame *frames = NULL;
+	char *filename;
+	FILE *fp;
+	unsigned lo, hi, mid;
+	unsigned i;
+	int ret = -1;
+
+	if (handle->hdr.feat_mask & COMPRESSED)
+		return -1;
+
+	filename = index_filename(handle, task->tid);
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		free(filename);
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, UFTRACE_INDEX_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != UFTRACE_INDEX_VERSION || hdr.tid != (unsigned)task->tid) {
+		pr_log("invalid index file: %s\n", filename);
+		goto out;
+	}
+
+	entries = xmalloc(hdr.nr_entry * sizeof(*entries));
+	if (fread(entries, sizeof(*entries), hdr.nr_entry, fp) != hdr.nr_entry) {
+		pr_log("index file is truncated: %s\n", filename);
+		goto out;
+	}
+
+	/* find the last checkpoint not after the time */
+	lo = 0;
+	hi = hdr.nr_entry;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (entries[mid].time <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		goto out;
+
+	entry = &entries[lo - 1];
+	if (entry->depth > (unsigned)handle->hdr.max_stack ||
+	    entry->frame + entry->depth > hdr.nr_frame)
+		goto out;
+
+	frames = xcalloc(entry->depth + 1, sizeof(*frames));
+
+	fseek(fp, sizeof(hdr) + hdr.nr_entry * sizeof(*entries) +
+	      entry->frame * sizeof(*frames), SEEK_SET);
+	if (fread(frames, sizeof(*frames), entry->depth, fp) != entry->depth) {
+		pr_log("index file is truncated: %s\n", filename);
+		goto out;
+	}
+
+	for (i = 0; i < entry->depth; i++) {
+		struct fstack *fstack = &task->func_stack[i];
+
+		fstack->addr       = frames[i].addr;
+		fstack->valid      = frames[i].addr != 0;
+		fstack->total_time = frames[i].time;
+		fstack->child_time = frames[i].child_time;
+	}
+
+	/* filter state of the frames is rebuilt when reading records */
+	task->index_frames = frames;
+	task->nr_index_frames = entry->depth;
+	frames = NULL;
+
+	task->data.pos = entry->offset;
+	task->compact.time = 0;
+	task->compact.nr_addr = 0;
+
+	pr_dbg("task %d: start from offset %"PRIu64" with %u frames\n",
+	       task->tid, entry->offset, entry->depth);
+	ret = 0;
+
+out:
+	fclose(fp);
+	free(entries);
+	free(frames);
+	free(filename);
+	return ret;
+}
@@ -31,6 +31,9 @@
 
 static bool kernel_tracing_enabled;
 
+/* it's cleared when the kernel doesn't support splicing trace_pipe_raw */
+static bool kernel_splice = true;
+
 
 static char *get_tracing_file(const char *name)
 {
@@ -323,15 +326,34 @@ setup:
 
 	kernel->traces	= xcalloc(n, sizeof(*kernel->traces));
 	kernel->fds	= xcalloc(n, sizeof(*kernel->fds));
+	kernel->pipes	= xcalloc(n * 2, sizeof(*kernel->pipes));
 
  	for (i = 0; i < kernel->nr_cpus; i++) {
 		kernel->traces[i] = -1;
 		kernel->fds[i] = -1;
+		kernel->pipes[i * 2] = -1;
+		kernel->pipes[i * 2 + 1] = -1;
 	}
 
 	return 0;
 }
 
+static void close_trace_files(struct ftrace_kernel *kernel)
+{
+	int i;
+
+	for (i = 0; i < kernel->nr_cpus; i++) {
+		close(kernel->traces[i]);
+		close(kernel->fds[i]);
+		close(kernel->pipes[i * 2]);
+		close(kernel->pipes[i * 2 + 1]);
+	}
+
+	free(kernel->traces);
+	free(kernel->fds);
+	free(kernel->pipes);
+}
+
 /**
  * start_kernel_tracing - prepare to record kernel ftrace data (binary)
  * @kernel : kernel ftrace handle
@@ -383,6 +405,11 @@ int start_kernel_tracing(struct ftrace_kernel *kernel)
 			pr_dbg("failed to open output file: %s: %m\n", buf);
 			goto out;
 		}
+
+		if (kernel_splice && pipe(&kernel->pipes[i * 2]) < 0) {
+			pr_dbg("cannot create pipe, disable splice: %m\n");
+			kernel_splice = false;
+		}
 	}
 
 	if (write_tracing_file("tracing_on", "1") < 0) {
@@ -394,33 +421,17 @@ int start_kernel_tracing(struct ftrace_kernel *kernel)
 	return 0;
 
 out:
-	for (i = 0; kernel->nr_cpus; i++) {
-		close(kernel->traces[i]);
-		close(kernel->fds[i]);
-	}
-
-	free(kernel->traces);
-	free(kernel->fds);
-
+	close_trace_files(kernel);
 	reset_tracing_files();
 	return -1;
 }
 
-/**
- * record_kernel_trace_pipe - read and save kernel ftrace data for specific cpu
- * @kernel - kernel ftrace handle
- * @cpu - cpu to read
- *
- * This function read trace data for @cpu and save it to file.
- */
-int record_kernel_trace_pipe(struct ftrace_kernel *kernel, int cpu)
+/* read and save a (possibly partial) page of @cpu by copying data */
+static int read_kernel_trace_pipe(struct ftrace_kernel *kernel, int cpu)
 {
 	char buf[4096];
 	ssize_t n;
 
-	if (cpu < 0 || cpu >= kernel->nr_cpus)
-		return 0;
-
 retry:
 	n = read(kernel->traces[cpu], buf, sizeof(buf));
 	if (n < 0) {
@@ -438,6 +449,68 @@ retry:
 	return n;
 }
 
+/* move a full page of @cpu to the file without copying to user */
+static int splice_kernel_trace_pipe(struct ftrace_kernel *kernel, int cpu)
+{
+	int *pfd = &kernel->pipes[cpu * 2];
+	ssize_t in, out;
+	ssize_t left;
+
+retry:
+	in = splice(kernel->traces[cpu], NULL, pfd[1], NULL, getpagesize(),
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (in < 0) {
+		if (errno == EINTR)
+			goto retry;
+		if (errno == EAGAIN)
+			return 0;
+		else
+			return -errno;
+	}
+
+	left = in;
+	while (left > 0) {
+		out = splice(pfd[0], NULL, kernel->fds[cpu], NULL, left,
+			     SPLICE_F_MOVE);
+		if (out < 0 && errno == EINTR)
+			continue;
+		if (out <= 0)
+			return -1;
+		left -= out;
+	}
+
+	return in;
+}
+
+/**
+ * record_kernel_trace_pipe - read and save kernel ftrace data for specific cpu
+ * @kernel - kernel ftrace handle
+ * @cpu - cpu to read
+ *
+ * This function read trace data for @cpu and save it to file.  The data
+ * is spliced a page at a time so only full pages are saved.  A partial
+ * page is left in the kernel until finish_kernel_tracing().
+ */
+int record_kernel_trace_pipe(struct ftrace_kernel *kernel, int cpu)
+{
+	int ret;
+
+	if (cpu < 0 || cpu >= kernel->nr_cpus)
+		return 0;
+
+	if (!kernel_splice)
+		return read_kernel_trace_pipe(kernel, cpu);
+
+	ret = splice_kernel_trace_pipe(kernel, cpu);
+	if (ret == -EINVAL || ret == -ENOSYS) {
+		pr_dbg("cannot splice the trace data, disable splice\n");
+		kernel_splice = false;
+		return read_kernel_trace_pipe(kernel, cpu);
+	}
+
+	return ret;
+}
+
 /**
  * record_kernel_tracing - read and save kernel ftrace data (binary)
  * @kernel - kernel ftrace handle
@@ -497,14 +570,13 @@ int finish_kernel_tracing(struct ftrace_kernel *kernel)
 	while (record_kernel_tracing(kernel) > 0)
 		continue;
 
+	/* splice() leaves the last partial page, read it out */
 	for (i = 0; i < kernel->nr_cpus; i++) {
-		close(kernel->traces[i]);
-		close(kernel->fds[i]);
+		while (read_kernel_trace_pipe(kernel, i) > 0)
+			continue;
 	}
 
-	free(kernel->traces);
-	free(kernel->fds);
-
+	close_trace_files(kernel);
 	reset_tracing_files();
 
 	return 0;
@@ -571,6 +643,12 @@ int setup_kernel_data(struct ftrace_kernel *kernel)
 	kernel->rstack_done   = xcalloc(kernel->nr_cpus, sizeof(*kernel->rstack_done));
 	kernel->missed_events = xcalloc(kernel->nr_cpus, sizeof(*kernel->missed_events));
 
+	/* it'll be built on the first read_kernel_stack() */
+	kernel->heap    = xcalloc(kernel->nr_cpus, sizeof(*kernel->heap));
+	kernel->nr_heap = -1;
+
+	kernel->records = NULL;
+
 	/* FIXME: should read recorded data file */
 	if (pevent_is_file_bigendian(kernel->pevent))
 		endian = KBUFFER_ENDIAN_BIG;
@@ -674,6 +752,7 @@ int finish_kernel_data(struct ftrace_kernel *kernel)
 	free(kernel->rstack_valid);
 	free(kernel->rstack_done);
 	free(kernel->missed_events);
+	free(kernel->heap);
 
 	trace_seq_destroy(&trace_seq);
 	pevent_free(kernel->pevent);
@@ -828,46 +907,242 @@ int read_kernel_cpu_data(struct ftrace_kernel *kernel, int cpu)
 	return 0;
 }
 
+static uint64_t kernel_rstack_time(struct ftrace_kernel *kernel, int cpu)
+{
+	return kernel->rstacks[cpu].end_time ?: kernel->rstacks[cpu].start_time;
+}
+
+static bool kernel_heap_less(struct ftrace_kernel *kernel, int a, int b)
+{
+	uint64_t ta = kernel_rstack_time(kernel, a);
+	uint64_t tb = kernel_rstack_time(kernel, b);
+
+	if (ta != tb)
+		return ta < tb;
+	return a < b;
+}
+
+static void kernel_heap_down(struct ftrace_kernel *kernel, int pos)
+{
+	int *heap = kernel->heap;
+	int nr = kernel->nr_heap;
+	int cpu = heap[pos];
+
+	while (2 * pos + 1 < nr) {
+		int child = 2 * pos + 1;
+
+		if (child + 1 < nr &&
+		    kernel_heap_less(kernel, heap[child + 1], heap[child]))
+			child++;
+
+		if (!kernel_heap_less(kernel, heap[child], cpu))
+			break;
+
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = cpu;
+}
+
+static void setup_kernel_heap(struct ftrace_kernel *kernel)
+{
+	int i;
+
+	kernel->nr_heap = 0;
+
+	for (i = 0; i < kernel->nr_cpus; i++) {
+		if (kernel->rstack_done[i])
+			continue;
+
+		if (!kernel->rstack_valid[i]) {
+			read_kernel_cpu_data(kernel, i);
+			if (!kernel->rstack_valid[i])
+				continue;
+		}
+
+		kernel->heap[kernel->nr_heap++] = i;
+	}
+
+	for (i = kernel->nr_heap / 2 - 1; i >= 0; i--)
+		kernel_heap_down(kernel, i);
+}
+
+/* a task kernel handle has a single slot which is filled from records */
+static int read_kernel_record(struct ftrace_kernel *kernel,
+			      struct mcount_ret_stack *rstack)
+{
+	int idx = kernel->records_idx;
+
+	if (!kernel->rstack_valid[0]) {
+		if (idx == kernel->nr_records)
+			return -1;
+
+		memcpy(&kernel->rstacks[0], &kernel->records[idx],
+		       sizeof(*kernel->rstacks));
+		kernel->missed_events[0] = kernel->records_missed[idx];
+		kernel->rstack_valid[0] = true;
+		kernel->records_idx++;
+	}
+
+	memcpy(rstack, &kernel->rstacks[0], sizeof(*rstack));
+	return 0;
+}
+
 /**
  * read_kernel_stack - peek next kernel ftrace data
  * @kernel - kernel ftrace handle
  * @rstack - ftrace return stack
  *
  * This function returns next return stack (based on timestamp)
- * from data files.
+ * from data files.  The cpus are kept in a min-heap so only the cpu
+ * consumed last time needs to be read and reordered.
  */
 int read_kernel_stack(struct ftrace_kernel *kernel,
 		      struct mcount_ret_stack *rstack)
 {
-	int i;
-	int first_cpu = -1;
-	uint64_t first_timestamp = 0;
-	struct mcount_ret_stack *first_rstack = NULL;
+	int cpu;
 
-	for (i = 0; i < kernel->nr_cpus; i++) {
-		uint64_t timestamp;
+	if (kernel->records)
+		return read_kernel_record(kernel, rstack);
 
-		if (kernel->rstack_done[i])
-			continue;
+	if (kernel->nr_heap < 0)
+		setup_kernel_heap(kernel);
 
-		if (!kernel->rstack_valid[i]) {
-			read_kernel_cpu_data(kernel, i);
-			if (!kernel->rstack_valid[i])
-				continue;
-		}
+	while (kernel->nr_heap > 0) {
+		cpu = kernel->heap[0];
+
+		if (kernel->rstack_valid[cpu])
+			break;
 
-		timestamp = kernel->rstacks[i].end_time ?: kernel->rstacks[i].start_time;
-		if (!first_rstack || first_timestamp > timestamp) {
-			first_rstack = &kernel->rstacks[i];
-			first_timestamp = timestamp;
-			first_cpu = i;
+		if (kernel->rstack_done[cpu] ||
+		    read_kernel_cpu_data(kernel, cpu) < 0) {
+			/* no more record in this cpu */
+			kernel->heap[0] = kernel->heap[--kernel->nr_heap];
+			if (kernel->nr_heap == 0)
+				break;
 		}
+		kernel_heap_down(kernel, 0);
 	}
 
-	if (first_rstack == NULL)
+	if (kernel->nr_heap == 0)
 		return -1;
 
-	memcpy(rstack, first_rstack, sizeof(*rstack));
+	cpu = kernel->heap[0];
+	memcpy(rstack, &kernel->rstacks[cpu], sizeof(*rstack));
 
-	return first_cpu;
+	return cpu;
+}
+
+struct kernel_tid {
+	int tid;
+	int idx;
+};
+
+static int cmp_kernel_tid(const void *a, const void *b)
+{
+	const struct kernel_tid *ka = a;
+	const struct kernel_tid *kb = b;
+
+	return ka->tid - kb->tid;
+}
+
+static void add_kernel_record(struct ftrace_kernel *kernel,
+			      struct mcount_ret_stack *rstack, int missed)
+{
+	int nr = kernel->nr_records;
+
+	/* double the size when it's full (i.e. a power of 2) */
+	if ((nr & (nr - 1)) == 0) {
+		int size = nr ? nr * 2 : 1;
+
+		kernel->records = xrealloc(kernel->records,
+					   size * sizeof(*kernel->records));
+		kernel->records_missed = xrealloc(kernel->records_missed,
+						  size * sizeof(*kernel->records_missed));
+	}
+
+	memcpy(&kernel->records[nr], rstack, sizeof(*rstack));
+	kernel->records_missed[nr] = missed;
+	kernel->nr_records++;
+}
+
+/**
+ * split_kernel_data - read all kernel records and split them by task
+ * @kernel - kernel ftrace handle
+ * @nr_tid - number of tasks
+ * @tids - array of task ids
+ *
+ * This function consumes all records in @kernel and returns an array
+ * of @nr_tid kernel handles.  Each handle has records of the matching
+ * task in @tids only and can be used (as handle->kern) by different
+ * threads in parallel.  Missed events are accounted to the task of the
+ * following record.  Records of other tasks are discarded.
+ */
+struct ftrace_kernel *split_kernel_data(struct ftrace_kernel *kernel,
+					int nr_tid, int *tids)
+{
+	struct ftrace_kernel *kernels;
+	struct kernel_tid *ktids, *kt, key;
+	struct mcount_ret_stack rstack;
+	int i, cpu, missed;
+
+	kernels = xcalloc(nr_tid, sizeof(*kernels));
+	ktids = xcalloc(nr_tid, sizeof(*ktids));
+
+	for (i = 0; i < nr_tid; i++) {
+		ktids[i].tid = tids[i];
+		ktids[i].idx = i;
+	}
+	qsort(ktids, nr_tid, sizeof(*ktids), cmp_kernel_tid);
+
+	while ((cpu = read_kernel_stack(kernel, &rstack)) >= 0) {
+		missed = kernel->missed_events[cpu];
+
+		kernel->missed_events[cpu] = 0;
+		kernel->rstack_valid[cpu] = false;
+
+		key.tid = rstack.tid;
+		kt = bsearch(&key, ktids, nr_tid, sizeof(*ktids), cmp_kernel_tid);
+		if (kt == NULL)
+			continue;
+
+		add_kernel_record(&kernels[kt->idx], &rstack, missed);
+	}
+
+	for (i = 0; i < nr_tid; i++) {
+		struct ftrace_kernel *k = &kernels[i];
+
+		k->nr_cpus = 1;
+		k->depth = kernel->depth;
+		k->rstacks = xcalloc(1, sizeof(*k->rstacks));
+		k->rstack_valid = xcalloc(1, sizeof(*k->rstack_valid));
+		k->missed_events = xcalloc(1, sizeof(*k->missed_events));
+
+		/* tasks without records will see an empty heap */
+		k->nr_heap = 0;
+	}
+
+	free(ktids);
+	return kernels;
+}
+
+/**
+ * finish_split_kernel_data - release kernel handles from split_kernel_data()
+ * @kernels - array of kernel handles
+ * @nr_tid - number of tasks
+ */
+void finish_split_kernel_data(struct ftrace_kernel *kernels, int nr_tid)
+{
+	int i;
+
+	for (i = 0; i < nr_tid; i++) {
+		struct ftrace_kernel *k = &kernels[i];
+
+		free(k->records);
+		free(k->records_missed);
+		free(k->rstacks);
+		free(k->rstack_valid);
+		free(k->missed_events);
+	}
+	free(kernels);
 }
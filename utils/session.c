@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
 
 #define PR_FMT     "session"
@@ -8,6 +9,7 @@
 
 #include "uftrace.h"
 #include "utils/symbol.h"
+#include "utils/filter.h"
 #include "utils/rbtree.h"
 #include "utils/utils.h"
 #include "libmcount/mcount.h"
@@ -61,6 +63,8 @@ void read_session_map(char *dirname, struct symtabs *symtabs, char *sid)
 		map->symtab.sym_names = NULL;
 		map->symtab.nr_sym = 0;
 		map->symtab.nr_alloc = 0;
+		map->symtab.name_sorted = false;
+		map->symtab.names = NULL;
 		memcpy(map->libname, path, namelen);
 		map->libname[strlen(path)] = '\0';
 		last_libname = map->libname;
@@ -129,19 +133,12 @@ void create_session(struct ftrace_msg_sess *msg, char *dirname, char *exename,
 	rb_insert_color(&s->node, &sessions);
 }
 
-/**
- * find_session - find a matching session using @pid and @timestamp
- * @pid: task pid to search
- * @timestamp: timestamp of task
- *
- * This function searches the sessions tree using @pid and @timestamp.
- * The most recent session that has a smaller than the @timestamp will
- * be returned.
- */
-struct ftrace_session *find_session(int pid, uint64_t timestamp)
+static struct ftrace_session *__find_session(int pid, uint64_t timestamp,
+					     uint64_t *next)
 {
 	struct ftrace_session *iter;
 	struct ftrace_session *s = NULL;
+	struct ftrace_session *succ = NULL;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &sessions.rb_node;
 
@@ -149,21 +146,47 @@ struct ftrace_session *find_session(int pid, uint64_t timestamp)
 		parent = *p;
 		iter = rb_entry(parent, struct ftrace_session, node);
 
-		if (iter->pid > pid)
+		if (iter->pid > pid) {
+			succ = iter;
 			p = &parent->rb_left;
+		}
 		else if (iter->pid < pid)
 			p = &parent->rb_right;
-		else if (iter->start_time > timestamp)
+		else if (iter->start_time > timestamp) {
+			succ = iter;
 			p = &parent->rb_left;
+		}
 		else {
 			s = iter;
 			p = &parent->rb_right;
 		}
 	}
 
+	/* the next session of the pid (if any) is the successor */
+	if (succ && succ->pid == pid)
+		*next = succ->start_time;
+	else
+		*next = -1ULL;
+
 	return s;
 }
 
+/**
+ * find_session - find a matching session using @pid and @timestamp
+ * @pid: task pid to search
+ * @timestamp: timestamp of task
+ *
+ * This function searches the sessions tree using @pid and @timestamp.
+ * The most recent session that has a smaller than the @timestamp will
+ * be returned.
+ */
+struct ftrace_session *find_session(int pid, uint64_t timestamp)
+{
+	uint64_t next;
+
+	return __find_session(pid, timestamp, &next);
+}
+
 /**
  * walk_sessions - iterates all session and invokes @callback
  * @callback: function to be called for each task
@@ -224,13 +247,36 @@ static void add_session_ref(struct ftrace_task *task, struct ftrace_session *ses
  * list of parent or thread-leader.
  */
 struct ftrace_session *find_task_session(int pid, uint64_t timestamp)
+{
+	uint64_t start, end;
+
+	return find_task_session_range(pid, timestamp, &start, &end);
+}
+
+/**
+ * find_task_session_range - find a matching session and its time range
+ * @pid - task pid to search
+ * @timestamp - timestamp of task
+ * @start - pointer to save the start time of the session
+ * @end - pointer to save the end time of the session
+ *
+ * This function is same as find_task_session() but it also returns a
+ * time range [@start, @end) that the result is valid for the @pid.
+ * Callers can reuse the session for timestamps in the range.
+ */
+struct ftrace_session *find_task_session_range(int pid, uint64_t timestamp,
+					       uint64_t *start, uint64_t *end)
 {
 	struct ftrace_task *t;
 	struct ftrace_sess_ref *r;
-	struct ftrace_session *s = find_session(pid, timestamp);
+	uint64_t next;
+	struct ftrace_session *s = __find_session(pid, timestamp, &next);
 
-	if (s)
+	if (s) {
+		*start = s->start_time;
+		*end = next;
 		return s;
+	}
 
 	/* if it cannot find its own session, inherit from parent or leader */
 	t = find_task(pid);
@@ -239,14 +285,162 @@ struct ftrace_session *find_task_session(int pid, uint64_t timestamp)
 
 	r = &t->sess;
 	while (r) {
-		if (r->start <= timestamp && timestamp < r->end)
+		if (r->start <= timestamp && timestamp < r->end) {
+			/* its own session (if any) takes precedence */
+			*start = r->start;
+			*end = r->end < next ? r->end : next;
 			return r->sess;
+		}
 		r = r->next;
 	}
 
 	return NULL;
 }
 
+/*
+ * Each session keeps lookup results of symbol, filter and fixup for
+ * addresses in a hash table since the same functions are looked up for
+ * every record.  The filters and fixups should be set up before it's
+ * used as the results are not updated later.  It's not thread-safe.
+ */
+#define SESS_ADDR_CACHE_INIT  1024
+
+static unsigned sess_addr_hash(unsigned long addr)
+{
+	return ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static struct ftrace_sess_addr *lookup_sess_addr(struct ftrace_session *sess,
+						 unsigned long addr)
+{
+	unsigned mask = sess->addr_cache_size - 1;
+	unsigned i = sess_addr_hash(addr) & mask;
+
+	while (sess->addr_cache[i].valid) {
+		if (sess->addr_cache[i].addr == addr)
+			break;
+
+		i = (i + 1) & mask;
+	}
+	return &sess->addr_cache[i];
+}
+
+static void grow_sess_addr_cache(struct ftrace_session *sess)
+{
+	struct ftrace_sess_addr *old = sess->addr_cache;
+	unsigned old_size = sess->addr_cache_size;
+	unsigned i;
+
+	if (old_size)
+		sess->addr_cache_size = old_size * 2;
+	else
+		sess->addr_cache_size = SESS_ADDR_CACHE_INIT;
+
+	sess->addr_cache = xcalloc(sess->addr_cache_size,
+				   sizeof(*sess->addr_cache));
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].valid)
+			*lookup_sess_addr(sess, old[i].addr) = old[i];
+	}
+	free(old);
+}
+
+/**
+ * find_session_addr - find cached lookup results of an address
+ * @sess - session to search
+ * @addr - function address (of a record)
+ *
+ * This function returns symbol, filter and fixup info of @addr in
+ * @sess.  They're looked up on the first call for each address and
+ * saved in the session.
+ */
+struct ftrace_sess_addr *find_session_addr(struct ftrace_session *sess,
+					   unsigned long addr)
+{
+	struct ftrace_sess_addr *sa;
+	struct ftrace_trigger tr;
+	unsigned long real_addr = addr;
+
+	if (sess->nr_addr_cache * 2 >= sess->addr_cache_size)
+		grow_sess_addr_cache(sess);
+
+	sa = lookup_sess_addr(sess, addr);
+	if (sa->valid)
+		return sa;
+
+	if (is_kernel_address(addr))
+		real_addr = get_real_address(addr);
+
+	sa->addr   = addr;
+	sa->sym    = find_symtabs(&sess->symtabs, addr);
+	sa->filter = ftrace_match_filter(&sess->filters, real_addr, &tr);
+	sa->fixup  = ftrace_match_filter(&sess->fixups, real_addr, &tr);
+	sa->valid  = true;
+
+	sess->nr_addr_cache++;
+	return sa;
+}
+
+/**
+ * find_session_sym - find a symbol using the cache in the session
+ * @sess - session to search (can be %NULL for kernel functions)
+ * @addr - function address
+ *
+ * This function returns a symbol of @addr like find_symtabs() but it
+ * uses the address cache in @sess.
+ */
+struct sym *find_session_sym(struct ftrace_session *sess, unsigned long addr)
+{
+	if (sess == NULL) {
+		if (is_kernel_address(addr))
+			return find_symtabs(NULL, addr);
+		return NULL;
+	}
+
+	return find_session_addr(sess, addr)->sym;
+}
+
+/**
+ * add_session_control - save settings changed by 'uftrace control'
+ * @cmsg: control message read from task file (time in nsec)
+ *
+ * This function adds the control event to the session of the process
+ * at the time.  The events are kept sorted by time in the session.
+ */
+void add_session_control(struct ftrace_msg_ctrl *cmsg)
+{
+	struct ftrace_session *s;
+	struct ftrace_ctrl_event *ctrl;
+	struct ftrace_ctrl_event **p;
+
+	s = find_session(cmsg->task.pid, cmsg->task.time);
+	if (s == NULL) {
+		pr_dbg("cannot find session for control: pid = %d\n",
+		       cmsg->task.pid);
+		return;
+	}
+
+	ctrl = xmalloc(sizeof(*ctrl) + cmsg->len + 1);
+	ctrl->time = cmsg->task.time;
+	ctrl->tid  = cmsg->task.tid;
+	ctrl->gen  = cmsg->gen;
+	memcpy(ctrl->settings, cmsg->settings, cmsg->len);
+	ctrl->settings[cmsg->len] = '\0';
+
+	/* threads can send them out of order */
+	p = &s->ctrls;
+	while (*p && (*p)->time <= ctrl->time)
+		p = &(*p)->next;
+
+	ctrl->next = *p;
+	*p = ctrl;
+	s->ctrl_next = s->ctrls;
+
+	pr_dbg2("control #%u at %"PRIu64":%s\n",
+		ctrl->gen, ctrl->time, ctrl->settings);
+}
+
 /**
  * create_task - create a new task from task message
  * @msg: ftrace task message read from task file
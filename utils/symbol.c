@@ -15,6 +15,7 @@
 #include <gelf.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "symbol"
@@ -67,6 +68,94 @@ static int namefind(const void *a, const void *b)
 	return strcmp(name, sym->name);
 }
 
+#define SYM_NAME_CHUNK_SIZE  (64 * 1024)
+
+struct sym_name_chunk {
+	struct sym_name_chunk *next;
+	size_t used;
+	size_t size;
+	char buf[];
+};
+
+static char *copy_name(struct sym_name_chunk **chunks, const char *str)
+{
+	struct sym_name_chunk *chunk = *chunks;
+	size_t len = strlen(str) + 1;
+	char *name;
+
+	if (chunk == NULL || chunk->used + len > chunk->size) {
+		size_t size = SYM_NAME_CHUNK_SIZE;
+
+		if (size < len)
+			size = len;
+
+		chunk = xmalloc(sizeof(*chunk) + size);
+		chunk->next = *chunks;
+		chunk->used = 0;
+		chunk->size = size;
+		*chunks = chunk;
+	}
+
+	name = chunk->buf + chunk->used;
+	memcpy(name, str, len);
+	chunk->used += len;
+
+	return name;
+}
+
+static void free_names(struct sym_name_chunk **chunks)
+{
+	struct sym_name_chunk *chunk;
+
+	while (*chunks) {
+		chunk = *chunks;
+		*chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+static bool is_mangled(const char *name)
+{
+	return !strncmp(name, "_Z", 2) || !strncmp(name, "_GLOBAL__sub_I", 14);
+}
+
+/*
+ * Symbol names are saved as is when loading and demangled on the first
+ * use since most of symbols are never used.
+ */
+static void set_symbol_name(struct symtab *symtab, struct sym *sym,
+			    const char *name, unsigned long flags)
+{
+	sym->name = copy_name(&symtab->names, name);
+	sym->mangled = (flags & SYMTAB_FL_DEMANGLE) && is_mangled(name);
+}
+
+/* demangled names live until the program exits */
+static struct sym_name_chunk *demangled_names;
+static pthread_mutex_t demangle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *get_symbol_name(struct sym *sym)
+{
+	char *name;
+
+	if (!__atomic_load_n(&sym->mangled, __ATOMIC_ACQUIRE))
+		return sym->name;
+
+	pthread_mutex_lock(&demangle_lock);
+
+	if (sym->mangled) {
+		name = demangle(sym->name);
+		if (name != sym->name) {
+			sym->name = copy_name(&demangled_names, name);
+			free(name);
+		}
+		__atomic_store_n(&sym->mangled, false, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&demangle_lock);
+	return sym->name;
+}
+
 bool check_libpthread(const char *filename)
 {
 	int fd;
@@ -139,19 +228,14 @@ elf_error:
 
 static void __unload_symtab(struct symtab *symtab)
 {
-	size_t i;
-
-	for (i = 0; i < symtab->nr_sym; i++) {
-		struct sym *sym = symtab->sym + i;
-		free(sym->name);
-	}
-
+	free_names(&symtab->names);
 	free(symtab->sym_names);
 	free(symtab->sym);
 
 	symtab->nr_sym = 0;
 	symtab->sym = NULL;
 	symtab->sym_names = NULL;
+	symtab->name_sorted = false;
 }
 
 void unload_symtabs(struct symtabs *symtabs)
@@ -305,11 +389,7 @@ static int load_symtab(struct symtab *symtab, const char *filename,
 		}
 
 		name = elf_strptr(elf, symstr_idx, elf_sym.st_name);
-
-		if (flags & SYMTAB_FL_DEMANGLE)
-			sym->name = demangle(name);
-		else
-			sym->name = xstrdup(name);
+		set_symbol_name(symtab, sym, name, flags);
 
 		pr_dbg3("[%zd] %c %lx + %-5u %s\n", symtab->nr_sym,
 			sym->type, sym->addr, sym->size, sym->name);
@@ -341,14 +421,6 @@ static int load_symtab(struct symtab *symtab, const char *filename,
 	}
 	symtab->nr_alloc = symtab->nr_sym;
 	symtab->sym = xrealloc(symtab->sym, symtab->nr_sym * sizeof(*symtab->sym));
-
-	symtab->sym_names = xmalloc(sizeof(*symtab->sym_names) * symtab->nr_sym);
-
-	for (i = 0; i < symtab->nr_sym; i++)
-		symtab->sym_names[i] = &symtab->sym[i];
-	qsort(symtab->sym_names, symtab->nr_sym, sizeof(*symtab->sym_names), namesort);
-
-	symtab->name_sorted = true;
 	ret = 0;
 out:
 	elf_end(elf);
@@ -540,10 +612,7 @@ static int load_dynsymtab(struct symtab *dsymtab, const char *filename,
 		if (flags & SYMTAB_FL_ADJ_OFFSET)
 			sym->addr += offset;
 
-		if (flags & SYMTAB_FL_DEMANGLE)
-			sym->name = demangle(name);
-		else
-			sym->name = xstrdup(name);
+		set_symbol_name(dsymtab, sym, name, flags);
 
 		if (GELF_ST_TYPE(esym.st_info) != STT_FUNC)
 			sym->addr = 0;
@@ -580,6 +649,7 @@ int check_trace_functions(const char *filename)
 	Elf_Scn *dynsym_sec, *sec;
 	Elf_Data *dynsym_data;
 	size_t shstr_idx, dynstr_idx = 0;
+	bool has_mcount_loc = false;
 	const char *trace_funcs[] = {
 		"mcount",
 		"__fentry__",
@@ -605,6 +675,7 @@ int check_trace_functions(const char *filename)
 	sec = dynsym_sec = NULL;
 	while ((sec = elf_nextscn(elf, sec)) != NULL) {
 		GElf_Shdr shdr;
+		char *shstr;
 
 		if (gelf_getshdr(sec, &shdr) == NULL)
 			goto elf_error;
@@ -613,8 +684,12 @@ int check_trace_functions(const char *filename)
 			dynsym_sec = sec;
 			dynstr_idx = shdr.sh_link;
 			nr_dynsym = shdr.sh_size / shdr.sh_entsize;
-			break;
 		}
+
+		/* -mrecord-mcount saves call sites (maybe nop) here */
+		shstr = elf_strptr(elf, shstr_idx, shdr.sh_name);
+		if (shstr && !strcmp(shstr, "__mcount_loc"))
+			has_mcount_loc = true;
 	}
 
 	if (dynsym_sec == NULL) {
@@ -643,7 +718,8 @@ int check_trace_functions(const char *filename)
 			}
 		}
 	}
-	ret = 0;
+	/* 3 for functions which need dynamic patching */
+	ret = has_mcount_loc ? 3 : 0;
 
 out:
 	elf_end(elf);
@@ -772,7 +848,6 @@ int load_symbol_file(struct symtabs *symtabs, const char *symfile,
 	FILE *fp;
 	char *line = NULL;
 	size_t len = 0;
-	unsigned int i;
 	unsigned int grow = SYMTAB_GROW;
 	struct symtab *stab = &symtabs->symtab;
 	char allowed_types[] = "TtwPK";
@@ -860,8 +935,8 @@ int load_symbol_file(struct symtabs *symtabs, const char *symfile,
 
 		sym->addr = addr + offset;
 		sym->type = type;
-		sym->name = demangle(name);
 		sym->size = 0;
+		set_symbol_name(stab, sym, name, SYMTAB_FL_DEMANGLE);
 
 		pr_dbg3("[%zd] %c %lx + %-5u %s\n", stab->nr_sym,
 			sym->type, sym->addr, sym->size, sym->name);
@@ -874,14 +949,6 @@ int load_symbol_file(struct symtabs *symtabs, const char *symfile,
 	stab = &symtabs->symtab;
 	qsort(stab->sym, stab->nr_sym, sizeof(*stab->sym), addrsort);
 
-	stab->sym_names = xmalloc(sizeof(*stab->sym_names) * stab->nr_sym);
-
-	for (i = 0; i < stab->nr_sym; i++)
-		stab->sym_names[i] = &stab->sym[i];
-	qsort(stab->sym_names, stab->nr_sym, sizeof(*stab->sym_names), namesort);
-
-	stab->name_sorted = true;
-
 	/*
 	 * sort dynamic symbol while reserving original index in ->sym_names[]
 	 */
@@ -981,7 +1048,6 @@ static int load_module_symbol(struct symtab *symtab, const char *symfile,
 	FILE *fp;
 	char *line = NULL;
 	size_t len = 0;
-	unsigned int i;
 	unsigned int grow = SYMTAB_GROW;
 	char allowed_types[] = "TtwPK";
 	unsigned long prev_addr = -1;
@@ -1063,8 +1129,8 @@ static int load_module_symbol(struct symtab *symtab, const char *symfile,
 
 		sym->addr = addr + offset;
 		sym->type = type;
-		sym->name = demangle(name);
 		sym->size = 0;
+		set_symbol_name(symtab, sym, name, SYMTAB_FL_DEMANGLE);
 
 		pr_dbg3("[%zd] %c %lx + %-5u %s\n", symtab->nr_sym,
 			sym->type, sym->addr, sym->size, sym->name);
@@ -1076,15 +1142,6 @@ static int load_module_symbol(struct symtab *symtab, const char *symfile,
 
 	qsort(symtab->sym, symtab->nr_sym, sizeof(*symtab->sym), addrsort);
 
-	symtab->sym_names = xmalloc(sizeof(*symtab->sym_names) * symtab->nr_sym);
-
-	for (i = 0; i < symtab->nr_sym; i++)
-		symtab->sym_names[i] = &symtab->sym[i];
-	qsort(symtab->sym_names, symtab->nr_sym, sizeof(*symtab->sym_names),
-	      namesort);
-
-	symtab->name_sorted = true;
-
 	fclose(fp);
 	return 0;
 }
@@ -1231,6 +1288,58 @@ unsigned long get_real_address(unsigned long addr)
 	return addr;
 }
 
+/*
+ * Symbols of libraries are loaded on demand, and it can be called from
+ * multiple threads (e.g. uftrace report).  The symtab is built aside and
+ * published by setting nr_sym at last so that lookups don't need the lock.
+ */
+static pthread_mutex_t maps_symtab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_maps_symtab(struct symtabs *symtabs,
+			     struct ftrace_proc_maps *maps)
+{
+	struct symtab symtab = {};
+	bool found = false;
+
+	pthread_mutex_lock(&maps_symtab_lock);
+
+	/* other thread might load it already */
+	if (maps->symtab.nr_sym)
+		goto out;
+
+	if (symtabs->flags & SYMTAB_FL_USE_SYMFILE) {
+		char *symfile = NULL;
+		unsigned long offset = 0;
+
+		if (symtabs->flags & SYMTAB_FL_ADJ_OFFSET)
+			offset = maps->start;
+
+		xasprintf(&symfile, "%s/%s.sym", symtabs->dirname,
+			  basename(maps->libname));
+		if (!load_module_symbol(&symtab, symfile, offset))
+			found = true;
+		free(symfile);
+	}
+
+	if (!found)
+		load_symtab(&symtab, maps->libname, maps->start, symtabs->flags);
+
+	if (symtab.nr_sym == 0) {
+		__unload_symtab(&symtab);
+		goto out;
+	}
+
+	maps->symtab.sym         = symtab.sym;
+	maps->symtab.sym_names   = symtab.sym_names;
+	maps->symtab.nr_alloc    = symtab.nr_alloc;
+	maps->symtab.name_sorted = symtab.name_sorted;
+	maps->symtab.names       = symtab.names;
+	__atomic_store_n(&maps->symtab.nr_sym, symtab.nr_sym, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&maps_symtab_lock);
+}
+
 struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
 {
 	struct symtab *stab = &symtabs->symtab;
@@ -1270,30 +1379,8 @@ struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
 	}
 
 	if (maps) {
-		if (maps->symtab.nr_sym == 0) {
-			bool found = false;
-
-			if (symtabs->flags & SYMTAB_FL_USE_SYMFILE) {
-				char *symfile = NULL;
-				unsigned long offset = 0;
-
-				if (symtabs->flags & SYMTAB_FL_ADJ_OFFSET)
-					offset = maps->start;
-
-				xasprintf(&symfile, "%s/%s.sym", symtabs->dirname,
-					  basename(maps->libname));
-				if (!load_module_symbol(&maps->symtab, symfile,
-							offset)) {
-					found = true;
-				}
-				free(symfile);
-			}
-
-			if (!found) {
-				load_symtab(&maps->symtab, maps->libname,
-					    maps->start, symtabs->flags);
-			}
-		}
+		if (__atomic_load_n(&maps->symtab.nr_sym, __ATOMIC_ACQUIRE) == 0)
+			load_maps_symtab(symtabs, maps);
 
 		stab = &maps->symtab;
 		sym = bsearch((const void *)addr, stab->sym, stab->nr_sym,
@@ -1303,10 +1390,43 @@ struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
 	return sym;
 }
 
+static pthread_mutex_t sym_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sort symbols by (demangled) name on the first name lookup */
+static void build_sym_names(struct symtab *symtab)
+{
+	struct sym **sym_names;
+	size_t i;
+
+	pthread_mutex_lock(&sym_names_lock);
+
+	/* other thread might build it already */
+	if (symtab->sym_names)
+		goto out;
+
+	sym_names = xmalloc(sizeof(*sym_names) * symtab->nr_sym);
+
+	for (i = 0; i < symtab->nr_sym; i++) {
+		sym_names[i] = &symtab->sym[i];
+		get_symbol_name(sym_names[i]);
+	}
+	qsort(sym_names, symtab->nr_sym, sizeof(*sym_names), namesort);
+
+	symtab->name_sorted = true;
+	__atomic_store_n(&symtab->sym_names, sym_names, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&sym_names_lock);
+}
+
 struct sym * find_symname(struct symtab *symtab, const char *name)
 {
 	size_t i;
 
+	if (symtab->nr_sym &&
+	    __atomic_load_n(&symtab->sym_names, __ATOMIC_ACQUIRE) == NULL)
+		build_sym_names(symtab);
+
 	if (symtab->name_sorted) {
 		struct sym **psym;
 
@@ -1321,7 +1441,7 @@ struct sym * find_symname(struct symtab *symtab, const char *name)
 	for (i = 0; i < symtab->nr_sym; i++) {
 		struct sym *sym = &symtab->sym[i];
 
-		if (!strcmp(name, sym->name))
+		if (!strcmp(name, get_symbol_name(sym)))
 			return sym;
 	}
 
@@ -1337,7 +1457,7 @@ char *symbol_getname(struct sym *sym, unsigned long addr)
 		return name;
 	}
 
-	return sym->name;
+	return get_symbol_name(sym);
 }
 
 /* must be used in pair with symbol_getname() */
@@ -1378,3 +1498,42 @@ void print_symtabs(struct symtabs *symtabs)
 		symbol_putname(sym, name);
 	}
 }
+
+#ifdef UNIT_TEST
+TEST_CASE(symbol_lazy_demangle)
+{
+	struct symtab stab = {};
+	const char *names[] = {
+		"_ZN3ABC3fooEv", "main", "_ZN2ns3barEv",
+	};
+	struct sym *sym;
+	unsigned i;
+
+	stab.sym = xcalloc(ARRAY_SIZE(names), sizeof(*stab.sym));
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		sym = &stab.sym[stab.nr_sym++];
+		sym->addr = 0x1000 * (i + 1);
+		sym->size = 0x1000;
+		sym->type = ST_GLOBAL;
+		set_symbol_name(&stab, sym, names[i], SYMTAB_FL_DEMANGLE);
+	}
+
+	TEST_EQ(stab.sym[0].mangled, true);
+	TEST_EQ(stab.sym[1].mangled, false);
+	TEST_STREQ("ABC::foo", symbol_getname(&stab.sym[0], 0x1000));
+	TEST_EQ(stab.sym[0].mangled, false);
+	TEST_EQ(stab.sym[2].mangled, true);
+	TEST_EQ(stab.sym_names, NULL);
+
+	sym = find_symname(&stab, "ns::bar");
+	TEST_NE(stab.sym_names, NULL);
+	TEST_EQ(sym, &stab.sym[2]);
+	TEST_EQ(find_symname(&stab, "main"), &stab.sym[1]);
+	TEST_EQ(find_symname(&stab, "_ZN2ns3barEv"), NULL);
+
+	__unload_symtab(&stab);
+	TEST_EQ(stab.names, NULL);
+
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */
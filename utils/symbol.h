@@ -28,16 +28,21 @@ struct sym {
 	unsigned size;
 	enum symtype type;
 	char *name;
+	bool mangled;  /* name is not demangled yet */
 };
 
 #define SYMTAB_GROW  16
 
+/* symbol names are allocated from chunks and released at once */
+struct sym_name_chunk;
+
 struct symtab {
 	struct sym *sym;
-	struct sym **sym_names;
+	struct sym **sym_names;  /* built on the first name lookup */
 	size_t nr_sym;
 	size_t nr_alloc;
 	bool name_sorted;
+	struct sym_name_chunk *names;
 };
 
 struct ftrace_proc_maps {